@@ -7,15 +7,67 @@ QT = core gui
 QMAKE_CXXFLAGS_RELEASE += -Wall -Wextra
 
 HEADERS += \
+	checksum.h \
+	convert.h \
+	copy.h \
+	decode.h \
+	deinterlace.h \
+	denoise.h \
+	drmsink.h \
+	fbsink.h \
+	frame.h \
+	framebus.h \
 	mainwindow.h \
+	mjpeg.h \
+	motion.h \
+	osd.h \
+	pattern.h \
+	prerecord.h \
+	present.h \
+	record.h \
+	recover.h \
+	replay.h \
+	rt.h \
+	scale.h \
+	snapshot.h \
+	stream.h \
+	tap.h \
 	videoworker.h \
 
 
 SOURCES += \
+	checksum.cpp \
+	convert.cpp \
+	copy.cpp \
+	decode.cpp \
+	deinterlace.cpp \
+	denoise.cpp \
+	drmsink.cpp \
+	fbsink.cpp \
+	framebus.cpp \
 	main.cpp \
 	mainwindow.cpp \
+	mjpeg.cpp \
+	motion.cpp \
+	osd.cpp \
+	pattern.cpp \
+	prerecord.cpp \
+	present.cpp \
+	record.cpp \
+	recover.cpp \
+	replay.cpp \
+	rt.cpp \
+	scale.cpp \
+	snapshot.cpp \
+	stream.cpp \
+	tap.cpp \
 	videoworker.cpp \
 
+LIBS += -ljpeg -lrt
+
+CONFIG += link_pkgconfig
+PKGCONFIG += libdrm
+
 RESOURCES = atmel-demo.qrc
 
 QMAKE_RESOURCE_FLAGS += -compress 0
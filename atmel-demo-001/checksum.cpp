@@ -0,0 +1,330 @@
+/*
+ * checksum.cpp -- frame integrity checks by CRC32C
+ *
+ * Every frame is hashed in bands of rows, row padding left out, and the
+ * frame checksum is the CRC32C of the band CRCs, taken little-endian. A
+ * frame is flagged
+ *
+ *	repeated	when its sequence number is that of the previous frame
+ *	identical	when its data is that of the previous frame, or that
+ *			the capture buffer held before, i.e. it was never
+ *			written
+ *	torn		when it is short, or when bands that changed since
+ *			the previous frame are what the capture buffer held
+ *			before, i.e. it was only partly written
+ *
+ * Bands that do not change, such as black borders, say nothing about
+ * tearing. A live sensor never delivers the same data twice, but a still
+ * synthetic source does, so only captured frames are checked for tearing.
+ *
+ * The CRC uses the SSE4.2 or ARMv8 CRC32C instructions when built for
+ * them, and slicing-by-8 tables otherwise.
+ *
+ * Author: Johan Hovold <jhovold@gmail.com>
+ */
+
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#else
+#include <pthread.h>
+#endif
+
+#include "checksum.h"
+#include "common.h"
+
+
+#define CHECKSUM_REPORT_MAX	10	/* flagged frames logged */
+
+
+#if defined(__SSE4_2__)
+
+static uint32_t crc32c_update(uint32_t crc, const unsigned char *p, size_t len)
+{
+	for (; len && ((size_t)p & 7); --len)
+		crc = _mm_crc32_u8(crc, *p++);
+#if defined(__x86_64__)
+	for (; len >= 8; len -= 8, p += 8) {
+		uint64_t v;
+
+		memcpy(&v, p, 8);
+		crc = (uint32_t)_mm_crc32_u64(crc, v);
+	}
+#endif
+	for (; len >= 4; len -= 4, p += 4) {
+		uint32_t v;
+
+		memcpy(&v, p, 4);
+		crc = _mm_crc32_u32(crc, v);
+	}
+	for (; len; --len)
+		crc = _mm_crc32_u8(crc, *p++);
+
+	return crc;
+}
+
+static void crc32c_setup(void)
+{
+}
+
+#elif defined(__ARM_FEATURE_CRC32)
+
+static uint32_t crc32c_update(uint32_t crc, const unsigned char *p, size_t len)
+{
+	for (; len && ((size_t)p & 7); --len)
+		crc = __crc32cb(crc, *p++);
+	for (; len >= 8; len -= 8, p += 8) {
+		uint64_t v;
+
+		memcpy(&v, p, 8);
+		crc = __crc32cd(crc, v);
+	}
+	for (; len; --len)
+		crc = __crc32cb(crc, *p++);
+
+	return crc;
+}
+
+static void crc32c_setup(void)
+{
+}
+
+#else
+
+#define CRC32C_POLY	0x82f63b78	/* reflected */
+
+static uint32_t crc_table[8][256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+static void crc_table_init(void)
+{
+	uint32_t c;
+	unsigned n, k;
+
+	for (n = 0; n < 256; ++n) {
+		c = n;
+		for (k = 0; k < 8; ++k)
+			c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+		crc_table[0][n] = c;
+	}
+
+	for (n = 0; n < 256; ++n) {
+		c = crc_table[0][n];
+		for (k = 1; k < 8; ++k) {
+			c = crc_table[0][c & 0xff] ^ (c >> 8);
+			crc_table[k][n] = c;
+		}
+	}
+}
+
+static uint32_t crc32c_update(uint32_t crc, const unsigned char *p, size_t len)
+{
+	for (; len >= 8; len -= 8, p += 8) {
+		crc ^= p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+		crc = crc_table[7][crc & 0xff] ^
+			crc_table[6][(crc >> 8) & 0xff] ^
+			crc_table[5][(crc >> 16) & 0xff] ^
+			crc_table[4][crc >> 24] ^
+			crc_table[3][p[4]] ^ crc_table[2][p[5]] ^
+			crc_table[1][p[6]] ^ crc_table[0][p[7]];
+	}
+	for (; len; --len)
+		crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+static void crc32c_setup(void)
+{
+	pthread_once(&crc_table_once, crc_table_init);
+}
+
+#endif
+
+/*
+ * Extend the CRC32C of earlier data, or zero, by len bytes of buf.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	crc32c_setup();
+
+	return ~crc32c_update(~crc, (const unsigned char *)buf, len);
+}
+
+/*
+ * Hash each band of rows. Returns false for a frame too short to hold
+ * all rows, whose missing rows are left out.
+ */
+static bool hash_bands(const struct frame_checker *fc, const void *data,
+					size_t size, uint32_t *bands)
+{
+	const unsigned char *src = (const unsigned char *)data;
+	unsigned line = fc->width * 2;
+	unsigned rows = fc->height;
+	unsigned b, y, end;
+	uint32_t crc;
+
+	if (size < (size_t)fc->stride * (fc->height - 1) + line)
+		rows = size / fc->stride;
+
+	for (b = 0, y = 0; b < fc->bands; ++b) {
+		end = (b + 1) * fc->height / fc->bands;
+		if (end > rows)
+			end = rows;
+
+		crc = ~0U;
+		for (; y < end; ++y)
+			crc = crc32c_update(crc, src + (size_t)y * fc->stride,
+									line);
+		bands[b] = ~crc;
+	}
+
+	return rows == fc->height;
+}
+
+static uint32_t hash_frame(const struct frame_checker *fc,
+						const uint32_t *bands)
+{
+	unsigned char buf[4 * CHECKSUM_BANDS];
+	unsigned b;
+
+	for (b = 0; b < fc->bands; ++b) {
+		buf[4 * b] = bands[b];
+		buf[4 * b + 1] = bands[b] >> 8;
+		buf[4 * b + 2] = bands[b] >> 16;
+		buf[4 * b + 3] = bands[b] >> 24;
+	}
+
+	return crc32c(0, buf, 4 * fc->bands);
+}
+
+static void checksum_account(struct frame_checker *fc, long long start)
+{
+	unsigned cost = now_ns() - start;
+
+	fc->bytes += (unsigned long long)fc->width * 2 * fc->height;
+	fc->cost += cost;
+	if (cost > fc->cost_max)
+		fc->cost_max = cost;
+}
+
+/*
+ * Set up checks of width x height YUYV frames.
+ */
+int checksum_init(struct frame_checker *fc, unsigned width, unsigned height,
+							unsigned stride)
+{
+	if (!width || !height || stride < width * 2)
+		return -1;
+
+	memset(fc, 0, sizeof(*fc));
+	fc->width = width;
+	fc->height = height;
+	fc->stride = stride;
+	fc->bands = height < CHECKSUM_BANDS ? height : CHECKSUM_BANDS;
+
+	crc32c_setup();
+
+	return 0;
+}
+
+void checksum_free(struct frame_checker *fc)
+{
+	if (!fc->frames)
+		return;
+
+	printf("%s - %lu frames, %lu repeated, %lu identical, %lu torn, "
+			"crc avg %lld max %u us, %llu MB/s\n", __func__,
+			fc->frames, fc->repeated, fc->identical, fc->torn,
+			fc->cost / fc->frames / 1000, fc->cost_max / 1000,
+			fc->cost ? fc->bytes * 1000 / fc->cost : 0);
+}
+
+/*
+ * Check a frame against the previous one and against what its capture
+ * buffer held before, and store its checksum in the frame. Returns the
+ * flags raised, if any.
+ */
+unsigned checksum_frame(struct frame_checker *fc, struct video_frame *frame)
+{
+	uint32_t bands[CHECKSUM_BANDS];
+	const uint32_t *held = NULL;
+	long long start = now_ns();
+	unsigned flags = 0;
+	unsigned b;
+
+	if (!hash_bands(fc, frame->data, frame->size, bands))
+		flags |= CHECKSUM_TORN;
+
+	if (frame->capture >= 0 && frame->capture < VIDEO_MAX_FRAME &&
+					fc->have_held[frame->capture])
+		held = fc->held[frame->capture];
+
+	if (fc->have_last) {
+		if (frame->sequence == fc->last_sequence)
+			flags |= CHECKSUM_REPEATED;
+		if (!memcmp(bands, fc->last, fc->bands * sizeof(bands[0])))
+			flags |= CHECKSUM_IDENTICAL;
+	}
+
+	if (held && !memcmp(bands, held, fc->bands * sizeof(bands[0]))) {
+		flags |= CHECKSUM_IDENTICAL;
+	} else if (held && fc->have_last) {
+		for (b = 0; b < fc->bands; ++b) {
+			if (bands[b] != fc->last[b] && bands[b] == held[b])
+				flags |= CHECKSUM_TORN;
+		}
+	}
+
+	frame->checksum = hash_frame(fc, bands);
+
+	memcpy(fc->last, bands, fc->bands * sizeof(bands[0]));
+	fc->last_sequence = frame->sequence;
+	fc->have_last = true;
+
+	if (frame->capture >= 0 && frame->capture < VIDEO_MAX_FRAME) {
+		memcpy(fc->held[frame->capture], bands,
+					fc->bands * sizeof(bands[0]));
+		fc->have_held[frame->capture] = true;
+	}
+
+	++fc->frames;
+	checksum_account(fc, start);
+
+	if (flags & CHECKSUM_REPEATED)
+		++fc->repeated;
+	if (flags & CHECKSUM_IDENTICAL)
+		++fc->identical;
+	if (flags & CHECKSUM_TORN)
+		++fc->torn;
+
+	if (flags && fc->repeated + fc->identical + fc->torn <=
+							CHECKSUM_REPORT_MAX) {
+		err("%s - frame %u:%s%s%s, crc %08x\n", __func__,
+				frame->sequence,
+				flags & CHECKSUM_REPEATED ? " repeated" : "",
+				flags & CHECKSUM_IDENTICAL ? " identical" : "",
+				flags & CHECKSUM_TORN ? " torn" : "",
+				frame->checksum);
+	}
+
+	return flags;
+}
+
+/*
+ * Note what a capture buffer holds after the frame has been filtered in
+ * place, so that old data left in it is still recognised.
+ */
+void checksum_rewritten(struct frame_checker *fc,
+					const struct video_frame *frame)
+{
+	long long start;
+
+	if (frame->capture < 0 || frame->capture >= VIDEO_MAX_FRAME)
+		return;
+
+	start = now_ns();
+	hash_bands(fc, frame->data, frame->size, fc->held[frame->capture]);
+	checksum_account(fc, start);
+}
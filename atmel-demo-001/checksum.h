@@ -0,0 +1,58 @@
+/*
+ * checksum.h -- frame integrity checks by CRC32C
+ *
+ * Author: Johan Hovold <jhovold@gmail.com>
+ */
+
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stdint.h>
+
+#include <linux/videodev2.h>
+
+#include "frame.h"
+
+
+#define CHECKSUM_BANDS		16	/* row bands hashed separately */
+
+enum {
+	CHECKSUM_REPEATED	= 1 << 0,	/* sequence number seen before */
+	CHECKSUM_IDENTICAL	= 1 << 1,	/* data seen before */
+	CHECKSUM_TORN		= 1 << 2,	/* partly old or short data */
+};
+
+struct frame_checker {
+	unsigned width;		/* YUYV frame geometry */
+	unsigned height;
+	unsigned stride;
+	unsigned bands;
+
+	uint32_t last[CHECKSUM_BANDS];	/* of the previous frame */
+	unsigned last_sequence;
+	bool have_last;
+
+	/* of the frame last held by each capture buffer */
+	uint32_t held[VIDEO_MAX_FRAME][CHECKSUM_BANDS];
+	bool have_held[VIDEO_MAX_FRAME];
+
+	unsigned long frames;
+	unsigned long repeated;
+	unsigned long identical;
+	unsigned long torn;
+	unsigned long long bytes;
+	long long cost;		/* ns, total */
+	unsigned cost_max;	/* ns */
+};
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+int checksum_init(struct frame_checker *fc, unsigned width, unsigned height,
+							unsigned stride);
+void checksum_free(struct frame_checker *fc);
+
+unsigned checksum_frame(struct frame_checker *fc, struct video_frame *frame);
+void checksum_rewritten(struct frame_checker *fc,
+					const struct video_frame *frame);
+
+#endif	/* CHECKSUM_H */
@@ -11,6 +11,7 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <ctime>
 
 
 #define SCREEN_WIDTH	800
@@ -36,4 +37,24 @@
 		exit(EXIT_FAILURE); \
 	} while (0)
 
+static inline long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* time main() was entered, for tracking startup phases */
+extern long long startup_begin;
+
+static inline void startup_mark(const char *phase)
+{
+	long long t = now_ns() - startup_begin;
+
+	printf("startup - %s: %lld.%03lld ms\n", phase, t / 1000000,
+							t / 1000 % 1000);
+}
+
 #endif
@@ -0,0 +1,394 @@
+/*
+ * convert.cpp -- YUV to XRGB8888 conversion
+ *
+ * BT.601 limited range in 16-bit fixed point with six fractional bits, so
+ * that eight pixels fit in a vector register. Sums that overflow are
+ * saturated, which only happens for values that clamp to 255 anyway, and
+ * the SIMD kernels therefore match the plain C version exactly.
+ *
+ * Pixels are stored as B, G, R, X bytes, i.e. XRGB8888 in a little-endian
+ * framebuffer.
+ *
+ * YUYV rows can also be split into planes, as taken by libjpeg for raw
+ * 4:2:2 input.
+ *
+ * Author: Johan Hovold <jhovold@gmail.com>
+ */
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include "common.h"
+#include "convert.h"
+
+
+#define CY	74	/* 1.164, plus a half below */
+#define CRV	102	/* 1.596 */
+#define CGU	25	/* 0.391 */
+#define CGV	52	/* 0.813 */
+#define CBU	129	/* 2.018 */
+
+static inline unsigned char clamp_pixel(int v)
+{
+	v = (v + 32) >> 6;
+
+	return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+/* Convert two pixels sharing chroma. */
+static inline void convert_pair(unsigned char *dst, int y0, int y1, int u,
+									int v)
+{
+	int r, g, b;
+
+	y0 -= 16;
+	y1 -= 16;
+	y0 = CY * y0 + (y0 >> 1);
+	y1 = CY * y1 + (y1 >> 1);
+	u -= 128;
+	v -= 128;
+
+	r = CRV * v;
+	g = -CGU * u - CGV * v;
+	b = CBU * u;
+
+	dst[0] = clamp_pixel(y0 + b);
+	dst[1] = clamp_pixel(y0 + g);
+	dst[2] = clamp_pixel(y0 + r);
+	dst[3] = 0xff;
+	dst[4] = clamp_pixel(y1 + b);
+	dst[5] = clamp_pixel(y1 + g);
+	dst[6] = clamp_pixel(y1 + r);
+	dst[7] = 0xff;
+}
+
+#if defined(__SSE2__)
+
+/*
+ * Convert eight pixels, given as 16-bit luma and per-pixel chroma, and
+ * store them at dst.
+ */
+static inline void convert_8(unsigned char *dst, __m128i y, __m128i u,
+								__m128i v)
+{
+	const __m128i round = _mm_set1_epi16(32);
+	const __m128i alpha = _mm_set1_epi8((char)0xff);
+	__m128i r, g, b, bg, ra;
+
+	y = _mm_sub_epi16(y, _mm_set1_epi16(16));
+	y = _mm_add_epi16(_mm_mullo_epi16(y, _mm_set1_epi16(CY)),
+						_mm_srai_epi16(y, 1));
+	y = _mm_adds_epi16(y, round);
+	u = _mm_sub_epi16(u, _mm_set1_epi16(128));
+	v = _mm_sub_epi16(v, _mm_set1_epi16(128));
+
+	r = _mm_adds_epi16(y, _mm_mullo_epi16(v, _mm_set1_epi16(CRV)));
+	g = _mm_subs_epi16(y, _mm_mullo_epi16(u, _mm_set1_epi16(CGU)));
+	g = _mm_subs_epi16(g, _mm_mullo_epi16(v, _mm_set1_epi16(CGV)));
+	b = _mm_adds_epi16(y, _mm_mullo_epi16(u, _mm_set1_epi16(CBU)));
+
+	r = _mm_packus_epi16(_mm_srai_epi16(r, 6), _mm_setzero_si128());
+	g = _mm_packus_epi16(_mm_srai_epi16(g, 6), _mm_setzero_si128());
+	b = _mm_packus_epi16(_mm_srai_epi16(b, 6), _mm_setzero_si128());
+
+	bg = _mm_unpacklo_epi8(b, g);
+	ra = _mm_unpacklo_epi8(r, alpha);
+
+	_mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi16(bg, ra));
+	_mm_storeu_si128((__m128i *)(dst + 16), _mm_unpackhi_epi16(bg, ra));
+}
+
+static void yuyv_row(unsigned char *dst, const unsigned char *src,
+							unsigned width)
+{
+	const __m128i lmask = _mm_set1_epi16(0x00ff);
+	const __m128i cmask = _mm_set1_epi32(0x0000ffff);
+	__m128i p, y, c, u, v;
+	unsigned x;
+
+	for (x = 0; x + 8 <= width; x += 8, src += 16, dst += 32) {
+		p = _mm_loadu_si128((const __m128i *)src);
+
+		y = _mm_and_si128(p, lmask);
+		c = _mm_srli_epi16(p, 8);		/* u0 v0 u1 v1 ... */
+
+		u = _mm_and_si128(c, cmask);
+		u = _mm_or_si128(u, _mm_slli_epi32(u, 16));
+		v = _mm_srli_epi32(c, 16);
+		v = _mm_or_si128(v, _mm_slli_epi32(v, 16));
+
+		convert_8(dst, y, u, v);
+	}
+
+	for (; x < width; x += 2, src += 4, dst += 8)
+		convert_pair(dst, src[0], src[2], src[1], src[3]);
+}
+
+static void i420_row(unsigned char *dst, const unsigned char *py,
+			const unsigned char *pu, const unsigned char *pv,
+			unsigned width)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i y, u, v;
+	int cu, cv;
+	unsigned x;
+
+	for (x = 0; x + 8 <= width; x += 8, py += 8, pu += 4, pv += 4,
+								dst += 32) {
+		memcpy(&cu, pu, 4);
+		memcpy(&cv, pv, 4);
+
+		y = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)py),
+									zero);
+		u = _mm_unpacklo_epi8(_mm_cvtsi32_si128(cu), zero);
+		v = _mm_unpacklo_epi8(_mm_cvtsi32_si128(cv), zero);
+
+		convert_8(dst, y, _mm_unpacklo_epi16(u, u),
+						_mm_unpacklo_epi16(v, v));
+	}
+
+	for (; x < width; x += 2, py += 2, ++pu, ++pv, dst += 8)
+		convert_pair(dst, py[0], py[1], *pu, *pv);
+}
+
+static void yuyv_unpack_row(unsigned char *y, unsigned char *u,
+			unsigned char *v, const unsigned char *src,
+			unsigned width)
+{
+	const __m128i mask = _mm_set1_epi16(0x00ff);
+	__m128i a, b, uv;
+	unsigned x;
+
+	for (x = 0; x + 16 <= width; x += 16, src += 32) {
+		a = _mm_loadu_si128((const __m128i *)src);
+		b = _mm_loadu_si128((const __m128i *)(src + 16));
+
+		_mm_storeu_si128((__m128i *)(y + x), _mm_packus_epi16(
+				_mm_and_si128(a, mask), _mm_and_si128(b, mask)));
+
+		uv = _mm_packus_epi16(_mm_srli_epi16(a, 8),
+						_mm_srli_epi16(b, 8));
+		_mm_storel_epi64((__m128i *)(u + x / 2), _mm_packus_epi16(
+					_mm_and_si128(uv, mask), uv));
+		_mm_storel_epi64((__m128i *)(v + x / 2), _mm_packus_epi16(
+					_mm_srli_epi16(uv, 8), uv));
+	}
+
+	for (; x < width; x += 2, src += 4) {
+		y[x] = src[0];
+		u[x / 2] = src[1];
+		y[x + 1] = src[2];
+		v[x / 2] = src[3];
+	}
+}
+
+#elif defined(__ARM_NEON__)
+
+/*
+ * Convert eight pixels, given as 16-bit luma and per-pixel chroma, into
+ * planar bytes.
+ */
+static inline void convert_8(uint8x8_t *r, uint8x8_t *g, uint8x8_t *b,
+				int16x8_t y, int16x8_t u, int16x8_t v)
+{
+	int16x8_t t;
+
+	y = vsubq_s16(y, vdupq_n_s16(16));
+	y = vaddq_s16(vmulq_n_s16(y, CY), vshrq_n_s16(y, 1));
+	u = vsubq_s16(u, vdupq_n_s16(128));
+	v = vsubq_s16(v, vdupq_n_s16(128));
+
+	*r = vqrshrun_n_s16(vqaddq_s16(y, vmulq_n_s16(v, CRV)), 6);
+	t = vqsubq_s16(y, vmulq_n_s16(u, CGU));
+	*g = vqrshrun_n_s16(vqsubq_s16(t, vmulq_n_s16(v, CGV)), 6);
+	*b = vqrshrun_n_s16(vqaddq_s16(y, vmulq_n_s16(u, CBU)), 6);
+}
+
+static inline int16x8_t widen(uint8x8_t v)
+{
+	return vreinterpretq_s16_u16(vmovl_u8(v));
+}
+
+/* Sixteen pixels per iteration, even and odd pixels converted apart. */
+static void yuyv_row(unsigned char *dst, const unsigned char *src,
+							unsigned width)
+{
+	uint8x8x4_t p, out;
+	uint8x8_t re, ge, be, ro, go, bo;
+	uint8x8x2_t z;
+	int16x8_t u, v;
+	unsigned x;
+
+	out.val[3] = vdup_n_u8(0xff);
+
+	for (x = 0; x + 16 <= width; x += 16, src += 32, dst += 64) {
+		p = vld4_u8(src);		/* y0, u, y1, v */
+		u = widen(p.val[1]);
+		v = widen(p.val[3]);
+
+		convert_8(&re, &ge, &be, widen(p.val[0]), u, v);
+		convert_8(&ro, &go, &bo, widen(p.val[2]), u, v);
+
+		z = vzip_u8(be, bo);
+		out.val[0] = z.val[0];
+		p.val[0] = z.val[1];
+		z = vzip_u8(ge, go);
+		out.val[1] = z.val[0];
+		p.val[1] = z.val[1];
+		z = vzip_u8(re, ro);
+		out.val[2] = z.val[0];
+		p.val[2] = z.val[1];
+		vst4_u8(dst, out);
+
+		out.val[0] = p.val[0];
+		out.val[1] = p.val[1];
+		out.val[2] = p.val[2];
+		vst4_u8(dst + 32, out);
+	}
+
+	for (; x < width; x += 2, src += 4, dst += 8)
+		convert_pair(dst, src[0], src[2], src[1], src[3]);
+}
+
+static void i420_row(unsigned char *dst, const unsigned char *py,
+			const unsigned char *pu, const unsigned char *pv,
+			unsigned width)
+{
+	uint8x8x4_t out;
+	uint8x8x2_t cu, cv;
+	unsigned x;
+
+	out.val[3] = vdup_n_u8(0xff);
+
+	for (x = 0; x + 16 <= width; x += 16, py += 16, pu += 8, pv += 8,
+								dst += 64) {
+		/* duplicate each chroma sample for its two pixels */
+		cu = vzip_u8(vld1_u8(pu), vld1_u8(pu));
+		cv = vzip_u8(vld1_u8(pv), vld1_u8(pv));
+
+		convert_8(&out.val[2], &out.val[1], &out.val[0],
+				widen(vld1_u8(py)), widen(cu.val[0]),
+				widen(cv.val[0]));
+		vst4_u8(dst, out);
+
+		convert_8(&out.val[2], &out.val[1], &out.val[0],
+				widen(vld1_u8(py + 8)), widen(cu.val[1]),
+				widen(cv.val[1]));
+		vst4_u8(dst + 32, out);
+	}
+
+	for (; x < width; x += 2, py += 2, ++pu, ++pv, dst += 8)
+		convert_pair(dst, py[0], py[1], *pu, *pv);
+}
+
+static void yuyv_unpack_row(unsigned char *y, unsigned char *u,
+			unsigned char *v, const unsigned char *src,
+			unsigned width)
+{
+	uint8x8x4_t yuyv;
+	uint8x8x2_t yy;
+	unsigned x;
+
+	for (x = 0; x + 16 <= width; x += 16, src += 32) {
+		yuyv = vld4_u8(src);
+		yy.val[0] = yuyv.val[0];
+		yy.val[1] = yuyv.val[2];
+		vst2_u8(y + x, yy);
+		vst1_u8(u + x / 2, yuyv.val[1]);
+		vst1_u8(v + x / 2, yuyv.val[3]);
+	}
+
+	for (; x < width; x += 2, src += 4) {
+		y[x] = src[0];
+		u[x / 2] = src[1];
+		y[x + 1] = src[2];
+		v[x / 2] = src[3];
+	}
+}
+
+#else
+
+static void yuyv_row(unsigned char *dst, const unsigned char *src,
+							unsigned width)
+{
+	unsigned x;
+
+	for (x = 0; x < width; x += 2, src += 4, dst += 8)
+		convert_pair(dst, src[0], src[2], src[1], src[3]);
+}
+
+static void i420_row(unsigned char *dst, const unsigned char *py,
+			const unsigned char *pu, const unsigned char *pv,
+			unsigned width)
+{
+	unsigned x;
+
+	for (x = 0; x < width; x += 2, py += 2, ++pu, ++pv, dst += 8)
+		convert_pair(dst, py[0], py[1], *pu, *pv);
+}
+
+static void yuyv_unpack_row(unsigned char *y, unsigned char *u,
+			unsigned char *v, const unsigned char *src,
+			unsigned width)
+{
+	unsigned x;
+
+	for (x = 0; x < width; x += 2, src += 4) {
+		y[x] = src[0];
+		u[x / 2] = src[1];
+		y[x + 1] = src[2];
+		v[x / 2] = src[3];
+	}
+}
+
+#endif
+
+/*
+ * Convert a YUYV frame of an even width into XRGB8888.
+ */
+void convert_yuyv_xrgb(void *dst, unsigned dst_stride, const void *src,
+				unsigned src_stride, unsigned width,
+				unsigned height)
+{
+	const unsigned char *s = (const unsigned char *)src;
+	unsigned char *d = (unsigned char *)dst;
+	unsigned y;
+
+	for (y = 0; y < height; ++y, s += src_stride, d += dst_stride)
+		yuyv_row(d, s, width);
+}
+
+/*
+ * Convert an I420 frame into XRGB8888. The chroma planes have half the
+ * stride of the luma plane, as for V4L2_PIX_FMT_YUV420.
+ */
+void convert_i420_xrgb(void *dst, unsigned dst_stride, const void *y,
+				const void *u, const void *v,
+				unsigned y_stride, unsigned width,
+				unsigned height)
+{
+	const unsigned char *py = (const unsigned char *)y;
+	const unsigned char *pu = (const unsigned char *)u;
+	const unsigned char *pv = (const unsigned char *)v;
+	unsigned char *d = (unsigned char *)dst;
+	unsigned c;
+	unsigned row;
+
+	for (row = 0; row < height; ++row, py += y_stride, d += dst_stride) {
+		c = row / 2 * (y_stride / 2);
+		i420_row(d, py, pu + c, pv + c, width);
+	}
+}
+
+/*
+ * Split a row of YUYV of an even width into Y, U and V planes.
+ */
+void convert_yuyv_unpack(unsigned char *y, unsigned char *u,
+				unsigned char *v, const void *src,
+				unsigned width)
+{
+	yuyv_unpack_row(y, u, v, (const unsigned char *)src, width);
+}
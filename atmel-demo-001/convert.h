@@ -0,0 +1,22 @@
+/*
+ * convert.h -- YUV to XRGB8888 conversion
+ *
+ * Author: Johan Hovold <jhovold@gmail.com>
+ */
+
+#ifndef CONVERT_H
+#define CONVERT_H
+
+
+void convert_yuyv_xrgb(void *dst, unsigned dst_stride, const void *src,
+				unsigned src_stride, unsigned width,
+				unsigned height);
+void convert_i420_xrgb(void *dst, unsigned dst_stride, const void *y,
+				const void *u, const void *v,
+				unsigned y_stride, unsigned width,
+				unsigned height);
+void convert_yuyv_unpack(unsigned char *y, unsigned char *u,
+				unsigned char *v, const void *src,
+				unsigned width);
+
+#endif	/* CONVERT_H */
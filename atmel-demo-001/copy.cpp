@@ -0,0 +1,277 @@
+/*
+ * copy.cpp -- stride-aware frame copies
+ *
+ * Frames are copied line by line, so that the source and destination may
+ * use different strides and padding is never moved. Frames without padding
+ * on either side are copied in one go.
+ *
+ * Lines go through one of a few kernels, and the fastest on the running
+ * system is picked at startup by timing them on a frame of the actual
+ * geometry. Besides the C library memcpy, there is a kernel with
+ * non-temporal stores on x86, which keeps output buffers that are never
+ * read back out of the cache, and one with 64-byte NEON bursts on ARM.
+ *
+ * Author: Johan Hovold <jhovold@gmail.com>
+ */
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include <stdint.h>
+
+#include "common.h"
+#include "copy.h"
+
+
+#define COPY_RUNS		8	/* per kernel when selecting */
+#define COPY_BENCH_RUNS		64
+
+struct copy_kernel {
+	const char *name;
+	void (*line)(void *dst, const void *src, size_t n);
+	bool fence;		/* stores must be fenced after a frame */
+};
+
+static void line_memcpy(void *dst, const void *src, size_t n)
+{
+	memcpy(dst, src, n);
+}
+
+#if defined(__SSE2__)
+
+static void line_stream(void *dst, const void *src, size_t n)
+{
+	unsigned char *d = (unsigned char *)dst;
+	const unsigned char *s = (const unsigned char *)src;
+	__m128i a, b, c, e;
+	size_t head;
+
+	/* streaming stores need an aligned destination */
+	head = -(uintptr_t)d & 15;
+	if (head > n)
+		head = n;
+	memcpy(d, s, head);
+	d += head;
+	s += head;
+	n -= head;
+
+	for (; n >= 64; n -= 64, d += 64, s += 64) {
+		a = _mm_loadu_si128((const __m128i *)s);
+		b = _mm_loadu_si128((const __m128i *)(s + 16));
+		c = _mm_loadu_si128((const __m128i *)(s + 32));
+		e = _mm_loadu_si128((const __m128i *)(s + 48));
+		_mm_stream_si128((__m128i *)d, a);
+		_mm_stream_si128((__m128i *)(d + 16), b);
+		_mm_stream_si128((__m128i *)(d + 32), c);
+		_mm_stream_si128((__m128i *)(d + 48), e);
+	}
+
+	memcpy(d, s, n);
+}
+
+#elif defined(__ARM_NEON__)
+
+static void line_neon(void *dst, const void *src, size_t n)
+{
+	unsigned char *d = (unsigned char *)dst;
+	const unsigned char *s = (const unsigned char *)src;
+	uint8x16_t a, b, c, e;
+
+	for (; n >= 64; n -= 64, d += 64, s += 64) {
+		__builtin_prefetch(s + 256);
+		a = vld1q_u8(s);
+		b = vld1q_u8(s + 16);
+		c = vld1q_u8(s + 32);
+		e = vld1q_u8(s + 48);
+		vst1q_u8(d, a);
+		vst1q_u8(d + 16, b);
+		vst1q_u8(d + 32, c);
+		vst1q_u8(d + 48, e);
+	}
+
+	memcpy(d, s, n);
+}
+
+#endif
+
+static const struct copy_kernel kernels[] = {
+	{ "memcpy", line_memcpy, false },
+#if defined(__SSE2__)
+	{ "sse2-stream", line_stream, true },
+#elif defined(__ARM_NEON__)
+	{ "neon", line_neon, false },
+#endif
+};
+
+#define KERNEL_COUNT	(sizeof(kernels) / sizeof(kernels[0]))
+
+static const struct copy_kernel *kernel = &kernels[0];
+
+static void copy_run(const struct copy_kernel *k, void *dst,
+			unsigned dst_stride, const void *src,
+			unsigned src_stride, size_t line, unsigned height)
+{
+	unsigned char *d = (unsigned char *)dst;
+	const unsigned char *s = (const unsigned char *)src;
+	unsigned y;
+
+	if (src_stride == line && dst_stride == line) {
+		line *= height;
+		height = 1;
+	}
+
+	for (y = 0; y < height; ++y, d += dst_stride, s += src_stride)
+		k->line(d, s, line);
+
+#if defined(__SSE2__)
+	if (k->fence)
+		_mm_sfence();
+#endif
+}
+
+void copy_frame(void *dst, unsigned dst_stride, const void *src,
+			unsigned src_stride, size_t line, unsigned height)
+{
+	copy_run(kernel, dst, dst_stride, src, src_stride, line, height);
+}
+
+const char *copy_kernel_name(void)
+{
+	return kernel->name;
+}
+
+/*
+ * Time the best of runs copies of a frame in MB/s, counting only the
+ * bytes of the image and not any padding.
+ */
+static unsigned copy_time(const struct copy_kernel *k, void *dst,
+			unsigned dst_stride, const void *src,
+			unsigned src_stride, size_t line, unsigned height,
+			unsigned runs)
+{
+	long long start, t, best = 0;
+	unsigned i;
+
+	for (i = 0; i < runs; ++i) {
+		start = now_ns();
+		copy_run(k, dst, dst_stride, src, src_stride, line, height);
+		t = now_ns() - start;
+		if (!best || t < best)
+			best = t;
+	}
+
+	if (!best)
+		best = 1;
+
+	return line * height * 1000ULL / best;
+}
+
+static int copy_buffers(unsigned char **dst, unsigned char **src,
+			unsigned dst_stride, unsigned src_stride,
+			unsigned height)
+{
+	/* large enough for a flat copy of the source */
+	if (dst_stride < src_stride)
+		dst_stride = src_stride;
+
+	*src = (unsigned char *)malloc(src_stride * height);
+	*dst = (unsigned char *)malloc(dst_stride * height);
+	if (!*src || !*dst) {
+		free(*src);
+		free(*dst);
+		return -1;
+	}
+
+	/* fault the pages in before timing */
+	memset(*src, 0x80, src_stride * height);
+	memset(*dst, 0, dst_stride * height);
+
+	return 0;
+}
+
+/*
+ * Pick the fastest kernel for frames of the given geometry.
+ */
+void copy_init(size_t line, unsigned height, unsigned src_stride,
+						unsigned dst_stride)
+{
+	unsigned char *src, *dst;
+	unsigned rate, best = 0;
+	unsigned i;
+
+	if (KERNEL_COUNT == 1)
+		return;
+
+	if (copy_buffers(&dst, &src, dst_stride, src_stride, height))
+		return;
+
+	for (i = 0; i < KERNEL_COUNT; ++i) {
+		rate = copy_time(&kernels[i], dst, dst_stride, src, src_stride,
+						line, height, COPY_RUNS);
+		if (rate > best) {
+			best = rate;
+			kernel = &kernels[i];
+		}
+	}
+
+	free(src);
+	free(dst);
+
+	printf("%s - %s, %u MB/s\n", __func__, kernel->name, best);
+}
+
+static void copy_benchmark_run(const char *desc, size_t line,
+			unsigned height, unsigned src_stride,
+			unsigned dst_stride)
+{
+	unsigned char *src, *dst;
+	unsigned i;
+
+	if (copy_buffers(&dst, &src, dst_stride, src_stride, height))
+		die("out of memory\n");
+
+	printf("%-20s", desc);
+	for (i = 0; i < KERNEL_COUNT; ++i) {
+		printf(" %12s %5u MB/s", kernels[i].name,
+				copy_time(&kernels[i], dst, dst_stride, src,
+						src_stride, line, height,
+						COPY_BENCH_RUNS));
+	}
+
+	/* a flat copy moves the padding too */
+	if (src_stride != line) {
+		printf("   flat memcpy %5llu MB/s",
+				copy_time(&kernels[0], dst, src_stride, src,
+						src_stride, src_stride, height,
+						COPY_BENCH_RUNS) *
+						(unsigned long long)line /
+						src_stride);
+	}
+	printf("\n");
+
+	free(src);
+	free(dst);
+}
+
+/*
+ * Compare the copy bandwidth of the kernels against plain memcpy for
+ * frames of width x height YUYV, both packed and with padded lines.
+ */
+void copy_benchmark(unsigned width, unsigned height)
+{
+	size_t line = width * 2;
+	unsigned padded = (line + 255) & ~255U;
+
+	if (padded == line)
+		padded += 256;
+
+	printf("copy bandwidth, %ux%u YUYV, best of %u\n", width, height,
+							COPY_BENCH_RUNS);
+
+	copy_benchmark_run("packed", line, height, line, line);
+	copy_benchmark_run("padded source", line, height, padded, line);
+	copy_benchmark_run("padded both", line, height, padded, padded);
+}
@@ -0,0 +1,22 @@
+/*
+ * copy.h -- stride-aware frame copies
+ *
+ * Author: Johan Hovold <jhovold@gmail.com>
+ */
+
+#ifndef COPY_H
+#define COPY_H
+
+#include <cstddef>
+
+
+void copy_init(size_t line, unsigned height, unsigned src_stride,
+						unsigned dst_stride);
+const char *copy_kernel_name(void);
+
+void copy_frame(void *dst, unsigned dst_stride, const void *src,
+			unsigned src_stride, size_t line, unsigned height);
+
+void copy_benchmark(unsigned width, unsigned height);
+
+#endif	/* COPY_H */
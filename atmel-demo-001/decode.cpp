@@ -0,0 +1,486 @@
+/*
+ * decode.cpp -- pipelined MJPEG decoding to YUYV
+ *
+ * Compressed frames are decoded straight from the capture buffers by a
+ * pool of threads, each working on a different frame, and handed back in
+ * capture order. Decoding uses the libjpeg(-turbo) raw data interface so
+ * that the SIMD IDCT output is packed into YUYV one iMCU row at a time
+ * without colour conversion or upsampling passes.
+ *
+ * Author: Johan Hovold <jhovold@gmail.com>
+ */
+
+#include <csetjmp>
+#include <cstdio>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <jpeglib.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include "common.h"
+#include "decode.h"
+
+
+struct decode_error {
+	struct jpeg_error_mgr mgr;
+	jmp_buf env;
+};
+
+struct decode_ctx {
+	struct jpeg_decompress_struct cinfo;
+	struct decode_error err;
+
+	/* one iMCU row of planar output */
+	JSAMPROW rows[3][2 * DCTSIZE];
+	unsigned char *strip;
+};
+
+
+#if defined(__SSE2__)
+
+static void yuyv_pack_row(unsigned char *dst, const unsigned char *y,
+		const unsigned char *u, const unsigned char *v, unsigned width)
+{
+	__m128i yy, uv;
+	unsigned x;
+
+	for (x = 0; x + 16 <= width; x += 16, dst += 32) {
+		yy = _mm_loadu_si128((const __m128i *)(y + x));
+		uv = _mm_unpacklo_epi8(
+			_mm_loadl_epi64((const __m128i *)(u + x / 2)),
+			_mm_loadl_epi64((const __m128i *)(v + x / 2)));
+		_mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi8(yy, uv));
+		_mm_storeu_si128((__m128i *)(dst + 16),
+						_mm_unpackhi_epi8(yy, uv));
+	}
+
+	for (; x < width; x += 2, dst += 4) {
+		dst[0] = y[x];
+		dst[1] = u[x / 2];
+		dst[2] = y[x + 1];
+		dst[3] = v[x / 2];
+	}
+}
+
+#elif defined(__ARM_NEON__)
+
+static void yuyv_pack_row(unsigned char *dst, const unsigned char *y,
+		const unsigned char *u, const unsigned char *v, unsigned width)
+{
+	uint8x16x2_t yuyv;
+	uint8x8x2_t uv;
+	unsigned x;
+
+	for (x = 0; x + 16 <= width; x += 16, dst += 32) {
+		uv = vzip_u8(vld1_u8(u + x / 2), vld1_u8(v + x / 2));
+		yuyv.val[0] = vld1q_u8(y + x);
+		yuyv.val[1] = vcombine_u8(uv.val[0], uv.val[1]);
+		vst2q_u8(dst, yuyv);
+	}
+
+	for (; x < width; x += 2, dst += 4) {
+		dst[0] = y[x];
+		dst[1] = u[x / 2];
+		dst[2] = y[x + 1];
+		dst[3] = v[x / 2];
+	}
+}
+
+#else
+
+static void yuyv_pack_row(unsigned char *dst, const unsigned char *y,
+		const unsigned char *u, const unsigned char *v, unsigned width)
+{
+	unsigned x;
+
+	for (x = 0; x < width; x += 2, dst += 4) {
+		dst[0] = y[x];
+		dst[1] = u[x / 2];
+		dst[2] = y[x + 1];
+		dst[3] = v[x / 2];
+	}
+}
+
+#endif
+
+static void decode_error_exit(j_common_ptr cinfo)
+{
+	struct decode_error *err = (struct decode_error *)cinfo->err;
+
+	longjmp(err->env, 1);
+}
+
+static void decode_output_message(j_common_ptr cinfo)
+{
+	(void)cinfo;
+}
+
+static int decode_ctx_init(struct decode_ctx *ctx, unsigned width)
+{
+	unsigned stride;
+	unsigned char *p;
+	unsigned c, i;
+
+	memset(ctx, 0, sizeof(*ctx));
+
+	/* room for 4:2:0 (two luma block rows) padded to full MCUs */
+	stride = (width + 2 * DCTSIZE - 1) & ~(2 * DCTSIZE - 1);
+	ctx->strip = (unsigned char *)malloc(3 * 2 * DCTSIZE * stride);
+	if (!ctx->strip)
+		return -1;
+
+	p = ctx->strip;
+	for (c = 0; c < 3; ++c) {
+		for (i = 0; i < 2 * DCTSIZE; ++i, p += stride)
+			ctx->rows[c][i] = p;
+	}
+
+	ctx->cinfo.err = jpeg_std_error(&ctx->err.mgr);
+	ctx->err.mgr.error_exit = decode_error_exit;
+	ctx->err.mgr.output_message = decode_output_message;
+	jpeg_create_decompress(&ctx->cinfo);
+
+	return 0;
+}
+
+static void decode_ctx_free(struct decode_ctx *ctx)
+{
+	jpeg_destroy_decompress(&ctx->cinfo);
+	free(ctx->strip);
+}
+
+/*
+ * Decode a 4:2:2 or 4:2:0 YCbCr JPEG of the expected size into YUYV. Other
+ * layouts are rejected, as UVC cameras do not produce them.
+ */
+static int decode_mjpeg(struct decode_ctx *ctx, const void *src, size_t size,
+			unsigned char *dst, unsigned width, unsigned height)
+{
+	struct jpeg_decompress_struct *cinfo = &ctx->cinfo;
+	JSAMPARRAY planes[3];
+	unsigned char *out;
+	unsigned lines, vsub, row, i;
+
+	if (setjmp(ctx->err.env)) {
+		jpeg_abort_decompress(cinfo);
+		return -1;
+	}
+
+	jpeg_mem_src(cinfo, (unsigned char *)src, size);
+	jpeg_read_header(cinfo, TRUE);
+
+	if (cinfo->image_width != width || cinfo->image_height != height ||
+			cinfo->num_components != 3 ||
+			cinfo->jpeg_color_space != JCS_YCbCr ||
+			cinfo->comp_info[0].h_samp_factor != 2 ||
+			cinfo->comp_info[0].v_samp_factor > 2 ||
+			cinfo->comp_info[1].h_samp_factor != 1 ||
+			cinfo->comp_info[1].v_samp_factor != 1 ||
+			cinfo->comp_info[2].h_samp_factor != 1 ||
+			cinfo->comp_info[2].v_samp_factor != 1) {
+		jpeg_abort_decompress(cinfo);
+		return -1;
+	}
+
+	vsub = cinfo->comp_info[0].v_samp_factor;
+
+	cinfo->raw_data_out = TRUE;
+	cinfo->dct_method = JDCT_IFAST;
+	cinfo->do_fancy_upsampling = FALSE;
+	jpeg_start_decompress(cinfo);
+
+	planes[0] = ctx->rows[0];
+	planes[1] = ctx->rows[1];
+	planes[2] = ctx->rows[2];
+
+	/* dst is not advanced, as it is live across setjmp() */
+	out = dst;
+	for (row = 0; row < height; ) {
+		lines = jpeg_read_raw_data(cinfo, planes, vsub * DCTSIZE);
+		if (!lines) {
+			jpeg_abort_decompress(cinfo);
+			return -1;
+		}
+
+		for (i = 0; i < lines && row < height; ++i, ++row) {
+			yuyv_pack_row(out, ctx->rows[0][i],
+					ctx->rows[1][i / vsub],
+					ctx->rows[2][i / vsub], width);
+			out += width * 2;
+		}
+	}
+
+	jpeg_finish_decompress(cinfo);
+
+	return 0;
+}
+
+static struct decode_slot *decode_next_queued(struct decoder *dec)
+{
+	struct decode_slot *slot = NULL;
+	unsigned i;
+
+	for (i = 0; i < dec->pool_size; ++i) {
+		if (dec->pool[i].state != DECODE_QUEUED)
+			continue;
+		if (!slot || dec->pool[i].seq < slot->seq)
+			slot = &dec->pool[i];
+	}
+
+	return slot;
+}
+
+static void *decode_thread(void *arg)
+{
+	struct decoder *dec = (struct decoder *)arg;
+	struct decode_slot *slot;
+	struct decode_ctx ctx;
+	uint64_t event = 1;
+	int ret;
+
+	rt_thread_setup("decode", &dec->rt);
+
+	if (decode_ctx_init(&ctx, dec->width))
+		die("%s: out of memory\n", __func__);
+
+	pthread_mutex_lock(&dec->lock);
+	while (!dec->stop) {
+		slot = decode_next_queued(dec);
+		if (!slot) {
+			pthread_cond_wait(&dec->cond, &dec->lock);
+			continue;
+		}
+
+		slot->state = DECODE_BUSY;
+		pthread_mutex_unlock(&dec->lock);
+
+		ret = decode_mjpeg(&ctx, slot->in.data, slot->in.size,
+					slot->data, dec->width, dec->height);
+
+		pthread_mutex_lock(&dec->lock);
+		if (ret) {
+			slot->state = DECODE_FAILED;
+			++dec->errors;
+		} else {
+			slot->state = DECODE_DONE;
+			++dec->decoded;
+		}
+		pthread_cond_broadcast(&dec->cond);
+
+		if (write(dec->event_fd, &event, sizeof(event)) < 0)
+			err_errno("eventfd");
+	}
+	pthread_mutex_unlock(&dec->lock);
+
+	decode_ctx_free(&ctx);
+
+	return NULL;
+}
+
+/*
+ * Start threads decoding width x height MJPEG frames into YUYV, with two
+ * more slots than threads so that decoding can continue while the display
+ * holds on to frames.
+ */
+int decoder_init(struct decoder *dec, unsigned width, unsigned height,
+			unsigned threads, const struct rt_params *rt)
+{
+	unsigned i;
+	int ret;
+
+	memset(dec, 0, sizeof(*dec));
+
+	if (!threads || threads > DECODE_THREADS_MAX)
+		return -1;
+
+	dec->width = width;
+	dec->height = height;
+	dec->rt = *rt;
+	dec->pool_size = threads + 2;
+
+	for (i = 0; i < dec->pool_size; ++i) {
+		dec->pool[i].data = (unsigned char *)malloc(width * height * 2);
+		if (!dec->pool[i].data)
+			goto err_free;
+	}
+
+	dec->event_fd = eventfd(0, EFD_NONBLOCK);
+	if (dec->event_fd < 0)
+		goto err_free;
+
+	pthread_mutex_init(&dec->lock, NULL);
+	pthread_cond_init(&dec->cond, NULL);
+
+	for (i = 0; i < threads; ++i) {
+		ret = pthread_create(&dec->threads[i], NULL, decode_thread, dec);
+		if (ret) {
+			errno = ret;
+			die_errno("pthread_create");
+		}
+	}
+	dec->thread_count = threads;
+
+	return 0;
+
+err_free:
+	for (i = 0; i < dec->pool_size; ++i)
+		free(dec->pool[i].data);
+
+	return -1;
+}
+
+void decoder_free(struct decoder *dec)
+{
+	unsigned i;
+
+	pthread_mutex_lock(&dec->lock);
+	dec->stop = true;
+	pthread_cond_broadcast(&dec->cond);
+	pthread_mutex_unlock(&dec->lock);
+
+	for (i = 0; i < dec->thread_count; ++i)
+		pthread_join(dec->threads[i], NULL);
+
+	for (i = 0; i < dec->pool_size; ++i)
+		free(dec->pool[i].data);
+
+	close(dec->event_fd);
+	pthread_cond_destroy(&dec->cond);
+	pthread_mutex_destroy(&dec->lock);
+}
+
+/*
+ * Queue a compressed frame for decoding. Returns false if all slots are in
+ * use, in which case the frame is dropped and should be released by the
+ * caller.
+ */
+bool decoder_submit(struct decoder *dec, const struct video_frame *in)
+{
+	struct decode_slot *slot = NULL;
+	unsigned i;
+
+	pthread_mutex_lock(&dec->lock);
+
+	for (i = 0; i < dec->pool_size; ++i) {
+		if (dec->pool[i].state == DECODE_FREE) {
+			slot = &dec->pool[i];
+			break;
+		}
+	}
+
+	if (!slot) {
+		++dec->overruns;
+		pthread_mutex_unlock(&dec->lock);
+		return false;
+	}
+
+	slot->state = DECODE_QUEUED;
+	slot->seq = dec->submit_seq++;
+	slot->in = *in;
+	pthread_cond_signal(&dec->cond);
+
+	pthread_mutex_unlock(&dec->lock);
+
+	return true;
+}
+
+/*
+ * Get the next decoded frame in submission order. Returns 1 and fills in
+ * out if a frame is ready, -1 if it failed to decode, and 0 if the next
+ * frame is still being decoded. In the first two cases, capture is set to
+ * the capture buffer which is no longer needed.
+ */
+int decoder_get(struct decoder *dec, struct video_frame *out, int *capture)
+{
+	struct decode_slot *slot = NULL;
+	uint64_t event;
+	unsigned i;
+	int ret;
+
+	if (read(dec->event_fd, &event, sizeof(event)) < 0 && errno != EAGAIN)
+		err_errno("eventfd");
+
+	pthread_mutex_lock(&dec->lock);
+
+	for (i = 0; i < dec->pool_size; ++i) {
+		if ((dec->pool[i].state == DECODE_DONE ||
+				dec->pool[i].state == DECODE_FAILED) &&
+				dec->pool[i].seq == dec->deliver_seq) {
+			slot = &dec->pool[i];
+			break;
+		}
+	}
+
+	if (!slot) {
+		pthread_mutex_unlock(&dec->lock);
+		return 0;
+	}
+
+	++dec->deliver_seq;
+	*capture = slot->in.capture;
+
+	if (slot->state == DECODE_FAILED) {
+		slot->state = DECODE_FREE;
+		ret = -1;
+	} else {
+		slot->state = DECODE_HELD;
+
+		*out = slot->in;
+		out->capture = -1;
+		out->decoded = slot - dec->pool;
+		out->dmabuf = -1;
+		out->data = slot->data;
+		out->size = dec->width * dec->height * 2;
+		ret = 1;
+	}
+
+	pthread_mutex_unlock(&dec->lock);
+
+	return ret;
+}
+
+void decoder_release(struct decoder *dec, int slot)
+{
+	pthread_mutex_lock(&dec->lock);
+	dec->pool[slot].state = DECODE_FREE;
+	pthread_mutex_unlock(&dec->lock);
+}
+
+/*
+ * Wait for frames being decoded and discard all frames not yet handed out,
+ * e.g. before the capture stream is stopped. Frames held by the caller
+ * still need to be released.
+ */
+void decoder_flush(struct decoder *dec)
+{
+	bool busy;
+	unsigned i;
+
+	pthread_mutex_lock(&dec->lock);
+
+	do {
+		busy = false;
+		for (i = 0; i < dec->pool_size; ++i) {
+			if (dec->pool[i].state == DECODE_QUEUED ||
+					dec->pool[i].state == DECODE_BUSY)
+				busy = true;
+		}
+		if (busy)
+			pthread_cond_wait(&dec->cond, &dec->lock);
+	} while (busy);
+
+	for (i = 0; i < dec->pool_size; ++i) {
+		if (dec->pool[i].state != DECODE_HELD)
+			dec->pool[i].state = DECODE_FREE;
+	}
+	dec->deliver_seq = dec->submit_seq;
+
+	pthread_mutex_unlock(&dec->lock);
+}
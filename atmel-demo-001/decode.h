@@ -0,0 +1,67 @@
+/*
+ * decode.h -- pipelined MJPEG decoding to YUYV
+ *
+ * Author: Johan Hovold <jhovold@gmail.com>
+ */
+
+#ifndef DECODE_H
+#define DECODE_H
+
+#include <pthread.h>
+
+#include "frame.h"
+#include "rt.h"
+
+
+#define DECODE_THREADS_MAX	4
+#define DECODE_SLOTS_MAX	(DECODE_THREADS_MAX + 2)
+
+enum decode_state {
+	DECODE_FREE,
+	DECODE_QUEUED,
+	DECODE_BUSY,
+	DECODE_DONE,
+	DECODE_FAILED,
+	DECODE_HELD,
+};
+
+struct decode_slot {
+	enum decode_state state;
+	unsigned long seq;
+	struct video_frame in;
+	unsigned char *data;	/* YUYV */
+};
+
+struct decoder {
+	unsigned width;
+	unsigned height;
+	struct rt_params rt;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t threads[DECODE_THREADS_MAX];
+	unsigned thread_count;
+	bool stop;
+
+	struct decode_slot pool[DECODE_SLOTS_MAX];
+	unsigned pool_size;
+	unsigned long submit_seq;
+	unsigned long deliver_seq;
+
+	int event_fd;
+
+	unsigned long decoded;
+	unsigned long errors;
+	unsigned long overruns;
+};
+
+int decoder_init(struct decoder *dec, unsigned width, unsigned height,
+			unsigned threads, const struct rt_params *rt);
+void decoder_free(struct decoder *dec);
+
+bool decoder_submit(struct decoder *dec, const struct video_frame *in);
+int decoder_get(struct decoder *dec, struct video_frame *out, int *capture);
+void decoder_release(struct decoder *dec, int slot);
+void decoder_flush(struct decoder *dec);
+
+#endif	/* DECODE_H */
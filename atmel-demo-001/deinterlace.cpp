@@ -0,0 +1,395 @@
+/*
+ * deinterlace.cpp -- deinterlacing of woven YUYV frames
+ *
+ * Frames captured with V4L2_FIELD_INTERLACED hold two fields taken half a
+ * frame period apart, woven line by line, which combs on motion. One field
+ * is kept and the lines of the other one are
+ *
+ *	bob		interpolated from the lines above and below
+ *	blend		left in place, but every line is low-passed vertically
+ *			as (above + 2 * line + below) / 4
+ *	adaptive	woven in where neither the line nor the one above has
+ *			changed since the previous frame, and interpolated
+ *			elsewhere
+ *
+ * Showing each field in turn gives output at the field rate. YUYV keeps
+ * luma and chroma interleaved in the same rows, so all bytes are treated
+ * alike.
+ *
+ * Author: Johan Hovold <jhovold@gmail.com>
+ */
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include "common.h"
+#include "deinterlace.h"
+
+
+#define DEINT_BENCH_RUNS	64
+
+struct deint_kernel {
+	const char *name;
+	void (*interp)(unsigned char *dst, const unsigned char *a,
+				const unsigned char *b, size_t n);
+	void (*blend)(unsigned char *dst, const unsigned char *a,
+				const unsigned char *c, const unsigned char *b,
+				size_t n);
+	void (*adaptive)(unsigned char *dst, const unsigned char *c,
+				const unsigned char *a, const unsigned char *b,
+				const unsigned char *pc,
+				const unsigned char *pa, size_t n,
+				unsigned threshold);
+};
+
+static inline unsigned absdiff(unsigned x, unsigned y)
+{
+	return x > y ? x - y : y - x;
+}
+
+static void interp_c(unsigned char *dst, const unsigned char *a,
+				const unsigned char *b, size_t n)
+{
+	while (n--)
+		*dst++ = (*a++ + *b++ + 1) >> 1;
+}
+
+/* rounds like two rounding averages, as the SIMD kernels do */
+static void blend_c(unsigned char *dst, const unsigned char *a,
+			const unsigned char *c, const unsigned char *b,
+			size_t n)
+{
+	while (n--)
+		*dst++ = (((*a++ + *b++ + 1) >> 1) + *c++ + 1) >> 1;
+}
+
+static void adaptive_c(unsigned char *dst, const unsigned char *c,
+			const unsigned char *a, const unsigned char *b,
+			const unsigned char *pc, const unsigned char *pa,
+			size_t n, unsigned threshold)
+{
+	unsigned m;
+	size_t i;
+
+	for (i = 0; i < n; ++i) {
+		m = absdiff(c[i], pc[i]);
+		if (absdiff(a[i], pa[i]) > m)
+			m = absdiff(a[i], pa[i]);
+
+		dst[i] = m > threshold ? (a[i] + b[i] + 1) >> 1 : c[i];
+	}
+}
+
+#if defined(__SSE2__)
+
+static void interp_sse2(unsigned char *dst, const unsigned char *a,
+				const unsigned char *b, size_t n)
+{
+	for (; n >= 16; n -= 16, dst += 16, a += 16, b += 16) {
+		_mm_storeu_si128((__m128i *)dst, _mm_avg_epu8(
+				_mm_loadu_si128((const __m128i *)a),
+				_mm_loadu_si128((const __m128i *)b)));
+	}
+
+	interp_c(dst, a, b, n);
+}
+
+static void blend_sse2(unsigned char *dst, const unsigned char *a,
+			const unsigned char *c, const unsigned char *b,
+			size_t n)
+{
+	__m128i ab;
+
+	for (; n >= 16; n -= 16, dst += 16, a += 16, c += 16, b += 16) {
+		ab = _mm_avg_epu8(_mm_loadu_si128((const __m128i *)a),
+				_mm_loadu_si128((const __m128i *)b));
+		_mm_storeu_si128((__m128i *)dst, _mm_avg_epu8(ab,
+				_mm_loadu_si128((const __m128i *)c)));
+	}
+
+	blend_c(dst, a, c, b, n);
+}
+
+static inline __m128i absdiff_sse2(__m128i x, __m128i y)
+{
+	return _mm_or_si128(_mm_subs_epu8(x, y), _mm_subs_epu8(y, x));
+}
+
+static void adaptive_sse2(unsigned char *dst, const unsigned char *c,
+			const unsigned char *a, const unsigned char *b,
+			const unsigned char *pc, const unsigned char *pa,
+			size_t n, unsigned threshold)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i thr = _mm_set1_epi8((char)threshold);
+	__m128i vc, va, vb, m, still;
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		vc = _mm_loadu_si128((const __m128i *)(c + i));
+		va = _mm_loadu_si128((const __m128i *)(a + i));
+		vb = _mm_loadu_si128((const __m128i *)(b + i));
+
+		m = _mm_max_epu8(
+			absdiff_sse2(vc, _mm_loadu_si128((const __m128i *)(pc + i))),
+			absdiff_sse2(va, _mm_loadu_si128((const __m128i *)(pa + i))));
+
+		/* bytes that changed no more than the threshold */
+		still = _mm_cmpeq_epi8(_mm_subs_epu8(m, thr), zero);
+
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_or_si128(
+				_mm_and_si128(still, vc),
+				_mm_andnot_si128(still, _mm_avg_epu8(va, vb))));
+	}
+
+	adaptive_c(dst + i, c + i, a + i, b + i, pc + i, pa + i, n - i,
+								threshold);
+}
+
+#elif defined(__ARM_NEON__)
+
+static void interp_neon(unsigned char *dst, const unsigned char *a,
+				const unsigned char *b, size_t n)
+{
+	for (; n >= 16; n -= 16, dst += 16, a += 16, b += 16)
+		vst1q_u8(dst, vrhaddq_u8(vld1q_u8(a), vld1q_u8(b)));
+
+	interp_c(dst, a, b, n);
+}
+
+static void blend_neon(unsigned char *dst, const unsigned char *a,
+			const unsigned char *c, const unsigned char *b,
+			size_t n)
+{
+	uint8x16_t ab;
+
+	for (; n >= 16; n -= 16, dst += 16, a += 16, c += 16, b += 16) {
+		ab = vrhaddq_u8(vld1q_u8(a), vld1q_u8(b));
+		vst1q_u8(dst, vrhaddq_u8(ab, vld1q_u8(c)));
+	}
+
+	blend_c(dst, a, c, b, n);
+}
+
+static void adaptive_neon(unsigned char *dst, const unsigned char *c,
+			const unsigned char *a, const unsigned char *b,
+			const unsigned char *pc, const unsigned char *pa,
+			size_t n, unsigned threshold)
+{
+	const uint8x16_t thr = vdupq_n_u8(threshold);
+	uint8x16_t vc, va, vb, m;
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		vc = vld1q_u8(c + i);
+		va = vld1q_u8(a + i);
+		vb = vld1q_u8(b + i);
+
+		m = vmaxq_u8(vabdq_u8(vc, vld1q_u8(pc + i)),
+				vabdq_u8(va, vld1q_u8(pa + i)));
+
+		vst1q_u8(dst + i, vbslq_u8(vcgtq_u8(m, thr),
+						vrhaddq_u8(va, vb), vc));
+	}
+
+	adaptive_c(dst + i, c + i, a + i, b + i, pc + i, pa + i, n - i,
+								threshold);
+}
+
+#endif
+
+static const struct deint_kernel kernels[] = {
+	{ "c", interp_c, blend_c, adaptive_c },
+#if defined(__SSE2__)
+	{ "sse2", interp_sse2, blend_sse2, adaptive_sse2 },
+#elif defined(__ARM_NEON__)
+	{ "neon", interp_neon, blend_neon, adaptive_neon },
+#endif
+};
+
+#define KERNEL_COUNT	(sizeof(kernels) / sizeof(kernels[0]))
+
+static const char *mode_names[] = {
+	"bob",
+	"blend",
+	"adaptive",
+};
+
+const char *deint_mode_name(enum deint_mode mode)
+{
+	return mode_names[mode];
+}
+
+int deint_init(struct deinterlacer *di, enum deint_mode mode,
+					unsigned width, unsigned height)
+{
+	memset(di, 0, sizeof(*di));
+	di->mode = mode;
+	di->line = width * 2;
+	di->height = height;
+	di->threshold = DEINT_THRESHOLD;
+
+	if (mode != DEINT_ADAPTIVE)
+		return 0;
+
+	di->ref[0] = (unsigned char *)malloc(di->line * height);
+	di->ref[1] = (unsigned char *)malloc(di->line * height);
+	if (!di->ref[0] || !di->ref[1]) {
+		deint_free(di);
+		return -1;
+	}
+
+	return 0;
+}
+
+void deint_free(struct deinterlacer *di)
+{
+	if (di->frames) {
+		printf("%s - %s, %lu frames, cost avg %lld max %u us\n",
+				__func__, mode_names[di->mode], di->frames,
+				di->cost / di->frames / 1000,
+				di->cost_max / 1000);
+	}
+
+	free(di->ref[0]);
+	free(di->ref[1]);
+	di->ref[0] = di->ref[1] = NULL;
+}
+
+static void deint_run(struct deinterlacer *di, const struct deint_kernel *k,
+			unsigned char *dst, unsigned dst_stride,
+			const unsigned char *src, unsigned src_stride,
+			unsigned height, unsigned field, bool store)
+{
+	const unsigned char *prev = di->ref[!di->cur];
+	unsigned char *ref = di->ref[di->cur];
+	const size_t line = di->line;
+	const unsigned char *a, *b;
+	bool have_prev;
+	unsigned y, ya;
+
+	have_prev = di->frames_seen > 1;
+
+	for (y = 0; y < height; ++y, dst += dst_stride, src += src_stride) {
+		/* neighbouring lines of the other parity, mirrored at edges */
+		ya = y ? y - 1 : 1;
+		a = y ? src - src_stride : src + src_stride;
+		b = y + 1 < height ? src + src_stride : a;
+		if (height == 1)
+			a = b = src;
+
+		if (di->mode == DEINT_BLEND) {
+			k->blend(dst, a, src, b, line);
+		} else if ((y & 1) == field) {
+			memcpy(dst, src, line);
+		} else if (di->mode == DEINT_BOB || !have_prev) {
+			k->interp(dst, a, b, line);
+		} else {
+			k->adaptive(dst, src, a, b, prev + y * line,
+					prev + (height > 1 ? ya : y) * line,
+					line, di->threshold);
+		}
+
+		if (store)
+			memcpy(ref + y * line, src, line);
+	}
+}
+
+/*
+ * Deinterlace a frame keeping the given field, zero for the top one. Pass
+ * the same sequence number when showing the other field of a frame, so
+ * that motion is still measured against the previous frame.
+ */
+void deint_frame(struct deinterlacer *di, void *dst, unsigned dst_stride,
+			const void *src, unsigned src_stride, unsigned height,
+			unsigned field, unsigned sequence)
+{
+	long long start, cost;
+	bool store = false;
+
+	if (height > di->height)
+		height = di->height;
+
+	start = now_ns();
+
+	if (di->mode == DEINT_ADAPTIVE &&
+			(!di->frames_seen || sequence != di->sequence)) {
+		di->cur = !di->cur;
+		di->sequence = sequence;
+		++di->frames_seen;
+		store = true;
+	}
+
+	deint_run(di, &kernels[KERNEL_COUNT - 1], (unsigned char *)dst,
+			dst_stride, (const unsigned char *)src, src_stride,
+			height, field & 1, store);
+
+	cost = now_ns() - start;
+	++di->frames;
+	di->cost += cost;
+	if (cost > di->cost_max)
+		di->cost_max = cost;
+}
+
+/*
+ * Time every mode with every kernel on frames of width x height YUYV.
+ * The adaptive mode is timed on a frame where half the lines move.
+ */
+void deint_benchmark(unsigned width, unsigned height)
+{
+	const size_t line = width * 2;
+	struct deinterlacer di;
+	unsigned char *src[2], *dst;
+	long long start, t, best;
+	unsigned mode, i, run;
+	size_t j;
+
+	src[0] = (unsigned char *)malloc(line * height);
+	src[1] = (unsigned char *)malloc(line * height);
+	dst = (unsigned char *)malloc(line * height);
+	if (!src[0] || !src[1] || !dst)
+		die("out of memory\n");
+
+	for (j = 0; j < line * height; ++j) {
+		src[0][j] = j * 13;
+		src[1][j] = (j / line) % 4 < 2 ? j * 13 : j * 7;
+	}
+	memset(dst, 0, line * height);
+
+	printf("deinterlace, %ux%u YUYV, best of %u\n", width, height,
+							DEINT_BENCH_RUNS);
+
+	for (mode = DEINT_BOB; mode <= DEINT_ADAPTIVE; ++mode) {
+		if (deint_init(&di, (enum deint_mode)mode, width, height))
+			die("out of memory\n");
+
+		printf("%-10s", mode_names[mode]);
+		for (i = 0; i < KERNEL_COUNT; ++i) {
+			best = 0;
+			for (run = 0; run < DEINT_BENCH_RUNS; ++run) {
+				start = now_ns();
+				deint_run(&di, &kernels[i], dst, line,
+						src[run & 1], line, height,
+						run & 1, mode == DEINT_ADAPTIVE);
+				t = now_ns() - start;
+				if (!best || t < best)
+					best = t;
+
+				/* the reference alternates like frames */
+				di.cur = !di.cur;
+				di.frames_seen = 2;
+			}
+			printf(" %6s %5lld us", kernels[i].name, best / 1000);
+		}
+		printf("\n");
+
+		deint_free(&di);
+	}
+
+	free(dst);
+	free(src[1]);
+	free(src[0]);
+}
@@ -0,0 +1,49 @@
+/*
+ * deinterlace.h -- deinterlacing of woven YUYV frames
+ *
+ * Author: Johan Hovold <jhovold@gmail.com>
+ */
+
+#ifndef DEINTERLACE_H
+#define DEINTERLACE_H
+
+#include <cstddef>
+
+
+#define DEINT_THRESHOLD	12	/* change per byte considered motion */
+
+enum deint_mode {
+	DEINT_BOB,		/* interpolate the other field */
+	DEINT_BLEND,		/* low-pass both fields together */
+	DEINT_ADAPTIVE		/* weave where static, interpolate on motion */
+};
+
+struct deinterlacer {
+	enum deint_mode mode;
+	size_t line;		/* bytes */
+	unsigned height;
+	unsigned threshold;
+
+	/* previous and current source frames, for motion detection */
+	unsigned char *ref[2];
+	unsigned cur;
+	unsigned sequence;
+	unsigned frames_seen;
+
+	unsigned long frames;
+	long long cost;		/* ns, total */
+	unsigned cost_max;	/* ns */
+};
+
+int deint_init(struct deinterlacer *di, enum deint_mode mode,
+					unsigned width, unsigned height);
+void deint_free(struct deinterlacer *di);
+const char *deint_mode_name(enum deint_mode mode);
+
+void deint_frame(struct deinterlacer *di, void *dst, unsigned dst_stride,
+			const void *src, unsigned src_stride, unsigned height,
+			unsigned field, unsigned sequence);
+
+void deint_benchmark(unsigned width, unsigned height);
+
+#endif	/* DEINTERLACE_H */
@@ -0,0 +1,341 @@
+/*
+ * denoise.cpp -- motion-gated temporal noise reduction
+ *
+ * Every byte is filtered recursively against the previous output:
+ *
+ *	out = ref + (cur - ref) * w / 128
+ *
+ * where the weight w of the new value grows with the difference to the
+ * reference. Differences within the noise floor keep most of the
+ * reference, while motion takes the new value as is, so that moving
+ * objects do not smear. Arithmetic is in 16-bit fixed point and the SIMD
+ * kernels give the same output as the C ones.
+ *
+ * The level trades quality for cost:
+ *
+ *	1	luma only, half of the reference kept where static, which
+ *		skips the chroma planes of YUV420 altogether
+ *	2	luma and chroma, three quarters kept
+ *	3	luma and chroma, seven eighths kept, and motion gated on
+ *		groups of four bytes, i.e. whole YUYV pixel pairs, so that
+ *		noise in one byte does not leave ghosts of a moving edge,
+ *		at a few more instructions per vector
+ *
+ * Frames are filtered in place, and the output is also kept as the
+ * reference, which is allocated once.
+ *
+ * Author: Johan Hovold <jhovold@gmail.com>
+ */
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include <linux/videodev2.h>
+
+#include "common.h"
+#include "denoise.h"
+
+
+#define DENOISE_NOISE	3	/* differences taken as noise */
+#define DENOISE_GAIN	8	/* weight per level of difference above */
+#define WEIGHT_ONE	128
+
+struct denoise_params {
+	unsigned weight;
+	bool chroma;		/* keep odd bytes as they are */
+	bool grouped;
+};
+
+static inline unsigned absdiff(unsigned x, unsigned y)
+{
+	return x > y ? x - y : y - x;
+}
+
+static void row_c(unsigned char *cur, unsigned char *ref, size_t n,
+					const struct denoise_params *p)
+{
+	unsigned d, w;
+	size_t i, j, end;
+	int v;
+
+	for (i = 0; i < n; i = end) {
+		end = p->grouped ? (i | 3) + 1 : i + 1;
+		if (end > n)
+			end = n;
+
+		d = 0;
+		for (j = i; j < end; ++j) {
+			if (absdiff(cur[j], ref[j]) > d)
+				d = absdiff(cur[j], ref[j]);
+		}
+
+		w = p->weight;
+		if (d > DENOISE_NOISE)
+			w += (d - DENOISE_NOISE) * DENOISE_GAIN;
+		if (w > WEIGHT_ONE)
+			w = WEIGHT_ONE;
+
+		for (j = i; j < end; ++j) {
+			if (p->chroma && (j & 1)) {
+				ref[j] = cur[j];
+				continue;
+			}
+
+			/* rounded, and floored like an arithmetic shift */
+			v = (cur[j] - ref[j]) * (int)w + 64 + 32768;
+			v = ref[j] + (v >> 7) - 256;
+			cur[j] = ref[j] = v;
+		}
+	}
+}
+
+#if defined(__SSE2__)
+
+static void row_simd(unsigned char *cur, unsigned char *ref, size_t n,
+					const struct denoise_params *p)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i noise = _mm_set1_epi8(DENOISE_NOISE);
+	const __m128i gain = _mm_set1_epi16(DENOISE_GAIN);
+	const __m128i weight = _mm_set1_epi16(p->weight);
+	const __m128i one = _mm_set1_epi16(WEIGHT_ONE);
+	const __m128i round = _mm_set1_epi16(64);
+	const __m128i low = _mm_set1_epi32(0xff);
+	const __m128i chroma = _mm_set1_epi32(WEIGHT_ONE << 16);
+	__m128i c, r, d, w[2], v[2];
+	unsigned i;
+
+	for (; n >= 16; n -= 16, cur += 16, ref += 16) {
+		c = _mm_loadu_si128((const __m128i *)cur);
+		r = _mm_loadu_si128((const __m128i *)ref);
+
+		d = _mm_or_si128(_mm_subs_epu8(c, r), _mm_subs_epu8(r, c));
+		if (p->grouped) {
+			d = _mm_max_epu8(d, _mm_srli_epi32(d, 8));
+			d = _mm_max_epu8(d, _mm_srli_epi32(d, 16));
+			d = _mm_and_si128(d, low);
+			d = _mm_or_si128(d, _mm_slli_epi32(d, 8));
+			d = _mm_or_si128(d, _mm_slli_epi32(d, 16));
+		}
+		d = _mm_subs_epu8(d, noise);
+
+		w[0] = _mm_unpacklo_epi8(d, zero);
+		w[1] = _mm_unpackhi_epi8(d, zero);
+		v[0] = _mm_sub_epi16(_mm_unpacklo_epi8(c, zero),
+					_mm_unpacklo_epi8(r, zero));
+		v[1] = _mm_sub_epi16(_mm_unpackhi_epi8(c, zero),
+					_mm_unpackhi_epi8(r, zero));
+
+		for (i = 0; i < 2; ++i) {
+			w[i] = _mm_min_epi16(_mm_add_epi16(weight,
+					_mm_mullo_epi16(w[i], gain)), one);
+			if (p->chroma)
+				w[i] = _mm_max_epi16(w[i], chroma);
+
+			v[i] = _mm_srai_epi16(_mm_add_epi16(
+					_mm_mullo_epi16(v[i], w[i]), round), 7);
+		}
+
+		v[0] = _mm_add_epi16(v[0], _mm_unpacklo_epi8(r, zero));
+		v[1] = _mm_add_epi16(v[1], _mm_unpackhi_epi8(r, zero));
+		c = _mm_packus_epi16(v[0], v[1]);
+
+		_mm_storeu_si128((__m128i *)cur, c);
+		_mm_storeu_si128((__m128i *)ref, c);
+	}
+
+	row_c(cur, ref, n, p);
+}
+
+#elif defined(__ARM_NEON__)
+
+static void row_simd(unsigned char *cur, unsigned char *ref, size_t n,
+					const struct denoise_params *p)
+{
+	const uint8x16_t noise = vdupq_n_u8(DENOISE_NOISE);
+	const uint8x8_t gain = vdup_n_u8(DENOISE_GAIN);
+	const uint16x8_t weight = vdupq_n_u16(p->weight);
+	const uint16x8_t one = vdupq_n_u16(WEIGHT_ONE);
+	const uint32x4_t low = vdupq_n_u32(0xff);
+	const uint16x8_t chroma = vreinterpretq_u16_u32(
+					vdupq_n_u32(WEIGHT_ONE << 16));
+	uint8x16_t c, r, d;
+	uint32x4_t t;
+	uint16x8_t wl, wh;
+	int16x8_t vl, vh;
+
+	for (; n >= 16; n -= 16, cur += 16, ref += 16) {
+		c = vld1q_u8(cur);
+		r = vld1q_u8(ref);
+
+		d = vabdq_u8(c, r);
+		if (p->grouped) {
+			t = vreinterpretq_u32_u8(d);
+			d = vmaxq_u8(d, vreinterpretq_u8_u32(vshrq_n_u32(t, 8)));
+			t = vreinterpretq_u32_u8(d);
+			d = vmaxq_u8(d, vreinterpretq_u8_u32(vshrq_n_u32(t, 16)));
+			t = vandq_u32(vreinterpretq_u32_u8(d), low);
+			d = vreinterpretq_u8_u32(vmulq_n_u32(t, 0x01010101));
+		}
+		d = vqsubq_u8(d, noise);
+
+		wl = vminq_u16(vmlal_u8(weight, vget_low_u8(d), gain), one);
+		wh = vminq_u16(vmlal_u8(weight, vget_high_u8(d), gain), one);
+		if (p->chroma) {
+			wl = vmaxq_u16(wl, chroma);
+			wh = vmaxq_u16(wh, chroma);
+		}
+
+		vl = vreinterpretq_s16_u16(vsubl_u8(vget_low_u8(c),
+							vget_low_u8(r)));
+		vh = vreinterpretq_s16_u16(vsubl_u8(vget_high_u8(c),
+							vget_high_u8(r)));
+		vl = vrshrq_n_s16(vmulq_s16(vl, vreinterpretq_s16_u16(wl)), 7);
+		vh = vrshrq_n_s16(vmulq_s16(vh, vreinterpretq_s16_u16(wh)), 7);
+		vl = vaddq_s16(vl, vreinterpretq_s16_u16(
+						vmovl_u8(vget_low_u8(r))));
+		vh = vaddq_s16(vh, vreinterpretq_s16_u16(
+						vmovl_u8(vget_high_u8(r))));
+
+		c = vcombine_u8(vqmovun_s16(vl), vqmovun_s16(vh));
+		vst1q_u8(cur, c);
+		vst1q_u8(ref, c);
+	}
+
+	row_c(cur, ref, n, p);
+}
+
+#else
+
+static void row_simd(unsigned char *cur, unsigned char *ref, size_t n,
+					const struct denoise_params *p)
+{
+	row_c(cur, ref, n, p);
+}
+
+#endif
+
+int denoise_init(struct denoiser *dn, unsigned fourcc, unsigned width,
+			unsigned height, unsigned stride, unsigned level)
+{
+	size_t size;
+
+	memset(dn, 0, sizeof(*dn));
+	dn->fourcc = fourcc;
+	dn->width = width;
+	dn->height = height;
+	dn->stride = stride;
+	dn->level = level;
+
+	switch (level) {
+	case 1:
+		dn->weight = WEIGHT_ONE / 2;
+		dn->luma_only = true;
+		break;
+	case 2:
+		dn->weight = WEIGHT_ONE / 4;
+		break;
+	default:
+		dn->weight = WEIGHT_ONE / 8;
+		dn->grouped = true;
+		break;
+	}
+
+	if (fourcc == V4L2_PIX_FMT_YUV420)
+		size = width * height + 2 * ((width + 1) / 2) *
+							((height + 1) / 2);
+	else
+		size = width * 2 * height;
+
+	dn->ref = (unsigned char *)calloc(1, size);
+	if (!dn->ref)
+		return -1;
+
+	return 0;
+}
+
+void denoise_free(struct denoiser *dn)
+{
+	if (dn->frames) {
+		printf("%s - level %u, %lu frames, cost avg %lld max %u us\n",
+				__func__, dn->level, dn->frames,
+				dn->cost / dn->frames / 1000,
+				dn->cost_max / 1000);
+	}
+
+	free(dn->ref);
+	dn->ref = NULL;
+}
+
+static void denoise_plane(struct denoiser *dn, unsigned char *plane,
+			unsigned stride, unsigned char *ref, size_t line,
+			unsigned height, const struct denoise_params *p)
+{
+	unsigned y;
+
+	for (y = 0; y < height; ++y, plane += stride, ref += line) {
+		if (dn->have_ref)
+			row_simd(plane, ref, line, p);
+		else
+			memcpy(ref, plane, line);
+	}
+}
+
+/*
+ * Filter a frame in place. Short YUYV frames are filtered as far as they
+ * go, and short YUV420 frames are left alone.
+ */
+void denoise_frame(struct denoiser *dn, void *frame, size_t size)
+{
+	unsigned char *data = (unsigned char *)frame;
+	unsigned cw = (dn->width + 1) / 2;
+	unsigned ch = (dn->height + 1) / 2;
+	unsigned cstride = dn->stride / 2;
+	struct denoise_params p;
+	long long start, cost;
+	unsigned height;
+	unsigned char *u, *v;
+
+	start = now_ns();
+
+	p.weight = dn->weight;
+	p.chroma = false;
+	p.grouped = dn->grouped;
+
+	if (dn->fourcc == V4L2_PIX_FMT_YUV420) {
+		u = data + dn->stride * dn->height;
+		v = u + cstride * ch;
+		if (size < (size_t)(v - data) + cstride * ch)
+			return;
+
+		denoise_plane(dn, data, dn->stride, dn->ref, dn->width,
+							dn->height, &p);
+		if (!dn->luma_only) {
+			denoise_plane(dn, u, cstride,
+					dn->ref + dn->width * dn->height,
+					cw, ch, &p);
+			denoise_plane(dn, v, cstride,
+					dn->ref + dn->width * dn->height +
+							cw * ch, cw, ch, &p);
+		}
+	} else {
+		height = dn->height;
+		if (size < (size_t)dn->stride * height)
+			height = size / dn->stride;
+
+		p.chroma = dn->luma_only;
+		denoise_plane(dn, data, dn->stride, dn->ref, dn->width * 2,
+							height, &p);
+	}
+
+	dn->have_ref = true;
+
+	cost = now_ns() - start;
+	++dn->frames;
+	dn->cost += cost;
+	if (cost > dn->cost_max)
+		dn->cost_max = cost;
+}
@@ -0,0 +1,41 @@
+/*
+ * denoise.h -- motion-gated temporal noise reduction
+ *
+ * Author: Johan Hovold <jhovold@gmail.com>
+ */
+
+#ifndef DENOISE_H
+#define DENOISE_H
+
+#include <cstddef>
+
+
+#define DENOISE_LEVEL_MAX	3
+#define DENOISE_LEVEL		2
+
+struct denoiser {
+	unsigned fourcc;	/* YUYV or YUV420 */
+	unsigned width;
+	unsigned height;
+	unsigned stride;	/* of the luma plane for YUV420 */
+	unsigned level;
+
+	unsigned weight;	/* of the new value where static, Q7 */
+	bool luma_only;
+	bool grouped;		/* gate on groups of four bytes */
+
+	unsigned char *ref;	/* previous output, without padding */
+	bool have_ref;
+
+	unsigned long frames;
+	long long cost;		/* ns, total */
+	unsigned cost_max;	/* ns */
+};
+
+int denoise_init(struct denoiser *dn, unsigned fourcc, unsigned width,
+			unsigned height, unsigned stride, unsigned level);
+void denoise_free(struct denoiser *dn);
+
+void denoise_frame(struct denoiser *dn, void *frame, size_t size);
+
+#endif	/* DENOISE_H */
@@ -0,0 +1,838 @@
+/*
+ * drmsink.cpp -- DRM/KMS plane video sink
+ *
+ * The first connected connector is used, on the CRTC it is already driven
+ * by, if any, so that an active console or user interface on the primary
+ * plane is left alone. An inactive CRTC is set up with the preferred mode
+ * and a black primary plane.
+ *
+ * An overlay plane is preferred, as it can be positioned and usually
+ * scaled; the video is then shown in a window centred on the screen. When
+ * only the primary plane is available, it is covered with a dumb buffer
+ * of the mode size with the video converted into its centre.
+ *
+ * Only one commit is outstanding at a time. A frame arriving while a flip
+ * is pending is queued for the next vblank event and replaces any frame
+ * queued before it. A frame stays referenced until another one has taken
+ * its place on screen, so that its capture buffer is not refilled while
+ * being scanned out.
+ *
+ * Works with the vkms driver, which exposes overlay planes when loaded
+ * with enable_overlay=1.
+ *
+ * Author: Johan Hovold <jhovold@gmail.com>
+ */
+
+#include <drm_fourcc.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include "common.h"
+#include "drmsink.h"
+
+
+#define DRM_CLOSE_TIMEOUT	100	/* ms, for the last flip */
+
+static const char *plane_prop_names[DRM_PLANE_PROP_COUNT] = {
+	"FB_ID",
+	"CRTC_ID",
+	"SRC_X",
+	"SRC_Y",
+	"SRC_W",
+	"SRC_H",
+	"CRTC_X",
+	"CRTC_Y",
+	"CRTC_W",
+	"CRTC_H",
+};
+
+
+/*
+ * Look up a property of an object by name. Returns its id, or zero if
+ * there is no such property.
+ */
+static uint32_t drm_property(int fd, uint32_t object, uint32_t type,
+					const char *name, uint64_t *value)
+{
+	drmModeObjectProperties *props;
+	drmModePropertyRes *prop;
+	uint32_t id = 0;
+	unsigned i;
+
+	props = drmModeObjectGetProperties(fd, object, type);
+	if (!props)
+		return 0;
+
+	for (i = 0; i < props->count_props && !id; ++i) {
+		prop = drmModeGetProperty(fd, props->props[i]);
+		if (!prop)
+			continue;
+
+		if (!strcmp(prop->name, name)) {
+			id = prop->prop_id;
+			if (value)
+				*value = props->prop_values[i];
+		}
+		drmModeFreeProperty(prop);
+	}
+
+	drmModeFreeObjectProperties(props);
+
+	return id;
+}
+
+static int drm_dumb_create(int fd, struct drm_dumb *dumb, unsigned width,
+					unsigned height, uint32_t format)
+{
+	struct drm_mode_create_dumb create;
+	struct drm_mode_destroy_dumb destroy;
+	struct drm_mode_map_dumb map;
+	uint32_t handles[4] = { 0 };
+	uint32_t pitches[4] = { 0 };
+	uint32_t offsets[4] = { 0 };
+
+	memset(&create, 0, sizeof(create));
+	create.width = width;
+	create.height = height;
+	create.bpp = format == DRM_FORMAT_YUYV ? 16 : 32;
+
+	if (drmIoctl(fd, DRM_IOCTL_MODE_CREATE_DUMB, &create)) {
+		err_errno("DRM_IOCTL_MODE_CREATE_DUMB");
+		return -1;
+	}
+
+	dumb->handle = create.handle;
+	dumb->pitch = create.pitch;
+	dumb->size = create.size;
+
+	handles[0] = dumb->handle;
+	pitches[0] = dumb->pitch;
+
+	if (drmModeAddFB2(fd, width, height, format, handles, pitches, offsets,
+							&dumb->fb, 0)) {
+		err_errno("drmModeAddFB2");
+		goto err_destroy;
+	}
+
+	memset(&map, 0, sizeof(map));
+	map.handle = dumb->handle;
+
+	if (drmIoctl(fd, DRM_IOCTL_MODE_MAP_DUMB, &map)) {
+		err_errno("DRM_IOCTL_MODE_MAP_DUMB");
+		goto err_rmfb;
+	}
+
+	dumb->map = mmap(NULL, dumb->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+								fd, map.offset);
+	if (dumb->map == MAP_FAILED) {
+		err_errno("mmap");
+		goto err_rmfb;
+	}
+
+	/* black, whatever the format */
+	if (format == DRM_FORMAT_YUYV) {
+		uint32_t *p = (uint32_t *)dumb->map;
+		size_t i;
+
+		for (i = 0; i < dumb->size / 4; ++i)
+			p[i] = 0x80108010;
+	} else {
+		memset(dumb->map, 0, dumb->size);
+	}
+
+	return 0;
+
+err_rmfb:
+	drmModeRmFB(fd, dumb->fb);
+err_destroy:
+	memset(&destroy, 0, sizeof(destroy));
+	destroy.handle = dumb->handle;
+	drmIoctl(fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+	memset(dumb, 0, sizeof(*dumb));
+
+	return -1;
+}
+
+static void drm_dumb_destroy(int fd, struct drm_dumb *dumb)
+{
+	struct drm_mode_destroy_dumb destroy;
+
+	if (!dumb->fb)
+		return;
+
+	munmap(dumb->map, dumb->size);
+	drmModeRmFB(fd, dumb->fb);
+
+	memset(&destroy, 0, sizeof(destroy));
+	destroy.handle = dumb->handle;
+	drmIoctl(fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+
+	memset(dumb, 0, sizeof(*dumb));
+}
+
+static void drm_gem_close(int fd, uint32_t handle)
+{
+	struct drm_gem_close gem_close;
+
+	memset(&gem_close, 0, sizeof(gem_close));
+	gem_close.handle = handle;
+	drmIoctl(fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+}
+
+/*
+ * Find a connected connector and the CRTC to drive it with. Returns the
+ * index of the CRTC, or -1.
+ */
+static int drm_find_output(struct drm_sink *ds, drmModeRes *res,
+						drmModeModeInfo *mode)
+{
+	drmModeConnector *conn = NULL;
+	drmModeEncoder *enc;
+	drmModeCrtc *crtc;
+	int index = -1;
+	int i, j;
+
+	for (i = 0; i < res->count_connectors; ++i) {
+		conn = drmModeGetConnector(ds->fd, res->connectors[i]);
+		if (conn && conn->connection == DRM_MODE_CONNECTED &&
+						conn->count_modes > 0)
+			break;
+		drmModeFreeConnector(conn);
+		conn = NULL;
+	}
+
+	if (!conn) {
+		err("%s: no connected display\n", ds->path);
+		return -1;
+	}
+	ds->connector = conn->connector_id;
+
+	/* keep the current CRTC and mode, if already driven */
+	enc = conn->encoder_id ? drmModeGetEncoder(ds->fd, conn->encoder_id) :
+									NULL;
+	if (enc && enc->crtc_id) {
+		crtc = drmModeGetCrtc(ds->fd, enc->crtc_id);
+		if (crtc && crtc->mode_valid) {
+			ds->crtc = crtc->crtc_id;
+			*mode = crtc->mode;
+		}
+		drmModeFreeCrtc(crtc);
+	}
+	drmModeFreeEncoder(enc);
+
+	if (!ds->crtc) {
+		*mode = conn->modes[0];
+		for (i = 0; i < conn->count_modes; ++i) {
+			if (conn->modes[i].type & DRM_MODE_TYPE_PREFERRED) {
+				*mode = conn->modes[i];
+				break;
+			}
+		}
+
+		for (i = 0; i < conn->count_encoders && !ds->crtc; ++i) {
+			enc = drmModeGetEncoder(ds->fd, conn->encoders[i]);
+			if (!enc)
+				continue;
+			for (j = 0; j < res->count_crtcs; ++j) {
+				if (enc->possible_crtcs & (1 << j)) {
+					ds->crtc = res->crtcs[j];
+					break;
+				}
+			}
+			drmModeFreeEncoder(enc);
+		}
+	}
+
+	for (i = 0; i < res->count_crtcs; ++i) {
+		if (res->crtcs[i] == ds->crtc)
+			index = i;
+	}
+
+	if (index < 0)
+		err("%s: no CRTC for connector %u\n", ds->path, ds->connector);
+
+	drmModeFreeConnector(conn);
+
+	return index;
+}
+
+static bool drm_plane_has_format(const drmModePlane *plane, uint32_t format)
+{
+	unsigned i;
+
+	for (i = 0; i < plane->count_formats; ++i) {
+		if (plane->formats[i] == format)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Pick the plane to show the video on: an overlay plane that can scan out
+ * YUYV, one that takes XRGB8888, or else the primary plane.
+ */
+static int drm_find_plane(struct drm_sink *ds, int crtc_index)
+{
+	drmModePlaneRes *res;
+	drmModePlane *plane;
+	uint64_t type;
+	unsigned score, best = 0;
+	unsigned i;
+
+	res = drmModeGetPlaneResources(ds->fd);
+	if (!res) {
+		err_errno("drmModeGetPlaneResources");
+		return -1;
+	}
+
+	for (i = 0; i < res->count_planes; ++i) {
+		plane = drmModeGetPlane(ds->fd, res->planes[i]);
+		if (!plane)
+			continue;
+
+		if (!(plane->possible_crtcs & (1 << crtc_index)) ||
+				!drm_property(ds->fd, plane->plane_id,
+						DRM_MODE_OBJECT_PLANE, "type",
+						&type)) {
+			drmModeFreePlane(plane);
+			continue;
+		}
+
+		score = 0;
+		if (type == DRM_PLANE_TYPE_OVERLAY) {
+			if (drm_plane_has_format(plane, DRM_FORMAT_YUYV))
+				score = 3;
+			else if (drm_plane_has_format(plane,
+							DRM_FORMAT_XRGB8888))
+				score = 2;
+		} else if (type == DRM_PLANE_TYPE_PRIMARY) {
+			if (!ds->primary)
+				ds->primary = plane->plane_id;
+			if (drm_plane_has_format(plane, DRM_FORMAT_XRGB8888))
+				score = 1;
+		}
+
+		if (score > best) {
+			best = score;
+			ds->plane = plane->plane_id;
+			ds->direct = score == 3;
+		}
+
+		drmModeFreePlane(plane);
+	}
+
+	drmModeFreePlaneResources(res);
+
+	if (!ds->plane) {
+		err("%s: no usable plane\n", ds->path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void drm_add_plane(struct drm_sink *ds, drmModeAtomicReq *req,
+				uint32_t plane, const uint32_t *props,
+				uint32_t fb, unsigned src_width,
+				unsigned src_height, unsigned x, unsigned y,
+				unsigned width, unsigned height)
+{
+	drmModeAtomicAddProperty(req, plane, props[DRM_PLANE_FB_ID], fb);
+	drmModeAtomicAddProperty(req, plane, props[DRM_PLANE_CRTC_ID],
+								ds->crtc);
+	drmModeAtomicAddProperty(req, plane, props[DRM_PLANE_SRC_X], 0);
+	drmModeAtomicAddProperty(req, plane, props[DRM_PLANE_SRC_Y], 0);
+	drmModeAtomicAddProperty(req, plane, props[DRM_PLANE_SRC_W],
+							src_width << 16);
+	drmModeAtomicAddProperty(req, plane, props[DRM_PLANE_SRC_H],
+							src_height << 16);
+	drmModeAtomicAddProperty(req, plane, props[DRM_PLANE_CRTC_X], x);
+	drmModeAtomicAddProperty(req, plane, props[DRM_PLANE_CRTC_Y], y);
+	drmModeAtomicAddProperty(req, plane, props[DRM_PLANE_CRTC_W], width);
+	drmModeAtomicAddProperty(req, plane, props[DRM_PLANE_CRTC_H], height);
+}
+
+/*
+ * Bring up the CRTC if needed and put the plane in place with a black
+ * frame, in one blocking commit.
+ */
+static int drm_setup(struct drm_sink *ds, bool modeset, unsigned width,
+							unsigned height)
+{
+	uint32_t primary_props[DRM_PLANE_PROP_COUNT];
+	drmModeAtomicReq *req;
+	uint32_t flags = 0;
+	unsigned i;
+	int ret;
+
+	req = drmModeAtomicAlloc();
+	if (!req)
+		return -ENOMEM;
+
+	if (modeset) {
+		flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+
+		drmModeAtomicAddProperty(req, ds->connector,
+				drm_property(ds->fd, ds->connector,
+						DRM_MODE_OBJECT_CONNECTOR,
+						"CRTC_ID", NULL), ds->crtc);
+		drmModeAtomicAddProperty(req, ds->crtc,
+				drm_property(ds->fd, ds->crtc,
+						DRM_MODE_OBJECT_CRTC,
+						"MODE_ID", NULL), ds->mode_blob);
+		drmModeAtomicAddProperty(req, ds->crtc,
+				drm_property(ds->fd, ds->crtc,
+						DRM_MODE_OBJECT_CRTC,
+						"ACTIVE", NULL), 1);
+
+		if (ds->background.fb) {
+			for (i = 0; i < DRM_PLANE_PROP_COUNT; ++i)
+				primary_props[i] = drm_property(ds->fd,
+						ds->primary,
+						DRM_MODE_OBJECT_PLANE,
+						plane_prop_names[i], NULL);
+
+			drm_add_plane(ds, req, ds->primary, primary_props,
+					ds->background.fb, ds->mode_width,
+					ds->mode_height, 0, 0,
+					ds->mode_width, ds->mode_height);
+		}
+	}
+
+	drm_add_plane(ds, req, ds->plane, ds->plane_props, ds->dumb[0].fb,
+			ds->dumb_width, ds->dumb_height,
+			(ds->mode_width - width) / 2,
+			(ds->mode_height - height) / 2, width, height);
+
+	ret = drmModeAtomicCommit(ds->fd, req, flags, NULL);
+	drmModeAtomicFree(req);
+
+	if (!ret) {
+		ds->shown.fb = ds->dumb[0].fb;
+		ds->shown.dumb = 0;
+	}
+
+	return ret;
+}
+
+static void drm_frame_init(struct video_frame *frame)
+{
+	memset(frame, 0, sizeof(*frame));
+	frame->capture = -1;
+	frame->decoded = -1;
+	frame->dmabuf = -1;
+}
+
+static void drm_scanout_init(struct drm_scanout *out)
+{
+	drm_frame_init(&out->frame);
+	out->fb = 0;
+	out->dumb = -1;
+}
+
+/*
+ * Open the DRM device at path for video of width x height, shown in a
+ * window of the given size where the plane can scale.
+ */
+int drmsink_open(struct drm_sink *ds, const char *path, unsigned width,
+			unsigned height, unsigned window_width,
+			unsigned window_height)
+{
+	drmModeModeInfo mode;
+	drmModeRes *res;
+	uint64_t active = 0;
+	bool modeset;
+	int crtc_index;
+	unsigned i;
+	int ret;
+
+	memset(ds, 0, sizeof(*ds));
+	ds->path = path;
+	ds->width = width;
+	ds->height = height;
+	drm_scanout_init(&ds->shown);
+	drm_scanout_init(&ds->pending);
+	drm_scanout_init(&ds->queued);
+
+	ds->fd = open(path, O_RDWR | O_CLOEXEC | O_NONBLOCK);
+	if (ds->fd < 0) {
+		err_errno("%s", path);
+		return -1;
+	}
+
+	if (drmSetClientCap(ds->fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1) ||
+			drmSetClientCap(ds->fd, DRM_CLIENT_CAP_ATOMIC, 1)) {
+		err("%s: atomic modesetting not supported\n", path);
+		goto err_close;
+	}
+
+	res = drmModeGetResources(ds->fd);
+	if (!res) {
+		err_errno("drmModeGetResources");
+		goto err_close;
+	}
+	crtc_index = drm_find_output(ds, res, &mode);
+	drmModeFreeResources(res);
+	if (crtc_index < 0)
+		goto err_close;
+
+	/* an active CRTC has already been set up by someone else */
+	drm_property(ds->fd, ds->crtc, DRM_MODE_OBJECT_CRTC, "ACTIVE", &active);
+	modeset = !active;
+
+	ds->mode_width = mode.hdisplay;
+	ds->mode_height = mode.vdisplay;
+
+	if (drm_find_plane(ds, crtc_index))
+		goto err_close;
+
+	for (i = 0; i < DRM_PLANE_PROP_COUNT; ++i) {
+		ds->plane_props[i] = drm_property(ds->fd, ds->plane,
+						DRM_MODE_OBJECT_PLANE,
+						plane_prop_names[i], NULL);
+		if (!ds->plane_props[i]) {
+			err("%s: plane %u has no %s property\n", path,
+						ds->plane, plane_prop_names[i]);
+			goto err_close;
+		}
+	}
+
+	/* the primary plane covers the screen, with the video centred */
+	ds->format = ds->direct ? DRM_FORMAT_YUYV : DRM_FORMAT_XRGB8888;
+	if (ds->plane == ds->primary) {
+		ds->dumb_width = ds->mode_width;
+		ds->dumb_height = ds->mode_height;
+		window_width = ds->mode_width;
+		window_height = ds->mode_height;
+	} else {
+		ds->dumb_width = width;
+		ds->dumb_height = height;
+	}
+
+	for (i = 0; i < DRM_DUMB_COUNT; ++i) {
+		if (drm_dumb_create(ds->fd, &ds->dumb[i], ds->dumb_width,
+					ds->dumb_height, ds->format))
+			goto err_free;
+	}
+
+	if (ds->width > ds->dumb_width)
+		ds->width = ds->dumb_width & ~1U;
+	if (ds->height > ds->dumb_height)
+		ds->height = ds->dumb_height;
+	ds->dumb_offset = (ds->dumb_height - ds->height) / 2 *
+							ds->dumb[0].pitch +
+			(ds->dumb_width - ds->width) / 2 *
+				(ds->format == DRM_FORMAT_YUYV ? 2 : 4);
+
+	if (modeset) {
+		if (drmModeCreatePropertyBlob(ds->fd, &mode, sizeof(mode),
+							&ds->mode_blob)) {
+			err_errno("drmModeCreatePropertyBlob");
+			goto err_free;
+		}
+
+		if (ds->plane != ds->primary && ds->primary &&
+				drm_dumb_create(ds->fd, &ds->background,
+						ds->mode_width,
+						ds->mode_height,
+						DRM_FORMAT_XRGB8888))
+			goto err_free;
+	}
+
+	if (window_width > ds->mode_width || window_height > ds->mode_height) {
+		window_width = ds->dumb_width;
+		window_height = ds->dumb_height;
+	}
+
+	ret = drm_setup(ds, modeset, window_width, window_height);
+	if (ret == -EINVAL && (window_width != ds->dumb_width ||
+					window_height != ds->dumb_height)) {
+		/* the plane cannot scale */
+		window_width = ds->dumb_width;
+		window_height = ds->dumb_height;
+		ret = drm_setup(ds, modeset, window_width, window_height);
+	}
+	if (ret) {
+		errno = -ret;
+		err_errno("%s: atomic commit", path);
+		goto err_free;
+	}
+
+	printf("%s - %s: %ux%u, plane %u%s, %s, window %ux%u\n", __func__,
+			path, ds->mode_width, ds->mode_height, ds->plane,
+			ds->plane == ds->primary ? " (primary)" : "",
+			ds->direct ? "zero-copy YUYV" : "XRGB8888",
+			window_width, window_height);
+
+	return 0;
+
+err_free:
+	for (i = 0; i < DRM_DUMB_COUNT; ++i)
+		drm_dumb_destroy(ds->fd, &ds->dumb[i]);
+	drm_dumb_destroy(ds->fd, &ds->background);
+	if (ds->mode_blob)
+		drmModeDestroyPropertyBlob(ds->fd, ds->mode_blob);
+err_close:
+	close(ds->fd);
+
+	return -1;
+}
+
+void drmsink_close(struct drm_sink *ds)
+{
+	drmModeAtomicReq *req;
+	struct video_frame released[2];
+	struct pollfd pfd;
+	unsigned i;
+
+	/* wait for the last flip */
+	pfd.fd = ds->fd;
+	pfd.events = POLLIN;
+	while (ds->pending.fb && poll(&pfd, 1, DRM_CLOSE_TIMEOUT) > 0)
+		drmsink_dispatch(ds, released);
+
+	req = drmModeAtomicAlloc();
+	if (req) {
+		drmModeAtomicAddProperty(req, ds->plane,
+					ds->plane_props[DRM_PLANE_FB_ID], 0);
+		drmModeAtomicAddProperty(req, ds->plane,
+					ds->plane_props[DRM_PLANE_CRTC_ID], 0);
+		if (drmModeAtomicCommit(ds->fd, req, 0, NULL))
+			err("%s: could not disable plane %u\n", ds->path,
+								ds->plane);
+		drmModeAtomicFree(req);
+	}
+
+	if (ds->commits) {
+		printf("%s - %lu commits, %lu flips, %lu zero-copy, "
+				"%lu dropped, %lu errors, capture to vblank "
+				"avg %lld max %lld us\n", __func__,
+				ds->commits, ds->flips, ds->direct_frames,
+				ds->dropped, ds->errors,
+				ds->flips ? ds->latency / ds->flips / 1000 : 0,
+				ds->latency_max / 1000);
+	}
+
+	drmsink_forget(ds);
+	for (i = 0; i < DRM_DUMB_COUNT; ++i)
+		drm_dumb_destroy(ds->fd, &ds->dumb[i]);
+	drm_dumb_destroy(ds->fd, &ds->background);
+	if (ds->mode_blob)
+		drmModeDestroyPropertyBlob(ds->fd, ds->mode_blob);
+
+	close(ds->fd);
+}
+
+/*
+ * Get a framebuffer for capture buffer index, importing its DMABUF the
+ * first time. Returns zero if the buffer cannot be scanned out, in which
+ * case no further imports are attempted.
+ */
+uint32_t drmsink_import(struct drm_sink *ds, unsigned index, int dmabuf,
+							unsigned stride)
+{
+	struct drm_import *imp = &ds->imported[index];
+	uint32_t handles[4] = { 0 };
+	uint32_t pitches[4] = { 0 };
+	uint32_t offsets[4] = { 0 };
+
+	if (imp->fb || ds->no_import)
+		return imp->fb;
+
+	if (dmabuf < 0 || drmPrimeFDToHandle(ds->fd, dmabuf, &imp->handle)) {
+		err("%s: cannot import capture buffers, copying\n", ds->path);
+		ds->no_import = true;
+		return 0;
+	}
+
+	handles[0] = imp->handle;
+	pitches[0] = stride;
+
+	if (drmModeAddFB2(ds->fd, ds->width, ds->height, DRM_FORMAT_YUYV,
+					handles, pitches, offsets, &imp->fb, 0)) {
+		err_errno("drmModeAddFB2");
+		err("%s: cannot scan out capture buffers, copying\n",
+								ds->path);
+		drm_gem_close(ds->fd, imp->handle);
+		imp->handle = 0;
+		imp->fb = 0;
+		ds->no_import = true;
+	}
+
+	return imp->fb;
+}
+
+/*
+ * Drop the imported capture buffers, which are about to be freed.
+ */
+void drmsink_forget(struct drm_sink *ds)
+{
+	unsigned i;
+
+	for (i = 0; i < VIDEO_MAX_FRAME; ++i) {
+		if (!ds->imported[i].fb)
+			continue;
+		drmModeRmFB(ds->fd, ds->imported[i].fb);
+		drm_gem_close(ds->fd, ds->imported[i].handle);
+		ds->imported[i].fb = 0;
+		ds->imported[i].handle = 0;
+	}
+}
+
+/*
+ * Get a dumb buffer that is neither on screen nor about to be, positioned
+ * at the video. A queued frame may be using it, but will be replaced by
+ * the frame written into it.
+ */
+void *drmsink_buffer(struct drm_sink *ds, int *dumb, unsigned *pitch)
+{
+	int i;
+
+	for (i = 0; i < DRM_DUMB_COUNT; ++i) {
+		if (i != ds->shown.dumb && i != ds->pending.dumb)
+			break;
+	}
+
+	*dumb = i;
+	*pitch = ds->dumb[i].pitch;
+
+	return (char *)ds->dumb[i].map + ds->dumb_offset;
+}
+
+static int drm_commit(struct drm_sink *ds, const struct drm_scanout *out)
+{
+	drmModeAtomicReq *req;
+	int ret;
+
+	req = drmModeAtomicAlloc();
+	if (!req)
+		return ENOMEM;
+
+	drmModeAtomicAddProperty(req, ds->plane,
+				ds->plane_props[DRM_PLANE_FB_ID], out->fb);
+
+	ret = drmModeAtomicCommit(ds->fd, req, DRM_MODE_ATOMIC_NONBLOCK |
+					DRM_MODE_PAGE_FLIP_EVENT, ds);
+	drmModeAtomicFree(req);
+
+	if (ret)
+		return -ret;
+
+	ds->pending = *out;
+	++ds->commits;
+	if (out->dumb < 0)
+		++ds->direct_frames;
+
+	return 0;
+}
+
+/*
+ * Show a frame at the next vblank, or after the pending flip. Frames that
+ * are no longer needed, because they were superseded or could not be
+ * committed, are returned in released. Returns their number.
+ */
+unsigned drmsink_show(struct drm_sink *ds, const struct drm_scanout *out,
+					struct video_frame *released)
+{
+	unsigned count = 0;
+	int ret;
+
+	if (ds->pending.fb) {
+		if (ds->queued.fb) {
+			released[count++] = ds->queued.frame;
+			++ds->dropped;
+		}
+		ds->queued = *out;
+		return count;
+	}
+
+	ret = drm_commit(ds, out);
+	if (ret) {
+		ds->error = ret;
+		++ds->errors;
+		released[count++] = out->frame;
+	}
+
+	return count;
+}
+
+static void drm_flip_handler(int fd, unsigned int sequence,
+				unsigned int tv_sec, unsigned int tv_usec,
+				void *user_data)
+{
+	struct drm_sink *ds = (struct drm_sink *)user_data;
+	long long latency;
+
+	(void)fd;
+	(void)sequence;
+
+	if (!ds->pending.fb)
+		return;
+
+	/* vblank timestamps are CLOCK_MONOTONIC */
+	if (ds->pending.frame.timestamp) {
+		latency = tv_sec * 1000000000LL + tv_usec * 1000LL -
+						ds->pending.frame.timestamp;
+		ds->latency += latency;
+		if (latency > ds->latency_max)
+			ds->latency_max = latency;
+	}
+
+	++ds->flips;
+}
+
+/*
+ * Handle flip events and commit any queued frame. The frame replaced on
+ * screen, and a queued frame that could not be committed, are returned in
+ * released. Returns their number.
+ */
+unsigned drmsink_dispatch(struct drm_sink *ds, struct video_frame *released)
+{
+	drmEventContext ctx;
+	unsigned long flips = ds->flips;
+	unsigned count = 0;
+	int ret;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.version = 2;
+	ctx.page_flip_handler = drm_flip_handler;
+
+	drmHandleEvent(ds->fd, &ctx);
+
+	if (ds->flips == flips)
+		return 0;
+
+	released[count++] = ds->shown.frame;
+	ds->shown = ds->pending;
+	drm_scanout_init(&ds->pending);
+
+	if (ds->queued.fb) {
+		ret = drm_commit(ds, &ds->queued);
+		if (ret) {
+			ds->error = ret;
+			++ds->errors;
+			released[count++] = ds->queued.frame;
+		}
+		drm_scanout_init(&ds->queued);
+	}
+
+	return count;
+}
+
+/*
+ * Stop holding on to frames without taking them off the screen, for when
+ * their buffers are reclaimed wholesale.
+ */
+void drmsink_disown(struct drm_sink *ds)
+{
+	drm_frame_init(&ds->shown.frame);
+	drm_frame_init(&ds->pending.frame);
+
+	if (ds->queued.fb)
+		drm_scanout_init(&ds->queued);
+}
@@ -0,0 +1,116 @@
+/*
+ * drmsink.h -- DRM/KMS plane video sink
+ *
+ * Shows frames on a plane with non-blocking atomic commits, one flip at a
+ * time. Capture buffers are imported as DRM framebuffers through their
+ * DMABUFs and scanned out in place when the plane can show YUYV; anything
+ * else is copied or converted into dumb buffers.
+ *
+ * Author: Johan Hovold <jhovold@gmail.com>
+ */
+
+#ifndef DRMSINK_H
+#define DRMSINK_H
+
+#include <linux/videodev2.h>
+#include <stdint.h>
+
+#include "frame.h"
+
+
+#define DRM_DUMB_COUNT	3
+
+enum {
+	DRM_PLANE_FB_ID,
+	DRM_PLANE_CRTC_ID,
+	DRM_PLANE_SRC_X,
+	DRM_PLANE_SRC_Y,
+	DRM_PLANE_SRC_W,
+	DRM_PLANE_SRC_H,
+	DRM_PLANE_CRTC_X,
+	DRM_PLANE_CRTC_Y,
+	DRM_PLANE_CRTC_W,
+	DRM_PLANE_CRTC_H,
+	DRM_PLANE_PROP_COUNT
+};
+
+struct drm_dumb {
+	uint32_t handle;
+	uint32_t fb;
+	unsigned pitch;
+	void *map;
+	size_t size;
+};
+
+/* capture buffer imported through its DMABUF */
+struct drm_import {
+	uint32_t handle;
+	uint32_t fb;
+};
+
+/* a frame on its way to or on the screen */
+struct drm_scanout {
+	struct video_frame frame;	/* held until replaced on screen */
+	uint32_t fb;			/* zero if the slot is empty */
+	int dumb;			/* dumb buffer, or -1 */
+};
+
+struct drm_sink {
+	const char *path;
+	int fd;
+
+	uint32_t connector;
+	uint32_t crtc;
+	uint32_t plane;
+	uint32_t primary;
+	uint32_t plane_props[DRM_PLANE_PROP_COUNT];
+	uint32_t mode_blob;
+	unsigned mode_width;
+	unsigned mode_height;
+
+	bool direct;		/* plane scans out YUYV */
+	bool no_import;		/* capture buffers cannot be scanned out */
+	uint32_t format;
+	unsigned width;		/* video */
+	unsigned height;
+
+	/* dumb buffers for frames that cannot be scanned out in place */
+	struct drm_dumb dumb[DRM_DUMB_COUNT];
+	unsigned dumb_width;
+	unsigned dumb_height;
+	unsigned dumb_offset;	/* of the video within a dumb buffer */
+	struct drm_dumb background;
+
+	struct drm_import imported[VIDEO_MAX_FRAME];
+
+	struct drm_scanout shown;
+	struct drm_scanout pending;	/* committed, waiting for vblank */
+	struct drm_scanout queued;	/* waiting for the pending flip */
+	int error;
+
+	unsigned long commits;
+	unsigned long flips;
+	unsigned long direct_frames;
+	unsigned long dropped;
+	unsigned long errors;
+	long long latency;	/* capture to vblank, ns, total */
+	long long latency_max;	/* ns */
+};
+
+int drmsink_open(struct drm_sink *ds, const char *path, unsigned width,
+			unsigned height, unsigned window_width,
+			unsigned window_height);
+void drmsink_close(struct drm_sink *ds);
+
+uint32_t drmsink_import(struct drm_sink *ds, unsigned index, int dmabuf,
+							unsigned stride);
+void drmsink_forget(struct drm_sink *ds);
+
+void *drmsink_buffer(struct drm_sink *ds, int *dumb, unsigned *pitch);
+unsigned drmsink_show(struct drm_sink *ds, const struct drm_scanout *out,
+					struct video_frame *released);
+unsigned drmsink_dispatch(struct drm_sink *ds,
+					struct video_frame *released);
+void drmsink_disown(struct drm_sink *ds);
+
+#endif	/* DRMSINK_H */
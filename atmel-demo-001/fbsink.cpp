@@ -0,0 +1,286 @@
+/*
+ * fbsink.cpp -- framebuffer video sink
+ *
+ * The video is centred on the screen, and the border is left transparent
+ * when the framebuffer is an alpha-blended overlay. A page is only drawn
+ * once the pan away from it has taken effect: if the last flip was less
+ * than a refresh period ago, the next vblank is waited for first.
+ *
+ * An existing regular file can be given in place of the device. It is sized
+ * for two pages of the requested resolution and flips are only recorded,
+ * which allows testing without a display or the vfb driver. A missing path
+ * is an error, so that a mistyped device is not silently taken for one.
+ *
+ * Author: Johan Hovold <jhovold@gmail.com>
+ */
+
+#include <fcntl.h>
+#include <linux/videodev2.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "convert.h"
+#include "fbsink.h"
+
+
+#define FB_PERIOD_DEFAULT	16666667LL	/* ns, 60 Hz */
+
+
+static long long fb_period(const struct fb_var_screeninfo *var)
+{
+	unsigned long long total;
+
+	if (!var->pixclock)
+		return FB_PERIOD_DEFAULT;
+
+	total = (unsigned long long)(var->xres + var->left_margin +
+				var->right_margin + var->hsync_len) *
+			(var->yres + var->upper_margin + var->lower_margin +
+				var->vsync_len);
+
+	/* pixclock is in ps */
+	return total * var->pixclock / 1000;
+}
+
+static int fb_open_memory(struct fb_sink *fb, unsigned width,
+							unsigned height)
+{
+	memset(&fb->var, 0, sizeof(fb->var));
+	fb->var.xres = width;
+	fb->var.yres = height;
+	fb->var.xres_virtual = width;
+	fb->var.yres_virtual = 2 * height;
+	fb->var.bits_per_pixel = 32;
+
+	fb->memory = true;
+	fb->stride = width * 4;
+	fb->mem_size = (size_t)fb->stride * fb->var.yres_virtual;
+	fb->period = FB_PERIOD_DEFAULT;
+
+	if (ftruncate(fb->fd, fb->mem_size) == -1) {
+		err_errno("%s", fb->path);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Switch the device to 32 bpp with room for two pages, or a single page if
+ * the driver cannot pan.
+ */
+static int fb_open_device(struct fb_sink *fb)
+{
+	struct fb_fix_screeninfo fix;
+	struct fb_var_screeninfo var;
+
+	if (ioctl(fb->fd, FBIOGET_VSCREENINFO, &var) == -1) {
+		err_errno("FBIOGET_VSCREENINFO");
+		return -1;
+	}
+
+	var.bits_per_pixel = 32;
+	var.xres_virtual = var.xres;
+	var.yres_virtual = 2 * var.yres;
+	var.xoffset = 0;
+	var.yoffset = 0;
+	var.activate = FB_ACTIVATE_NOW;
+
+	if (ioctl(fb->fd, FBIOPUT_VSCREENINFO, &var) == -1) {
+		var.yres_virtual = var.yres;
+		if (ioctl(fb->fd, FBIOPUT_VSCREENINFO, &var) == -1) {
+			err_errno("FBIOPUT_VSCREENINFO");
+			return -1;
+		}
+	}
+
+	if (ioctl(fb->fd, FBIOGET_VSCREENINFO, &fb->var) == -1 ||
+			ioctl(fb->fd, FBIOGET_FSCREENINFO, &fix) == -1) {
+		err_errno("FBIOGET_SCREENINFO");
+		return -1;
+	}
+
+	if (fb->var.bits_per_pixel != 32) {
+		err("%s: %u bpp not supported\n", fb->path,
+						fb->var.bits_per_pixel);
+		return -1;
+	}
+
+	fb->stride = fix.line_length;
+	fb->mem_size = fix.smem_len;
+	fb->period = fb_period(&fb->var);
+	fb->can_wait = true;
+
+	return 0;
+}
+
+/*
+ * Open the framebuffer at path. The resolution is only used when path is an
+ * existing regular file, which then stands in for the device.
+ */
+int fbsink_open(struct fb_sink *fb, const char *path, unsigned width,
+							unsigned height)
+{
+	struct stat st;
+	int ret;
+
+	memset(fb, 0, sizeof(*fb));
+	fb->path = path;
+
+	fb->fd = open(path, O_RDWR | O_CLOEXEC);
+	if (fb->fd < 0) {
+		err_errno("%s", path);
+		return -1;
+	}
+
+	if (fstat(fb->fd, &st) == -1) {
+		err_errno("fstat");
+		goto err_close;
+	}
+
+	if (S_ISREG(st.st_mode))
+		ret = fb_open_memory(fb, width, height);
+	else
+		ret = fb_open_device(fb);
+	if (ret)
+		goto err_close;
+
+	fb->pages = fb->var.yres_virtual / fb->var.yres;
+	if (fb->pages > 2)
+		fb->pages = 2;
+	if ((size_t)fb->stride * fb->var.yres * fb->pages > fb->mem_size)
+		fb->pages = 1;
+
+	fb->mem = (unsigned char *)mmap(NULL, fb->mem_size,
+					PROT_READ | PROT_WRITE, MAP_SHARED,
+					fb->fd, 0);
+	if (fb->mem == MAP_FAILED) {
+		err_errno("mmap");
+		goto err_close;
+	}
+	memset(fb->mem, 0, fb->mem_size);
+
+	printf("%s - %s: %ux%u, stride %u, %u page%s, refresh %lld us\n",
+			__func__, path, fb->var.xres, fb->var.yres,
+			fb->stride, fb->pages, fb->pages > 1 ? "s" : "",
+			fb->period / 1000);
+
+	return 0;
+
+err_close:
+	close(fb->fd);
+
+	return -1;
+}
+
+void fbsink_close(struct fb_sink *fb)
+{
+	if (fb->frames) {
+		printf("%s - %lu frames, %lu vblank waits, %lu pan errors, "
+				"convert avg %lld max %u us\n", __func__,
+				fb->frames, fb->waits, fb->pan_errors,
+				fb->cost / fb->frames / 1000,
+				fb->cost_max / 1000);
+	}
+
+	munmap(fb->mem, fb->mem_size);
+	close(fb->fd);
+}
+
+/*
+ * Make sure that the hidden page is no longer being scanned out.
+ */
+static void fb_wait_flip(struct fb_sink *fb)
+{
+	__u32 crtc = 0;
+
+	if (!fb->can_wait || now_ns() - fb->flipped >= fb->period)
+		return;
+
+	if (ioctl(fb->fd, FBIO_WAITFORVSYNC, &crtc) == -1) {
+		fb->can_wait = false;
+		return;
+	}
+
+	++fb->waits;
+}
+
+static void fb_flip(struct fb_sink *fb, unsigned page)
+{
+	fb->front = page;
+	fb->flipped = now_ns();
+
+	if (fb->memory)
+		return;
+
+	fb->var.xoffset = 0;
+	fb->var.yoffset = page * fb->var.yres;
+
+	if (ioctl(fb->fd, FBIOPAN_DISPLAY, &fb->var) == -1) {
+		if (!fb->pan_errors)
+			err_errno("FBIOPAN_DISPLAY");
+		++fb->pan_errors;
+	}
+}
+
+/*
+ * Draw a YUYV or I420 frame into the hidden page, clipped to the screen.
+ * Returns where the video starts, and its clipped size, so that it can be
+ * drawn over before the flip.
+ */
+unsigned char *fbsink_draw(struct fb_sink *fb, unsigned fourcc,
+			const void *src, unsigned src_stride, unsigned *width,
+			unsigned *height)
+{
+	unsigned page = fb->pages > 1 ? !fb->front : fb->front;
+	const unsigned char *u, *v;
+	unsigned char *dst;
+	long long start, cost;
+
+	/* chroma planes of the whole frame */
+	u = (const unsigned char *)src + src_stride * *height;
+	v = u + src_stride / 2 * ((*height + 1) / 2);
+
+	if (*width > fb->var.xres)
+		*width = fb->var.xres & ~1U;
+	if (*height > fb->var.yres)
+		*height = fb->var.yres;
+
+	if (fb->pages > 1)
+		fb_wait_flip(fb);
+
+	start = now_ns();
+
+	dst = fb->mem + (size_t)fb->stride * (page * fb->var.yres +
+						(fb->var.yres - *height) / 2) +
+				(fb->var.xres - *width) / 2 * 4;
+
+	if (fourcc == V4L2_PIX_FMT_YUV420)
+		convert_i420_xrgb(dst, fb->stride, src, u, v, src_stride,
+							*width, *height);
+	else
+		convert_yuyv_xrgb(dst, fb->stride, src, src_stride, *width,
+							*height);
+
+	cost = now_ns() - start;
+	++fb->frames;
+	fb->cost += cost;
+	if (cost > fb->cost_max)
+		fb->cost_max = cost;
+
+	fb->back = page;
+
+	return dst;
+}
+
+/*
+ * Show the page last drawn.
+ */
+void fbsink_flip(struct fb_sink *fb)
+{
+	if (fb->pages > 1)
+		fb_flip(fb, fb->back);
+}
@@ -0,0 +1,52 @@
+/*
+ * fbsink.h -- framebuffer video sink
+ *
+ * Displays frames by converting them to XRGB8888 straight into a mapped
+ * framebuffer, for boards without an overlay-capable V4L2 output. With a
+ * virtual resolution of twice the screen height, frames are drawn into the
+ * hidden page and flipped to with FBIOPAN_DISPLAY.
+ *
+ * Author: Johan Hovold <jhovold@gmail.com>
+ */
+
+#ifndef FBSINK_H
+#define FBSINK_H
+
+#include <linux/fb.h>
+#include <stddef.h>
+
+
+struct fb_sink {
+	const char *path;
+	int fd;
+	bool memory;		/* regular file standing in for a framebuffer */
+
+	unsigned char *mem;
+	size_t mem_size;
+	struct fb_var_screeninfo var;
+	unsigned stride;
+	unsigned pages;		/* 2 when double buffered */
+	unsigned front;		/* page being scanned out */
+	unsigned back;		/* page last drawn */
+
+	long long period;	/* refresh period, ns */
+	long long flipped;	/* last pan, ns */
+	bool can_wait;		/* FBIO_WAITFORVSYNC is supported */
+
+	unsigned long frames;
+	unsigned long waits;
+	unsigned long pan_errors;
+	long long cost;		/* ns, total */
+	unsigned cost_max;	/* ns */
+};
+
+int fbsink_open(struct fb_sink *fb, const char *path, unsigned width,
+							unsigned height);
+void fbsink_close(struct fb_sink *fb);
+
+unsigned char *fbsink_draw(struct fb_sink *fb, unsigned fourcc,
+			const void *src, unsigned src_stride, unsigned *width,
+			unsigned *height);
+void fbsink_flip(struct fb_sink *fb);
+
+#endif	/* FBSINK_H */
@@ -0,0 +1,29 @@
+/*
+ * frame.h
+ *
+ * Author: Johan Hovold <jhovold@gmail.com>
+ */
+
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <cstddef>
+
+
+/*
+ * A frame on its way to the display, backed either by a capture buffer or
+ * by a decoder slot. The backing buffer is held until the frame is
+ * released.
+ */
+struct video_frame {
+	int capture;		/* capture buffer index, or -1 */
+	int decoded;		/* decoder slot, or -1 */
+	const void *data;
+	size_t size;
+	int dmabuf;		/* exported capture buffer, or -1 */
+	unsigned sequence;
+	long long timestamp;	/* ns, CLOCK_MONOTONIC */
+	unsigned checksum;	/* CRC32C, set when checked */
+};
+
+#endif	/* FRAME_H */
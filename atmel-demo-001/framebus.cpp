@@ -0,0 +1,307 @@
+/*
+ * framebus.cpp -- shared-memory frame bus
+ *
+ * The producer copies each frame once into the next slot of the ring,
+ * after which any number of readers in other processes can use it in
+ * place. A slot is rewritten only after slot_count newer frames, and
+ * readers detect that through the slot seqlock rather than by taking a
+ * lock the producer would have to wait for.
+ *
+ * The memfd is handed out over a Unix stream socket with SCM_RIGHTS to
+ * every process that connects, and is sealed so that readers can rely on
+ * its size.
+ *
+ * Author: Johan Hovold <jhovold@gmail.com>
+ */
+
+#include <fcntl.h>
+#include <linux/videodev2.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "framebus.h"
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC		0x0001U
+#define MFD_ALLOW_SEALING	0x0002U
+#endif
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS		1033
+#define F_SEAL_SEAL		0x0001
+#define F_SEAL_SHRINK		0x0002
+#define F_SEAL_GROW		0x0004
+#endif
+
+
+static size_t page_align(size_t size)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	return (size + page - 1) & ~(page - 1);
+}
+
+/*
+ * Create a bus of slots frames of width x height YUYV, served on the Unix
+ * socket at path.
+ */
+int framebus_init(struct framebus *bus, const char *path, unsigned slots,
+			unsigned width, unsigned height, unsigned stride)
+{
+	struct framebus_header *hdr;
+	struct sockaddr_un sun;
+	size_t slots_offset, slot_size;
+
+	memset(bus, 0, sizeof(*bus));
+	bus->path = path;
+	bus->width = width;
+	bus->height = height;
+	bus->stride = stride;
+	bus->fd_listen = -1;
+
+	if (!slots || slots > FRAMEBUS_SLOTS_MAX)
+		return -1;
+
+	/* page-aligned frame data, so that readers can map or DMA from it */
+	slots_offset = page_align(sizeof(*hdr));
+	slot_size = page_align(sizeof(struct framebus_slot)) +
+					page_align(stride * height);
+	bus->mem_size = slots_offset + slots * slot_size;
+
+	bus->fd_mem = syscall(SYS_memfd_create, "atmel-demo-frames",
+					MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (bus->fd_mem < 0) {
+		err_errno("memfd_create");
+		return -1;
+	}
+
+	if (ftruncate(bus->fd_mem, bus->mem_size) == -1) {
+		err_errno("ftruncate");
+		goto err_close;
+	}
+
+	if (fcntl(bus->fd_mem, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+							F_SEAL_SEAL) == -1)
+		err_errno("F_ADD_SEALS");
+
+	bus->mem = mmap(NULL, bus->mem_size, PROT_READ | PROT_WRITE,
+						MAP_SHARED, bus->fd_mem, 0);
+	if (bus->mem == MAP_FAILED) {
+		err_errno("mmap");
+		goto err_close;
+	}
+
+	hdr = (struct framebus_header *)bus->mem;
+	hdr->magic = FRAMEBUS_MAGIC;
+	hdr->version = FRAMEBUS_VERSION;
+	hdr->slot_count = slots;
+	hdr->slots_offset = slots_offset;
+	hdr->slot_size = slot_size;
+	hdr->data_offset = page_align(sizeof(struct framebus_slot));
+	hdr->head = 0;
+	bus->hdr = hdr;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		err("%s: path too long\n", path);
+		goto err_unmap;
+	}
+	strcpy(sun.sun_path, path);
+
+	bus->fd_listen = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK |
+							SOCK_CLOEXEC, 0);
+	if (bus->fd_listen < 0) {
+		err_errno("socket");
+		goto err_unmap;
+	}
+
+	unlink(path);
+	if (bind(bus->fd_listen, (struct sockaddr *)&sun, sizeof(sun)) ||
+			listen(bus->fd_listen, 4)) {
+		err_errno("%s", path);
+		goto err_socket;
+	}
+
+	return 0;
+
+err_socket:
+	close(bus->fd_listen);
+err_unmap:
+	munmap(bus->mem, bus->mem_size);
+err_close:
+	close(bus->fd_mem);
+
+	return -1;
+}
+
+void framebus_free(struct framebus *bus)
+{
+	close(bus->fd_listen);
+	unlink(bus->path);
+	munmap(bus->mem, bus->mem_size);
+	close(bus->fd_mem);
+
+	printf("%s - %lu frames published, %lu readers\n", __func__,
+						bus->published, bus->readers);
+}
+
+void framebus_publish(struct framebus *bus, const struct video_frame *frame)
+{
+	struct framebus_header *hdr = bus->hdr;
+	struct framebus_slot *slot;
+	uint64_t generation;
+	size_t size;
+
+	generation = hdr->head + 1;
+	slot = (struct framebus_slot *)((char *)bus->mem + hdr->slots_offset +
+				hdr->slot_size * (generation % hdr->slot_count));
+
+	size = frame->size;
+	if (size > bus->stride * bus->height)
+		size = bus->stride * bus->height;
+
+	++slot->lock;
+	__sync_synchronize();
+
+	slot->sequence = frame->sequence;
+	slot->generation = generation;
+	slot->timestamp = frame->timestamp;
+	slot->fourcc = V4L2_PIX_FMT_YUYV;
+	slot->width = bus->width;
+	slot->height = bus->height;
+	slot->stride = bus->stride;
+	slot->size = size;
+	memcpy((char *)slot + hdr->data_offset, frame->data, size);
+
+	__sync_synchronize();
+	++slot->lock;
+
+	hdr->head = generation;
+	++bus->published;
+}
+
+/*
+ * Hand the bus to processes waiting on the socket.
+ */
+void framebus_serve(struct framebus *bus)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr *cm;
+	struct msghdr msg;
+	struct iovec iov;
+	char byte = 0;
+	int fd;
+
+	while ((fd = accept4(bus->fd_listen, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+		iov.iov_base = &byte;
+		iov.iov_len = 1;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		cm = CMSG_FIRSTHDR(&msg);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cm), &bus->fd_mem, sizeof(int));
+
+		if (sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) == 1)
+			++bus->readers;
+		else
+			err_errno("sendmsg");
+
+		close(fd);
+	}
+}
+
+/*
+ * Connect to the bus served at path and map it read-only.
+ */
+int framebus_open(struct framebus_reader *reader, const char *path)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	const struct framebus_header *hdr;
+	struct sockaddr_un sun;
+	struct cmsghdr *cm;
+	struct msghdr msg;
+	struct iovec iov;
+	struct stat st;
+	char byte;
+	int sock, fd;
+
+	memset(reader, 0, sizeof(*reader));
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sun.sun_path))
+		return -1;
+	strcpy(sun.sun_path, path);
+
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return -1;
+
+	if (connect(sock, (struct sockaddr *)&sun, sizeof(sun))) {
+		close(sock);
+		return -1;
+	}
+
+	iov.iov_base = &byte;
+	iov.iov_len = 1;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1) {
+		close(sock);
+		return -1;
+	}
+	close(sock);
+
+	cm = CMSG_FIRSTHDR(&msg);
+	if (!cm || cm->cmsg_level != SOL_SOCKET ||
+			cm->cmsg_type != SCM_RIGHTS)
+		return -1;
+	memcpy(&fd, CMSG_DATA(cm), sizeof(int));
+
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	reader->mem_size = st.st_size;
+	reader->mem = mmap(NULL, reader->mem_size, PROT_READ, MAP_SHARED,
+									fd, 0);
+	close(fd);
+
+	if (reader->mem == MAP_FAILED)
+		return -1;
+
+	hdr = (const struct framebus_header *)reader->mem;
+	if (reader->mem_size < sizeof(*hdr) || hdr->magic != FRAMEBUS_MAGIC ||
+			hdr->version != FRAMEBUS_VERSION ||
+			hdr->slots_offset + (size_t)hdr->slot_count *
+				hdr->slot_size > reader->mem_size) {
+		munmap((void *)reader->mem, reader->mem_size);
+		return -1;
+	}
+	reader->hdr = hdr;
+
+	return 0;
+}
+
+void framebus_close(struct framebus_reader *reader)
+{
+	munmap((void *)reader->mem, reader->mem_size);
+}
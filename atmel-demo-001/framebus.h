@@ -0,0 +1,122 @@
+/*
+ * framebus.h -- shared-memory frame bus
+ *
+ * Frames are published into a ring of slots in a sealed memfd, which local
+ * readers obtain over a Unix socket and map read-only. Every slot is
+ * guarded by a seqlock, so readers never block the producer but must check
+ * that a slot was not rewritten while they were using it.
+ *
+ * Author: Johan Hovold <jhovold@gmail.com>
+ */
+
+#ifndef FRAMEBUS_H
+#define FRAMEBUS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "frame.h"
+
+
+#define FRAMEBUS_MAGIC		0x56344c42	/* "V4LB" */
+#define FRAMEBUS_VERSION	1
+#define FRAMEBUS_SLOTS_MAX	16
+#define FRAMEBUS_ALIGN		64
+
+struct framebus_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slot_count;
+	uint32_t slots_offset;	/* of the first slot */
+	uint32_t slot_size;	/* header and data, including padding */
+	uint32_t data_offset;	/* of frame data within a slot */
+	volatile uint64_t head;	/* generation of the newest frame */
+} __attribute__((aligned(FRAMEBUS_ALIGN)));
+
+struct framebus_slot {
+	volatile uint32_t lock;	/* odd while being written */
+	uint32_t sequence;
+	uint64_t generation;	/* published frame count, from 1 */
+	uint64_t timestamp;	/* ns, CLOCK_MONOTONIC */
+	uint32_t fourcc;
+	uint16_t width;
+	uint16_t height;
+	uint32_t stride;
+	uint32_t size;
+} __attribute__((aligned(FRAMEBUS_ALIGN)));
+
+/* producer */
+struct framebus {
+	const char *path;
+	int fd_listen;
+	int fd_mem;
+	void *mem;
+	size_t mem_size;
+
+	struct framebus_header *hdr;
+	unsigned width;
+	unsigned height;
+	unsigned stride;
+
+	unsigned long readers;
+	unsigned long published;
+};
+
+int framebus_init(struct framebus *bus, const char *path, unsigned slots,
+			unsigned width, unsigned height, unsigned stride);
+void framebus_free(struct framebus *bus);
+void framebus_publish(struct framebus *bus, const struct video_frame *frame);
+void framebus_serve(struct framebus *bus);
+
+/* readers */
+struct framebus_reader {
+	const void *mem;
+	size_t mem_size;
+	const struct framebus_header *hdr;
+};
+
+int framebus_open(struct framebus_reader *reader, const char *path);
+void framebus_close(struct framebus_reader *reader);
+
+static inline const struct framebus_slot *
+framebus_slot_at(const struct framebus_reader *reader, uint64_t generation)
+{
+	return (const struct framebus_slot *)((const char *)reader->mem +
+				reader->hdr->slots_offset +
+				reader->hdr->slot_size *
+				(generation % reader->hdr->slot_count));
+}
+
+static inline const void *
+framebus_data(const struct framebus_reader *reader,
+				const struct framebus_slot *slot)
+{
+	return (const char *)slot + reader->hdr->data_offset;
+}
+
+/*
+ * Start reading a slot in place. Returns the lock value to pass to
+ * framebus_read_end(), or zero if the slot is being written.
+ */
+static inline uint32_t framebus_read_begin(const struct framebus_slot *slot)
+{
+	uint32_t lock = slot->lock;
+
+	__sync_synchronize();
+
+	return lock & 1 ? 0 : lock;
+}
+
+/*
+ * Returns true if the slot was not rewritten since framebus_read_begin(),
+ * i.e. if whatever was read from it is valid.
+ */
+static inline bool framebus_read_end(const struct framebus_slot *slot,
+							uint32_t lock)
+{
+	__sync_synchronize();
+
+	return lock && slot->lock == lock;
+}
+
+#endif	/* FRAMEBUS_H */
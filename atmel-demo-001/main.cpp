@@ -10,20 +10,26 @@
 
 #include <fcntl.h>
 #include <linux/fb.h>
+#include <pthread.h>
 #include <signal.h>
 #include <sys/ioctl.h>
 #include <unistd.h>
 
 #include "common.h"
+#include "copy.h"
 #include "mainwindow.h"
+#include "rt.h"
 #include "videoworker.h"
 
 
 #define FB_DEV_OVERLAY	"/dev/fb1"
+#define DRM_DEV		"/dev/dri/card0"
 #define V4L_DEV_CAPTURE	"/dev/video1"
 #define V4L_DEV_OUTPUT	"/dev/video0"
 
 
+long long startup_begin;
+
 static int fb_setup(const char *dev, size_t width, size_t height)
 {
 	struct fb_var_screeninfo vinfo;
@@ -57,56 +63,445 @@ static int fb_setup(const char *dev, size_t width, size_t height)
 	return ret;
 }
 
+/*
+ * Return the value of a "--name=value" option, an empty string for a plain
+ * "--name", or NULL if arg is not the named option.
+ */
+static const char *option_value(const char *arg, const char *name)
+{
+	size_t len = strlen(name);
+
+	if (strncmp(arg, "--", 2) || strncmp(arg + 2, name, len))
+		return NULL;
+
+	arg += 2 + len;
+	if (*arg == '=')
+		return arg + 1;
+	if (*arg == '\0')
+		return arg;
+
+	return NULL;
+}
+
+static unsigned option_uint(const char *name, const char *val)
+{
+	char *end;
+	unsigned long n;
+
+	errno = 0;
+	n = strtoul(val, &end, 0);
+	if (errno || !*val || *end)
+		die("invalid value for --%s: '%s'\n", name, val);
+
+	return n;
+}
+
+static void option_rt(const char *name, const char *val,
+						struct rt_params *params)
+{
+	if (rt_params_parse(params, val))
+		die("invalid value for --%s: '%s' "
+				"(expected policy[:priority[:cpu]])\n", name, val);
+}
+
+/*
+ * Parse and remove the demo options from argv so that the remaining
+ * arguments can be handed over to QApplication.
+ */
+static void parse_options(int *argc, char **argv, video_options *opts,
+				unsigned *rt_measure, bool *copy_bench,
+				bool *deint_bench, QSize *size)
+{
+	unsigned width, height;
+
+	const char *val;
+	int i, n;
+
+	for (i = 1, n = 1; i < *argc; ++i) {
+		const char *arg = argv[i];
+
+		if ((val = option_value(arg, "size"))) {
+			if (sscanf(val, "%ux%u", &width, &height) != 2 ||
+					!width || !height || width % 2)
+				die("invalid value for --size: '%s'\n", val);
+			*size = QSize(width, height);
+		} else if ((val = option_value(arg, "capture-size"))) {
+			if (sscanf(val, "%ux%u", &width, &height) != 2 ||
+					!width || !height || width % 2)
+				die("invalid value for --capture-size: '%s'\n",
+									val);
+			opts->capture_size = QSize(width, height);
+		} else if ((val = option_value(arg, "capture-format"))) {
+			if (!strcmp(val, "yuyv"))
+				opts->capture_fourcc = V4L2_PIX_FMT_YUYV;
+			else if (!strcmp(val, "mjpeg"))
+				opts->capture_fourcc = V4L2_PIX_FMT_MJPEG;
+			else
+				die("invalid value for --capture-format: '%s'\n",
+									val);
+		} else if ((val = option_value(arg, "decode-threads"))) {
+			opts->decode_threads = option_uint("decode-threads", val);
+			if (!opts->decode_threads ||
+					opts->decode_threads > DECODE_THREADS_MAX)
+				die("--decode-threads must be 1 to %d\n",
+							DECODE_THREADS_MAX);
+		} else if ((val = option_value(arg, "capture-buffers"))) {
+			opts->capture_buffers = option_uint("capture-buffers", val);
+		} else if ((val = option_value(arg, "output-buffers"))) {
+			opts->output_buffers = option_uint("output-buffers", val);
+		} else if ((val = option_value(arg, "adaptive-buffers"))) {
+			opts->adaptive_buffers = true;
+			if (*val)
+				opts->drop_target = option_uint("adaptive-buffers", val);
+		} else if ((val = option_value(arg, "max-capture-buffers"))) {
+			opts->max_capture_buffers = option_uint("max-capture-buffers", val);
+		} else if ((val = option_value(arg, "skip-backlog"))) {
+			opts->skip_backlog = option_uint("skip-backlog", val);
+		} else if ((val = option_value(arg, "rt-capture"))) {
+			option_rt("rt-capture", val, &opts->rt[RT_THREAD_CAPTURE]);
+		} else if ((val = option_value(arg, "rt-output"))) {
+			option_rt("rt-output", val, &opts->rt[RT_THREAD_OUTPUT]);
+		} else if ((val = option_value(arg, "rt-convert"))) {
+			option_rt("rt-convert", val, &opts->rt[RT_THREAD_CONVERT]);
+		} else if ((val = option_value(arg, "mlock"))) {
+			opts->lock_memory = true;
+		} else if ((val = option_value(arg, "present"))) {
+			opts->present = true;
+			if (*val)
+				opts->present_delay = option_uint("present", val) * 1000;
+		} else if ((val = option_value(arg, "present-depth"))) {
+			opts->present_depth = option_uint("present-depth", val);
+			if (opts->present_depth < 1 || opts->present_depth > 2)
+				die("--present-depth must be 1 or 2\n");
+		} else if ((val = option_value(arg, "refresh"))) {
+			opts->refresh = option_uint("refresh", val);
+			if (!opts->refresh)
+				die("invalid refresh rate\n");
+		} else if ((val = option_value(arg, "motion"))) {
+			opts->motion = true;
+			if (*val)
+				opts->motion_budget = option_uint("motion", val);
+		} else if ((val = option_value(arg, "skip-static"))) {
+			opts->motion = true;
+			opts->skip_static = true;
+			if (*val)
+				opts->skip_threshold = option_uint("skip-static", val);
+		} else if ((val = option_value(arg, "checksum"))) {
+			opts->checksum = true;
+		} else if ((val = option_value(arg, "record"))) {
+			if (!*val)
+				die("--record requires a file name\n");
+			opts->record.path = val;
+		} else if ((val = option_value(arg, "record-encoder"))) {
+			if (!*val)
+				die("--record-encoder requires a device\n");
+			opts->record.encoder = val;
+		} else if ((val = option_value(arg, "record-quality"))) {
+			opts->record.quality = option_uint("record-quality", val);
+			if (!opts->record.quality || opts->record.quality > 100)
+				die("--record-quality must be 1 to 100\n");
+		} else if ((val = option_value(arg, "record-bitrate"))) {
+			opts->record.bitrate = option_uint("record-bitrate", val);
+		} else if ((val = option_value(arg, "record-depth"))) {
+			opts->record.depth = option_uint("record-depth", val);
+			if (!opts->record.depth || opts->record.depth > TAP_DEPTH_MAX)
+				die("--record-depth must be 1 to %d\n",
+								TAP_DEPTH_MAX);
+		} else if ((val = option_value(arg, "stream"))) {
+			if (!*val)
+				die("--stream requires an address\n");
+			opts->stream.address = val;
+		} else if ((val = option_value(arg, "stream-depth"))) {
+			opts->stream.depth = option_uint("stream-depth", val);
+			if (!opts->stream.depth || opts->stream.depth > TAP_DEPTH_MAX)
+				die("--stream-depth must be 1 to %d\n",
+								TAP_DEPTH_MAX);
+		} else if ((val = option_value(arg, "prerecord"))) {
+			if (!*val)
+				die("--prerecord requires a file name\n");
+			opts->prerecord.path = val;
+		} else if ((val = option_value(arg, "prerecord-seconds"))) {
+			opts->prerecord.seconds = option_uint("prerecord-seconds",
+									val);
+			if (!opts->prerecord.seconds)
+				die("--prerecord-seconds must be at least 1\n");
+		} else if ((val = option_value(arg, "prerecord-post"))) {
+			opts->prerecord.post = option_uint("prerecord-post", val);
+		} else if ((val = option_value(arg, "prerecord-memory"))) {
+			opts->prerecord.memory = (size_t)option_uint(
+					"prerecord-memory", val) << 20;
+			if (!opts->prerecord.memory)
+				die("--prerecord-memory must be at least 1 MiB\n");
+		} else if ((val = option_value(arg, "prerecord-quality"))) {
+			opts->prerecord.quality = option_uint("prerecord-quality",
+									val);
+			if (!opts->prerecord.quality ||
+					opts->prerecord.quality > 100)
+				die("--prerecord-quality must be 1 to 100\n");
+		} else if ((val = option_value(arg, "prerecord-trigger"))) {
+			if (!*val)
+				die("--prerecord-trigger requires a socket path\n");
+			opts->prerecord.trigger = val;
+		} else if ((val = option_value(arg, "frame-bus"))) {
+			if (!*val)
+				die("--frame-bus requires a socket path\n");
+			opts->bus_path = val;
+		} else if ((val = option_value(arg, "frame-bus-slots"))) {
+			opts->bus_slots = option_uint("frame-bus-slots", val);
+			if (opts->bus_slots < 2 ||
+					opts->bus_slots > FRAMEBUS_SLOTS_MAX)
+				die("--frame-bus-slots must be 2 to %d\n",
+							FRAMEBUS_SLOTS_MAX);
+		} else if ((val = option_value(arg, "fb-sink"))) {
+			opts->fb_path = *val ? val : FB_DEV_OVERLAY;
+		} else if ((val = option_value(arg, "drm-sink"))) {
+			opts->drm_path = *val ? val : DRM_DEV;
+		} else if ((val = option_value(arg, "denoise"))) {
+			opts->denoise = *val ? option_uint("denoise", val) :
+								DENOISE_LEVEL;
+			if (!opts->denoise || opts->denoise > DENOISE_LEVEL_MAX)
+				die("--denoise must be 1 to %d\n",
+							DENOISE_LEVEL_MAX);
+		} else if ((val = option_value(arg, "deinterlace"))) {
+			opts->deinterlace = true;
+			if (!*val || !strcmp(val, "adaptive"))
+				opts->deint_mode = DEINT_ADAPTIVE;
+			else if (!strcmp(val, "bob"))
+				opts->deint_mode = DEINT_BOB;
+			else if (!strcmp(val, "blend"))
+				opts->deint_mode = DEINT_BLEND;
+			else
+				die("invalid value for --deinterlace: '%s'\n",
+									val);
+		} else if ((val = option_value(arg, "field-rate"))) {
+			opts->deinterlace = true;
+			opts->field_rate = true;
+		} else if ((val = option_value(arg, "osd"))) {
+			opts->osd = true;
+			if (*val)
+				opts->osd_label = val;
+		} else if ((val = option_value(arg, "replay"))) {
+			if (!*val)
+				die("--replay requires a file name\n");
+			opts->replay_path = val;
+		} else if ((val = option_value(arg, "replay-speed"))) {
+			if (!strcmp(val, "max")) {
+				opts->replay_speed = 0;
+			} else {
+				opts->replay_speed = option_uint("replay-speed", val);
+				if (!opts->replay_speed)
+					die("--replay-speed must be a percentage or 'max'\n");
+			}
+		} else if ((val = option_value(arg, "replay-fps"))) {
+			opts->replay_rate = option_uint("replay-fps", val);
+			if (!opts->replay_rate)
+				die("invalid frame rate\n");
+		} else if ((val = option_value(arg, "replay-loop"))) {
+			opts->replay_loop = true;
+		} else if ((val = option_value(arg, "pattern"))) {
+			opts->pattern = true;
+			if (!strcmp(val, "max"))
+				opts->pattern_rate = 0;
+			else if (*val)
+				opts->pattern_rate = option_uint("pattern", val);
+			if (*val && strcmp(val, "max") && !opts->pattern_rate)
+				die("--pattern must be a frame rate or 'max'\n");
+		} else if ((val = option_value(arg, "rt-measure"))) {
+			*rt_measure = *val ? option_uint("rt-measure", val) : 10;
+		} else if ((val = option_value(arg, "copy-benchmark"))) {
+			*copy_bench = true;
+		} else if ((val = option_value(arg, "deinterlace-benchmark"))) {
+			*deint_bench = true;
+		} else {
+			argv[n++] = argv[i];
+		}
+	}
+
+	argv[n] = NULL;
+	*argc = n;
+
+	if (opts->fb_path && opts->drm_path)
+		die("--fb-sink and --drm-sink are exclusive\n");
+	if ((opts->fb_path || opts->drm_path) && opts->present)
+		die("--present cannot be used with --fb-sink or --drm-sink\n");
+	if (opts->field_rate && opts->deint_mode == DEINT_BLEND)
+		die("--field-rate needs --deinterlace=bob or adaptive\n");
+}
+
+static void *init_thread(void *arg)
+{
+	VideoWorker *worker = (VideoWorker *)arg;
+
+	worker->init();
+
+	return NULL;
+}
+
+/*
+ * Create the worker and set up the video devices in the background while
+ * the user interface is being built.
+ */
+static VideoWorker *worker_create(const video_options &options,
+				QSize &videoSize, QSize *windowSize,
+				pthread_t *thread)
+{
+	video_options opts = options;
+	VideoWorker *worker;
+	int ret;
+
+	/* let the overlay scale down sources larger than the screen */
+	*windowSize = videoSize;
+	if (windowSize->width() > SCREEN_WIDTH ||
+			windowSize->height() > SCREEN_HEIGHT)
+		windowSize->scale(SCREEN_WIDTH, SCREEN_HEIGHT,
+							Qt::KeepAspectRatio);
+	opts.window = *windowSize;
+
+	worker = new VideoWorker(V4L_DEV_CAPTURE, V4L_DEV_OUTPUT, videoSize,
+									opts);
+
+	ret = pthread_create(thread, NULL, init_thread, worker);
+	if (ret) {
+		errno = ret;
+		die_errno("pthread_create");
+	}
+
+	return worker;
+}
+
+static VideoWorker *signal_worker;
+
 static void signalhandler(int sig)
 {
 	if (sig == SIGINT || sig == SIGTERM)
 		qApp->quit();
+	else if (sig == SIGUSR1 && signal_worker)
+		signal_worker->triggerEvent();
 }
 
 int main(int argc, char *argv[])
 {
+	video_options opts;
+	unsigned rt_measure = 0;
+	bool copy_bench = false;
+	bool deint_bench = false;
+	bool overlay;
+	unsigned width, height;
+	VideoWorker *worker = NULL;
+	pthread_t init;
+	struct timespec ts;
 	QSize videoSize;
+	QSize windowSize;
 	int ret;
 
-	fb_setup(FB_DEV_OVERLAY, SCREEN_WIDTH, SCREEN_HEIGHT);
+	startup_begin = now_ns();
+	clock_gettime(CLOCK_BOOTTIME, &ts);
+	printf("startup - main: %ld.%03ld s since boot\n", (long)ts.tv_sec,
+							ts.tv_nsec / 1000000);
+
+	parse_options(&argc, argv, &opts, &rt_measure, &copy_bench,
+						&deint_bench, &videoSize);
+
+	/* the measurement locks memory itself, for the rt run only */
+	if (rt_measure) {
+		rt_measure_latency(&opts.rt[RT_THREAD_CAPTURE],
+					opts.lock_memory, rt_measure);
+		return 0;
+	}
+
+	if (opts.lock_memory)
+		rt_lock_memory();
+
+	if (copy_bench) {
+		if (opts.capture_size.isValid())
+			videoSize = opts.capture_size;
+		else if (!videoSize.isValid())
+			videoSize = QSize(640, 480);
+		copy_benchmark(videoSize.width(), videoSize.height());
+		return 0;
+	}
+
+	if (deint_bench) {
+		if (opts.capture_size.isValid())
+			videoSize = opts.capture_size;
+		else if (!videoSize.isValid())
+			videoSize = QSize(640, 480);
+		deint_benchmark(videoSize.width(), videoSize.height());
+		return 0;
+	}
+
+	/*
+	 * There may be no fbdev at all with a DRM sink, or with a frame-buffer
+	 * sink on anything but the overlay.
+	 */
+	overlay = !opts.drm_path && (!opts.fb_path ||
+				!strcmp(opts.fb_path, FB_DEV_OVERLAY));
+	if (overlay) {
+		fb_setup(FB_DEV_OVERLAY, SCREEN_WIDTH, SCREEN_HEIGHT);
+		startup_mark("framebuffer");
+	}
+
+	/* recordings with frame headers know their size */
+	if (opts.replay_path && !videoSize.isValid() &&
+			!replay_probe(opts.replay_path, &width, &height))
+		videoSize = QSize(width, height);
+
+	/*
+	 * With a known video size, the devices can be set up while Qt starts,
+	 * otherwise the default depends on the arguments left by Qt.
+	 */
+	if (videoSize.isValid())
+		worker = worker_create(opts, videoSize, &windowSize, &init);
 
 	QApplication app(argc, argv);
 	app.setApplicationName("atmel-demo");
+	startup_mark("application");
 
-	if (app.arguments().count() > 1)
-		videoSize = QSize(320, 240);
-	else
-		videoSize = QSize(640, 480);
+	if (!worker) {
+		if (app.arguments().count() > 1)
+			videoSize = QSize(320, 240);
+		else
+			videoSize = QSize(640, 480);
+
+		worker = worker_create(opts, videoSize, &windowSize, &init);
+	}
 
 	QWSServer *server = QWSServer::instance();
 	if(server)
 		server->setCursorVisible(false);
 
-	VideoWorker *worker = new VideoWorker(V4L_DEV_CAPTURE,
-							V4L_DEV_OUTPUT,
-							videoSize);
-	MainWindow window(worker, videoSize);
+	MainWindow window(worker, windowSize);
 	window.setAttribute(Qt::WA_OpaquePaintEvent);
 	window.setAttribute(Qt::WA_NoSystemBackground);
 	window.setWindowFlags(Qt::FramelessWindowHint);
 	window.setFixedSize(SCREEN_WIDTH, SCREEN_HEIGHT);
 	window.show();
+	startup_mark("window");
+
+	pthread_join(init, NULL);
 
 	QThread *thread = new QThread();
 	worker->moveToThread(thread);
 	QObject::connect(thread, SIGNAL(started()), worker, SLOT(run()));
 
+	signal_worker = worker;
 	signal(SIGINT, signalhandler);
 	signal(SIGTERM, signalhandler);
+	signal(SIGUSR1, signalhandler);
 
 	thread->start();
 
 	ret = app.exec();
 
+	/* no more triggers once the worker starts tearing down */
+	signal(SIGUSR1, SIG_IGN);
+	signal_worker = NULL;
+
 	worker->stop();
 	thread->wait();
 
-	fb_setup(FB_DEV_OVERLAY, 0, 0);
+	if (overlay)
+		fb_setup(FB_DEV_OVERLAY, 0, 0);
 
 	return ret;
 }
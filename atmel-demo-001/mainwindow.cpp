@@ -4,9 +4,13 @@
  * Author: Johan Hovold <jhovold@gmail.com>
  */
 
+#include <QtCore/QDateTime>
 #include <QtCore/QDebug>
+#include <QtCore/QTimer>
 
-#include <QtGui/QLabel>
+#include <QtGui/QColor>
+#include <QtGui/QPalette>
+#include <QtGui/QShortcut>
 #include <QtGui/QStyle>
 #include <QtGui/QHBoxLayout>
 #include <QtGui/QVBoxLayout>
@@ -15,25 +19,28 @@
 #include "mainwindow.h"
 
 #define ICON_SIZE	60
+#define BG_COLOR	"#0085c1"
 
 MainWindow::MainWindow(VideoWorker *worker, QSize &videoSize, QWidget *parent) :
         QMainWindow(parent),
 	m_worker(worker)
 {
-	static const char *bg_style = "background-color:#0085c1;";
-	static const char *bg_transparent = "background: transparent;" \
-					    "border = none;";
+	QPalette bg;
+
+	/* a palette is much cheaper to set up than style sheets */
+	bg.setColor(QPalette::Window, QColor(BG_COLOR));
 
 	connect(m_worker, SIGNAL(started()), this, SLOT(videoStarted()));
 	connect(m_worker, SIGNAL(paused()), this, SLOT(videoPaused()));
 
 	m_playpause = new QToolButton;
-	m_playpause->setIcon(QIcon(":/images/play.png"));
 	m_playpause->setIconSize(QSize(ICON_SIZE, ICON_SIZE));
-	m_playpause->setStyleSheet(bg_transparent);
+	m_playpause->setAutoRaise(true);
 	m_playpause->setFocusPolicy(Qt::NoFocus);
 	connect(m_playpause, SIGNAL(clicked()), this, SLOT(onPlayPause()));
 
+	new QShortcut(QKeySequence(Qt::Key_S), this, SLOT(onSnapshot()));
+
 	QHBoxLayout *bl = new QHBoxLayout;
 	bl->setAlignment(Qt::AlignBottom | Qt::AlignHCenter);
 	bl->setContentsMargins(0, 0, 0, videoSize.height() / 20);
@@ -49,12 +56,16 @@ MainWindow::MainWindow(VideoWorker *worker, QSize &videoSize, QWidget *parent) :
 	QLabel *right = new QLabel;
 	right->setMaximumHeight(videoSize.height());
 	right->setAlignment(Qt::AlignCenter);
-	right->setPixmap(QPixmap(":/images/logo-atmel-small.png"));
+	m_logo = right;
 
-	top->setStyleSheet(bg_style);
-	bottom->setStyleSheet(bg_style);
-	left->setStyleSheet(bg_style);
-	right->setStyleSheet(bg_style);
+	top->setPalette(bg);
+	top->setAutoFillBackground(true);
+	bottom->setPalette(bg);
+	bottom->setAutoFillBackground(true);
+	left->setPalette(bg);
+	left->setAutoFillBackground(true);
+	right->setPalette(bg);
+	right->setAutoFillBackground(true);
 
 	QHBoxLayout *ml = new QHBoxLayout;
 	ml->setSpacing(0);
@@ -77,12 +88,32 @@ MainWindow::MainWindow(VideoWorker *worker, QSize &videoSize, QWidget *parent) :
 	base->setLayout(layout);
 
 	setCentralWidget(base);
+
+	/* decode images once the window is up */
+	QTimer::singleShot(0, this, SLOT(loadResources()));
 }
 
 MainWindow::~MainWindow()
 {
 }
 
+const QIcon &MainWindow::icon(QIcon *icon, const char *path)
+{
+	if (icon->isNull())
+		*icon = QIcon(path);
+
+	return *icon;
+}
+
+void MainWindow::loadResources()
+{
+	if (m_playpause->icon().isNull())
+		m_playpause->setIcon(icon(&m_play, ":/images/play.png"));
+	m_logo->setPixmap(QPixmap(":/images/logo-atmel-small.png"));
+
+	startup_mark("resources");
+}
+
 void MainWindow::onPlayPause()
 {
 	qDebug("%s", __func__);
@@ -90,16 +121,26 @@ void MainWindow::onPlayPause()
 	m_worker->pause();
 }
 
+void MainWindow::onSnapshot()
+{
+	QString path;
+
+	path = QDateTime::currentDateTime().toString(
+					"'snapshot-'yyyyMMdd-hhmmsszzz'.jpg'");
+	if (!m_worker->snapshot(path))
+		qWarning("snapshot busy");
+}
+
 void MainWindow::videoStarted()
 {
 	qDebug("%s", __func__);
 
-	m_playpause->setIcon(QIcon(":/images/pause.png"));
+	m_playpause->setIcon(icon(&m_pause, ":/images/pause.png"));
 }
 
 void MainWindow::videoPaused()
 {
 	qDebug("%s", __func__);
 
-	m_playpause->setIcon(QIcon(":/images/play.png"));
+	m_playpause->setIcon(icon(&m_play, ":/images/play.png"));
 }
@@ -1,6 +1,8 @@
 #ifndef MAIN_WINDOW_H
 #define MAIN_WINDOW_H
 
+#include <QtGui/QIcon>
+#include <QtGui/QLabel>
 #include <QtGui/QMainWindow>
 #include <QtGui/QToolButton>
 
@@ -17,13 +19,22 @@ public:
 
 private slots:
 	void onPlayPause();
+	void onSnapshot();
+	void loadResources();
 
 	void videoStarted();
 	void videoPaused();
 
 private:
+	const QIcon &icon(QIcon *icon, const char *path);
+
 	VideoWorker *m_worker;
 	QToolButton *m_playpause;
+	QLabel *m_logo;
+
+	/* loaded on first use */
+	QIcon m_play;
+	QIcon m_pause;
 };
 
 #endif	/* MAIN_WINDOW_H */
@@ -0,0 +1,172 @@
+/*
+ * mjpeg.cpp -- software JPEG compression of YUYV frames
+ *
+ * Frames are compressed to 4:2:2 JPEGs from raw planar data, unpacked from
+ * YUYV one iMCU of rows at a time, so libjpeg does neither colour
+ * conversion nor chroma downsampling. Output goes either to a file, where
+ * JPEGs appended back to back make an MJPEG stream, or to a buffer of a
+ * fixed size.
+ *
+ * Author: Johan Hovold <jhovold@gmail.com>
+ */
+
+#include "common.h"
+#include "convert.h"
+#include "mjpeg.h"
+
+
+static void mjpeg_error_exit(j_common_ptr cinfo)
+{
+	struct mjpeg_error *err = (struct mjpeg_error *)cinfo->err;
+
+	(*cinfo->err->output_message)(cinfo);
+	longjmp(err->env, 1);
+}
+
+static void mem_init(j_compress_ptr cinfo)
+{
+	(void)cinfo;
+}
+
+/* The buffer is full, which fails the frame. */
+static boolean mem_empty(j_compress_ptr cinfo)
+{
+	struct mjpeg_error *err = (struct mjpeg_error *)cinfo->err;
+
+	longjmp(err->env, 1);
+
+	return FALSE;
+}
+
+static void mem_term(j_compress_ptr cinfo)
+{
+	(void)cinfo;
+}
+
+/*
+ * Set up compression of width x height frames, favouring speed over
+ * quality when fast.
+ */
+int mjpeg_init(struct mjpeg_encoder *enc, unsigned width, unsigned height,
+					unsigned quality, bool fast)
+{
+	struct jpeg_compress_struct *cinfo = &enc->cinfo;
+	unsigned stride;
+	unsigned i;
+
+	memset(enc, 0, sizeof(*enc));
+	enc->width = width;
+	enc->height = height;
+
+	stride = (width + 2 * DCTSIZE - 1) & ~(2 * DCTSIZE - 1);
+	enc->strip = (unsigned char *)malloc(3 * DCTSIZE * stride);
+	if (!enc->strip)
+		return -1;
+
+	for (i = 0; i < DCTSIZE; ++i) {
+		enc->rows[0][i] = enc->strip + i * stride;
+		enc->rows[1][i] = enc->strip + (DCTSIZE + i) * stride;
+		enc->rows[2][i] = enc->strip + (2 * DCTSIZE + i) * stride;
+	}
+	enc->planes[0] = enc->rows[0];
+	enc->planes[1] = enc->rows[1];
+	enc->planes[2] = enc->rows[2];
+
+	enc->dest.init_destination = mem_init;
+	enc->dest.empty_output_buffer = mem_empty;
+	enc->dest.term_destination = mem_term;
+
+	cinfo->err = jpeg_std_error(&enc->err.mgr);
+	enc->err.mgr.error_exit = mjpeg_error_exit;
+	jpeg_create_compress(cinfo);
+
+	cinfo->image_width = width;
+	cinfo->image_height = height;
+	cinfo->input_components = 3;
+	cinfo->in_color_space = JCS_YCbCr;
+	jpeg_set_defaults(cinfo);
+	jpeg_set_quality(cinfo, quality, TRUE);
+	cinfo->raw_data_in = TRUE;
+	if (fast)
+		cinfo->dct_method = JDCT_IFAST;
+	cinfo->comp_info[0].h_samp_factor = 2;
+	cinfo->comp_info[0].v_samp_factor = 1;
+	cinfo->comp_info[1].h_samp_factor = 1;
+	cinfo->comp_info[1].v_samp_factor = 1;
+	cinfo->comp_info[2].h_samp_factor = 1;
+	cinfo->comp_info[2].v_samp_factor = 1;
+
+	return 0;
+}
+
+void mjpeg_free(struct mjpeg_encoder *enc)
+{
+	jpeg_destroy_compress(&enc->cinfo);
+	free(enc->strip);
+	enc->strip = NULL;
+}
+
+/*
+ * Compress a frame to out, or to the buffer set up in the destination
+ * manager if out is NULL.
+ */
+static int mjpeg_encode(struct mjpeg_encoder *enc, FILE *out,
+					const void *src, unsigned stride)
+{
+	struct jpeg_compress_struct *cinfo = &enc->cinfo;
+	const unsigned char *line;
+	unsigned row, i;
+
+	if (setjmp(enc->err.env)) {
+		jpeg_abort_compress(cinfo);
+		return -1;
+	}
+
+	if (out)
+		jpeg_stdio_dest(cinfo, out);
+	else
+		cinfo->dest = &enc->dest;
+
+	line = (const unsigned char *)src;
+
+	jpeg_start_compress(cinfo, TRUE);
+	for (row = 0; row < enc->height; ) {
+		for (i = 0; i < DCTSIZE; ++i) {
+			/* replicate the last row into the padding */
+			if (row + i < enc->height)
+				line = (const unsigned char *)src +
+							(row + i) * stride;
+			convert_yuyv_unpack(enc->rows[0][i], enc->rows[1][i],
+					enc->rows[2][i], line, enc->width);
+		}
+		row += jpeg_write_raw_data(cinfo, enc->planes, DCTSIZE);
+	}
+	jpeg_finish_compress(cinfo);
+
+	return 0;
+}
+
+/*
+ * Append a frame as a JPEG to out.
+ */
+int mjpeg_write(struct mjpeg_encoder *enc, FILE *out, const void *src,
+							unsigned stride)
+{
+	return mjpeg_encode(enc, out, src, stride);
+}
+
+/*
+ * Compress a frame into buf. Returns the length of the JPEG, or zero on
+ * errors, including a JPEG larger than size.
+ */
+size_t mjpeg_compress(struct mjpeg_encoder *enc, void *buf, size_t size,
+					const void *src, unsigned stride)
+{
+	enc->dest.next_output_byte = (JOCTET *)buf;
+	enc->dest.free_in_buffer = size;
+
+	if (mjpeg_encode(enc, NULL, src, stride))
+		return 0;
+
+	return size - enc->dest.free_in_buffer;
+}
@@ -0,0 +1,44 @@
+/*
+ * mjpeg.h -- software JPEG compression of YUYV frames
+ *
+ * Author: Johan Hovold <jhovold@gmail.com>
+ */
+
+#ifndef MJPEG_H
+#define MJPEG_H
+
+#include <csetjmp>
+#include <cstdio>
+
+#include <jpeglib.h>
+
+
+struct mjpeg_error {
+	struct jpeg_error_mgr mgr;
+	jmp_buf env;
+};
+
+struct mjpeg_encoder {
+	struct jpeg_compress_struct cinfo;
+	struct mjpeg_error err;
+	struct jpeg_destination_mgr dest;	/* for memory output */
+
+	unsigned width;
+	unsigned height;
+
+	/* planar rows of one iMCU, as taken by raw input */
+	unsigned char *strip;
+	JSAMPROW rows[3][DCTSIZE];
+	JSAMPARRAY planes[3];
+};
+
+int mjpeg_init(struct mjpeg_encoder *enc, unsigned width, unsigned height,
+					unsigned quality, bool fast);
+void mjpeg_free(struct mjpeg_encoder *enc);
+
+int mjpeg_write(struct mjpeg_encoder *enc, FILE *out, const void *src,
+							unsigned stride);
+size_t mjpeg_compress(struct mjpeg_encoder *enc, void *buf, size_t size,
+					const void *src, unsigned stride);
+
+#endif	/* MJPEG_H */
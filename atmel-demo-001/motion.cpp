@@ -0,0 +1,242 @@
+/*
+ * motion.cpp -- scene change detection on downsampled luma
+ *
+ * Each frame is reduced to a luma thumbnail by averaging groups of four
+ * pixels on every step:th row, and scored by the mean absolute difference
+ * to the thumbnail of the reference frame (the last frame accepted). The
+ * row step is doubled or halved to keep the per-frame cost within budget.
+ *
+ * Author: Johan Hovold <jhovold@gmail.com>
+ */
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include "common.h"
+#include "motion.h"
+
+
+#define MOTION_STEP_MIN		4
+#define MOTION_STEP_MAX		32
+#define MOTION_SCORE_MAX	25500	/* hundredths of a luma level */
+
+
+#if defined(__SSE2__)
+
+/* Average the luma of four YUYV pixels (eight bytes) per output sample. */
+static void thumb_row(unsigned char *dst, const unsigned char *src,
+								unsigned tw)
+{
+	const __m128i ymask = _mm_set1_epi16(0x00ff);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i a, b;
+	int v;
+	unsigned x;
+
+	for (x = 0; x + 4 <= tw; x += 4, src += 32, dst += 4) {
+		a = _mm_and_si128(_mm_loadu_si128((const __m128i *)src), ymask);
+		b = _mm_and_si128(_mm_loadu_si128((const __m128i *)(src + 16)),
+									ymask);
+		a = _mm_shuffle_epi32(_mm_sad_epu8(a, zero),
+						_MM_SHUFFLE(3, 3, 2, 0));
+		b = _mm_shuffle_epi32(_mm_sad_epu8(b, zero),
+						_MM_SHUFFLE(3, 3, 2, 0));
+		a = _mm_srli_epi32(_mm_unpacklo_epi64(a, b), 2);
+		a = _mm_packs_epi32(a, a);
+		a = _mm_packus_epi16(a, a);
+		v = _mm_cvtsi128_si32(a);
+		memcpy(dst, &v, 4);
+	}
+
+	for (; x < tw; ++x, src += 8)
+		*dst++ = (src[0] + src[2] + src[4] + src[6]) >> 2;
+}
+
+static unsigned sad(const unsigned char *a, const unsigned char *b, size_t n)
+{
+	__m128i acc = _mm_setzero_si128();
+	unsigned sum;
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(
+				_mm_loadu_si128((const __m128i *)(a + i)),
+				_mm_loadu_si128((const __m128i *)(b + i))));
+	}
+
+	sum = _mm_cvtsi128_si32(acc) +
+			_mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+
+	for (; i < n; ++i)
+		sum += abs(a[i] - b[i]);
+
+	return sum;
+}
+
+#elif defined(__ARM_NEON__)
+
+static void thumb_row(unsigned char *dst, const unsigned char *src,
+								unsigned tw)
+{
+	uint8x16x2_t yuyv;
+	uint32x4_t sum;
+	uint16x4_t avg;
+	uint8x8_t v;
+	unsigned x;
+
+	for (x = 0; x + 4 <= tw; x += 4, src += 32, dst += 4) {
+		yuyv = vld2q_u8(src);
+		sum = vpaddlq_u16(vpaddlq_u8(yuyv.val[0]));
+		avg = vshrn_n_u32(sum, 2);
+		v = vmovn_u16(vcombine_u16(avg, avg));
+		vst1_lane_u32((uint32_t *)dst, vreinterpret_u32_u8(v), 0);
+	}
+
+	for (; x < tw; ++x, src += 8)
+		*dst++ = (src[0] + src[2] + src[4] + src[6]) >> 2;
+}
+
+static unsigned sad(const unsigned char *a, const unsigned char *b, size_t n)
+{
+	uint32x4_t acc = vdupq_n_u32(0);
+	uint64x2_t acc2;
+	unsigned sum;
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16)
+		acc = vpadalq_u16(acc, vpaddlq_u8(vabdq_u8(vld1q_u8(a + i),
+							vld1q_u8(b + i))));
+
+	acc2 = vpaddlq_u32(acc);
+	sum = vgetq_lane_u64(acc2, 0) + vgetq_lane_u64(acc2, 1);
+
+	for (; i < n; ++i)
+		sum += abs(a[i] - b[i]);
+
+	return sum;
+}
+
+#else
+
+static void thumb_row(unsigned char *dst, const unsigned char *src,
+								unsigned tw)
+{
+	unsigned x;
+
+	for (x = 0; x < tw; ++x, src += 8)
+		*dst++ = (src[0] + src[2] + src[4] + src[6]) >> 2;
+}
+
+static unsigned sad(const unsigned char *a, const unsigned char *b, size_t n)
+{
+	unsigned sum = 0;
+	size_t i;
+
+	for (i = 0; i < n; ++i)
+		sum += abs(a[i] - b[i]);
+
+	return sum;
+}
+
+#endif
+
+/*
+ * Set up a detector for YUYV frames of the given geometry, with a cost
+ * budget in microseconds per frame.
+ */
+int motion_init(struct motion_detector *md, unsigned width, unsigned height,
+					unsigned stride, unsigned budget)
+{
+	size_t size;
+
+	memset(md, 0, sizeof(*md));
+
+	md->width = width;
+	md->height = height;
+	md->stride = stride;
+	md->budget = budget;
+	md->step = MOTION_STEP_MIN;
+	md->tw = width / 4;
+	md->th = height / md->step;
+
+	size = md->tw * md->th;
+	md->ref = (unsigned char *)malloc(size);
+	md->cur = (unsigned char *)malloc(size);
+	if (!md->ref || !md->cur) {
+		motion_free(md);
+		return -1;
+	}
+
+	return 0;
+}
+
+void motion_free(struct motion_detector *md)
+{
+	free(md->ref);
+	free(md->cur);
+	md->ref = NULL;
+	md->cur = NULL;
+}
+
+/*
+ * Return the mean absolute luma difference between frame and the reference
+ * frame in hundredths of a luma level. The first frame, and any frame
+ * following a change of thumbnail resolution, scores the maximum.
+ */
+unsigned motion_analyze(struct motion_detector *md, const void *frame)
+{
+	const unsigned char *src = (const unsigned char *)frame;
+	unsigned long long diff;
+	unsigned score;
+	long long start;
+	unsigned cost;
+	size_t n;
+	unsigned y;
+
+	start = now_ns();
+
+	md->cur_step = md->step;
+	for (y = 0; y < md->th; ++y) {
+		thumb_row(md->cur + y * md->tw, src, md->tw);
+		src += md->step * md->stride;
+	}
+
+	n = md->tw * md->th;
+	if (md->ref_step == md->step && n) {
+		diff = sad(md->cur, md->ref, n);
+		score = diff * 100 / n;
+	} else {
+		score = MOTION_SCORE_MAX;
+	}
+
+	cost = now_ns() - start;
+
+	++md->frames;
+	md->cost += cost;
+	if (cost > md->cost_max)
+		md->cost_max = cost;
+
+	if (cost > md->budget * 1000 && md->step < MOTION_STEP_MAX) {
+		md->step *= 2;
+		md->th = md->height / md->step;
+	} else if (cost < md->budget * 1000 / 4 && md->step > MOTION_STEP_MIN) {
+		md->step /= 2;
+		md->th = md->height / md->step;
+	}
+
+	return score;
+}
+
+/* Make the last analysed frame the reference for subsequent frames. */
+void motion_accept(struct motion_detector *md)
+{
+	unsigned char *tmp;
+
+	tmp = md->ref;
+	md->ref = md->cur;
+	md->cur = tmp;
+	md->ref_step = md->cur_step;
+}
@@ -0,0 +1,41 @@
+/*
+ * motion.h -- scene change detection on downsampled luma
+ *
+ * Author: Johan Hovold <jhovold@gmail.com>
+ */
+
+#ifndef MOTION_H
+#define MOTION_H
+
+#include <cstddef>
+
+
+struct motion_detector {
+	unsigned width;		/* source YUYV geometry */
+	unsigned height;
+	unsigned stride;
+
+	unsigned step;		/* source rows per thumbnail row */
+	unsigned tw;		/* thumbnail width */
+	unsigned th;		/* thumbnail height at current step */
+
+	unsigned char *ref;
+	unsigned char *cur;
+	unsigned ref_step;	/* zero if there is no reference */
+	unsigned cur_step;
+
+	unsigned budget;	/* us per frame */
+
+	unsigned long frames;
+	long long cost;		/* ns, total */
+	unsigned cost_max;	/* ns */
+};
+
+int motion_init(struct motion_detector *md, unsigned width, unsigned height,
+					unsigned stride, unsigned budget);
+void motion_free(struct motion_detector *md);
+
+unsigned motion_analyze(struct motion_detector *md, const void *frame);
+void motion_accept(struct motion_detector *md);
+
+#endif	/* MOTION_H */
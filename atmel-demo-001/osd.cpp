@@ -0,0 +1,536 @@
+/*
+ * osd.cpp -- on-screen display burned into outgoing frames
+ *
+ * Glyphs and icons are rasterised once into layers in the pixel format of
+ * the frames, premultiplied by alpha, so that compositing is a single
+ * per-byte blend:
+ *
+ *	dst = color + dst * (255 - alpha) / 255
+ *
+ * For YUYV the chroma of a macropixel gets the mean alpha of its two
+ * pixels. Text is built by copying glyphs out of the atlas when it
+ * changes, and only the covered part of each row is blended per frame,
+ * which keeps the cost to a few microseconds for a line of text.
+ *
+ * Author: Johan Hovold <jhovold@gmail.com>
+ */
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include "common.h"
+#include "osd.h"
+
+
+#define FONT_FIRST	0x20
+#define FONT_COUNT	95
+#define FONT_WIDTH	5
+#define FONT_HEIGHT	7
+#define FONT_SCALE	2
+
+/* scaled glyph with a one pixel outline, an even width for YUYV */
+#define GLYPH_WIDTH	(FONT_WIDTH * FONT_SCALE + 2)
+#define GLYPH_HEIGHT	(FONT_HEIGHT * FONT_SCALE + 2)
+
+#define TEXT_COLOR	0xffffffff
+#define OUTLINE_COLOR	0xa0000000
+
+/* columns, least significant bit at the top */
+static const unsigned char font[FONT_COUNT][FONT_WIDTH] = {
+	{ 0x00, 0x00, 0x00, 0x00, 0x00 }, { 0x00, 0x00, 0x5f, 0x00, 0x00 },
+	{ 0x00, 0x07, 0x00, 0x07, 0x00 }, { 0x14, 0x7f, 0x14, 0x7f, 0x14 },
+	{ 0x24, 0x2a, 0x7f, 0x2a, 0x12 }, { 0x23, 0x13, 0x08, 0x64, 0x62 },
+	{ 0x36, 0x49, 0x55, 0x22, 0x50 }, { 0x00, 0x05, 0x03, 0x00, 0x00 },
+	{ 0x00, 0x1c, 0x22, 0x41, 0x00 }, { 0x00, 0x41, 0x22, 0x1c, 0x00 },
+	{ 0x14, 0x08, 0x3e, 0x08, 0x14 }, { 0x08, 0x08, 0x3e, 0x08, 0x08 },
+	{ 0x00, 0x50, 0x30, 0x00, 0x00 }, { 0x08, 0x08, 0x08, 0x08, 0x08 },
+	{ 0x00, 0x60, 0x60, 0x00, 0x00 }, { 0x20, 0x10, 0x08, 0x04, 0x02 },
+	{ 0x3e, 0x51, 0x49, 0x45, 0x3e }, { 0x00, 0x42, 0x7f, 0x40, 0x00 },
+	{ 0x42, 0x61, 0x51, 0x49, 0x46 }, { 0x21, 0x41, 0x45, 0x4b, 0x31 },
+	{ 0x18, 0x14, 0x12, 0x7f, 0x10 }, { 0x27, 0x45, 0x45, 0x45, 0x39 },
+	{ 0x3c, 0x4a, 0x49, 0x49, 0x30 }, { 0x01, 0x71, 0x09, 0x05, 0x03 },
+	{ 0x36, 0x49, 0x49, 0x49, 0x36 }, { 0x06, 0x49, 0x49, 0x29, 0x1e },
+	{ 0x00, 0x36, 0x36, 0x00, 0x00 }, { 0x00, 0x56, 0x36, 0x00, 0x00 },
+	{ 0x08, 0x14, 0x22, 0x41, 0x00 }, { 0x14, 0x14, 0x14, 0x14, 0x14 },
+	{ 0x00, 0x41, 0x22, 0x14, 0x08 }, { 0x02, 0x01, 0x51, 0x09, 0x06 },
+	{ 0x32, 0x49, 0x79, 0x41, 0x3e }, { 0x7e, 0x11, 0x11, 0x11, 0x7e },
+	{ 0x7f, 0x49, 0x49, 0x49, 0x36 }, { 0x3e, 0x41, 0x41, 0x41, 0x22 },
+	{ 0x7f, 0x41, 0x41, 0x22, 0x1c }, { 0x7f, 0x49, 0x49, 0x49, 0x41 },
+	{ 0x7f, 0x09, 0x09, 0x01, 0x01 }, { 0x3e, 0x41, 0x41, 0x51, 0x32 },
+	{ 0x7f, 0x08, 0x08, 0x08, 0x7f }, { 0x00, 0x41, 0x7f, 0x41, 0x00 },
+	{ 0x20, 0x40, 0x41, 0x3f, 0x01 }, { 0x7f, 0x08, 0x14, 0x22, 0x41 },
+	{ 0x7f, 0x40, 0x40, 0x40, 0x40 }, { 0x7f, 0x02, 0x04, 0x02, 0x7f },
+	{ 0x7f, 0x04, 0x08, 0x10, 0x7f }, { 0x3e, 0x41, 0x41, 0x41, 0x3e },
+	{ 0x7f, 0x09, 0x09, 0x09, 0x06 }, { 0x3e, 0x41, 0x51, 0x21, 0x5e },
+	{ 0x7f, 0x09, 0x19, 0x29, 0x46 }, { 0x46, 0x49, 0x49, 0x49, 0x31 },
+	{ 0x01, 0x01, 0x7f, 0x01, 0x01 }, { 0x3f, 0x40, 0x40, 0x40, 0x3f },
+	{ 0x1f, 0x20, 0x40, 0x20, 0x1f }, { 0x7f, 0x20, 0x18, 0x20, 0x7f },
+	{ 0x63, 0x14, 0x08, 0x14, 0x63 }, { 0x03, 0x04, 0x78, 0x04, 0x03 },
+	{ 0x61, 0x51, 0x49, 0x45, 0x43 }, { 0x00, 0x7f, 0x41, 0x41, 0x00 },
+	{ 0x02, 0x04, 0x08, 0x10, 0x20 }, { 0x00, 0x41, 0x41, 0x7f, 0x00 },
+	{ 0x04, 0x02, 0x01, 0x02, 0x04 }, { 0x40, 0x40, 0x40, 0x40, 0x40 },
+	{ 0x00, 0x01, 0x02, 0x04, 0x00 }, { 0x20, 0x54, 0x54, 0x54, 0x78 },
+	{ 0x7f, 0x48, 0x44, 0x44, 0x38 }, { 0x38, 0x44, 0x44, 0x44, 0x20 },
+	{ 0x38, 0x44, 0x44, 0x48, 0x7f }, { 0x38, 0x54, 0x54, 0x54, 0x18 },
+	{ 0x08, 0x7e, 0x09, 0x01, 0x02 }, { 0x08, 0x14, 0x54, 0x54, 0x3c },
+	{ 0x7f, 0x08, 0x04, 0x04, 0x78 }, { 0x00, 0x44, 0x7d, 0x40, 0x00 },
+	{ 0x20, 0x40, 0x44, 0x3d, 0x00 }, { 0x00, 0x7f, 0x10, 0x28, 0x44 },
+	{ 0x00, 0x41, 0x7f, 0x40, 0x00 }, { 0x7c, 0x04, 0x18, 0x04, 0x78 },
+	{ 0x7c, 0x08, 0x04, 0x04, 0x78 }, { 0x38, 0x44, 0x44, 0x44, 0x38 },
+	{ 0x7c, 0x14, 0x14, 0x14, 0x08 }, { 0x08, 0x14, 0x14, 0x18, 0x7c },
+	{ 0x7c, 0x08, 0x04, 0x04, 0x08 }, { 0x48, 0x54, 0x54, 0x54, 0x20 },
+	{ 0x04, 0x3f, 0x44, 0x40, 0x20 }, { 0x3c, 0x40, 0x40, 0x20, 0x7c },
+	{ 0x1c, 0x20, 0x40, 0x20, 0x1c }, { 0x3c, 0x40, 0x30, 0x40, 0x3c },
+	{ 0x44, 0x28, 0x10, 0x28, 0x44 }, { 0x0c, 0x50, 0x50, 0x50, 0x3c },
+	{ 0x44, 0x64, 0x54, 0x4c, 0x44 }, { 0x00, 0x08, 0x36, 0x41, 0x00 },
+	{ 0x00, 0x00, 0x7f, 0x00, 0x00 }, { 0x00, 0x41, 0x36, 0x08, 0x00 },
+	{ 0x02, 0x01, 0x02, 0x04, 0x02 },
+};
+
+
+static inline unsigned div255(unsigned x)
+{
+	x += 128;
+
+	return (x + (x >> 8)) >> 8;
+}
+
+/* Blend n bytes of a premultiplied layer row over dst. */
+static inline void blend_bytes(unsigned char *dst, const unsigned char *color,
+				const unsigned char *alpha, unsigned n)
+{
+	unsigned v;
+
+	while (n--) {
+		v = *color++ + div255(*dst * (255 - *alpha++));
+		*dst++ = v > 255 ? 255 : v;
+	}
+}
+
+#if defined(__SSE2__)
+
+static void blend_row(unsigned char *dst, const unsigned char *color,
+				const unsigned char *alpha, unsigned n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i ones = _mm_set1_epi8((char)0xff);
+	const __m128i round = _mm_set1_epi16(128);
+	__m128i d, inv, lo, hi;
+
+	for (; n >= 16; n -= 16, dst += 16, color += 16, alpha += 16) {
+		d = _mm_loadu_si128((const __m128i *)dst);
+		inv = _mm_xor_si128(_mm_loadu_si128((const __m128i *)alpha),
+									ones);
+
+		lo = _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero),
+					_mm_unpacklo_epi8(inv, zero));
+		hi = _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero),
+					_mm_unpackhi_epi8(inv, zero));
+		lo = _mm_add_epi16(lo, round);
+		hi = _mm_add_epi16(hi, round);
+		lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+		hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+
+		d = _mm_adds_epu8(_mm_packus_epi16(lo, hi),
+				_mm_loadu_si128((const __m128i *)color));
+		_mm_storeu_si128((__m128i *)dst, d);
+	}
+
+	blend_bytes(dst, color, alpha, n);
+}
+
+#elif defined(__ARM_NEON__)
+
+static void blend_row(unsigned char *dst, const unsigned char *color,
+				const unsigned char *alpha, unsigned n)
+{
+	uint8x16_t d, inv;
+	uint16x8_t lo, hi;
+
+	for (; n >= 16; n -= 16, dst += 16, color += 16, alpha += 16) {
+		d = vld1q_u8(dst);
+		inv = vmvnq_u8(vld1q_u8(alpha));
+
+		lo = vmull_u8(vget_low_u8(d), vget_low_u8(inv));
+		hi = vmull_u8(vget_high_u8(d), vget_high_u8(inv));
+
+		/* exact division by 255 with rounding */
+		d = vcombine_u8(vraddhn_u16(lo, vrshrq_n_u16(lo, 8)),
+				vraddhn_u16(hi, vrshrq_n_u16(hi, 8)));
+
+		vst1q_u8(dst, vqaddq_u8(d, vld1q_u8(color)));
+	}
+
+	blend_bytes(dst, color, alpha, n);
+}
+
+#else
+
+static void blend_row(unsigned char *dst, const unsigned char *color,
+				const unsigned char *alpha, unsigned n)
+{
+	blend_bytes(dst, color, alpha, n);
+}
+
+#endif
+
+static void layer_free(struct osd_layer *layer)
+{
+	free(layer->color);
+	free(layer->alpha);
+	free(layer->span);
+	memset(layer, 0, sizeof(*layer));
+}
+
+static int layer_alloc(struct osd *osd, struct osd_layer *layer,
+					unsigned width, unsigned height)
+{
+	if (osd->format == OSD_YUYV)
+		width = (width + 1) & ~1U;
+
+	if (layer->width == width && layer->height == height)
+		return 0;
+
+	layer_free(layer);
+
+	layer->width = width;
+	layer->height = height;
+	layer->stride = width * osd->bpp;
+	layer->color = (unsigned char *)calloc(height, layer->stride);
+	layer->alpha = (unsigned char *)calloc(height, layer->stride);
+	layer->span = (unsigned short *)calloc(2 * height,
+						sizeof(*layer->span));
+	if (!layer->color || !layer->alpha || !layer->span) {
+		layer_free(layer);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Find the covered part of each row. */
+static void layer_spans(struct osd_layer *layer)
+{
+	const unsigned char *a = layer->alpha;
+	unsigned first, end;
+	unsigned x, y;
+
+	for (y = 0; y < layer->height; ++y, a += layer->stride) {
+		first = layer->stride;
+		end = 0;
+		for (x = 0; x < layer->stride; ++x) {
+			if (a[x]) {
+				if (x < first)
+					first = x;
+				end = x + 1;
+			}
+		}
+		if (first > end)
+			first = end;
+		layer->span[2 * y] = first;
+		layer->span[2 * y + 1] = end;
+	}
+}
+
+/*
+ * Fill a layer from non-premultiplied ARGB pixels of the same size.
+ */
+static void layer_fill(struct osd *osd, struct osd_layer *layer,
+			const uint32_t *argb, unsigned width, unsigned height,
+			unsigned stride)
+{
+	unsigned char *c, *a;
+	int r[2], g[2], b[2];
+	unsigned al[2];
+	int yy[2], u, v;
+	uint32_t p;
+	unsigned x, y, i;
+
+	memset(layer->color, 0, layer->stride * layer->height);
+	memset(layer->alpha, 0, layer->stride * layer->height);
+
+	for (y = 0; y < height; ++y, argb += stride) {
+		c = layer->color + y * layer->stride;
+		a = layer->alpha + y * layer->stride;
+
+		if (osd->format == OSD_XRGB8888) {
+			for (x = 0; x < width; ++x, c += 4, a += 4) {
+				p = argb[x];
+				al[0] = p >> 24;
+				c[0] = div255((p & 0xff) * al[0]);
+				c[1] = div255((p >> 8 & 0xff) * al[0]);
+				c[2] = div255((p >> 16 & 0xff) * al[0]);
+				c[3] = al[0];
+				a[0] = a[1] = a[2] = a[3] = al[0];
+			}
+			continue;
+		}
+
+		for (x = 0; x < width; x += 2, c += 4, a += 4) {
+			for (i = 0; i < 2; ++i) {
+				p = x + i < width ? argb[x + i] : 0;
+				al[i] = p >> 24;
+				r[i] = p >> 16 & 0xff;
+				g[i] = p >> 8 & 0xff;
+				b[i] = p & 0xff;
+				yy[i] = ((66 * r[i] + 129 * g[i] + 25 * b[i] +
+							128) >> 8) + 16;
+			}
+
+			/* alpha-weighted chroma of the pair */
+			u = v = 0;
+			for (i = 0; i < 2; ++i) {
+				u += (((-38 * r[i] - 74 * g[i] + 112 * b[i] +
+						128) >> 8) + 128) * al[i];
+				v += (((112 * r[i] - 94 * g[i] - 18 * b[i] +
+						128) >> 8) + 128) * al[i];
+			}
+
+			c[0] = div255(yy[0] * al[0]);
+			c[1] = div255(u / 2);
+			c[2] = div255(yy[1] * al[1]);
+			c[3] = div255(v / 2);
+			a[0] = al[0];
+			a[1] = a[3] = (al[0] + al[1] + 1) / 2;
+			a[2] = al[1];
+		}
+	}
+
+	layer_spans(layer);
+}
+
+/*
+ * Rasterise the font, scaled and outlined, into one row of glyphs.
+ */
+static int build_glyphs(struct osd *osd)
+{
+	const unsigned width = GLYPH_WIDTH * FONT_COUNT;
+	uint32_t *argb;
+	unsigned ch, col, row;
+	unsigned x, y;
+	int dx, dy;
+
+	if (layer_alloc(osd, &osd->glyphs, width, GLYPH_HEIGHT))
+		return -1;
+
+	argb = (uint32_t *)calloc(width * GLYPH_HEIGHT, sizeof(*argb));
+	if (!argb)
+		return -1;
+
+	for (ch = 0; ch < FONT_COUNT; ++ch) {
+		for (col = 0; col < FONT_WIDTH; ++col) {
+			for (row = 0; row < FONT_HEIGHT; ++row) {
+				if (!(font[ch][col] & (1 << row)))
+					continue;
+
+				x = ch * GLYPH_WIDTH + 1 + col * FONT_SCALE;
+				y = 1 + row * FONT_SCALE;
+
+				/* outline around the scaled dot */
+				for (dy = -1; dy <= FONT_SCALE; ++dy) {
+					for (dx = -1; dx <= FONT_SCALE; ++dx) {
+						uint32_t *p = &argb[(y + dy) *
+								width + x + dx];
+						if (!*p)
+							*p = OUTLINE_COLOR;
+					}
+				}
+			}
+		}
+
+		for (col = 0; col < FONT_WIDTH; ++col) {
+			for (row = 0; row < FONT_HEIGHT; ++row) {
+				if (!(font[ch][col] & (1 << row)))
+					continue;
+
+				x = ch * GLYPH_WIDTH + 1 + col * FONT_SCALE;
+				y = 1 + row * FONT_SCALE;
+
+				for (dy = 0; dy < FONT_SCALE; ++dy) {
+					for (dx = 0; dx < FONT_SCALE; ++dx)
+						argb[(y + dy) * width + x + dx] =
+								TEXT_COLOR;
+				}
+			}
+		}
+	}
+
+	layer_fill(osd, &osd->glyphs, argb, width, GLYPH_HEIGHT, width);
+	free(argb);
+
+	return 0;
+}
+
+int osd_init(struct osd *osd, enum osd_format format, unsigned width,
+							unsigned height)
+{
+	memset(osd, 0, sizeof(*osd));
+	osd->format = format;
+	osd->width = width;
+	osd->height = height;
+	osd->bpp = format == OSD_YUYV ? 2 : 4;
+
+	if (build_glyphs(osd)) {
+		osd_free(osd);
+		return -1;
+	}
+
+	return 0;
+}
+
+void osd_free(struct osd *osd)
+{
+	unsigned i;
+
+	if (osd->frames) {
+		printf("%s - %lu frames, cost avg %lld max %u us\n", __func__,
+				osd->frames, osd->cost / osd->frames / 1000,
+				osd->cost_max / 1000);
+	}
+
+	for (i = 0; i < OSD_ITEMS_MAX; ++i)
+		layer_free(&osd->items[i].layer);
+	layer_free(&osd->glyphs);
+}
+
+/*
+ * Show a line of text. The layer is only rebuilt when the text changes.
+ */
+int osd_text(struct osd *osd, unsigned item, int x, int y, const char *text)
+{
+	struct osd_item *it = &osd->items[item];
+	struct osd_layer *layer = &it->layer;
+	const struct osd_layer *glyphs = &osd->glyphs;
+	const unsigned glyph = GLYPH_WIDTH * osd->bpp;
+	size_t len = strlen(text);
+	unsigned i, row;
+	unsigned ch;
+
+	it->x = x;
+	it->y = y;
+	it->visible = true;
+
+	if (len >= OSD_TEXT_MAX)
+		len = OSD_TEXT_MAX - 1;
+	if (!strncmp(it->text, text, len) && !it->text[len] && layer->color)
+		return 0;
+
+	if (layer_alloc(osd, layer, len * GLYPH_WIDTH, GLYPH_HEIGHT))
+		return -1;
+
+	memcpy(it->text, text, len);
+	it->text[len] = '\0';
+
+	for (i = 0; i < len; ++i) {
+		ch = (unsigned char)text[i] - FONT_FIRST;
+		if (ch >= FONT_COUNT)
+			ch = '?' - FONT_FIRST;
+
+		for (row = 0; row < GLYPH_HEIGHT; ++row) {
+			memcpy(layer->color + row * layer->stride + i * glyph,
+				glyphs->color + row * glyphs->stride +
+							ch * glyph, glyph);
+			memcpy(layer->alpha + row * layer->stride + i * glyph,
+				glyphs->alpha + row * glyphs->stride +
+							ch * glyph, glyph);
+		}
+	}
+
+	layer_spans(layer);
+
+	return 0;
+}
+
+/*
+ * Show an icon given as non-premultiplied ARGB32 pixels.
+ */
+int osd_icon(struct osd *osd, unsigned item, int x, int y,
+			const uint32_t *argb, unsigned width, unsigned height,
+			unsigned stride)
+{
+	struct osd_item *it = &osd->items[item];
+
+	if (layer_alloc(osd, &it->layer, width, height))
+		return -1;
+
+	layer_fill(osd, &it->layer, argb, width, height, stride);
+
+	it->text[0] = '\0';
+	it->x = x;
+	it->y = y;
+	it->visible = true;
+
+	return 0;
+}
+
+void osd_show(struct osd *osd, unsigned item, bool visible)
+{
+	osd->items[item].visible = visible && osd->items[item].layer.color;
+}
+
+static void blend_item(const struct osd *osd, const struct osd_item *it,
+					unsigned char *frame, unsigned stride)
+{
+	const struct osd_layer *layer = &it->layer;
+	unsigned width = layer->width;
+	unsigned height = layer->height;
+	unsigned first, end, limit;
+	unsigned char *dst;
+	unsigned x, y, row;
+
+	if (width > osd->width || height > osd->height)
+		return;
+
+	x = it->x >= 0 ? it->x : osd->width - width + it->x + 1;
+	y = it->y >= 0 ? it->y : osd->height - height + it->y + 1;
+	if (osd->format == OSD_YUYV)
+		x &= ~1U;
+
+	if (x + width > osd->width)
+		x = osd->width - width;
+	if (y + height > osd->height)
+		y = osd->height - height;
+
+	dst = frame + y * stride + x * osd->bpp;
+	limit = width * osd->bpp;
+
+	for (row = 0; row < height; ++row, dst += stride) {
+		first = layer->span[2 * row];
+		end = layer->span[2 * row + 1];
+		if (end > limit)
+			end = limit;
+		if (first >= end)
+			continue;
+
+		blend_row(dst + first,
+			layer->color + row * layer->stride + first,
+			layer->alpha + row * layer->stride + first,
+			end - first);
+	}
+}
+
+/*
+ * Composite the visible items into a frame.
+ */
+void osd_blend(struct osd *osd, void *frame, unsigned stride)
+{
+	long long start, cost;
+	unsigned i;
+
+	start = now_ns();
+
+	for (i = 0; i < OSD_ITEMS_MAX; ++i) {
+		if (osd->items[i].visible)
+			blend_item(osd, &osd->items[i],
+					(unsigned char *)frame, stride);
+	}
+
+	cost = now_ns() - start;
+	++osd->frames;
+	osd->cost += cost;
+	if (cost > osd->cost_max)
+		osd->cost_max = cost;
+}
@@ -0,0 +1,70 @@
+/*
+ * osd.h -- on-screen display burned into outgoing frames
+ *
+ * Author: Johan Hovold <jhovold@gmail.com>
+ */
+
+#ifndef OSD_H
+#define OSD_H
+
+#include <stdint.h>
+
+
+#define OSD_ITEMS_MAX	8
+#define OSD_TEXT_MAX	64
+
+enum osd_format {
+	OSD_YUYV,
+	OSD_XRGB8888
+};
+
+/*
+ * Pixels in the frame format, premultiplied, with an alpha value for every
+ * byte. Only the bytes between the first and last covered ones of each row
+ * are blended.
+ */
+struct osd_layer {
+	unsigned char *color;
+	unsigned char *alpha;
+	unsigned width;
+	unsigned height;
+	unsigned stride;	/* bytes */
+	unsigned short *span;	/* first and end byte per row */
+};
+
+struct osd_item {
+	bool visible;
+	int x;			/* negative from the right edge */
+	int y;			/* negative from the bottom */
+	struct osd_layer layer;
+	char text[OSD_TEXT_MAX];
+};
+
+struct osd {
+	enum osd_format format;
+	unsigned width;		/* frame */
+	unsigned height;
+	unsigned bpp;		/* bytes per pixel */
+
+	struct osd_layer glyphs;
+	struct osd_item items[OSD_ITEMS_MAX];
+
+	unsigned long frames;
+	long long cost;		/* ns, total */
+	unsigned cost_max;	/* ns */
+};
+
+int osd_init(struct osd *osd, enum osd_format format, unsigned width,
+							unsigned height);
+void osd_free(struct osd *osd);
+
+int osd_text(struct osd *osd, unsigned item, int x, int y,
+							const char *text);
+int osd_icon(struct osd *osd, unsigned item, int x, int y,
+			const uint32_t *argb, unsigned width, unsigned height,
+			unsigned stride);
+void osd_show(struct osd *osd, unsigned item, bool visible);
+
+void osd_blend(struct osd *osd, void *frame, unsigned stride);
+
+#endif	/* OSD_H */
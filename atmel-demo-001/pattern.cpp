@@ -0,0 +1,346 @@
+/*
+ * pattern.cpp -- test-pattern frame source
+ *
+ * Generates frames in place of the capture device, paced by a timer at a
+ * fixed rate or as fast as the display path takes them. From the top,
+ * every frame has
+ *
+ *	colour bars	eight 75% bars, white to black, over two thirds
+ *	a gradient	a luma ramp scrolling left by a few pixels a frame
+ *	a counter	the frame sequence number as 32 black (0) or white
+ *			(1) blocks, most significant bit first, over the
+ *			bottom eighth
+ *
+ * so that sinks can check both the order and the content of what they get,
+ * and a frame can be told from its number alone. Ticks missed while the
+ * worker was busy are skipped, leaving gaps in the sequence as a sensor
+ * would.
+ *
+ * Frames are drawn into buffers that are handed out like capture buffers,
+ * and a buffer is only drawn into again once it has been released. Pixel
+ * pairs for the bars and the counter are worked out when opening, and
+ * rows are filled with 128-bit stores of them and then replicated.
+ *
+ * Author: Johan Hovold <jhovold@gmail.com>
+ */
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "pattern.h"
+
+
+#define PATTERN_SCROLL	2	/* pixel pairs a frame */
+
+/* 75% bars in BT.601 limited range: Y, Cb, Cr */
+static const unsigned char bar_colors[PATTERN_BARS][3] = {
+	{ 180, 128, 128 },	/* white */
+	{ 162,  44, 142 },	/* yellow */
+	{ 131, 156,  44 },	/* cyan */
+	{ 112,  72,  58 },	/* green */
+	{  84, 184, 198 },	/* magenta */
+	{  65, 100, 212 },	/* red */
+	{  35, 212, 114 },	/* blue */
+	{  16, 128, 128 },	/* black */
+};
+
+
+#if defined(__SSE2__)
+
+static void fill_pairs(unsigned char *dst, uint32_t pair, unsigned count)
+{
+	const __m128i v = _mm_set1_epi32(pair);
+
+	for (; count >= 4; count -= 4, dst += 16)
+		_mm_storeu_si128((__m128i *)dst, v);
+
+	for (; count; --count, dst += 4)
+		memcpy(dst, &pair, 4);
+}
+
+#elif defined(__ARM_NEON__)
+
+static void fill_pairs(unsigned char *dst, uint32_t pair, unsigned count)
+{
+	const uint8x16_t v = vreinterpretq_u8_u32(vdupq_n_u32(pair));
+
+	for (; count >= 4; count -= 4, dst += 16)
+		vst1q_u8(dst, v);
+
+	for (; count; --count, dst += 4)
+		memcpy(dst, &pair, 4);
+}
+
+#else
+
+static void fill_pairs(unsigned char *dst, uint32_t pair, unsigned count)
+{
+	for (; count; --count, dst += 4)
+		memcpy(dst, &pair, 4);
+}
+
+#endif
+
+/* Pack two pixels of the same colour in the byte order of the fourcc. */
+static uint32_t pack_pair(__u32 fourcc, unsigned char y, unsigned char u,
+							unsigned char v)
+{
+	unsigned char b[4];
+	uint32_t pair;
+
+	if (fourcc == V4L2_PIX_FMT_UYVY) {
+		b[0] = u;
+		b[1] = y;
+		b[2] = v;
+		b[3] = y;
+	} else {
+		b[0] = y;
+		b[1] = u;
+		b[2] = y;
+		b[3] = v;
+	}
+	memcpy(&pair, b, 4);
+
+	return pair;
+}
+
+static void draw_frame(const struct pattern_source *ps, unsigned char *dst,
+							unsigned sequence)
+{
+	unsigned pairs = ps->width / 2;
+	unsigned bit_pairs = pairs / PATTERN_BITS;
+	size_t line = ps->width * 2;
+	unsigned char *row;
+	unsigned offset;
+	unsigned b, x, end, y;
+
+	for (b = 0; b < PATTERN_BARS; ++b) {
+		x = b * pairs / PATTERN_BARS;
+		end = (b + 1) * pairs / PATTERN_BARS;
+		fill_pairs(dst + x * 4, ps->bars[b], end - x);
+	}
+	for (y = 1; y < ps->gradient_row; ++y)
+		memcpy(dst + y * ps->stride, dst, line);
+
+	offset = sequence * PATTERN_SCROLL % pairs;
+	for (y = ps->gradient_row; y < ps->counter_row; ++y)
+		memcpy(dst + y * ps->stride, ps->ramp + offset * 4, line);
+
+	row = dst + ps->counter_row * ps->stride;
+	for (b = 0; b < PATTERN_BITS; ++b) {
+		fill_pairs(row + b * bit_pairs * 4,
+				(sequence >> (PATTERN_BITS - 1 - b)) & 1 ?
+					ps->white : ps->black, bit_pairs);
+	}
+	fill_pairs(row + PATTERN_BITS * bit_pairs * 4, ps->black,
+					pairs - PATTERN_BITS * bit_pairs);
+	for (y = ps->counter_row + 1; y < ps->height; ++y)
+		memcpy(dst + y * ps->stride, row, line);
+}
+
+static void pattern_arm(struct pattern_source *ps)
+{
+	struct itimerspec its;
+	long long due;
+
+	if (ps->rate)
+		due = ps->start + ps->sequence * 1000000000LL / ps->rate;
+	else
+		due = 1;	/* in the past, as zero would disarm */
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = due / 1000000000LL;
+	its.it_value.tv_nsec = due % 1000000000LL;
+
+	if (timerfd_settime(ps->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) == -1)
+		die_errno("timerfd_settime");
+}
+
+/*
+ * Set up a source of width x height frames in a packed 4:2:2 fourcc, drawn
+ * into count buffers.
+ */
+int pattern_open(struct pattern_source *ps, unsigned width, unsigned height,
+			__u32 fourcc, unsigned rate, unsigned count)
+{
+	unsigned x, y;
+	unsigned char *p;
+	unsigned i;
+
+	memset(ps, 0, sizeof(*ps));
+	ps->timer_fd = -1;
+
+	if (fourcc != V4L2_PIX_FMT_YUYV && fourcc != V4L2_PIX_FMT_UYVY) {
+		err("%s: unsupported fourcc\n", __func__);
+		return -1;
+	}
+
+	if (width < 4 * PATTERN_BITS || width % 2 || height < 3) {
+		err("%s: %ux%u is too small\n", __func__, width, height);
+		return -1;
+	}
+
+	if (!count || count > PATTERN_BUFFERS_MAX) {
+		err("%s: %u buffers\n", __func__, count);
+		return -1;
+	}
+
+	ps->width = width;
+	ps->height = height;
+	ps->stride = width * 2;
+	ps->frame_size = (size_t)ps->stride * height;
+	ps->fourcc = fourcc;
+	ps->rate = rate;
+
+	ps->counter_row = height - (height >= 8 ? height / 8 : 1);
+	ps->gradient_row = height * 2 / 3;
+	if (ps->gradient_row > ps->counter_row)
+		ps->gradient_row = ps->counter_row;
+
+	for (i = 0; i < PATTERN_BARS; ++i) {
+		ps->bars[i] = pack_pair(fourcc, bar_colors[i][0],
+					bar_colors[i][1], bar_colors[i][2]);
+	}
+	ps->black = pack_pair(fourcc, 16, 128, 128);
+	ps->white = pack_pair(fourcc, 235, 128, 128);
+
+	ps->ramp = (unsigned char *)malloc(2 * ps->stride);
+	if (!ps->ramp)
+		return -1;
+
+	p = ps->ramp;
+	for (x = 0; x < 2 * width; x += 2, p += 4) {
+		y = 16 + 219 * (x % width) / (width - 1);
+		memcpy(p, &ps->black, 4);
+		p[fourcc == V4L2_PIX_FMT_UYVY ? 1 : 0] = y;
+		y = 16 + 219 * ((x + 1) % width) / (width - 1);
+		p[fourcc == V4L2_PIX_FMT_UYVY ? 3 : 2] = y;
+	}
+
+	for (i = 0; i < count; ++i) {
+		ps->buffers[i] = (unsigned char *)malloc(ps->frame_size);
+		if (!ps->buffers[i])
+			goto err_free;
+		ps->buffer_count = i + 1;
+	}
+
+	ps->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK |
+								TFD_CLOEXEC);
+	if (ps->timer_fd < 0) {
+		err_errno("timerfd_create");
+		goto err_free;
+	}
+
+	return 0;
+
+err_free:
+	for (i = 0; i < ps->buffer_count; ++i)
+		free(ps->buffers[i]);
+	free(ps->ramp);
+
+	return -1;
+}
+
+void pattern_close(struct pattern_source *ps)
+{
+	long long elapsed = ps->end - ps->begin;
+	unsigned i;
+
+	if (ps->frames > 1 && elapsed > 0) {
+		printf("%s - %lu frames in %lld ms, %llu.%llu fps, %lu dropped, "
+				"%lu late, draw avg %lld max %u us\n", __func__,
+				ps->frames, elapsed / 1000000,
+				(ps->frames - 1) * 1000000000ULL / elapsed,
+				(ps->frames - 1) * 10000000000ULL / elapsed % 10,
+				ps->dropped, ps->late,
+				ps->cost / ps->frames / 1000,
+				ps->cost_max / 1000);
+	}
+
+	close(ps->timer_fd);
+	for (i = 0; i < ps->buffer_count; ++i)
+		free(ps->buffers[i]);
+	free(ps->ramp);
+}
+
+/*
+ * (Re)start pacing, with the next frame due immediately and numbering
+ * going on from where it stopped.
+ */
+void pattern_start(struct pattern_source *ps)
+{
+	long long now = now_ns();
+
+	ps->start = now;
+	if (ps->rate)
+		ps->start -= ps->sequence * 1000000000LL / ps->rate;
+
+	if (!ps->frames)
+		ps->begin = now;
+
+	pattern_arm(ps);
+}
+
+/*
+ * Draw the next frame into buffer slot once the timer has expired. Returns
+ * 1 if a frame was drawn, and 0 if none is due yet or, with slot negative,
+ * there was no free buffer to draw it in.
+ */
+int pattern_next(struct pattern_source *ps, int slot,
+					struct video_frame *frame)
+{
+	uint64_t expirations;
+	long long now;
+	unsigned sequence, cost;
+
+	if (read(ps->timer_fd, &expirations, sizeof(expirations)) < 0)
+		return 0;
+
+	now = now_ns();
+
+	if (ps->rate) {
+		sequence = (now - ps->start) * ps->rate / 1000000000LL;
+		if (sequence > ps->sequence) {
+			ps->late += sequence - ps->sequence;
+			ps->sequence = sequence;
+		}
+	}
+
+	sequence = ps->sequence++;
+	pattern_arm(ps);
+
+	if (slot < 0) {
+		++ps->dropped;
+		return 0;
+	}
+
+	draw_frame(ps, ps->buffers[slot], sequence);
+
+	frame->capture = slot;
+	frame->decoded = -1;
+	frame->data = ps->buffers[slot];
+	frame->size = ps->frame_size;
+	frame->dmabuf = -1;
+	frame->sequence = sequence;
+	if (ps->rate)
+		frame->timestamp = ps->start + sequence * 1000000000LL /
+								ps->rate;
+	else
+		frame->timestamp = now;
+
+	ps->end = now_ns();
+	cost = ps->end - now;
+	ps->cost += cost;
+	if (cost > ps->cost_max)
+		ps->cost_max = cost;
+	++ps->frames;
+
+	return 1;
+}
@@ -0,0 +1,62 @@
+/*
+ * pattern.h -- test-pattern frame source
+ *
+ * Author: Johan Hovold <jhovold@gmail.com>
+ */
+
+#ifndef PATTERN_H
+#define PATTERN_H
+
+#include <stdint.h>
+
+#include <linux/videodev2.h>
+
+#include "frame.h"
+
+
+#define PATTERN_BARS		8
+#define PATTERN_BITS		32	/* of the frame counter */
+#define PATTERN_BUFFERS_MAX	VIDEO_MAX_FRAME
+
+struct pattern_source {
+	unsigned width;
+	unsigned height;
+	unsigned stride;
+	size_t frame_size;
+	__u32 fourcc;		/* packed 4:2:2 */
+	unsigned rate;		/* Hz, zero for max */
+
+	/* rows where the gradient and the counter start */
+	unsigned gradient_row;
+	unsigned counter_row;
+
+	/* pixel pairs, in the byte order of the fourcc */
+	uint32_t bars[PATTERN_BARS];
+	uint32_t black;
+	uint32_t white;
+	unsigned char *ramp;	/* gradient, two widths for scrolling */
+
+	unsigned char *buffers[PATTERN_BUFFERS_MAX];
+	unsigned buffer_count;
+
+	int timer_fd;
+	long long start;	/* time of frame zero */
+	unsigned sequence;	/* of the next frame */
+
+	unsigned long frames;
+	unsigned long dropped;	/* no free buffer */
+	unsigned long late;	/* ticks passed before drawing */
+	long long cost;		/* ns, total */
+	unsigned cost_max;	/* ns */
+	long long begin;
+	long long end;
+};
+
+int pattern_open(struct pattern_source *ps, unsigned width, unsigned height,
+			__u32 fourcc, unsigned rate, unsigned count);
+void pattern_close(struct pattern_source *ps);
+void pattern_start(struct pattern_source *ps);
+int pattern_next(struct pattern_source *ps, int slot,
+					struct video_frame *frame);
+
+#endif	/* PATTERN_H */
@@ -0,0 +1,560 @@
+/*
+ * prerecord.cpp -- pre-event history of the live stream
+ *
+ * The last seconds of video are kept in a ring in memory, so that an event
+ * can be written out together with what led up to it. Frames reach the
+ * history through a frame tap, like the frames recorded, so that keeping
+ * it costs the video worker a reference per frame. The history thread
+ * copies each frame into the ring, compressed to a JPEG first if a
+ * quality is given, and gives it back. The oldest frames are dropped when
+ * they are older than the history, or to make room.
+ *
+ * A trigger, by prerecord_trigger(), which is safe in a signal handler, or
+ * by any datagram on the trigger socket, has a second thread write out
+ * the history followed by the frames of the next seconds, while the
+ * history keeps being filled. Frames not yet written are never dropped
+ * for room, so a writer that falls behind loses new frames instead.
+ * Triggers during an event extend it.
+ *
+ * Raw events have a stream header per frame and can be replayed, while
+ * compressed ones are MJPEG streams.
+ *
+ * Author: Johan Hovold <jhovold@gmail.com>
+ */
+
+#include <cstdio>
+#include <endian.h>
+#include <limits.h>
+#include <linux/videodev2.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "prerecord.h"
+#include "stream.h"
+
+
+#define PRERECORD_FILE_BUFFER	(256 * 1024)
+
+
+static void kick(int fd)
+{
+	uint64_t event = 1;
+
+	if (write(fd, &event, sizeof(event)) < 0 && errno != EAGAIN)
+		err_errno("eventfd");
+}
+
+static inline struct prerecord_entry *entry(struct prerecorder *pr,
+							unsigned long serial)
+{
+	return &pr->entries[(pr->first + serial - pr->first_serial) %
+							pr->entry_max];
+}
+
+/* Drop the oldest frame, unless it is still to be written. */
+static bool evict(struct prerecorder *pr)
+{
+	if (!pr->count)
+		return false;
+
+	if (pr->writing && pr->first_serial >= pr->write_next)
+		return false;
+
+	pr->first = (pr->first + 1) % pr->entry_max;
+	--pr->count;
+	++pr->first_serial;
+
+	return true;
+}
+
+/*
+ * Find room for size bytes after the newest frame, or at the start of the
+ * ring, dropping the oldest frames as needed.
+ */
+static bool reserve(struct prerecorder *pr, size_t size, size_t *offset)
+{
+	struct prerecord_entry *oldest, *newest;
+
+	if (size > pr->opts.memory)
+		return false;
+
+	for (;;) {
+		if (!pr->count) {
+			*offset = 0;
+			return true;
+		}
+
+		if (pr->count < pr->entry_max) {
+			oldest = &pr->entries[pr->first];
+			newest = entry(pr, pr->first_serial + pr->count - 1);
+
+			if (newest->offset >= oldest->offset) {
+				/* in use from oldest to head */
+				if (pr->opts.memory - pr->head >= size) {
+					*offset = pr->head;
+					return true;
+				}
+				if (oldest->offset >= size) {
+					*offset = 0;
+					return true;
+				}
+			} else if (oldest->offset - pr->head >= size) {
+				*offset = pr->head;
+				return true;
+			}
+		}
+
+		if (!evict(pr))
+			return false;
+	}
+}
+
+static void store(struct prerecorder *pr, const struct video_frame *frame,
+					const void *data, size_t size)
+{
+	struct prerecord_entry *e;
+	long long age;
+	size_t offset;
+	bool writing;
+
+	pthread_mutex_lock(&pr->lock);
+	if (!reserve(pr, size, &offset)) {
+		pthread_mutex_unlock(&pr->lock);
+		++pr->overruns;
+		return;
+	}
+	pthread_mutex_unlock(&pr->lock);
+
+	/* the writer only reads frames in the history */
+	memcpy(pr->ring + offset, data, size);
+
+	pthread_mutex_lock(&pr->lock);
+	e = entry(pr, pr->first_serial + pr->count);
+	e->offset = offset;
+	e->size = size;
+	e->sequence = frame->sequence;
+	e->timestamp = frame->timestamp;
+	++pr->count;
+	pr->head = offset + size;
+
+	age = pr->opts.seconds * 1000000000LL;
+	while (pr->count > 1 &&
+			frame->timestamp - pr->entries[pr->first].timestamp > age)
+		if (!evict(pr))
+			break;
+
+	writing = pr->writing;
+	pthread_mutex_unlock(&pr->lock);
+
+	if (writing)
+		kick(pr->wake_fd);
+
+	++pr->frames;
+	pr->stored += size;
+}
+
+static void *prerecord_thread(void *arg)
+{
+	struct prerecorder *pr = (struct prerecorder *)arg;
+	struct video_frame frame;
+	long long start, cost;
+	size_t size;
+
+	rt_thread_setup("prerecord", &pr->opts.rt);
+
+	while (tap_pop(&pr->tap, &frame)) {
+		start = now_ns();
+
+		if (pr->opts.quality) {
+			size = mjpeg_compress(&pr->enc, pr->scratch,
+					pr->scratch_size, frame.data,
+					pr->stride);
+			tap_done(&pr->tap, &frame);
+			if (size)
+				store(pr, &frame, pr->scratch, size);
+		} else {
+			size = (size_t)pr->stride * pr->height;
+			if (frame.size < size)
+				size = 0;
+			if (size)
+				store(pr, &frame, frame.data, size);
+			tap_done(&pr->tap, &frame);
+		}
+
+		if (!size)
+			++pr->failed;
+
+		cost = now_ns() - start;
+		pr->cost += cost;
+		if (cost > pr->cost_max)
+			pr->cost_max = cost;
+	}
+
+	return NULL;
+}
+
+/* Collect triggers from the eventfd and the socket. */
+static bool triggered(struct prerecorder *pr)
+{
+	uint64_t event;
+	char msg[64];
+	bool ret = false;
+
+	if (read(pr->trigger_fd, &event, sizeof(event)) > 0)
+		ret = true;
+
+	while (pr->sock_fd >= 0 && recv(pr->sock_fd, msg, sizeof(msg), 0) >= 0)
+		ret = true;
+
+	return ret;
+}
+
+static void wait_events(struct prerecorder *pr, int timeout)
+{
+	struct pollfd pfd[3];
+	uint64_t event;
+	nfds_t n = 0;
+
+	pfd[n].fd = pr->wake_fd;
+	pfd[n++].events = POLLIN;
+	pfd[n].fd = pr->trigger_fd;
+	pfd[n++].events = POLLIN;
+	if (pr->sock_fd >= 0) {
+		pfd[n].fd = pr->sock_fd;
+		pfd[n++].events = POLLIN;
+	}
+
+	if (poll(pfd, n, timeout) > 0 && (pfd[0].revents & POLLIN)) {
+		if (read(pr->wake_fd, &event, sizeof(event)) < 0)
+			err_errno("eventfd");
+	}
+}
+
+static int write_frame(struct prerecorder *pr, FILE *out,
+					const struct prerecord_entry *e)
+{
+	struct stream_header hdr;
+
+	if (!pr->opts.quality) {
+		hdr.magic = htobe32(STREAM_MAGIC);
+		hdr.sequence = htobe32(e->sequence);
+		hdr.timestamp = htobe64(e->timestamp);
+		hdr.fourcc = htobe32(V4L2_PIX_FMT_YUYV);
+		hdr.width = htobe16(pr->width);
+		hdr.height = htobe16(pr->height);
+		hdr.stride = htobe32(pr->stride);
+		hdr.size = htobe32(e->size);
+		hdr.offset = 0;
+		hdr.length = htobe32(e->size);
+
+		if (fwrite(&hdr, sizeof(hdr), 1, out) != 1)
+			return -1;
+	}
+
+	if (fwrite(pr->ring + e->offset, 1, e->size, out) != e->size)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Write out the history and the frames that follow until the post-event
+ * time after the last trigger has passed.
+ */
+static void write_event(struct prerecorder *pr)
+{
+	char path[PATH_MAX];
+	struct prerecord_entry e;
+	long long start, until, history_ms, flushed = 0;
+	unsigned long frames = 0, history;
+	long long now;
+	FILE *out;
+	bool stop, have;
+
+	snprintf(path, sizeof(path), "%s.%lu", pr->opts.path, ++pr->events);
+
+	out = fopen(path, "w");
+	if (!out) {
+		err_errno("%s", path);
+		++pr->errors;
+		return;
+	}
+	setvbuf(out, NULL, _IOFBF, PRERECORD_FILE_BUFFER);
+
+	start = now_ns();
+	until = start + pr->opts.post * 1000000000LL;
+
+	pthread_mutex_lock(&pr->lock);
+	pr->writing = true;
+	pr->write_next = pr->first_serial;
+	history = pr->count;
+	history_ms = history ? (start - pr->entries[pr->first].timestamp) /
+								1000000 : 0;
+	pthread_mutex_unlock(&pr->lock);
+
+	for (;;) {
+		if (triggered(pr))
+			until = now_ns() + pr->opts.post * 1000000000LL;
+
+		pthread_mutex_lock(&pr->lock);
+		stop = pr->stop;
+		have = pr->write_next < pr->first_serial + pr->count;
+		if (have)
+			e = *entry(pr, pr->write_next);
+		pthread_mutex_unlock(&pr->lock);
+
+		if (!have) {
+			now = now_ns();
+			if (stop || now >= until)
+				break;
+			wait_events(pr, (until - now) / 1000000 + 1);
+			continue;
+		}
+
+		if (write_frame(pr, out, &e)) {
+			err_errno("%s", path);
+			++pr->errors;
+			break;
+		}
+
+		pthread_mutex_lock(&pr->lock);
+		++pr->write_next;
+		pthread_mutex_unlock(&pr->lock);
+
+		if (++frames == history)
+			flushed = now_ns();
+	}
+
+	pthread_mutex_lock(&pr->lock);
+	pr->writing = false;
+	pthread_mutex_unlock(&pr->lock);
+
+	if (fclose(out)) {
+		err_errno("%s", path);
+		++pr->errors;
+	}
+
+	pr->written += frames;
+
+	printf("%s - %s: %lu frames, history of %lu frames (%lld ms) "
+			"written in %lld ms\n", __func__, path, frames,
+			history, history_ms,
+			flushed ? (flushed - start) / 1000000 : -1);
+}
+
+static void *prerecord_writer(void *arg)
+{
+	struct prerecorder *pr = (struct prerecorder *)arg;
+	bool stop;
+
+	rt_thread_setup("prerecord-write", &pr->opts.rt);
+
+	for (;;) {
+		pthread_mutex_lock(&pr->lock);
+		stop = pr->stop;
+		pthread_mutex_unlock(&pr->lock);
+
+		if (stop)
+			break;
+
+		if (triggered(pr))
+			write_event(pr);
+		else
+			wait_events(pr, -1);
+	}
+
+	return NULL;
+}
+
+static int open_trigger(struct prerecorder *pr)
+{
+	struct sockaddr_un sun;
+	const char *path = pr->opts.trigger;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		err("%s: socket path too long\n", path);
+		return -1;
+	}
+	strcpy(sun.sun_path, path);
+
+	pr->sock_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK |
+							SOCK_CLOEXEC, 0);
+	if (pr->sock_fd < 0) {
+		err_errno("socket");
+		return -1;
+	}
+
+	unlink(path);
+	if (bind(pr->sock_fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+		err_errno("%s", path);
+		close(pr->sock_fd);
+		pr->sock_fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Start keeping a history of width x height YUYV frames.
+ */
+int prerecord_start(struct prerecorder *pr,
+			const struct prerecord_options *opts,
+			unsigned width, unsigned height, unsigned stride)
+{
+	int ret;
+
+	memset(pr, 0, sizeof(*pr));
+	pr->opts = *opts;
+	pr->width = width;
+	pr->height = height;
+	pr->stride = stride;
+	pr->trigger_fd = -1;
+	pr->sock_fd = -1;
+	pr->wake_fd = -1;
+
+	pr->entry_max = (opts->seconds + 1) * PRERECORD_RATE_MAX;
+	pr->entries = (struct prerecord_entry *)calloc(pr->entry_max,
+							sizeof(*pr->entries));
+	pr->ring = (unsigned char *)malloc(opts->memory);
+	if (!pr->entries || !pr->ring)
+		goto err_free;
+
+	/* commit the memory now rather than when an incident comes */
+	memset(pr->ring, 0, opts->memory);
+
+	if (opts->quality) {
+		pr->scratch_size = (size_t)stride * height;
+		pr->scratch = (unsigned char *)malloc(pr->scratch_size);
+		if (!pr->scratch)
+			goto err_free;
+		if (mjpeg_init(&pr->enc, width, height, opts->quality, true))
+			goto err_free;
+	}
+
+	pr->trigger_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	pr->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (pr->trigger_fd < 0 || pr->wake_fd < 0) {
+		err_errno("eventfd");
+		goto err_fds;
+	}
+
+	if (opts->trigger && open_trigger(pr))
+		goto err_fds;
+
+	if (tap_init(&pr->tap, opts->depth))
+		goto err_fds;
+
+	pthread_mutex_init(&pr->lock, NULL);
+
+	ret = pthread_create(&pr->thread, NULL, prerecord_thread, pr);
+	if (ret) {
+		errno = ret;
+		err_errno("pthread_create");
+		goto err_tap;
+	}
+
+	ret = pthread_create(&pr->writer, NULL, prerecord_writer, pr);
+	if (ret) {
+		errno = ret;
+		err_errno("pthread_create");
+		tap_stop(&pr->tap);
+		pthread_join(pr->thread, NULL);
+		goto err_tap;
+	}
+
+	return 0;
+
+err_tap:
+	pthread_mutex_destroy(&pr->lock);
+	tap_free(&pr->tap);
+err_fds:
+	if (pr->sock_fd >= 0) {
+		close(pr->sock_fd);
+		unlink(opts->trigger);
+	}
+	if (pr->trigger_fd >= 0)
+		close(pr->trigger_fd);
+	if (pr->wake_fd >= 0)
+		close(pr->wake_fd);
+	if (opts->quality && pr->scratch)
+		mjpeg_free(&pr->enc);
+err_free:
+	free(pr->scratch);
+	free(pr->ring);
+	free(pr->entries);
+
+	return -1;
+}
+
+/*
+ * Stop keeping the history once the history thread has given back all
+ * frames, which the caller must have reaped. An event being written is
+ * finished with the frames already kept.
+ */
+void prerecord_stop(struct prerecorder *pr)
+{
+	unsigned long handled;
+
+	tap_stop(&pr->tap);
+	pthread_join(pr->thread, NULL);
+
+	pthread_mutex_lock(&pr->lock);
+	pr->stop = true;
+	pthread_mutex_unlock(&pr->lock);
+	kick(pr->wake_fd);
+	pthread_join(pr->writer, NULL);
+
+	pthread_mutex_destroy(&pr->lock);
+	tap_free(&pr->tap);
+
+	if (pr->sock_fd >= 0) {
+		close(pr->sock_fd);
+		unlink(pr->opts.trigger);
+	}
+	close(pr->trigger_fd);
+	pr->trigger_fd = -1;
+	close(pr->wake_fd);
+
+	if (pr->opts.quality)
+		mjpeg_free(&pr->enc);
+	free(pr->scratch);
+	free(pr->ring);
+	free(pr->entries);
+
+	handled = pr->frames + pr->overruns + pr->failed;
+	printf("%s - %lu frames kept, %llu KiB, %lu overruns, %lu failed, "
+			"%lu dropped, cost avg %lld max %u us\n", __func__,
+			pr->frames, pr->stored / 1024, pr->overruns,
+			pr->failed, pr->tap.dropped,
+			handled ? pr->cost / handled / 1000 : 0,
+			pr->cost_max / 1000);
+	printf("%s - %lu events, %lu frames written, %lu errors\n", __func__,
+			pr->events, pr->written, pr->errors);
+}
+
+/*
+ * Write out the history, or extend the event being written. Safe to call
+ * from signal handlers.
+ */
+void prerecord_trigger(struct prerecorder *pr)
+{
+	uint64_t event = 1;
+	int saved = errno;
+	ssize_t n;
+
+	if (pr->trigger_fd < 0)
+		return;
+
+	/* only fails once the counter is about to overflow */
+	n = write(pr->trigger_fd, &event, sizeof(event));
+	(void)n;
+	errno = saved;
+}
@@ -0,0 +1,87 @@
+/*
+ * prerecord.h -- pre-event history of the live stream
+ *
+ * Author: Johan Hovold <jhovold@gmail.com>
+ */
+
+#ifndef PRERECORD_H
+#define PRERECORD_H
+
+#include <pthread.h>
+
+#include "mjpeg.h"
+#include "rt.h"
+#include "tap.h"
+
+
+#define PRERECORD_RATE_MAX	60	/* frames per second of history */
+
+struct prerecord_options {
+	const char *path;	/* events go to path.N, NULL to disable */
+	unsigned seconds;	/* history kept before a trigger */
+	unsigned post;		/* seconds written after the last trigger */
+	size_t memory;		/* bytes of history */
+	unsigned quality;	/* MJPEG, or zero for raw frames */
+	const char *trigger;	/* unix datagram socket, or NULL */
+	unsigned depth;		/* frames queued before dropping */
+	struct rt_params rt;	/* of both threads */
+};
+
+struct prerecord_entry {
+	size_t offset;		/* into the ring */
+	size_t size;
+	unsigned sequence;
+	long long timestamp;	/* ns, CLOCK_MONOTONIC */
+};
+
+struct prerecorder {
+	struct frame_tap tap;
+	pthread_t thread;	/* fills the history */
+	pthread_t writer;	/* writes out events */
+
+	struct prerecord_options opts;
+	unsigned width;		/* YUYV frame geometry */
+	unsigned height;
+	unsigned stride;
+
+	struct mjpeg_encoder enc;
+	unsigned char *scratch;	/* compressed frame */
+	size_t scratch_size;
+
+	int trigger_fd;		/* eventfd, signal safe */
+	int sock_fd;		/* trigger socket, or -1 */
+	int wake_fd;		/* new frames or stop, for the writer */
+
+	/* history, under lock */
+	pthread_mutex_t lock;
+	unsigned char *ring;
+	size_t head;		/* end of the newest frame */
+	struct prerecord_entry *entries;
+	unsigned entry_max;
+	unsigned first;
+	unsigned count;
+	unsigned long first_serial;	/* of the oldest frame */
+	bool writing;
+	unsigned long write_next;	/* frames from here on are kept */
+	bool stop;
+
+	unsigned long frames;
+	unsigned long overruns;	/* frames lost to a slow writer */
+	unsigned long failed;	/* short or incompressible frames */
+	unsigned long long stored;	/* bytes */
+	long long cost;		/* ns, total */
+	unsigned cost_max;	/* ns */
+
+	unsigned long events;
+	unsigned long written;
+	unsigned long errors;
+};
+
+int prerecord_start(struct prerecorder *pr,
+			const struct prerecord_options *opts,
+			unsigned width, unsigned height, unsigned stride);
+void prerecord_stop(struct prerecorder *pr);
+
+void prerecord_trigger(struct prerecorder *pr);
+
+#endif	/* PRERECORD_H */
@@ -0,0 +1,81 @@
+/*
+ * present.cpp -- vblank-aligned presentation scheduling
+ *
+ * Frames are scheduled for the first vblank at least a fixed delay after
+ * their capture timestamp rather than being queued for output as soon as
+ * they have been dequeued. This keeps a constant cadence on screen
+ * regardless of capture and processing jitter.
+ *
+ * The V4L2 output device provides no vblank events, but a displayed buffer
+ * is returned once it has been replaced on screen, which is used to track
+ * the refresh phase (and to refine the nominal refresh period).
+ *
+ * Author: Johan Hovold <jhovold@gmail.com>
+ */
+
+#include "common.h"
+#include "present.h"
+
+
+#define PRESENT_SLACK		2000000		/* ns */
+
+
+/*
+ * Return the capture time of buf on the CLOCK_MONOTONIC time base, or the
+ * current time if the driver does not provide monotonic timestamps.
+ */
+long long present_capture_time(const struct v4l2_buffer *buf)
+{
+	if ((buf->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) !=
+					V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+		return now_ns();
+
+	return buf->timestamp.tv_sec * 1000000000LL +
+					buf->timestamp.tv_usec * 1000LL;
+}
+
+/*
+ * refresh is the nominal refresh rate in Hz and delay the capture to
+ * display delay in microseconds.
+ */
+void present_init(struct present_sched *ps, unsigned refresh, unsigned delay)
+{
+	memset(ps, 0, sizeof(*ps));
+
+	ps->period = 1000000000LL / refresh;
+	ps->delay = delay * 1000LL;
+	ps->slack = PRESENT_SLACK;
+	ps->vblank = now_ns();
+}
+
+/*
+ * Update the refresh phase from an observed buffer swap at time t. The
+ * period is refined slowly from consecutive swaps one refresh apart.
+ */
+void present_vblank(struct present_sched *ps, long long t)
+{
+	long long dt = t - ps->vblank;
+
+	if (dt > ps->period * 3 / 4 && dt < ps->period * 5 / 4)
+		ps->period += (dt - ps->period) / 16;
+
+	ps->vblank = t;
+}
+
+/* Return the first vblank at or after t. */
+long long present_next_vblank(const struct present_sched *ps, long long t)
+{
+	long long n;
+
+	if (t <= ps->vblank)
+		return ps->vblank;
+
+	n = (t - ps->vblank + ps->period - 1) / ps->period;
+
+	return ps->vblank + n * ps->period;
+}
+
+long long present_target(const struct present_sched *ps, long long capture)
+{
+	return present_next_vblank(ps, capture + ps->delay);
+}
@@ -0,0 +1,44 @@
+/*
+ * present.h -- vblank-aligned presentation scheduling
+ *
+ * Author: Johan Hovold <jhovold@gmail.com>
+ */
+
+#ifndef PRESENT_H
+#define PRESENT_H
+
+#include <linux/videodev2.h>
+
+#include "frame.h"
+
+
+#define PRESENT_PENDING_MAX	4
+
+struct present_frame {
+	struct video_frame frame;
+	long long target;	/* vblank to display at, ns */
+	unsigned field;		/* kept when deinterlacing */
+};
+
+struct present_sched {
+	long long period;	/* display refresh period, ns */
+	long long vblank;	/* last observed vblank, ns */
+	long long delay;	/* capture to display delay, ns */
+	long long slack;	/* queue this long before the vblank, ns */
+
+	struct present_frame pending[PRESENT_PENDING_MAX];
+	unsigned pending_count;
+
+	unsigned long presented;
+	unsigned long dropped;
+	unsigned long held;
+};
+
+long long present_capture_time(const struct v4l2_buffer *buf);
+
+void present_init(struct present_sched *ps, unsigned refresh, unsigned delay);
+void present_vblank(struct present_sched *ps, long long t);
+long long present_next_vblank(const struct present_sched *ps, long long t);
+long long present_target(const struct present_sched *ps, long long capture);
+
+#endif	/* PRESENT_H */
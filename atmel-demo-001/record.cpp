@@ -0,0 +1,473 @@
+/*
+ * record.cpp -- encoded recording of the live stream
+ *
+ * The recorder runs on its own thread and is fed through a frame tap with
+ * references to the buffers being displayed, so recording costs the video
+ * worker no copies. Frames are either compressed to MJPEG in software,
+ * reading the YUYV buffers in place, or queued by DMABUF to a V4L2
+ * mem2mem encoder. When the recorder falls behind the tap drops its
+ * frames, while the display keeps going.
+ *
+ * With checksums, every frame recorded gets a line in path.crc with its
+ * sequence number, timestamp and CRC32C, as checked before any filtering.
+ *
+ * Author: Johan Hovold <jhovold@gmail.com>
+ */
+
+#include <cstdio>
+#include <climits>
+#include <fcntl.h>
+#include <linux/videodev2.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "mjpeg.h"
+#include "record.h"
+
+
+#define RECORD_FILE_BUFFER	(256 * 1024)
+
+
+static void record_checksum(struct recorder *rec,
+					const struct video_frame *frame)
+{
+	if (!rec->crc_out)
+		return;
+
+	fprintf(rec->crc_out, "%u %lld.%09lld %08x\n", frame->sequence,
+			frame->timestamp / 1000000000,
+			frame->timestamp % 1000000000, frame->checksum);
+}
+
+/*
+ * Compress YUYV frames to 4:2:2 JPEGs appended to the output file, which
+ * can be played back as a raw MJPEG stream.
+ */
+static void record_mjpeg(struct recorder *rec)
+{
+	struct mjpeg_encoder enc;
+	struct video_frame frame;
+
+	if (mjpeg_init(&enc, rec->width, rec->height, rec->opts.quality, true))
+		die("%s: out of memory\n", __func__);
+
+	while (tap_pop(&rec->tap, &frame)) {
+		if (mjpeg_write(&enc, rec->out, frame.data, rec->stride)) {
+			++rec->errors;
+		} else {
+			++rec->frames;
+			record_checksum(rec, &frame);
+		}
+
+		tap_done(&rec->tap, &frame);
+	}
+
+	mjpeg_free(&enc);
+}
+
+static int enc_init(struct recorder *rec)
+{
+	struct v4l2_capability cap;
+	struct v4l2_requestbuffers req;
+	struct v4l2_format fmt;
+	struct v4l2_control ctrl;
+	struct v4l2_buffer buf;
+	int type;
+	unsigned i;
+
+	rec->fd_enc = open(rec->opts.encoder, O_RDWR | O_NONBLOCK);
+	if (rec->fd_enc < 0) {
+		err_errno("%s", rec->opts.encoder);
+		return -1;
+	}
+
+	if (ioctl(rec->fd_enc, VIDIOC_QUERYCAP, &cap) == -1) {
+		err_errno("VIDIOC_QUERYCAP");
+		return -1;
+	}
+
+	if (!(cap.capabilities & V4L2_CAP_VIDEO_M2M) ||
+			!(cap.capabilities & V4L2_CAP_STREAMING)) {
+		err("%s is not a single-planar mem2mem device\n",
+							rec->opts.encoder);
+		return -1;
+	}
+
+	memset(&fmt, 0, sizeof(fmt));
+	fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	fmt.fmt.pix.width = rec->width;
+	fmt.fmt.pix.height = rec->height;
+	fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+	fmt.fmt.pix.bytesperline = rec->stride;
+
+	if (ioctl(rec->fd_enc, VIDIOC_S_FMT, &fmt) == -1 ||
+			fmt.fmt.pix.pixelformat != V4L2_PIX_FMT_YUYV ||
+			fmt.fmt.pix.bytesperline != rec->stride) {
+		err("%s does not accept %ux%u YUYV input\n",
+				rec->opts.encoder, rec->width, rec->height);
+		return -1;
+	}
+
+	memset(&fmt, 0, sizeof(fmt));
+	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	fmt.fmt.pix.width = rec->width;
+	fmt.fmt.pix.height = rec->height;
+	fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_H264;
+	fmt.fmt.pix.sizeimage = rec->width * rec->height;
+
+	if (ioctl(rec->fd_enc, VIDIOC_S_FMT, &fmt) == -1 ||
+			fmt.fmt.pix.pixelformat != V4L2_PIX_FMT_H264) {
+		err("%s does not support H.264\n", rec->opts.encoder);
+		return -1;
+	}
+
+	if (rec->opts.bitrate) {
+		ctrl.id = V4L2_CID_MPEG_VIDEO_BITRATE;
+		ctrl.value = rec->opts.bitrate;
+		if (ioctl(rec->fd_enc, VIDIOC_S_CTRL, &ctrl) == -1)
+			err_errno("V4L2_CID_MPEG_VIDEO_BITRATE");
+	}
+
+	/* input is imported from the capture buffers, one per tap slot */
+	memset(&req, 0, sizeof(req));
+	req.count = rec->opts.depth;
+	req.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	req.memory = V4L2_MEMORY_DMABUF;
+
+	if (ioctl(rec->fd_enc, VIDIOC_REQBUFS, &req) == -1) {
+		err_errno("VIDEO_OUTPUT: VIDIOC_REQBUFS");
+		return -1;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.count = RECORD_ENC_BUFFERS;
+	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	req.memory = V4L2_MEMORY_MMAP;
+
+	if (ioctl(rec->fd_enc, VIDIOC_REQBUFS, &req) == -1) {
+		err_errno("VIDEO_CAPTURE: VIDIOC_REQBUFS");
+		return -1;
+	}
+	rec->enc_count = req.count < RECORD_ENC_BUFFERS ?
+					req.count : RECORD_ENC_BUFFERS;
+
+	for (i = 0; i < rec->enc_count; ++i) {
+		memset(&buf, 0, sizeof(buf));
+		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buf.memory = V4L2_MEMORY_MMAP;
+		buf.index = i;
+
+		if (ioctl(rec->fd_enc, VIDIOC_QUERYBUF, &buf) == -1) {
+			err_errno("VIDIOC_QUERYBUF");
+			return -1;
+		}
+
+		rec->enc_buffers[i].length = buf.length;
+		rec->enc_buffers[i].start = mmap(NULL, buf.length, PROT_READ,
+				MAP_SHARED, rec->fd_enc, buf.m.offset);
+		if (rec->enc_buffers[i].start == MAP_FAILED) {
+			err_errno("mmap");
+			return -1;
+		}
+
+		if (ioctl(rec->fd_enc, VIDIOC_QBUF, &buf) == -1) {
+			err_errno("VIDIOC_QBUF");
+			return -1;
+		}
+	}
+
+	type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	if (ioctl(rec->fd_enc, VIDIOC_STREAMON, &type) == -1) {
+		err_errno("VIDEO_CAPTURE: VIDIOC_STREAMON");
+		return -1;
+	}
+
+	type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	if (ioctl(rec->fd_enc, VIDIOC_STREAMON, &type) == -1) {
+		err_errno("VIDEO_OUTPUT: VIDIOC_STREAMON");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void enc_free(struct recorder *rec)
+{
+	int type;
+	unsigned i;
+
+	if (rec->fd_enc < 0)
+		return;
+
+	type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	ioctl(rec->fd_enc, VIDIOC_STREAMOFF, &type);
+	type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	ioctl(rec->fd_enc, VIDIOC_STREAMOFF, &type);
+
+	/* streamoff returns all input frames */
+	for (i = 0; i < rec->opts.depth; ++i) {
+		if (rec->enc_busy[i]) {
+			tap_done(&rec->tap, &rec->enc_frames[i]);
+			rec->enc_busy[i] = false;
+		}
+	}
+
+	for (i = 0; i < rec->enc_count; ++i)
+		munmap(rec->enc_buffers[i].start, rec->enc_buffers[i].length);
+
+	close(rec->fd_enc);
+	rec->fd_enc = -1;
+}
+
+/*
+ * Write out encoded data and give back consumed input frames, waiting up
+ * to timeout ms for the encoder.
+ */
+static void enc_service(struct recorder *rec, int timeout)
+{
+	struct v4l2_buffer buf;
+	struct pollfd pfd;
+
+	pfd.fd = rec->fd_enc;
+	pfd.events = POLLIN | POLLOUT;
+
+	if (poll(&pfd, 1, timeout) <= 0)
+		return;
+
+	for (;;) {
+		memset(&buf, 0, sizeof(buf));
+		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buf.memory = V4L2_MEMORY_MMAP;
+
+		if (ioctl(rec->fd_enc, VIDIOC_DQBUF, &buf) == -1)
+			break;
+
+		if (fwrite(rec->enc_buffers[buf.index].start, 1,
+				buf.bytesused, rec->out) != buf.bytesused)
+			++rec->errors;
+		rec->bytes += buf.bytesused;
+
+		if (ioctl(rec->fd_enc, VIDIOC_QBUF, &buf) == -1)
+			err_errno("VIDEO_CAPTURE: VIDIOC_QBUF");
+	}
+
+	for (;;) {
+		memset(&buf, 0, sizeof(buf));
+		buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+		buf.memory = V4L2_MEMORY_DMABUF;
+
+		if (ioctl(rec->fd_enc, VIDIOC_DQBUF, &buf) == -1)
+			break;
+
+		if (buf.index < rec->opts.depth && rec->enc_busy[buf.index]) {
+			tap_done(&rec->tap, &rec->enc_frames[buf.index]);
+			rec->enc_busy[buf.index] = false;
+			--rec->enc_in_flight;
+			++rec->frames;
+		}
+	}
+}
+
+/*
+ * Give back every frame queued to the encoder by restarting its input
+ * queue, once what has been encoded is written out. The encoder may hold
+ * on to input until more arrives, which it will not while the tap drains.
+ */
+static void enc_flush(struct recorder *rec)
+{
+	int type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	unsigned i;
+
+	enc_service(rec, 0);
+	if (!rec->enc_in_flight)
+		return;
+
+	if (ioctl(rec->fd_enc, VIDIOC_STREAMOFF, &type) == -1)
+		err_errno("VIDEO_OUTPUT: VIDIOC_STREAMOFF");
+
+	for (i = 0; i < rec->opts.depth; ++i) {
+		if (rec->enc_busy[i]) {
+			tap_done(&rec->tap, &rec->enc_frames[i]);
+			rec->enc_busy[i] = false;
+			++rec->flushed;
+		}
+	}
+	rec->enc_in_flight = 0;
+
+	if (ioctl(rec->fd_enc, VIDIOC_STREAMON, &type) == -1) {
+		err_errno("VIDEO_OUTPUT: VIDIOC_STREAMON");
+		++rec->errors;
+	}
+}
+
+static void enc_queue(struct recorder *rec, const struct video_frame *frame)
+{
+	struct v4l2_buffer buf;
+	unsigned index;
+
+	for (index = 0; index < rec->opts.depth && rec->enc_busy[index];
+								++index)
+		;
+
+	memset(&buf, 0, sizeof(buf));
+	buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	buf.memory = V4L2_MEMORY_DMABUF;
+	buf.index = index;
+	buf.m.fd = frame->dmabuf;
+	buf.bytesused = frame->size;
+	buf.length = frame->size;
+
+	if (index == rec->opts.depth || frame->dmabuf < 0 ||
+			ioctl(rec->fd_enc, VIDIOC_QBUF, &buf) == -1) {
+		++rec->errors;
+		tap_done(&rec->tap, frame);
+		return;
+	}
+
+	rec->enc_frames[index] = *frame;
+	rec->enc_busy[index] = true;
+	++rec->enc_in_flight;
+
+	record_checksum(rec, frame);
+}
+
+/*
+ * Feed frames to the encoder while servicing it. The tap holds no more
+ * frames than the encoder takes, so a popped frame always has a slot.
+ */
+static void record_v4l2(struct recorder *rec)
+{
+	struct video_frame frame;
+	struct pollfd pfds[2];
+	unsigned in_flight;
+	int ret;
+
+	for (;;) {
+		while ((ret = tap_try_pop(&rec->tap, &frame)) > 0)
+			enc_queue(rec, &frame);
+		if (ret < 0)
+			break;
+
+		if (tap_draining(&rec->tap))
+			enc_flush(rec);
+
+		pfds[0].fd = rec->tap.pop_fd;
+		pfds[0].events = POLLIN;
+		pfds[1].fd = rec->enc_in_flight ? rec->fd_enc : -1;
+		pfds[1].events = POLLIN | POLLOUT;
+
+		if (poll(pfds, 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			die_errno("poll");
+		}
+
+		if (pfds[1].revents)
+			enc_service(rec, 0);
+	}
+
+	/* frames the encoder sits on are given back by enc_free() */
+	while (rec->enc_in_flight && !rec->errors) {
+		in_flight = rec->enc_in_flight;
+		enc_service(rec, 1000);
+		if (rec->enc_in_flight == in_flight)
+			break;
+	}
+}
+
+static void *record_thread(void *arg)
+{
+	struct recorder *rec = (struct recorder *)arg;
+
+	rt_thread_setup("record", &rec->opts.rt);
+
+	if (rec->opts.encoder)
+		record_v4l2(rec);
+	else
+		record_mjpeg(rec);
+
+	return NULL;
+}
+
+/*
+ * Start recording width x height YUYV frames to path. With a V4L2 encoder,
+ * frames pushed must carry an exported DMABUF.
+ */
+int recorder_start(struct recorder *rec, const struct record_options *opts,
+			unsigned width, unsigned height, unsigned stride)
+{
+	char crc_path[PATH_MAX];
+	int ret;
+
+	memset(rec, 0, sizeof(*rec));
+	rec->opts = *opts;
+	rec->width = width;
+	rec->height = height;
+	rec->stride = stride;
+	rec->fd_enc = -1;
+
+	if (tap_init(&rec->tap, opts->depth))
+		return -1;
+
+	rec->out = fopen(opts->path, "w");
+	if (!rec->out) {
+		err_errno("%s", opts->path);
+		goto err_tap;
+	}
+	setvbuf(rec->out, NULL, _IOFBF, RECORD_FILE_BUFFER);
+
+	if (opts->checksums) {
+		snprintf(crc_path, sizeof(crc_path), "%s.crc", opts->path);
+		rec->crc_out = fopen(crc_path, "w");
+		if (!rec->crc_out) {
+			err_errno("%s", crc_path);
+			goto err_out;
+		}
+	}
+
+	if (opts->encoder && enc_init(rec))
+		goto err_enc;
+
+	ret = pthread_create(&rec->thread, NULL, record_thread, rec);
+	if (ret) {
+		errno = ret;
+		err_errno("pthread_create");
+		goto err_enc;
+	}
+
+	return 0;
+
+err_enc:
+	enc_free(rec);
+	if (rec->crc_out)
+		fclose(rec->crc_out);
+err_out:
+	fclose(rec->out);
+err_tap:
+	tap_free(&rec->tap);
+
+	return -1;
+}
+
+/*
+ * Stop the recorder once it has given back all frames, which the caller
+ * must have reaped.
+ */
+void recorder_stop(struct recorder *rec)
+{
+	tap_stop(&rec->tap);
+	pthread_join(rec->thread, NULL);
+
+	enc_free(rec);
+	fclose(rec->out);
+	if (rec->crc_out)
+		fclose(rec->crc_out);
+	tap_free(&rec->tap);
+
+	printf("%s - %lu frames recorded, %lu dropped, %lu flushed, "
+			"%lu errors\n", __func__, rec->frames, rec->tap.dropped,
+			rec->flushed, rec->errors);
+}
@@ -0,0 +1,64 @@
+/*
+ * record.h -- encoded recording of the live stream
+ *
+ * Author: Johan Hovold <jhovold@gmail.com>
+ */
+
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <cstdio>
+#include <pthread.h>
+
+#include "rt.h"
+#include "tap.h"
+
+
+#define RECORD_ENC_BUFFERS	4
+
+struct record_options {
+	const char *path;	/* NULL to disable recording */
+	const char *encoder;	/* V4L2 mem2mem device, or NULL for MJPEG */
+	unsigned quality;	/* MJPEG */
+	unsigned bitrate;	/* bit/s, zero for encoder default */
+	unsigned depth;		/* frames queued before dropping */
+	bool checksums;		/* frame CRC32Cs listed in path.crc */
+	struct rt_params rt;	/* of the recorder thread */
+};
+
+struct record_buffer {
+	void *start;
+	size_t length;
+};
+
+struct recorder {
+	struct frame_tap tap;
+	pthread_t thread;
+
+	struct record_options opts;
+	unsigned width;		/* YUYV input geometry */
+	unsigned height;
+	unsigned stride;
+
+	FILE *out;
+	FILE *crc_out;		/* or NULL */
+
+	/* V4L2 mem2mem encoder, or -1 for software MJPEG */
+	int fd_enc;
+	struct record_buffer enc_buffers[RECORD_ENC_BUFFERS];
+	unsigned enc_count;
+	struct video_frame enc_frames[TAP_DEPTH_MAX];
+	bool enc_busy[TAP_DEPTH_MAX];
+	unsigned enc_in_flight;
+
+	unsigned long frames;
+	unsigned long long bytes;
+	unsigned long flushed;	/* given back unencoded on drains */
+	unsigned long errors;
+};
+
+int recorder_start(struct recorder *rec, const struct record_options *opts,
+			unsigned width, unsigned height, unsigned stride);
+void recorder_stop(struct recorder *rec);
+
+#endif	/* RECORD_H */
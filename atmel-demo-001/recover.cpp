@@ -0,0 +1,120 @@
+/*
+ * recover.cpp -- classification and accounting of streaming errors
+ *
+ * Errors on a streaming queue are mapped to the least disruptive action
+ * that is likely to get frames flowing again: retrying, restarting only
+ * the failing queue, or closing and reopening a device that has gone away
+ * (e.g. an unplugged USB camera). Repeated failures without a good frame
+ * in between escalate to the next action.
+ *
+ * The time from the first failure to the next good frame is tracked as the
+ * time to recover.
+ *
+ * Author: Johan Hovold <jhovold@gmail.com>
+ */
+
+#include "common.h"
+#include "recover.h"
+
+
+void recover_init(struct recovery *rc, const char *name, bool can_reopen)
+{
+	memset(rc, 0, sizeof(*rc));
+	rc->name = name;
+	rc->can_reopen = can_reopen;
+}
+
+enum recover_action recover_classify(int error)
+{
+	switch (error) {
+	case EAGAIN:
+	case EINTR:
+	case EBUSY:
+	case ENOMEM:
+		return RECOVER_RETRY;
+	case ENODEV:
+	case ENXIO:
+	case ENOENT:
+	case ESHUTDOWN:
+	case EBADF:
+		return RECOVER_REOPEN;
+	case EIO:
+	case EPIPE:
+	case ETIMEDOUT:
+	case EINVAL:
+	default:
+		return RECOVER_RESTART;
+	}
+}
+
+/*
+ * Account for a failure and return the action to take.
+ */
+enum recover_action recover_failed(struct recovery *rc, int error)
+{
+	enum recover_action action;
+	unsigned n;
+
+	action = recover_classify(error);
+
+	if (!rc->failed)
+		rc->failed = now_ns();
+	n = ++rc->attempts;
+	++rc->errors;
+
+	if (n > RECOVER_ESCALATE && action != RECOVER_REOPEN)
+		action = (enum recover_action)(action + 1);
+	if (action == RECOVER_REOPEN && !rc->can_reopen)
+		action = RECOVER_RESTART;
+
+	if (action == RECOVER_RESTART)
+		++rc->restarts;
+	else if (action == RECOVER_REOPEN)
+		++rc->reopens;
+
+	/* do not flood the log while a failure persists */
+	if (!(n & (n - 1))) {
+		err("%s: %s (%d), attempt %u, %s\n", rc->name, strerror(error),
+				error, n,
+				action == RECOVER_RETRY ? "retrying" :
+				action == RECOVER_RESTART ? "restarting" :
+				"reopening");
+	}
+
+	return action;
+}
+
+void recover_succeeded(struct recovery *rc)
+{
+	long long t = now_ns() - rc->failed;
+
+	++rc->recovered;
+	rc->recover_total += t;
+	if (t > rc->recover_max)
+		rc->recover_max = t;
+
+	printf("%s - recovered in %lld ms after %u attempts\n", rc->name,
+					t / 1000000, rc->attempts);
+
+	rc->failed = 0;
+	rc->attempts = 0;
+}
+
+void recover_print(const struct recovery *rc)
+{
+	if (!rc->errors && !rc->frame_errors)
+		return;
+
+	printf("%s - %lu errors, %lu frame errors, %lu restarts, %lu reopens, "
+			"%lu recovered", rc->name, rc->errors,
+			rc->frame_errors, rc->restarts, rc->reopens,
+			rc->recovered);
+	if (rc->recovered) {
+		printf(", time to recover avg %lld max %lld ms",
+				rc->recover_total / rc->recovered / 1000000,
+				rc->recover_max / 1000000);
+	}
+	if (rc->failed)
+		printf(", still failing");
+	printf("\n");
+}
@@ -0,0 +1,52 @@
+/*
+ * recover.h -- classification and accounting of streaming errors
+ *
+ * Author: Johan Hovold <jhovold@gmail.com>
+ */
+
+#ifndef RECOVER_H
+#define RECOVER_H
+
+
+#define RECOVER_ESCALATE	3	/* failed attempts before escalating */
+
+enum recover_action {
+	RECOVER_RETRY,		/* transient, try again */
+	RECOVER_RESTART,	/* stop and restart the queue */
+	RECOVER_REOPEN		/* device is gone, close and reopen it */
+};
+
+struct recovery {
+	const char *name;
+	bool can_reopen;
+
+	long long failed;	/* first failure since the last good frame */
+	unsigned attempts;	/* since the last good frame */
+
+	unsigned long errors;
+	unsigned long frame_errors;	/* buffers flagged by the driver */
+	unsigned long restarts;
+	unsigned long reopens;
+
+	unsigned long recovered;
+	long long recover_total;	/* ns */
+	long long recover_max;		/* ns */
+};
+
+void recover_init(struct recovery *rc, const char *name, bool can_reopen);
+enum recover_action recover_classify(int error);
+enum recover_action recover_failed(struct recovery *rc, int error);
+void recover_print(const struct recovery *rc);
+
+/*
+ * Note a good frame, which ends any ongoing recovery.
+ */
+void recover_succeeded(struct recovery *rc);
+
+static inline void recover_done(struct recovery *rc)
+{
+	if (rc->failed)
+		recover_succeeded(rc);
+}
+
+#endif	/* RECOVER_H */
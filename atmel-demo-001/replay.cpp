@@ -0,0 +1,332 @@
+/*
+ * replay.cpp -- file-driven frame source
+ *
+ * Replays recorded YUYV frames in place of the capture device, either
+ * paced to the original timestamps (scaled by speed) or as fast as the
+ * display path takes them. Files are either raw frames back to back, as
+ * written by "capture -o", which are paced at a fixed rate, or a dump of
+ * a TCP stream from --stream, where every frame has a header with its
+ * capture timestamp.
+ *
+ * The file is mapped and frames are handed out in place, with readahead
+ * requested a few frames ahead of the one being shown.
+ *
+ * Author: Johan Hovold <jhovold@gmail.com>
+ */
+
+#include <endian.h>
+#include <fcntl.h>
+#include <linux/videodev2.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "replay.h"
+#include "stream.h"
+
+
+#define REPLAY_READAHEAD	4	/* frames */
+
+
+static bool header_valid(const struct stream_header *hdr)
+{
+	return be32toh(hdr->magic) == STREAM_MAGIC &&
+			be32toh(hdr->fourcc) == V4L2_PIX_FMT_YUYV &&
+			be32toh(hdr->offset) == 0;
+}
+
+/*
+ * Get the frame size of a file with stream headers. Returns -1 for raw
+ * files.
+ */
+int replay_probe(const char *path, unsigned *width, unsigned *height)
+{
+	struct stream_header hdr;
+	int fd;
+	int ret = -1;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	if (read(fd, &hdr, sizeof(hdr)) == sizeof(hdr) && header_valid(&hdr)) {
+		*width = be16toh(hdr.width);
+		*height = be16toh(hdr.height);
+		ret = 0;
+	}
+
+	close(fd);
+
+	return ret;
+}
+
+static int replay_index(struct replay_source *rs)
+{
+	const struct stream_header *hdr;
+	size_t offset, size;
+	unsigned n = 0;
+
+	for (offset = 0; offset + sizeof(*hdr) <= rs->map_size; ++n) {
+		hdr = (const struct stream_header *)(rs->map + offset);
+		offset += sizeof(*hdr) + be32toh(hdr->size);
+	}
+
+	rs->offsets = (size_t *)malloc(n * sizeof(*rs->offsets));
+	if (!rs->offsets)
+		return -1;
+
+	for (offset = 0; offset + sizeof(*hdr) <= rs->map_size; ) {
+		hdr = (const struct stream_header *)(rs->map + offset);
+		size = be32toh(hdr->size);
+
+		if (!header_valid(hdr) || be16toh(hdr->width) != rs->width ||
+				be16toh(hdr->height) != rs->height ||
+				size < rs->stride * rs->height) {
+			err("%s: bad frame header at %zu\n", __func__, offset);
+			return -1;
+		}
+
+		/* ignore a truncated last frame */
+		if (offset + sizeof(*hdr) + size > rs->map_size)
+			break;
+
+		rs->offsets[rs->count++] = offset;
+		offset += sizeof(*hdr) + size;
+	}
+
+	return 0;
+}
+
+int replay_open(struct replay_source *rs, const char *path, unsigned width,
+			unsigned height, unsigned speed, unsigned rate,
+			bool loop)
+{
+	const struct stream_header *hdr;
+	struct stat st;
+
+	memset(rs, 0, sizeof(*rs));
+	rs->width = width;
+	rs->height = height;
+	rs->stride = width * 2;
+	rs->frame_size = rs->stride * height;
+	rs->speed = speed;
+	rs->rate = rate;
+	rs->loop = loop;
+
+	rs->fd = open(path, O_RDONLY);
+	if (rs->fd < 0) {
+		err_errno("%s", path);
+		return -1;
+	}
+
+	if (fstat(rs->fd, &st) == -1) {
+		err_errno("fstat");
+		goto err_close;
+	}
+
+	rs->map_size = st.st_size;
+	if (rs->map_size < sizeof(*hdr)) {
+		err("%s: no frames\n", path);
+		goto err_close;
+	}
+
+	rs->map = (const unsigned char *)mmap(NULL, rs->map_size, PROT_READ,
+						MAP_PRIVATE, rs->fd, 0);
+	if (rs->map == MAP_FAILED) {
+		err_errno("mmap");
+		goto err_close;
+	}
+	madvise((void *)rs->map, rs->map_size, MADV_SEQUENTIAL);
+
+	hdr = (const struct stream_header *)rs->map;
+	rs->framed = header_valid(hdr);
+
+	if (rs->framed) {
+		rs->stride = be32toh(hdr->stride);
+		if (replay_index(rs))
+			goto err_unmap;
+	} else {
+		rs->count = rs->map_size / rs->frame_size;
+	}
+
+	if (!rs->count) {
+		err("%s: no frames\n", path);
+		goto err_unmap;
+	}
+
+	rs->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK |
+								TFD_CLOEXEC);
+	if (rs->timer_fd < 0) {
+		err_errno("timerfd_create");
+		goto err_unmap;
+	}
+
+	return 0;
+
+err_unmap:
+	free(rs->offsets);
+	munmap((void *)rs->map, rs->map_size);
+err_close:
+	close(rs->fd);
+
+	return -1;
+}
+
+void replay_close(struct replay_source *rs)
+{
+	long long elapsed = rs->end - rs->begin;
+
+	if (rs->frames > 1 && elapsed > 0) {
+		printf("%s - %lu frames in %lld ms, %llu.%llu fps\n", __func__,
+				rs->frames, elapsed / 1000000,
+				(rs->frames - 1) * 1000000000ULL / elapsed,
+				(rs->frames - 1) * 10000000000ULL / elapsed % 10);
+	}
+
+	close(rs->timer_fd);
+	free(rs->offsets);
+	munmap((void *)rs->map, rs->map_size);
+	close(rs->fd);
+}
+
+static const unsigned char *replay_frame(const struct replay_source *rs,
+					unsigned index, size_t *size,
+					unsigned *sequence, long long *timestamp)
+{
+	const struct stream_header *hdr;
+
+	if (!rs->framed) {
+		*size = rs->frame_size;
+		*sequence = index;
+		*timestamp = index * 1000000000LL / rs->rate;
+		return rs->map + index * rs->frame_size;
+	}
+
+	hdr = (const struct stream_header *)(rs->map + rs->offsets[index]);
+	*size = rs->stride * rs->height;
+	*sequence = be32toh(hdr->sequence);
+	*timestamp = be64toh(hdr->timestamp);
+
+	return (const unsigned char *)(hdr + 1);
+}
+
+static void replay_readahead(const struct replay_source *rs, unsigned index)
+{
+	const unsigned char *p;
+	unsigned long page = sysconf(_SC_PAGESIZE);
+	unsigned long start;
+	size_t size;
+	unsigned sequence;
+	long long timestamp;
+
+	if (index >= rs->count)
+		return;
+
+	p = replay_frame(rs, index, &size, &sequence, &timestamp);
+	start = (unsigned long)p & ~(page - 1);
+
+	madvise((void *)start, (unsigned long)p + size - start,
+							MADV_WILLNEED);
+}
+
+static void replay_arm(struct replay_source *rs, long long due)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+
+	/* a zero value would disarm the timer */
+	if (due <= 0)
+		due = 1;
+
+	its.it_value.tv_sec = due / 1000000000LL;
+	its.it_value.tv_nsec = due % 1000000000LL;
+
+	if (timerfd_settime(rs->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) == -1)
+		die_errno("timerfd_settime");
+}
+
+/*
+ * (Re)start pacing from the current frame, which is due immediately.
+ */
+void replay_start(struct replay_source *rs)
+{
+	size_t size;
+	unsigned sequence;
+	unsigned i;
+
+	if (rs->index == rs->count)
+		rs->index = 0;
+
+	rs->start = now_ns();
+	replay_frame(rs, rs->index, &size, &sequence, &rs->first);
+
+	for (i = 0; i < REPLAY_READAHEAD; ++i)
+		replay_readahead(rs, rs->index + i);
+
+	if (!rs->frames)
+		rs->begin = rs->start;
+
+	replay_arm(rs, rs->start);
+}
+
+/*
+ * Get the next frame once the timer has expired. Returns 1 if a frame was
+ * returned, 0 if there is none yet, and -1 at the end of the file unless
+ * looping.
+ */
+int replay_next(struct replay_source *rs, struct video_frame *frame)
+{
+	uint64_t expirations;
+	size_t size;
+	unsigned sequence;
+	long long timestamp, due;
+
+	if (read(rs->timer_fd, &expirations, sizeof(expirations)) < 0)
+		return 0;
+
+	if (rs->index == rs->count) {
+		if (!rs->loop)
+			return -1;
+		replay_start(rs);
+		return 0;
+	}
+
+	frame->capture = -1;
+	frame->decoded = -1;
+	frame->dmabuf = -1;
+	frame->data = replay_frame(rs, rs->index, &size, &sequence, &timestamp);
+	frame->size = size;
+	frame->sequence = sequence;
+
+	if (rs->speed)
+		due = rs->start + (timestamp - rs->first) * 100 / rs->speed;
+	else
+		due = now_ns();
+	frame->timestamp = due;
+
+	replay_readahead(rs, rs->index + REPLAY_READAHEAD);
+	++rs->index;
+	++rs->frames;
+	rs->end = now_ns();
+
+	/* the end of the file is handled on the next expiration */
+	if (rs->index == rs->count) {
+		replay_arm(rs, rs->speed ? due : 0);
+		return 1;
+	}
+
+	if (rs->speed) {
+		replay_frame(rs, rs->index, &size, &sequence, &timestamp);
+		due = rs->start + (timestamp - rs->first) * 100 / rs->speed;
+	} else {
+		due = 0;
+	}
+
+	replay_arm(rs, due);
+
+	return 1;
+}
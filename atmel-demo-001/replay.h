@@ -0,0 +1,51 @@
+/*
+ * replay.h -- file-driven frame source
+ *
+ * Author: Johan Hovold <jhovold@gmail.com>
+ */
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <cstddef>
+
+#include "frame.h"
+
+
+struct replay_source {
+	int fd;
+	const unsigned char *map;
+	size_t map_size;
+
+	/* frames with stream headers, or raw frames at a fixed rate */
+	bool framed;
+	unsigned width;
+	unsigned height;
+	unsigned stride;
+	size_t frame_size;
+	size_t *offsets;	/* of framed frame headers */
+	unsigned count;
+	unsigned index;
+
+	unsigned speed;		/* percent of original, zero for max */
+	unsigned rate;		/* Hz, raw frames */
+	bool loop;
+
+	int timer_fd;
+	long long start;	/* time of the first frame in this pass */
+	long long first;	/* original timestamp of the first frame */
+
+	unsigned long frames;
+	long long begin;
+	long long end;
+};
+
+int replay_probe(const char *path, unsigned *width, unsigned *height);
+int replay_open(struct replay_source *rs, const char *path, unsigned width,
+			unsigned height, unsigned speed, unsigned rate,
+			bool loop);
+void replay_close(struct replay_source *rs);
+void replay_start(struct replay_source *rs);
+int replay_next(struct replay_source *rs, struct video_frame *frame);
+
+#endif	/* REPLAY_H */
@@ -0,0 +1,255 @@
+/*
+ * rt.cpp -- real-time scheduling and memory locking for the video threads
+ *
+ * Author: Johan Hovold <jhovold@gmail.com>
+ */
+
+#include <cmath>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <time.h>
+
+#include "common.h"
+#include "rt.h"
+
+
+#define RT_STACK_PREFAULT	(256 * 1024)
+#define RT_MEASURE_PERIOD	1000000		/* ns */
+
+
+void rt_params_init(struct rt_params *params)
+{
+	params->policy = SCHED_OTHER;
+	params->priority = 0;
+	params->cpu = -1;
+}
+
+/*
+ * Parse "policy[:priority[:cpu]]" where policy is one of other, fifo or rr,
+ * e.g. "fifo:80:1".
+ */
+int rt_params_parse(struct rt_params *params, const char *str)
+{
+	const char *p;
+	char *end;
+	size_t len;
+	int min, max;
+
+	rt_params_init(params);
+
+	p = strchr(str, ':');
+	len = p ? (size_t)(p - str) : strlen(str);
+
+	if (len == 5 && !strncmp(str, "other", len))
+		params->policy = SCHED_OTHER;
+	else if (len == 4 && !strncmp(str, "fifo", len))
+		params->policy = SCHED_FIFO;
+	else if (len == 2 && !strncmp(str, "rr", len))
+		params->policy = SCHED_RR;
+	else
+		return -1;
+
+	if (params->policy != SCHED_OTHER)
+		params->priority = sched_get_priority_min(params->policy);
+
+	if (p) {
+		str = p + 1;
+		if (*str && *str != ':') {
+			params->priority = strtol(str, &end, 0);
+			if (*end && *end != ':')
+				return -1;
+			str = end;
+		}
+
+		if (*str == ':') {
+			params->cpu = strtol(str + 1, &end, 0);
+			if (*end || end == str + 1 || params->cpu < 0)
+				return -1;
+		}
+	}
+
+	min = sched_get_priority_min(params->policy);
+	max = sched_get_priority_max(params->policy);
+	if (params->priority < min || params->priority > max)
+		return -1;
+
+	return 0;
+}
+
+static void rt_prefault_stack(void)
+{
+	volatile unsigned char stack[RT_STACK_PREFAULT];
+
+	memset((void *)stack, 0, sizeof(stack));
+}
+
+/*
+ * Name the calling thread and apply scheduling policy and CPU affinity.
+ * Failures are reported but not fatal, as the demo still works (with more
+ * jitter) without the required privileges.
+ */
+void rt_thread_setup(const char *name, const struct rt_params *params)
+{
+	struct sched_param param;
+	cpu_set_t set;
+	int ret;
+
+	prctl(PR_SET_NAME, name, 0, 0, 0);
+
+	if (params->cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(params->cpu, &set);
+
+		ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (ret) {
+			errno = ret;
+			err_errno("%s: cpu %d", name, params->cpu);
+		}
+	}
+
+	if (params->policy != SCHED_OTHER) {
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = params->priority;
+
+		ret = pthread_setschedparam(pthread_self(), params->policy,
+									&param);
+		if (ret) {
+			errno = ret;
+			err_errno("%s: policy %d, priority %d", name,
+					params->policy, params->priority);
+		}
+	}
+
+	rt_prefault_stack();
+}
+
+/*
+ * Lock current and future mappings (including the V4L2 buffers mapped
+ * later) and keep malloc from handing memory back to the kernel so that the
+ * streaming loop never takes a page fault.
+ */
+void rt_lock_memory(void)
+{
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+		err_errno("mlockall");
+		return;
+	}
+
+	mallopt(M_TRIM_THRESHOLD, -1);
+	mallopt(M_MMAP_MAX, 0);
+
+	rt_prefault_stack();
+}
+
+struct rt_measure {
+	struct rt_params params;
+	unsigned seconds;
+
+	unsigned long samples;
+	long long min;
+	long long max;
+	double sum;
+	double sum2;
+};
+
+static long long timespec_ns(const struct timespec *ts)
+{
+	return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+static void *rt_measure_thread(void *arg)
+{
+	struct rt_measure *m = (struct rt_measure *)arg;
+	struct timespec next, now;
+	long long end, lat;
+
+	rt_thread_setup("rt-measure", &m->params);
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	end = timespec_ns(&next) + m->seconds * 1000000000LL;
+
+	while (timespec_ns(&next) < end) {
+		next.tv_nsec += RT_MEASURE_PERIOD;
+		if (next.tv_nsec >= 1000000000) {
+			next.tv_nsec -= 1000000000;
+			++next.tv_sec;
+		}
+
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next,
+							NULL) == EINTR)
+			;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		lat = timespec_ns(&now) - timespec_ns(&next);
+		if (!m->samples || lat < m->min)
+			m->min = lat;
+		if (!m->samples || lat > m->max)
+			m->max = lat;
+		m->sum += lat;
+		m->sum2 += (double)lat * lat;
+		++m->samples;
+	}
+
+	return NULL;
+}
+
+static void rt_measure_run(const char *desc, const struct rt_params *params,
+							unsigned seconds)
+{
+	struct rt_measure m;
+	pthread_t thread;
+	double avg, dev;
+	int ret;
+
+	memset(&m, 0, sizeof(m));
+	m.params = *params;
+	m.seconds = seconds;
+
+	ret = pthread_create(&thread, NULL, rt_measure_thread, &m);
+	if (ret) {
+		errno = ret;
+		die_errno("pthread_create");
+	}
+	pthread_join(thread, NULL);
+
+	if (!m.samples)
+		return;
+
+	avg = m.sum / m.samples;
+	dev = sqrt(m.sum2 / m.samples - avg * avg);
+
+	printf("%-10s %8lu samples, latency min %6lld avg %8.1f "
+			"max %6lld us, jitter %8.1f us\n", desc, m.samples,
+			m.min / 1000, avg / 1000, m.max / 1000, dev / 1000);
+}
+
+/*
+ * Measure timer wakeup latency of a thread, first with default scheduling
+ * and unlocked memory and then with params applied and, if lock_memory is
+ * set, memory locked, so that the effect of the real-time settings (and of
+ * the current system load) can be compared. Memory stays locked after.
+ */
+void rt_measure_latency(const struct rt_params *params, bool lock_memory,
+							unsigned seconds)
+{
+	struct rt_params defaults;
+
+	rt_params_init(&defaults);
+
+	printf("measuring wakeup latency, period %d us, %u s per run\n",
+					RT_MEASURE_PERIOD / 1000, seconds);
+
+	rt_measure_run("default", &defaults, seconds);
+
+	if (params->policy == defaults.policy && params->cpu == defaults.cpu &&
+								!lock_memory)
+		return;
+
+	if (lock_memory)
+		rt_lock_memory();
+
+	rt_measure_run(lock_memory ? "rt+mlock" : "rt", params, seconds);
+}
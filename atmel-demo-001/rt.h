@@ -0,0 +1,35 @@
+/*
+ * rt.h -- real-time scheduling and memory locking for the video threads
+ *
+ * Author: Johan Hovold <jhovold@gmail.com>
+ */
+
+#ifndef RT_H
+#define RT_H
+
+#include <cstddef>
+
+
+enum rt_thread {
+	RT_THREAD_CAPTURE,
+	RT_THREAD_OUTPUT,
+	RT_THREAD_CONVERT,
+	RT_THREAD_COUNT
+};
+
+struct rt_params {
+	int policy;	/* SCHED_OTHER, SCHED_FIFO or SCHED_RR */
+	int priority;
+	int cpu;	/* -1 for no affinity */
+};
+
+void rt_params_init(struct rt_params *params);
+int rt_params_parse(struct rt_params *params, const char *str);
+
+void rt_thread_setup(const char *name, const struct rt_params *params);
+void rt_lock_memory(void);
+
+void rt_measure_latency(const struct rt_params *params, bool lock_memory,
+							unsigned seconds);
+
+#endif	/* RT_H */
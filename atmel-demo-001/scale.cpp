@@ -0,0 +1,218 @@
+/*
+ * scale.cpp -- downscaling of YUYV frames for the preview
+ *
+ * The preview is written straight into the output buffer, so that it
+ * takes the place of the copy the display path would otherwise make.
+ *
+ * Halving is the common case and gets a box filter over pairs of rows,
+ * which streams each source row through the cache once and produces one
+ * destination row from two source rows that are still in L1. Other ratios
+ * use nearest-neighbour sampling through precomputed row and column maps.
+ *
+ * Author: Johan Hovold <jhovold@gmail.com>
+ */
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include "common.h"
+#include "scale.h"
+
+
+/*
+ * Average a 4x2 block of pixels (two macropixels on two rows) into one
+ * macropixel.
+ */
+static inline void halve_pixel(unsigned char *dst, const unsigned char *a,
+							const unsigned char *b)
+{
+	dst[0] = (a[0] + a[2] + b[0] + b[2] + 2) >> 2;
+	dst[1] = (a[1] + a[5] + b[1] + b[5] + 2) >> 2;
+	dst[2] = (a[4] + a[6] + b[4] + b[6] + 2) >> 2;
+	dst[3] = (a[3] + a[7] + b[3] + b[7] + 2) >> 2;
+}
+
+#if defined(__SSE2__)
+
+/* Halve eight macropixels from rows a and b into four per iteration. */
+static void halve_row(unsigned char *dst, const unsigned char *a,
+				const unsigned char *b, unsigned n)
+{
+	const __m128i lmask = _mm_set1_epi32(0x000000ff);
+	const __m128i cmask = _mm_set1_epi32(0xff00ff00);
+	__m128i lo, hi, e, o, c;
+	unsigned x;
+
+	for (x = 0; x + 4 <= n; x += 4, a += 32, b += 32, dst += 16) {
+		lo = _mm_avg_epu8(_mm_loadu_si128((const __m128i *)a),
+				_mm_loadu_si128((const __m128i *)b));
+		hi = _mm_avg_epu8(_mm_loadu_si128((const __m128i *)(a + 16)),
+				_mm_loadu_si128((const __m128i *)(b + 16)));
+
+		/* even and odd macropixels */
+		lo = _mm_shuffle_epi32(lo, _MM_SHUFFLE(3, 1, 2, 0));
+		hi = _mm_shuffle_epi32(hi, _MM_SHUFFLE(3, 1, 2, 0));
+		e = _mm_unpacklo_epi64(lo, hi);
+		o = _mm_unpackhi_epi64(lo, hi);
+
+		/* chroma across the pair, luma within each macropixel */
+		c = _mm_and_si128(_mm_avg_epu8(e, o), cmask);
+		e = _mm_and_si128(_mm_avg_epu8(e, _mm_srli_epi32(e, 16)),
+									lmask);
+		o = _mm_and_si128(_mm_avg_epu8(o, _mm_srli_epi32(o, 16)),
+									lmask);
+
+		_mm_storeu_si128((__m128i *)dst,
+			_mm_or_si128(_mm_or_si128(e, _mm_slli_epi32(o, 16)), c));
+	}
+
+	for (; x < n; ++x, a += 8, b += 8, dst += 4)
+		halve_pixel(dst, a, b);
+}
+
+#elif defined(__ARM_NEON__)
+
+/* Halve sixteen macropixels from rows a and b into eight per iteration. */
+static void halve_row(unsigned char *dst, const unsigned char *a,
+				const unsigned char *b, unsigned n)
+{
+	uint8x16x4_t pa, pb;
+	uint8x16_t y, u, v;
+	uint8x8x2_t yy, uu, vv;
+	uint8x8x4_t out;
+	unsigned x;
+
+	for (x = 0; x + 8 <= n; x += 8, a += 64, b += 64, dst += 32) {
+		pa = vld4q_u8(a);
+		pb = vld4q_u8(b);
+
+		/* luma per source macropixel, chroma per source column */
+		y = vrhaddq_u8(vrhaddq_u8(pa.val[0], pb.val[0]),
+				vrhaddq_u8(pa.val[2], pb.val[2]));
+		u = vrhaddq_u8(pa.val[1], pb.val[1]);
+		v = vrhaddq_u8(pa.val[3], pb.val[3]);
+
+		yy = vuzp_u8(vget_low_u8(y), vget_high_u8(y));
+		uu = vuzp_u8(vget_low_u8(u), vget_high_u8(u));
+		vv = vuzp_u8(vget_low_u8(v), vget_high_u8(v));
+
+		out.val[0] = yy.val[0];
+		out.val[1] = vrhadd_u8(uu.val[0], uu.val[1]);
+		out.val[2] = yy.val[1];
+		out.val[3] = vrhadd_u8(vv.val[0], vv.val[1]);
+		vst4_u8(dst, out);
+	}
+
+	for (; x < n; ++x, a += 8, b += 8, dst += 4)
+		halve_pixel(dst, a, b);
+}
+
+#else
+
+static void halve_row(unsigned char *dst, const unsigned char *a,
+				const unsigned char *b, unsigned n)
+{
+	unsigned x;
+
+	for (x = 0; x < n; ++x, a += 8, b += 8, dst += 4)
+		halve_pixel(dst, a, b);
+}
+
+#endif
+
+static void sample_row(unsigned char *dst, const unsigned char *src,
+					const unsigned *x_map, unsigned n)
+{
+	unsigned c;
+	unsigned x;
+
+	for (x = 0; x < n; ++x, x_map += 2, dst += 4) {
+		/* chroma from the macropixel of the first pixel */
+		c = x_map[0] & ~3U;
+		dst[0] = src[x_map[0]];
+		dst[1] = src[c + 1];
+		dst[2] = src[x_map[1]];
+		dst[3] = src[c + 3];
+	}
+}
+
+int scaler_init(struct scaler *sc, unsigned src_width, unsigned src_height,
+			unsigned src_stride, unsigned dst_width,
+			unsigned dst_height, unsigned dst_stride)
+{
+	unsigned i;
+
+	memset(sc, 0, sizeof(*sc));
+
+	if (dst_width % 2 || !dst_width || !dst_height ||
+			dst_width > src_width || dst_height > src_height)
+		return -1;
+
+	sc->src_width = src_width;
+	sc->src_height = src_height;
+	sc->src_stride = src_stride;
+	sc->dst_width = dst_width;
+	sc->dst_height = dst_height;
+	sc->dst_stride = dst_stride;
+
+	sc->halve = src_width == 2 * dst_width &&
+					src_height == 2 * dst_height;
+	if (sc->halve)
+		return 0;
+
+	sc->x_map = (unsigned *)malloc(dst_width * sizeof(*sc->x_map));
+	sc->y_map = (unsigned *)malloc(dst_height * sizeof(*sc->y_map));
+	if (!sc->x_map || !sc->y_map) {
+		scaler_free(sc);
+		return -1;
+	}
+
+	/* sample at the centre of each destination pixel */
+	for (i = 0; i < dst_width; ++i)
+		sc->x_map[i] = (2 * i + 1) * src_width / (2 * dst_width) * 2;
+	for (i = 0; i < dst_height; ++i)
+		sc->y_map[i] = (2 * i + 1) * src_height / (2 * dst_height);
+
+	return 0;
+}
+
+void scaler_free(struct scaler *sc)
+{
+	free(sc->x_map);
+	free(sc->y_map);
+	sc->x_map = NULL;
+	sc->y_map = NULL;
+}
+
+void scaler_run(struct scaler *sc, void *dst, const void *src)
+{
+	const unsigned char *s = (const unsigned char *)src;
+	unsigned char *d = (unsigned char *)dst;
+	long long start, cost;
+	unsigned y;
+
+	start = now_ns();
+
+	if (sc->halve) {
+		for (y = 0; y < sc->dst_height; ++y) {
+			halve_row(d, s, s + sc->src_stride, sc->dst_width / 2);
+			s += 2 * sc->src_stride;
+			d += sc->dst_stride;
+		}
+	} else {
+		for (y = 0; y < sc->dst_height; ++y) {
+			sample_row(d, s + sc->y_map[y] * sc->src_stride,
+					sc->x_map, sc->dst_width / 2);
+			d += sc->dst_stride;
+		}
+	}
+
+	cost = now_ns() - start;
+	++sc->frames;
+	sc->cost += cost;
+	if (cost > sc->cost_max)
+		sc->cost_max = cost;
+}
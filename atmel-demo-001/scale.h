@@ -0,0 +1,36 @@
+/*
+ * scale.h -- downscaling of YUYV frames for the preview
+ *
+ * Author: Johan Hovold <jhovold@gmail.com>
+ */
+
+#ifndef SCALE_H
+#define SCALE_H
+
+
+struct scaler {
+	unsigned src_width;
+	unsigned src_height;
+	unsigned src_stride;
+
+	unsigned dst_width;
+	unsigned dst_height;
+	unsigned dst_stride;
+
+	bool halve;		/* exactly half size in both directions */
+	unsigned *x_map;	/* source byte offset per destination pixel */
+	unsigned *y_map;	/* source row per destination row */
+
+	unsigned long frames;
+	long long cost;		/* ns, total */
+	unsigned cost_max;	/* ns */
+};
+
+int scaler_init(struct scaler *sc, unsigned src_width, unsigned src_height,
+			unsigned src_stride, unsigned dst_width,
+			unsigned dst_height, unsigned dst_stride);
+void scaler_free(struct scaler *sc);
+
+void scaler_run(struct scaler *sc, void *dst, const void *src);
+
+#endif	/* SCALE_H */
@@ -0,0 +1,254 @@
+/*
+ * snapshot.cpp -- still snapshots of the live stream
+ *
+ * A snapshot is a full-resolution frame handed over through a frame tap,
+ * like the frames recorded, so taking one costs the video worker no more
+ * than a reference. The snapshot thread copies the frame out and gives it
+ * back at once, so that the capture buffer returns to the driver within
+ * a memcpy rather than after the encoding, and then writes it as a JPEG
+ * or, for paths ending in .png, as a PNG.
+ *
+ * The latency reported is from the request to the file being closed.
+ *
+ * Author: Johan Hovold <jhovold@gmail.com>
+ */
+
+#include <cstdio>
+#include <strings.h>
+
+#include <QtGui/QImage>
+
+#include "common.h"
+#include "convert.h"
+#include "mjpeg.h"
+#include "snapshot.h"
+
+
+/* Compress the copy to a 4:2:2 JPEG. */
+static int write_jpeg(struct snapshotter *sn, FILE *out)
+{
+	struct mjpeg_encoder enc;
+	int ret;
+
+	if (mjpeg_init(&enc, sn->width, sn->height, sn->quality, false))
+		return -1;
+
+	ret = mjpeg_write(&enc, out, sn->copy, sn->stride);
+	mjpeg_free(&enc);
+
+	return ret;
+}
+
+/* Convert the copy to RGB and let Qt write the PNG. */
+static int write_png(struct snapshotter *sn, const char *path)
+{
+	unsigned stride = sn->width * 4;
+
+	if (!sn->rgb) {
+		sn->rgb = (unsigned char *)malloc(stride * sn->height);
+		if (!sn->rgb)
+			return -1;
+	}
+
+	convert_yuyv_xrgb(sn->rgb, stride, sn->copy, sn->stride, sn->width,
+								sn->height);
+
+	QImage image(sn->rgb, sn->width, sn->height, stride,
+							QImage::Format_RGB32);
+
+	return image.save(QString::fromLocal8Bit(path), "PNG") ? 0 : -1;
+}
+
+static bool is_png(const char *path)
+{
+	size_t len = strlen(path);
+
+	return len >= 4 && !strcasecmp(path + len - 4, ".png");
+}
+
+static void snapshot_save(struct snapshotter *sn,
+					const struct video_frame *frame)
+{
+	char path[SNAPSHOT_PATH_MAX];
+	long long requested, start, copied, end, latency;
+	size_t size = (size_t)sn->stride * sn->height;
+	FILE *out;
+	int ret;
+
+	start = now_ns();
+
+	pthread_mutex_lock(&sn->lock);
+	strcpy(path, sn->path);
+	requested = sn->requested;
+	pthread_mutex_unlock(&sn->lock);
+
+	if (frame->size < size) {
+		tap_done(&sn->tap, frame);
+		err("%s: short frame\n", path);
+		++sn->failed;
+		return;
+	}
+
+	memcpy(sn->copy, frame->data, size);
+	tap_done(&sn->tap, frame);
+
+	copied = now_ns();
+
+	if (is_png(path)) {
+		ret = write_png(sn, path);
+	} else {
+		out = fopen(path, "w");
+		if (!out) {
+			err_errno("%s", path);
+			++sn->failed;
+			return;
+		}
+		ret = write_jpeg(sn, out);
+		if (fclose(out))
+			ret = -1;
+	}
+
+	if (ret) {
+		err("%s: failed to write snapshot\n", path);
+		++sn->failed;
+		return;
+	}
+
+	end = now_ns();
+	latency = end - requested;
+
+	printf("%s - %s: %ux%u in %lld ms (frame after %lld ms, copy %lld us, "
+			"encode %lld ms)\n", __func__, path, sn->width,
+			sn->height, latency / 1000000,
+			(frame->timestamp - requested) / 1000000,
+			(copied - start) / 1000, (end - copied) / 1000000);
+
+	++sn->taken;
+	sn->latency += latency;
+	if (latency > sn->latency_max)
+		sn->latency_max = latency;
+}
+
+static void *snapshot_thread(void *arg)
+{
+	struct snapshotter *sn = (struct snapshotter *)arg;
+	struct video_frame frame;
+
+	rt_thread_setup("snapshot", &sn->rt);
+
+	while (tap_pop(&sn->tap, &frame)) {
+		snapshot_save(sn, &frame);
+
+		pthread_mutex_lock(&sn->lock);
+		sn->busy = false;
+		pthread_mutex_unlock(&sn->lock);
+	}
+
+	return NULL;
+}
+
+/*
+ * Start the snapshot thread for width x height YUYV frames, scheduled by rt.
+ */
+int snapshot_start(struct snapshotter *sn, unsigned width, unsigned height,
+			unsigned stride, unsigned quality,
+			const struct rt_params *rt)
+{
+	int ret;
+
+	memset(sn, 0, sizeof(*sn));
+	sn->width = width;
+	sn->height = height;
+	sn->stride = stride;
+	sn->quality = quality;
+	sn->rt = *rt;
+
+	sn->copy = (unsigned char *)malloc((size_t)stride * height);
+	if (!sn->copy)
+		return -1;
+
+	if (tap_init(&sn->tap, 1))
+		goto err_copy;
+
+	pthread_mutex_init(&sn->lock, NULL);
+
+	ret = pthread_create(&sn->thread, NULL, snapshot_thread, sn);
+	if (ret) {
+		errno = ret;
+		err_errno("pthread_create");
+		goto err_tap;
+	}
+
+	return 0;
+
+err_tap:
+	pthread_mutex_destroy(&sn->lock);
+	tap_free(&sn->tap);
+err_copy:
+	free(sn->copy);
+
+	return -1;
+}
+
+/*
+ * Stop the snapshot thread once it has given back its frame, which the
+ * caller must have reaped.
+ */
+void snapshot_stop(struct snapshotter *sn)
+{
+	tap_stop(&sn->tap);
+	pthread_join(sn->thread, NULL);
+
+	pthread_mutex_destroy(&sn->lock);
+	tap_free(&sn->tap);
+	free(sn->copy);
+	free(sn->rgb);
+
+	if (!sn->taken && !sn->failed)
+		return;
+
+	printf("%s - %lu snapshots, %lu failed, latency avg %lld max %lld ms\n",
+			__func__, sn->taken, sn->failed,
+			sn->taken ? sn->latency / sn->taken / 1000000 : 0,
+			sn->latency_max / 1000000);
+}
+
+/* Check whether a snapshot is still being written. */
+bool snapshot_busy(struct snapshotter *sn)
+{
+	bool busy;
+
+	pthread_mutex_lock(&sn->lock);
+	busy = sn->busy;
+	pthread_mutex_unlock(&sn->lock);
+
+	return busy;
+}
+
+/*
+ * Hand a referenced frame over to be written to path, which fails if a
+ * snapshot is still being written. The frame is given back through the
+ * tap.
+ */
+bool snapshot_take(struct snapshotter *sn, const struct video_frame *frame,
+					const char *path, long long requested)
+{
+	pthread_mutex_lock(&sn->lock);
+	if (sn->busy) {
+		pthread_mutex_unlock(&sn->lock);
+		return false;
+	}
+	snprintf(sn->path, sizeof(sn->path), "%s", path);
+	sn->requested = requested;
+	sn->busy = true;
+	pthread_mutex_unlock(&sn->lock);
+
+	if (!tap_push(&sn->tap, frame)) {
+		pthread_mutex_lock(&sn->lock);
+		sn->busy = false;
+		pthread_mutex_unlock(&sn->lock);
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,53 @@
+/*
+ * snapshot.h -- still snapshots of the live stream
+ *
+ * Author: Johan Hovold <jhovold@gmail.com>
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <pthread.h>
+
+#include "rt.h"
+#include "tap.h"
+
+
+#define SNAPSHOT_QUALITY	92
+#define SNAPSHOT_PATH_MAX	256
+
+struct snapshotter {
+	struct frame_tap tap;
+	pthread_t thread;
+
+	unsigned width;		/* YUYV frame geometry */
+	unsigned height;
+	unsigned stride;
+	unsigned quality;	/* JPEG */
+	struct rt_params rt;
+
+	/* request being served, under lock */
+	pthread_mutex_t lock;
+	bool busy;
+	char path[SNAPSHOT_PATH_MAX];
+	long long requested;	/* ns, CLOCK_MONOTONIC */
+
+	unsigned char *copy;	/* frame copied out of the tap */
+	unsigned char *rgb;	/* for PNG, allocated on first use */
+
+	unsigned long taken;
+	unsigned long failed;
+	long long latency;	/* ns, total */
+	long long latency_max;	/* ns */
+};
+
+int snapshot_start(struct snapshotter *sn, unsigned width, unsigned height,
+			unsigned stride, unsigned quality,
+			const struct rt_params *rt);
+void snapshot_stop(struct snapshotter *sn);
+
+bool snapshot_busy(struct snapshotter *sn);
+bool snapshot_take(struct snapshotter *sn, const struct video_frame *frame,
+					const char *path, long long requested);
+
+#endif	/* SNAPSHOT_H */
@@ -0,0 +1,681 @@
+/*
+ * stream.cpp -- network streaming of the live stream
+ *
+ * Frames are served over TCP, UDP or a Unix socket from a separate thread
+ * that is fed through a frame tap, much like the recorder. Every client has
+ * its own short queue of references to the shared frames, and each frame
+ * is sent with a single scatter-gather sendmsg() of header and payload
+ * straight from the capture buffer, using MSG_ZEROCOPY where the socket
+ * supports it. Zero-copy sends keep the frame until the kernel reports
+ * completion on the socket error queue.
+ *
+ * A client that cannot keep up loses its oldest unsent frames, and is
+ * disconnected if it makes no progress at all for STREAM_STALL, so that
+ * it never holds buffers needed by the capture queue or other clients.
+ *
+ * Author: Johan Hovold <jhovold@gmail.com>
+ */
+
+#include <endian.h>
+#include <fcntl.h>
+#include <linux/errqueue.h>
+#include <linux/videodev2.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "stream.h"
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY			60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY			0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY		5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED	1
+#endif
+
+
+#define STREAM_UDP_PAYLOAD	8192
+#define STREAM_STALL		1000000000LL	/* ns */
+#define STREAM_POLL		100		/* ms */
+
+
+static void slot_release(struct streamer *st, unsigned index)
+{
+	struct stream_slot *slot = &st->pool[index];
+
+	if (--slot->users)
+		return;
+
+	slot->used = false;
+	tap_done(&st->tap, &slot->frame);
+}
+
+static void slot_fill(struct streamer *st, struct stream_slot *slot,
+					const struct video_frame *frame)
+{
+	struct stream_header *hdr;
+	size_t offset, length;
+	unsigned i;
+
+	slot->frame = *frame;
+	slot->used = true;
+	slot->users = 0;
+
+	if (st->type == SOCK_STREAM)
+		slot->chunks = 1;
+	else
+		slot->chunks = (frame->size + STREAM_UDP_PAYLOAD - 1) /
+							STREAM_UDP_PAYLOAD;
+
+	for (i = 0, offset = 0; i < slot->chunks; ++i, offset += length) {
+		if (st->type == SOCK_STREAM)
+			length = frame->size;
+		else if (frame->size - offset < STREAM_UDP_PAYLOAD)
+			length = frame->size - offset;
+		else
+			length = STREAM_UDP_PAYLOAD;
+
+		hdr = &slot->headers[i];
+		hdr->magic = htobe32(STREAM_MAGIC);
+		hdr->sequence = htobe32(frame->sequence);
+		hdr->timestamp = htobe64(frame->timestamp);
+		hdr->fourcc = htobe32(V4L2_PIX_FMT_YUYV);
+		hdr->width = htobe16(st->width);
+		hdr->height = htobe16(st->height);
+		hdr->stride = htobe32(st->stride);
+		hdr->size = htobe32(frame->size);
+		hdr->offset = htobe32(offset);
+		hdr->length = htobe32(length);
+	}
+}
+
+static void client_add(struct streamer *st, int fd)
+{
+	struct stream_client *client;
+	int one = 1;
+
+	if (st->client_count == STREAM_CLIENTS_MAX) {
+		close(fd);
+		return;
+	}
+
+	client = &st->clients[st->client_count++];
+	memset(client, 0, sizeof(*client));
+	client->fd = fd;
+	client->progress = now_ns();
+
+	/* not supported by Unix sockets, which fall back to copying */
+	client->zerocopy = !setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one,
+								sizeof(one));
+
+	++st->clients_served;
+}
+
+static void client_remove(struct streamer *st, struct stream_client *client)
+{
+	unsigned i;
+
+	for (i = 0; i < client->count; ++i)
+		slot_release(st, client->queue[i].slot);
+
+	st->dropped += client->dropped;
+	st->copied += client->copied;
+
+	close(client->fd);
+
+	*client = st->clients[--st->client_count];
+}
+
+/*
+ * Release sent frames whose zero-copy transmission has completed.
+ */
+static void client_complete(struct streamer *st, struct stream_client *client)
+{
+	unsigned n;
+
+	for (n = 0; n < client->sent; ++n) {
+		if (client->zerocopy && (int32_t)(client->zc_acked -
+						client->queue[n].zc_end) < 0)
+			break;
+		slot_release(st, client->queue[n].slot);
+	}
+
+	if (!n)
+		return;
+
+	client->count -= n;
+	client->sent -= n;
+	memmove(&client->queue[0], &client->queue[n],
+				client->count * sizeof(client->queue[0]));
+
+	client->progress = now_ns();
+}
+
+static int client_errqueue(struct streamer *st, struct stream_client *client)
+{
+	struct sock_extended_err *serr;
+	struct cmsghdr *cm;
+	struct msghdr msg;
+	char control[128];
+	socklen_t len;
+	int error;
+
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		if (recvmsg(client->fd, &msg, MSG_ERRQUEUE) == -1) {
+			if (errno == EAGAIN)
+				break;
+			return -1;
+		}
+
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			serr = (struct sock_extended_err *)CMSG_DATA(cm);
+			if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY ||
+					serr->ee_errno)
+				continue;
+
+			/* completions are reported in order as ranges */
+			client->zc_acked = serr->ee_data + 1;
+			if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				client->copied += serr->ee_data -
+							serr->ee_info + 1;
+		}
+	}
+
+	/* clear any pending ICMP error, which would keep POLLERR raised */
+	if (st->type == SOCK_DGRAM) {
+		len = sizeof(error);
+		getsockopt(client->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+	}
+
+	client_complete(st, client);
+
+	return 0;
+}
+
+/*
+ * Send as much of the queued frames as the socket accepts. Returns -1 if
+ * the client should be disconnected.
+ */
+static int client_send(struct streamer *st, struct stream_client *client)
+{
+	const struct stream_slot *slot;
+	const unsigned char *data;
+	struct stream_entry *entry;
+	struct msghdr msg;
+	struct iovec iov[2];
+	size_t end, len;
+	ssize_t n;
+	int flags;
+
+	flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+	if (client->zerocopy)
+		flags |= MSG_ZEROCOPY;
+
+	while (client->sent < client->count) {
+		entry = &client->queue[client->sent];
+		slot = &st->pool[entry->slot];
+		data = (const unsigned char *)slot->frame.data;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+
+		if (st->type == SOCK_STREAM) {
+			end = sizeof(struct stream_header) + slot->frame.size;
+
+			if (client->offset < sizeof(struct stream_header)) {
+				iov[0].iov_base = (char *)&slot->headers[0] +
+								client->offset;
+				iov[0].iov_len = sizeof(struct stream_header) -
+								client->offset;
+				iov[1].iov_base = (void *)data;
+				iov[1].iov_len = slot->frame.size;
+				msg.msg_iovlen = 2;
+			} else {
+				iov[0].iov_base = (void *)(data + client->offset -
+						sizeof(struct stream_header));
+				iov[0].iov_len = end - client->offset;
+				msg.msg_iovlen = 1;
+			}
+		} else {
+			end = slot->frame.size;
+			len = end - client->offset;
+			if (len > STREAM_UDP_PAYLOAD)
+				len = STREAM_UDP_PAYLOAD;
+
+			iov[0].iov_base = &slot->headers[client->offset /
+							STREAM_UDP_PAYLOAD];
+			iov[0].iov_len = sizeof(struct stream_header);
+			iov[1].iov_base = (void *)(data + client->offset);
+			iov[1].iov_len = len;
+			msg.msg_iovlen = 2;
+		}
+
+		n = sendmsg(client->fd, &msg, flags);
+		if (n == -1) {
+			if (errno == EAGAIN || errno == ENOBUFS)
+				return 0;
+			/* nobody listening (yet) on the datagram peer */
+			if (st->type == SOCK_DGRAM && errno == ECONNREFUSED)
+				n = 0;
+			else
+				return -1;
+		} else if (client->zerocopy) {
+			++client->zc_next;
+		}
+
+		if (st->type == SOCK_STREAM)
+			client->offset += n;
+		else if (n)
+			client->offset += n - sizeof(struct stream_header);
+		else
+			client->offset = end;
+
+		client->progress = now_ns();
+
+		if (client->offset == end) {
+			entry->zc_end = client->zc_next;
+			client->offset = 0;
+			++client->sent;
+			++client->frames;
+		}
+	}
+
+	client_complete(st, client);
+
+	return 0;
+}
+
+/*
+ * Drop the unsent frames of a client, or only the oldest one if
+ * oldest_only is set. Returns the number of frames dropped.
+ */
+static unsigned client_drop(struct streamer *st, struct stream_client *client,
+							bool oldest_only)
+{
+	unsigned first, n;
+	unsigned i;
+
+	/* a partially sent frame must be completed */
+	first = client->sent + (client->offset ? 1 : 0);
+	if (first >= client->count)
+		return 0;
+
+	n = oldest_only ? 1 : client->count - first;
+
+	for (i = first; i < first + n; ++i)
+		slot_release(st, client->queue[i].slot);
+
+	client->count -= n;
+	memmove(&client->queue[first], &client->queue[first + n],
+			(client->count - first) * sizeof(client->queue[0]));
+	client->dropped += n;
+
+	return n;
+}
+
+static void stream_frame(struct streamer *st, const struct video_frame *frame)
+{
+	struct stream_client *client;
+	struct stream_slot *slot;
+	unsigned index;
+	unsigned i;
+
+	for (index = 0; st->pool[index].used; ++index)
+		;
+
+	slot = &st->pool[index];
+	slot_fill(st, slot, frame);
+
+	/* hold a reference while queueing, as drops may release the slot */
+	slot->users = 1;
+
+	for (i = 0; i < st->client_count; ++i) {
+		client = &st->clients[i];
+
+		if (client->count == st->client_depth &&
+					!client_drop(st, client, true)) {
+			++client->dropped;
+			continue;
+		}
+
+		if (!client->count)
+			client->progress = now_ns();
+		client->queue[client->count++].slot = index;
+		++slot->users;
+	}
+
+	++st->frames;
+
+	slot_release(st, index);
+}
+
+static int stream_socket(struct streamer *st)
+{
+	const char *addr = st->opts.address;
+	struct addrinfo hints, *res;
+	struct sockaddr_un sun;
+	char host[256];
+	const char *port;
+	int one = 1;
+	int fd;
+	int ret;
+
+	st->fd_listen = -1;
+
+	if (!strncmp(addr, "unix:", 5)) {
+		st->type = SOCK_STREAM;
+		st->unix_path = addr + 5;
+
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		if (strlen(st->unix_path) >= sizeof(sun.sun_path)) {
+			err("%s: path too long\n", addr);
+			return -1;
+		}
+		strcpy(sun.sun_path, st->unix_path);
+
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK |
+							SOCK_CLOEXEC, 0);
+		if (fd < 0) {
+			err_errno("socket");
+			return -1;
+		}
+
+		unlink(st->unix_path);
+		if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) ||
+				listen(fd, STREAM_CLIENTS_MAX)) {
+			err_errno("%s", addr);
+			close(fd);
+			return -1;
+		}
+
+		st->fd_listen = fd;
+
+		return 0;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+
+	if (!strncmp(addr, "tcp:", 4)) {
+		st->type = SOCK_STREAM;
+		hints.ai_flags = AI_PASSIVE;
+	} else if (!strncmp(addr, "udp:", 4)) {
+		st->type = SOCK_DGRAM;
+	} else {
+		err("%s: unknown address type\n", addr);
+		return -1;
+	}
+	hints.ai_socktype = st->type;
+
+	/* the port follows the last colon, so that IPv6 hosts work */
+	addr += 4;
+	port = strrchr(addr, ':');
+	if (port) {
+		if ((size_t)(port - addr) >= sizeof(host)) {
+			err("%s: host name too long\n", addr);
+			return -1;
+		}
+		memcpy(host, addr, port - addr);
+		host[port - addr] = '\0';
+		++port;
+	} else if (st->type == SOCK_STREAM) {
+		host[0] = '\0';
+		port = addr;
+	} else {
+		err("%s: destination host required\n", st->opts.address);
+		return -1;
+	}
+
+	ret = getaddrinfo(host[0] ? host : NULL, port, &hints, &res);
+	if (ret) {
+		err("%s: %s\n", st->opts.address, gai_strerror(ret));
+		return -1;
+	}
+
+	fd = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK |
+						SOCK_CLOEXEC, res->ai_protocol);
+	if (fd < 0) {
+		err_errno("socket");
+		freeaddrinfo(res);
+		return -1;
+	}
+
+	if (st->type == SOCK_STREAM) {
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		ret = bind(fd, res->ai_addr, res->ai_addrlen);
+		if (!ret)
+			ret = listen(fd, STREAM_CLIENTS_MAX);
+	} else {
+		ret = connect(fd, res->ai_addr, res->ai_addrlen);
+	}
+
+	freeaddrinfo(res);
+
+	if (ret) {
+		err_errno("%s", st->opts.address);
+		close(fd);
+		return -1;
+	}
+
+	/* datagrams have a single, fixed client */
+	if (st->type == SOCK_STREAM)
+		st->fd_listen = fd;
+	else
+		client_add(st, fd);
+
+	return 0;
+}
+
+static void *stream_thread(void *arg)
+{
+	struct streamer *st = (struct streamer *)arg;
+	struct pollfd pfds[STREAM_CLIENTS_MAX + 2];
+	struct stream_client *client;
+	struct video_frame frame;
+	bool draining;
+	long long now;
+	unsigned nfds, polled;
+	unsigned i;
+	char discard[256];
+	int fd;
+	int ret;
+
+	rt_thread_setup("stream", &st->opts.rt);
+
+	for (;;) {
+		while ((ret = tap_try_pop(&st->tap, &frame)) > 0)
+			stream_frame(st, &frame);
+		if (ret < 0)
+			break;
+
+		/* give back what we can while the worker waits for us */
+		draining = tap_draining(&st->tap);
+		now = now_ns();
+
+		for (i = 0; i < st->client_count; ) {
+			client = &st->clients[i];
+
+			if (draining)
+				client_drop(st, client, false);
+
+			if (client_send(st, client) ||
+					(st->type == SOCK_STREAM &&
+					client->count &&
+					now - client->progress > STREAM_STALL)) {
+				if (client->count)
+					++st->stalls;
+				client_remove(st, client);
+				continue;
+			}
+			++i;
+		}
+
+		pfds[0].fd = st->tap.pop_fd;
+		pfds[0].events = POLLIN;
+		nfds = 1;
+
+		if (st->fd_listen >= 0) {
+			pfds[nfds].fd = st->fd_listen;
+			pfds[nfds].events = POLLIN;
+			++nfds;
+		}
+
+		for (i = 0; i < st->client_count; ++i) {
+			client = &st->clients[i];
+			pfds[nfds].fd = client->fd;
+			pfds[nfds].events = st->type == SOCK_STREAM ? POLLIN : 0;
+			if (client->sent < client->count)
+				pfds[nfds].events |= POLLOUT;
+			++nfds;
+		}
+
+		polled = nfds;
+		ret = poll(pfds, nfds, STREAM_POLL);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			die_errno("poll");
+		}
+
+		nfds = 1;
+
+		if (st->fd_listen >= 0) {
+			if (pfds[nfds].revents & POLLIN) {
+				fd = accept4(st->fd_listen, NULL, NULL,
+						SOCK_NONBLOCK | SOCK_CLOEXEC);
+				if (fd >= 0)
+					client_add(st, fd);
+			}
+			++nfds;
+		}
+
+		/* clients added above are polled on the next round */
+		for (i = 0; i < st->client_count; ) {
+			client = &st->clients[i];
+
+			if (nfds == polled || client->fd != pfds[nfds].fd)
+				break;
+			++nfds;
+
+			if (pfds[nfds - 1].revents & POLLERR &&
+					client_errqueue(st, client)) {
+				client_remove(st, client);
+				continue;
+			}
+
+			/* clients are not expected to talk, only to hang up */
+			if (pfds[nfds - 1].revents & (POLLIN | POLLHUP)) {
+				ret = recv(client->fd, discard,
+						sizeof(discard), MSG_DONTWAIT);
+				if (ret == 0 || (ret < 0 && errno != EAGAIN)) {
+					client_remove(st, client);
+					continue;
+				}
+			}
+			++i;
+		}
+	}
+
+	while (st->client_count)
+		client_remove(st, &st->clients[0]);
+
+	return NULL;
+}
+
+/*
+ * Start serving width x height YUYV frames on the configured address.
+ */
+int streamer_start(struct streamer *st, const struct stream_options *opts,
+			unsigned width, unsigned height, unsigned stride)
+{
+	unsigned chunks;
+	unsigned i;
+	int ret;
+
+	memset(st, 0, sizeof(*st));
+	st->opts = *opts;
+	st->width = width;
+	st->height = height;
+	st->stride = stride;
+
+	/* a single client may never hold all frames */
+	st->client_depth = opts->depth > 1 ? opts->depth - 1 : 1;
+
+	if (tap_init(&st->tap, opts->depth))
+		return -1;
+
+	chunks = (stride * height + STREAM_UDP_PAYLOAD - 1) /
+							STREAM_UDP_PAYLOAD;
+	for (i = 0; i < TAP_DEPTH_MAX; ++i) {
+		st->pool[i].headers = (struct stream_header *)calloc(chunks,
+						sizeof(struct stream_header));
+		if (!st->pool[i].headers)
+			goto err_free;
+	}
+
+	if (stream_socket(st))
+		goto err_free;
+
+	ret = pthread_create(&st->thread, NULL, stream_thread, st);
+	if (ret) {
+		errno = ret;
+		err_errno("pthread_create");
+		goto err_close;
+	}
+
+	return 0;
+
+err_close:
+	while (st->client_count)
+		client_remove(st, &st->clients[0]);
+	if (st->fd_listen >= 0)
+		close(st->fd_listen);
+err_free:
+	for (i = 0; i < TAP_DEPTH_MAX; ++i)
+		free(st->pool[i].headers);
+	tap_free(&st->tap);
+
+	return -1;
+}
+
+/*
+ * Stop the streamer once it has given back all frames, which the caller
+ * must have reaped.
+ */
+void streamer_stop(struct streamer *st)
+{
+	unsigned i;
+
+	tap_stop(&st->tap);
+	pthread_join(st->thread, NULL);
+
+	if (st->fd_listen >= 0)
+		close(st->fd_listen);
+	if (st->unix_path)
+		unlink(st->unix_path);
+
+	for (i = 0; i < TAP_DEPTH_MAX; ++i)
+		free(st->pool[i].headers);
+	tap_free(&st->tap);
+
+	printf("%s - %lu frames, %lu clients, %lu dropped, %lu stalled, "
+			"%lu zero-copy sends copied\n", __func__, st->frames,
+			st->clients_served, st->dropped + st->tap.dropped,
+			st->stalls, st->copied);
+}
@@ -0,0 +1,106 @@
+/*
+ * stream.h -- network streaming of the live stream
+ *
+ * Author: Johan Hovold <jhovold@gmail.com>
+ */
+
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "rt.h"
+#include "tap.h"
+
+
+#define STREAM_CLIENTS_MAX	8
+#define STREAM_MAGIC		0x56344c46	/* "V4LF" */
+
+/*
+ * Every frame, or with UDP every datagram, starts with a header in network
+ * byte order. Over stream sockets the payload is the whole frame, while
+ * datagrams carry length bytes of the frame starting at offset.
+ */
+struct stream_header {
+	uint32_t magic;
+	uint32_t sequence;
+	uint64_t timestamp;	/* ns, CLOCK_MONOTONIC */
+	uint32_t fourcc;
+	uint16_t width;
+	uint16_t height;
+	uint32_t stride;
+	uint32_t size;		/* frame size */
+	uint32_t offset;	/* payload offset into frame */
+	uint32_t length;	/* payload length */
+};
+
+struct stream_options {
+	/* tcp:[host:]port, udp:host:port or unix:path, NULL to disable */
+	const char *address;
+	unsigned depth;		/* frames held for all clients */
+	struct rt_params rt;	/* of the streamer thread */
+};
+
+struct stream_slot {
+	struct video_frame frame;
+	bool used;
+	unsigned users;		/* clients still sending the frame */
+	struct stream_header *headers;
+	unsigned chunks;
+};
+
+struct stream_entry {
+	unsigned slot;
+	uint32_t zc_end;	/* zero-copy id following the last send */
+};
+
+struct stream_client {
+	int fd;
+	bool zerocopy;
+
+	/* sent frames awaiting completion, followed by frames to send */
+	struct stream_entry queue[TAP_DEPTH_MAX];
+	unsigned count;
+	unsigned sent;
+	size_t offset;		/* progress of the first frame to send */
+
+	uint32_t zc_next;
+	uint32_t zc_acked;
+	long long progress;
+
+	unsigned long frames;
+	unsigned long dropped;
+	unsigned long copied;
+};
+
+struct streamer {
+	struct frame_tap tap;
+	pthread_t thread;
+
+	struct stream_options opts;
+	unsigned width;		/* YUYV frame geometry */
+	unsigned height;
+	unsigned stride;
+
+	int type;		/* SOCK_STREAM or SOCK_DGRAM */
+	int fd_listen;
+	const char *unix_path;
+
+	struct stream_slot pool[TAP_DEPTH_MAX];
+	struct stream_client clients[STREAM_CLIENTS_MAX];
+	unsigned client_count;
+	unsigned client_depth;
+
+	unsigned long clients_served;
+	unsigned long frames;
+	unsigned long dropped;
+	unsigned long copied;
+	unsigned long stalls;
+};
+
+int streamer_start(struct streamer *st, const struct stream_options *opts,
+			unsigned width, unsigned height, unsigned stride);
+void streamer_stop(struct streamer *st);
+
+#endif	/* STREAM_H */
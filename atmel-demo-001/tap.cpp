@@ -0,0 +1,216 @@
+/*
+ * tap.cpp -- bounded frame queue from the video worker to a consumer thread
+ *
+ * Frames are passed by reference, so the producer must keep the backing
+ * buffer until the consumer gives the frame back, which is signalled
+ * through an eventfd that the producer can select on. A full tap drops the
+ * new frame rather than stalling the producer. Consumers that need to
+ * poll on other descriptors can do so on a second eventfd instead of
+ * blocking in tap_pop().
+ *
+ * Author: Johan Hovold <jhovold@gmail.com>
+ */
+
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "tap.h"
+
+
+int tap_init(struct frame_tap *tap, unsigned depth)
+{
+	memset(tap, 0, sizeof(*tap));
+
+	if (!depth || depth > TAP_DEPTH_MAX)
+		return -1;
+
+	tap->depth = depth;
+
+	tap->event_fd = eventfd(0, EFD_NONBLOCK);
+	if (tap->event_fd < 0)
+		return -1;
+
+	tap->pop_fd = eventfd(0, EFD_NONBLOCK);
+	if (tap->pop_fd < 0) {
+		close(tap->event_fd);
+		return -1;
+	}
+
+	pthread_mutex_init(&tap->lock, NULL);
+	pthread_cond_init(&tap->cond, NULL);
+
+	return 0;
+}
+
+void tap_free(struct frame_tap *tap)
+{
+	close(tap->event_fd);
+	close(tap->pop_fd);
+	pthread_cond_destroy(&tap->cond);
+	pthread_mutex_destroy(&tap->lock);
+}
+
+static void tap_kick(struct frame_tap *tap)
+{
+	uint64_t event = 1;
+
+	if (write(tap->pop_fd, &event, sizeof(event)) < 0)
+		err_errno("eventfd");
+}
+
+/*
+ * Hand a frame to the consumer. Returns false if the consumer is behind and
+ * the frame was dropped.
+ */
+bool tap_push(struct frame_tap *tap, const struct video_frame *frame)
+{
+	pthread_mutex_lock(&tap->lock);
+
+	if (tap->outstanding == tap->depth || tap->stop) {
+		++tap->dropped;
+		pthread_mutex_unlock(&tap->lock);
+		return false;
+	}
+
+	tap->queue[(tap->head + tap->count) % TAP_DEPTH_MAX] = *frame;
+	++tap->count;
+	++tap->outstanding;
+	++tap->pushed;
+	pthread_cond_broadcast(&tap->cond);
+
+	pthread_mutex_unlock(&tap->lock);
+
+	tap_kick(tap);
+
+	return true;
+}
+
+/* Get a frame given back by the consumer, if any. */
+bool tap_reap(struct frame_tap *tap, struct video_frame *frame)
+{
+	uint64_t event;
+	bool ret = false;
+
+	if (read(tap->event_fd, &event, sizeof(event)) < 0 && errno != EAGAIN)
+		err_errno("eventfd");
+
+	pthread_mutex_lock(&tap->lock);
+	if (tap->done_count) {
+		*frame = tap->done[--tap->done_count];
+		--tap->outstanding;
+		ret = true;
+	}
+	pthread_mutex_unlock(&tap->lock);
+
+	return ret;
+}
+
+/*
+ * Wait for the consumer to give back all frames (which still need to be
+ * reaped). Consumers that hold on to frames should give them back early
+ * while the tap is draining.
+ */
+void tap_drain(struct frame_tap *tap)
+{
+	pthread_mutex_lock(&tap->lock);
+	tap->draining = true;
+	pthread_mutex_unlock(&tap->lock);
+
+	tap_kick(tap);
+
+	pthread_mutex_lock(&tap->lock);
+	while (tap->outstanding != tap->done_count)
+		pthread_cond_wait(&tap->cond, &tap->lock);
+	tap->draining = false;
+	pthread_mutex_unlock(&tap->lock);
+}
+
+/*
+ * Wait for the next frame. Returns false when the tap has been stopped and
+ * there are no more frames.
+ */
+bool tap_pop(struct frame_tap *tap, struct video_frame *frame)
+{
+	bool ret = false;
+
+	pthread_mutex_lock(&tap->lock);
+
+	while (!tap->count && !tap->stop)
+		pthread_cond_wait(&tap->cond, &tap->lock);
+
+	if (tap->count) {
+		*frame = tap->queue[tap->head];
+		tap->head = (tap->head + 1) % TAP_DEPTH_MAX;
+		--tap->count;
+		ret = true;
+	}
+
+	pthread_mutex_unlock(&tap->lock);
+
+	return ret;
+}
+
+/*
+ * Get the next frame without blocking. Returns 1 if a frame was returned,
+ * 0 if there is none yet, and -1 if the tap has been stopped and there are
+ * no more frames.
+ */
+int tap_try_pop(struct frame_tap *tap, struct video_frame *frame)
+{
+	uint64_t event;
+	int ret = 0;
+
+	if (read(tap->pop_fd, &event, sizeof(event)) < 0 && errno != EAGAIN)
+		err_errno("eventfd");
+
+	pthread_mutex_lock(&tap->lock);
+
+	if (tap->count) {
+		*frame = tap->queue[tap->head];
+		tap->head = (tap->head + 1) % TAP_DEPTH_MAX;
+		--tap->count;
+		ret = 1;
+	} else if (tap->stop) {
+		ret = -1;
+	}
+
+	pthread_mutex_unlock(&tap->lock);
+
+	return ret;
+}
+
+bool tap_draining(struct frame_tap *tap)
+{
+	bool ret;
+
+	pthread_mutex_lock(&tap->lock);
+	ret = tap->draining;
+	pthread_mutex_unlock(&tap->lock);
+
+	return ret;
+}
+
+void tap_done(struct frame_tap *tap, const struct video_frame *frame)
+{
+	uint64_t event = 1;
+
+	pthread_mutex_lock(&tap->lock);
+	tap->done[tap->done_count++] = *frame;
+	pthread_cond_broadcast(&tap->cond);
+	pthread_mutex_unlock(&tap->lock);
+
+	if (write(tap->event_fd, &event, sizeof(event)) < 0)
+		err_errno("eventfd");
+}
+
+void tap_stop(struct frame_tap *tap)
+{
+	pthread_mutex_lock(&tap->lock);
+	tap->stop = true;
+	pthread_cond_broadcast(&tap->cond);
+	pthread_mutex_unlock(&tap->lock);
+
+	tap_kick(tap);
+}
@@ -0,0 +1,54 @@
+/*
+ * tap.h -- bounded frame queue from the video worker to a consumer thread
+ *
+ * Author: Johan Hovold <jhovold@gmail.com>
+ */
+
+#ifndef TAP_H
+#define TAP_H
+
+#include <pthread.h>
+
+#include "frame.h"
+
+
+#define TAP_DEPTH_MAX	16
+
+struct frame_tap {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool stop;
+	bool draining;
+
+	/* frames handed to the consumer */
+	struct video_frame queue[TAP_DEPTH_MAX];
+	unsigned head;
+	unsigned count;
+	unsigned depth;
+
+	/* frames given back by the consumer */
+	struct video_frame done[TAP_DEPTH_MAX];
+	unsigned done_count;
+
+	unsigned outstanding;
+	int event_fd;		/* frames given back */
+	int pop_fd;		/* frames or state change for the consumer */
+
+	unsigned long pushed;
+	unsigned long dropped;
+};
+
+int tap_init(struct frame_tap *tap, unsigned depth);
+void tap_free(struct frame_tap *tap);
+
+bool tap_push(struct frame_tap *tap, const struct video_frame *frame);
+bool tap_reap(struct frame_tap *tap, struct video_frame *frame);
+void tap_drain(struct frame_tap *tap);
+
+bool tap_pop(struct frame_tap *tap, struct video_frame *frame);
+int tap_try_pop(struct frame_tap *tap, struct video_frame *frame);
+bool tap_draining(struct frame_tap *tap);
+void tap_done(struct frame_tap *tap, const struct video_frame *frame);
+void tap_stop(struct frame_tap *tap);
+
+#endif	/* TAP_H */
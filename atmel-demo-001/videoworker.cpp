@@ -13,23 +13,147 @@
 #include <linux/videodev2.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "common.h"
+#include "convert.h"
 #include "videoworker.h"
 
 
 #define CAPTURE_BUFFER_COUNT	8
 #define OUTPUT_BUFFER_COUNT	4
 
+#define CAPTURE_BUFFER_MIN	3
+#define CAPTURE_BUFFER_MAX	16
+#define DROP_TARGET		5	/* per mille */
 
-static void v4l_streamon(int fd, enum v4l2_buf_type type, size_t count)
+#define TUNE_WINDOW		64	/* frames per tuning decision */
+#define TUNE_HEADROOM		2	/* spare queued buffers before shrinking */
+
+#define PRESENT_DELAY		20000	/* us */
+#define PRESENT_DEPTH		1
+#define REFRESH_RATE		60
+
+#define MOTION_BUDGET		500	/* us */
+#define SKIP_THRESHOLD		150	/* hundredths of a luma level */
+
+#define DECODE_THREADS		2
+
+#define FIELD_PERIOD		20000000LL	/* ns, until measured */
+
+#define OSD_MARGIN		8
+#define OSD_DOT_SIZE		16
+#define OSD_DOT_COLOR		0xe02020
+
+enum {
+	OSD_ITEM_TIME,
+	OSD_ITEM_REC,
+	OSD_ITEM_LABEL
+};
+
+#define RECORD_QUALITY		80
+#define RECORD_DEPTH		3
+
+#define STREAM_DEPTH		3
+
+#define PRERECORD_SECONDS	10
+#define PRERECORD_POST		5	/* s */
+#define PRERECORD_MEMORY	(32 << 20)
+#define PRERECORD_DEPTH		3
+
+#define BUS_SLOTS		4
+
+#define REPLAY_RATE		30
+
+#define PATTERN_RATE		30
+
+#define CAPTURE_TIMEOUT		1000	/* ms without frames before restarting */
+#define REOPEN_INTERVAL		500	/* ms */
+
+
+video_options::video_options() :
+	capture_fourcc(V4L2_PIX_FMT_YUYV),
+	decode_threads(DECODE_THREADS),
+	capture_buffers(CAPTURE_BUFFER_COUNT),
+	output_buffers(OUTPUT_BUFFER_COUNT),
+	adaptive_buffers(false),
+	min_capture_buffers(CAPTURE_BUFFER_MIN),
+	max_capture_buffers(CAPTURE_BUFFER_MAX),
+	drop_target(DROP_TARGET),
+	skip_backlog(0),
+	lock_memory(false),
+	present(false),
+	present_delay(PRESENT_DELAY),
+	present_depth(PRESENT_DEPTH),
+	refresh(REFRESH_RATE),
+	motion(false),
+	motion_budget(MOTION_BUDGET),
+	skip_static(false),
+	skip_threshold(SKIP_THRESHOLD)
+{
+	for (unsigned i = 0; i < RT_THREAD_COUNT; ++i)
+		rt_params_init(&rt[i]);
+
+	memset(&record, 0, sizeof(record));
+	record.quality = RECORD_QUALITY;
+	record.depth = RECORD_DEPTH;
+
+	memset(&stream, 0, sizeof(stream));
+	stream.depth = STREAM_DEPTH;
+
+	memset(&prerecord, 0, sizeof(prerecord));
+	prerecord.seconds = PRERECORD_SECONDS;
+	prerecord.post = PRERECORD_POST;
+	prerecord.memory = PRERECORD_MEMORY;
+	prerecord.depth = PRERECORD_DEPTH;
+
+	bus_path = NULL;
+	bus_slots = BUS_SLOTS;
+
+	fb_path = NULL;
+	drm_path = NULL;
+
+	denoise = 0;
+
+	checksum = false;
+
+	deinterlace = false;
+	deint_mode = DEINT_ADAPTIVE;
+	field_rate = false;
+
+	osd = false;
+	osd_label = NULL;
+
+	replay_path = NULL;
+	replay_speed = 100;
+	replay_rate = REPLAY_RATE;
+	replay_loop = false;
+
+	pattern = false;
+	pattern_rate = PATTERN_RATE;
+}
+
+/*
+ * Queue all buffers that are neither parked nor in use and start streaming.
+ * The number of buffers queued is returned in queued, also on errors.
+ * Returns zero or an errno.
+ */
+static int v4l_streamon(int fd, enum v4l2_buf_type type,
+			const struct video_buffer *buffers, unsigned count,
+			unsigned *queued)
 {
 	struct v4l2_buffer buf;
 	int arg;
+	int ret;
 	unsigned i;
 
+	*queued = 0;
+
 	for (i = 0; i < count; ++i) {
+		if (buffers[i].parked || buffers[i].refs)
+			continue;
+
 		memset(&buf, 0, sizeof(buf));
 
 		buf.type = type;
@@ -37,12 +161,21 @@ static void v4l_streamon(int fd, enum v4l2_buf_type type, size_t count)
 		buf.index = i;
 
 		if (ioctl(fd, VIDIOC_QBUF, &buf) == -1)
-			die_errno("VIDIOC_QBUF");
+			goto err;
+		++*queued;
 	}
 
 	arg = type;
 	if (ioctl(fd, VIDIOC_STREAMON, &arg) == -1)
-		die_errno("%s", __func__);
+		goto err;
+
+	return 0;
+
+err:
+	ret = errno;
+	err_errno("%s", __func__);
+
+	return ret;
 }
 
 static void v4l_streamoff(int fd, enum v4l2_buf_type type)
@@ -54,12 +187,63 @@ static void v4l_streamoff(int fd, enum v4l2_buf_type type)
 		err_errno("%s", __func__);
 }
 
+static int v4l_buffer_map(int fd, enum v4l2_buf_type type,
+				struct video_buffer *buffer, unsigned index)
+{
+	struct v4l2_buffer buf;
+
+	memset(&buf, 0, sizeof(buf));
+	buf.type = type;
+	buf.memory = V4L2_MEMORY_MMAP;
+	buf.index = index;
+
+	if (ioctl(fd, VIDIOC_QUERYBUF, &buf) == -1) {
+		err_errno("VIDIOC_QUERYBUF");
+		return -1;
+	}
+
+	buffer->parked = false;
+	buffer->refs = 0;
+	buffer->dmabuf = -1;
+	buffer->length = buf.length;
+	buffer->start = mmap(NULL,
+				buf.length,
+				PROT_READ | PROT_WRITE,
+				MAP_SHARED,
+				fd,
+				buf.m.offset);
+
+	if (buffer->start == MAP_FAILED) {
+		err_errno("mmap");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void v4l_buffers_unmap(struct video_buffer *buffers, unsigned count)
+{
+	unsigned i;
+	int ret;
+
+	for (i = 0; i < count; ++i) {
+		if (buffers[i].dmabuf >= 0)
+			close(buffers[i].dmabuf);
+		ret = munmap(buffers[i].start, buffers[i].length);
+		if (ret == -1)
+			err_errno("munmap - buf %d", i);
+	}
+}
+
+/*
+ * Allocate and map count buffers, or fewer if that is what the driver
+ * provides. Returns NULL on errors.
+ */
 static struct video_buffer *v4l_buffers_alloc(int fd, enum v4l2_buf_type type,
-								size_t *count)
+							unsigned *count)
 {
 	struct video_buffer *buffers;
 	struct v4l2_requestbuffers req;
-	struct v4l2_buffer buf;
 	unsigned i;
 
 	memset(&req, 0, sizeof(req));
@@ -67,57 +251,102 @@ static struct video_buffer *v4l_buffers_alloc(int fd, enum v4l2_buf_type type,
 	req.type   = type;
 	req.memory = V4L2_MEMORY_MMAP;
 
-	if (ioctl(fd, VIDIOC_REQBUFS, &req) == -1)
-		die_errno("VIDIOC_REQBUFS");
+	if (ioctl(fd, VIDIOC_REQBUFS, &req) == -1) {
+		err_errno("VIDIOC_REQBUFS");
+		return NULL;
+	}
 
 	if (req.count < *count)
 		printf("%s - %u (%u)\n", __func__, req.count, *count);
 
-	if (req.count < 2)
-		die("insufficient buffer memory\n");
+	if (req.count < 2) {
+		err("insufficient buffer memory\n");
+		goto err_free;
+	}
 
 	*count = req.count;
 
 	buffers = (struct video_buffer *)calloc(req.count, sizeof(*buffers));
-	if (!buffers)
-		die_errno("calloc");
+	if (!buffers) {
+		err_errno("calloc");
+		goto err_free;
+	}
 
 	for (i = 0; i < req.count; ++i) {
-		memset(&buf, 0, sizeof(buf));
-		buf.type = type;
-		buf.memory = V4L2_MEMORY_MMAP;
-		buf.index = i;
+		if (v4l_buffer_map(fd, type, &buffers[i], i)) {
+			v4l_buffers_unmap(buffers, i);
+			free(buffers);
+			goto err_free;
+		}
+	}
+
+	return buffers;
+
+err_free:
+	req.count = 0;
+	ioctl(fd, VIDIOC_REQBUFS, &req);
+
+	return NULL;
+}
+
+/*
+ * Add buffers to an already allocated (and possibly streaming) queue using
+ * the current format. Returns the number of buffers added, which is zero if
+ * the driver does not support VIDIOC_CREATE_BUFS or is out of memory.
+ */
+static unsigned v4l_buffers_create(int fd, enum v4l2_buf_type type,
+				struct video_buffer **buffers, unsigned *count,
+				unsigned n)
+{
+	struct video_buffer *new_buffers;
+	struct v4l2_create_buffers create;
+	unsigned i;
+
+	memset(&create, 0, sizeof(create));
+	create.count = n;
+	create.memory = V4L2_MEMORY_MMAP;
+	create.format.type = type;
 
-		if (ioctl(fd, VIDIOC_QUERYBUF, &buf) == -1)
-			die_errno("VIDIOC_QUERYBUF");
+	if (ioctl(fd, VIDIOC_G_FMT, &create.format) == -1) {
+		err_errno("VIDIOC_G_FMT");
+		return 0;
+	}
+
+	if (ioctl(fd, VIDIOC_CREATE_BUFS, &create) == -1) {
+		err_errno("VIDIOC_CREATE_BUFS");
+		return 0;
+	}
 
-		buffers[i].length = buf.length;
-		buffers[i].start = mmap(NULL,
-					buf.length,
-					PROT_READ | PROT_WRITE,
-					MAP_SHARED,
-					fd,
-					buf.m.offset);
+	if (!create.count)
+		return 0;
 
-		if (buffers[i].start == MAP_FAILED)
-			die_errno("mmap");
+	new_buffers = (struct video_buffer *)realloc(*buffers,
+			(create.index + create.count) * sizeof(*new_buffers));
+	if (!new_buffers) {
+		err_errno("realloc");
+		return 0;
 	}
 
-	return buffers;
+	*buffers = new_buffers;
+
+	/* buffers that cannot be mapped are left unused */
+	for (i = create.index; i < create.index + create.count; ++i) {
+		if (v4l_buffer_map(fd, type, &new_buffers[i], i))
+			break;
+	}
+
+	*count = i;
+
+	return i - create.index;
 }
 
 static void v4l_buffers_free(int fd, enum v4l2_buf_type type,
-				struct video_buffer *buffers, size_t count)
+				struct video_buffer *buffers, unsigned count)
 {
 	struct v4l2_requestbuffers req;
-	unsigned i;
-	int ret;
 
-	for (i = 0; i < count; ++i) {
-		ret = munmap(buffers[i].start, buffers[i].length);
-		if (ret == -1)
-			err_errno("munmap - buf %d", i);
-	}
+	v4l_buffers_unmap(buffers, count);
+	free(buffers);
 
 	memset(&req, 0, sizeof(req));
 	req.count  = 0;
@@ -129,54 +358,231 @@ static void v4l_buffers_free(int fd, enum v4l2_buf_type type,
 }
 
 VideoWorker::VideoWorker(const char *device_capture, const char *device_output,
-				QSize &videoSize, QObject *parent) :
+				QSize &videoSize, const video_options &options,
+				QObject *parent) :
 	QObject(parent),
-	videoSize(videoSize)
+	videoSize(videoSize),
+	opts(options)
 {
+	/* full-resolution source with a downscaled preview, if larger */
+	sourceSize = opts.capture_size.isValid() ? opts.capture_size : videoSize;
+	scaling = false;
+	fb_output = false;
+	fb_staging = NULL;
+	drm_output = false;
+	denoising = false;
+	deinterlacing = false;
+	deint_staging = NULL;
+	deint_first = 0;
+	deint_field = 0;
+	deint_last = 0;
+	field_period = FIELD_PERIOD;
+	annotating = false;
+	osd_time = 0;
+
 	dev_capture = device_capture;
 	dev_output = device_output;
+
+	motion_skipped = 0;
+	checksumming = false;
+	decoding = false;
+	recording = false;
+	streaming = false;
+	prerecording = false;
+	snapshotting = false;
+	snapshot_requested = 0;
+	publishing = false;
+	replaying = false;
+	generating = false;
+	first_frame = false;
+
+	fd_capture = -1;
+	fd_output = -1;
+	capture_error = 0;
+	output_error = 0;
+	recover_init(&capture_recovery, "capture", true);
+	recover_init(&output_recovery, "output", false);
 }
 
 VideoWorker::~VideoWorker()
 {
 }
 
-void VideoWorker::initCapture()
+/*
+ * Open the capture device and set up its format and buffers. This is also
+ * used to get the device back after it has gone away, so errors are
+ * returned rather than fatal.
+ */
+int VideoWorker::openCapture()
 {
 	struct v4l2_capability cap;
 	struct v4l2_format fmt;
 
-	if (ioctl(fd_capture, VIDIOC_QUERYCAP, &cap) == -1)
-		die_errno("VIDIOC_QUERYCAP");
+	fd_capture = open(dev_capture, O_RDWR | O_NONBLOCK);
+	if (fd_capture < 0) {
+		err_errno("could not open %s", dev_capture);
+		return -1;
+	}
 
-	if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE))
-		die("%s is not a capture device\n", dev_capture);
+	if (ioctl(fd_capture, VIDIOC_QUERYCAP, &cap) == -1) {
+		err_errno("VIDIOC_QUERYCAP");
+		goto err_close;
+	}
 
-	if (!(cap.capabilities & V4L2_CAP_STREAMING))
-		die("%s does not support streaming i/o\n", dev_capture);
+	if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE)) {
+		err("%s is not a capture device\n", dev_capture);
+		goto err_close;
+	}
+
+	if (!(cap.capabilities & V4L2_CAP_STREAMING)) {
+		err("%s does not support streaming i/o\n", dev_capture);
+		goto err_close;
+	}
 
 	memset(&fmt, 0, sizeof(fmt));
 	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	fmt.fmt.pix.width = videoSize.width();
-	fmt.fmt.pix.height = videoSize.height();
-	fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+	fmt.fmt.pix.width = sourceSize.width();
+	fmt.fmt.pix.height = sourceSize.height();
+	fmt.fmt.pix.pixelformat = opts.capture_fourcc;
 	fmt.fmt.pix.field = V4L2_FIELD_INTERLACED;
 
-	if (ioctl(fd_capture, VIDIOC_S_FMT, &fmt))
-		die_errno("VIDIOC_S_FMT");
+	if (ioctl(fd_capture, VIDIOC_S_FMT, &fmt)) {
+		err_errno("VIDIOC_S_FMT");
+		goto err_close;
+	}
+
+	if (fmt.fmt.pix.pixelformat != opts.capture_fourcc) {
+		err("%s does not support fourcc %.4s\n", dev_capture,
+				(const char *)&opts.capture_fourcc);
+		goto err_close;
+	}
+
+	if (fmt.fmt.pix.width != (unsigned)sourceSize.width() ||
+			fmt.fmt.pix.height != (unsigned)sourceSize.height()) {
+		err("%s does not support %dx%d\n", dev_capture,
+				sourceSize.width(), sourceSize.height());
+		goto err_close;
+	}
+
+	/* frames are YUYV from here on, also when decoded */
+	if (fmt.fmt.pix.bytesperline < fmt.fmt.pix.width * 2 ||
+			fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_MJPEG)
+		fmt.fmt.pix.bytesperline = fmt.fmt.pix.width * 2;
+
+	/* the taps have been set up for the original layout */
+	if (capture_fmt.bytesperline &&
+			fmt.fmt.pix.bytesperline != capture_fmt.bytesperline) {
+		err("%s: stride changed to %u\n", dev_capture,
+						fmt.fmt.pix.bytesperline);
+		goto err_close;
+	}
+	capture_fmt = fmt.fmt.pix;
 
-	buf_capture_count = CAPTURE_BUFFER_COUNT;
+	buf_capture_count = opts.capture_buffers;
 	buf_capture = v4l_buffers_alloc(fd_capture,
 					V4L2_BUF_TYPE_VIDEO_CAPTURE,
 					&buf_capture_count);
 	if (!buf_capture)
-		die("v4l_buffers_alloc");
+		goto err_close;
+
+	buf_capture_active = buf_capture_count;
+	buf_capture_queued = 0;
+	memset(&tuner, 0, sizeof(tuner));
+	tuner.min_queued = ~0U;
+
+	return 0;
+
+err_close:
+	close(fd_capture);
+	fd_capture = -1;
+
+	return -1;
+}
+
+void VideoWorker::initCapture()
+{
+	memset(&capture_fmt, 0, sizeof(capture_fmt));
+
+	if (openCapture())
+		die("could not set up %s\n", dev_capture);
+
+	decoding = capture_fmt.pixelformat == V4L2_PIX_FMT_MJPEG;
+	if (decoding) {
+		if (decoder_init(&decoder, capture_fmt.width,
+				capture_fmt.height, opts.decode_threads,
+				&opts.rt[RT_THREAD_CONVERT]))
+			die("decoder_init\n");
+	}
+}
+
+/*
+ * Set up a recorded file as the frame source. Frames are handed out in
+ * place and do not refer to any capture buffer.
+ */
+void VideoWorker::initReplay()
+{
+	if (replay_open(&replay, opts.replay_path, sourceSize.width(),
+				sourceSize.height(), opts.replay_speed,
+				opts.replay_rate, opts.replay_loop))
+		die("replay_open\n");
+
+	if (replay.width != (unsigned)sourceSize.width() ||
+			replay.height != (unsigned)sourceSize.height())
+		die("%s is not %dx%d\n", opts.replay_path, sourceSize.width(),
+							sourceSize.height());
+
+	memset(&capture_fmt, 0, sizeof(capture_fmt));
+	capture_fmt.width = replay.width;
+	capture_fmt.height = replay.height;
+	capture_fmt.pixelformat = V4L2_PIX_FMT_YUYV;
+	capture_fmt.bytesperline = replay.stride;
+	capture_fmt.sizeimage = replay.stride * replay.height;
+
+	buf_capture_count = 0;
+	buf_capture = NULL;
+	replaying = true;
+}
+
+/*
+ * Set up the test pattern as the frame source. Its buffers stand in for
+ * the capture buffers, so that frames are referenced as usual and a buffer
+ * is only drawn into again once released.
+ */
+void VideoWorker::initPattern()
+{
+	unsigned i;
+
+	if (pattern_open(&pattern, sourceSize.width(), sourceSize.height(),
+				V4L2_PIX_FMT_YUYV, opts.pattern_rate,
+				opts.capture_buffers))
+		die("pattern_open\n");
+
+	memset(&capture_fmt, 0, sizeof(capture_fmt));
+	capture_fmt.width = pattern.width;
+	capture_fmt.height = pattern.height;
+	capture_fmt.pixelformat = V4L2_PIX_FMT_YUYV;
+	capture_fmt.bytesperline = pattern.stride;
+	capture_fmt.sizeimage = pattern.frame_size;
+
+	buf_capture_count = pattern.buffer_count;
+	buf_capture = (struct video_buffer *)calloc(buf_capture_count,
+						sizeof(*buf_capture));
+	if (!buf_capture)
+		die("out of memory\n");
+
+	for (i = 0; i < buf_capture_count; ++i) {
+		buf_capture[i].start = pattern.buffers[i];
+		buf_capture[i].length = pattern.frame_size;
+		buf_capture[i].dmabuf = -1;
+	}
+	generating = true;
 }
 
 void VideoWorker::initOutput()
 {
 	struct v4l2_capability cap;
 	struct v4l2_format fmt;
+	QSize window;
 	unsigned int i;
 
 	if (ioctl(fd_output, VIDIOC_QUERYCAP, &cap) == -1)
@@ -204,19 +610,25 @@ void VideoWorker::initOutput()
 	if (ioctl(fd_output, VIDIOC_S_FMT, &fmt) == -1)
 		die_errno("VIDEO_OUTPUT: VIDIOC_S_FMT");
 
+	output_stride = fmt.fmt.pix.bytesperline;
+	if (output_stride < fmt.fmt.pix.width * 2)
+		output_stride = fmt.fmt.pix.width * 2;
+
 	fmt.type = V4L2_BUF_TYPE_VIDEO_OVERLAY;
 	ioctl(fd_output, VIDIOC_G_FMT, &fmt);
 
+	window = opts.window.isValid() ? opts.window : videoSize;
+
 	fmt.type = V4L2_BUF_TYPE_VIDEO_OVERLAY;
-	fmt.fmt.win.w.left = (SCREEN_WIDTH - videoSize.width()) / 2;
-	fmt.fmt.win.w.top = (SCREEN_HEIGHT - videoSize.height()) / 2;
-	fmt.fmt.win.w.width = videoSize.width();
-	fmt.fmt.win.w.height = videoSize.height();
+	fmt.fmt.win.w.left = (SCREEN_WIDTH - window.width()) / 2;
+	fmt.fmt.win.w.top = (SCREEN_HEIGHT - window.height()) / 2;
+	fmt.fmt.win.w.width = window.width();
+	fmt.fmt.win.w.height = window.height();
 
 	if (ioctl(fd_output, VIDIOC_S_FMT, &fmt) == -1)
 		die_errno("VIDEO_OVERLAY: VIDIOC_S_FMT");
 
-	buf_output_count = OUTPUT_BUFFER_COUNT;
+	buf_output_count = opts.output_buffers;
 	buf_output = v4l_buffers_alloc(fd_output,
 					V4L2_BUF_TYPE_VIDEO_OUTPUT,
 					&buf_output_count);
@@ -227,136 +639,1677 @@ void VideoWorker::initOutput()
 		memset(buf_output[i].start, 0, buf_output[i].length);
 }
 
-void VideoWorker::processFrame(const void *p, size_t size)
+/*
+ * Display on a framebuffer instead, at the preview size.
+ */
+void VideoWorker::initFramebuffer()
 {
-	struct v4l2_buffer buf;
+	if (fbsink_open(&fb, opts.fb_path, SCREEN_WIDTH, SCREEN_HEIGHT))
+		die("could not open %s\n", opts.fb_path);
 
-	memset(&buf, 0, sizeof(buf));
-	buf.type   = V4L2_BUF_TYPE_VIDEO_OUTPUT;
-	buf.memory = V4L2_MEMORY_MMAP;
+	output_stride = videoSize.width() * 2;
+	fb_output = true;
+}
+
+/*
+ * Display on an overlay plane through DRM/KMS. Frames that are not
+ * scanned out in place are written into dumb buffers, directly when the
+ * plane takes YUYV.
+ */
+void VideoWorker::initDrm()
+{
+	QSize window = opts.window.isValid() ? opts.window : videoSize;
+
+	if (drmsink_open(&drm, opts.drm_path, videoSize.width(),
+				videoSize.height(), window.width(),
+				window.height()))
+		die("could not open %s\n", opts.drm_path);
+
+	if (drm.direct)
+		output_stride = drm.dumb[0].pitch;
+	else
+		output_stride = videoSize.width() * 2;
+	drm_output = true;
+}
+
+/*
+ * Deinterlace the displayed frames. The field order of plain
+ * V4L2_FIELD_INTERLACED depends on the standard, and only 525-line video
+ * has the bottom field first. Replayed frames are assumed to be top field
+ * first.
+ */
+void VideoWorker::initDeinterlace()
+{
+	v4l2_std_id std;
+
+	switch (capture_fmt.field) {
+	case V4L2_FIELD_NONE:
+		printf("%s - progressive capture, not deinterlacing\n",
+								__func__);
+		return;
+	case V4L2_FIELD_INTERLACED_BT:
+		deint_first = 1;
+		break;
+	case V4L2_FIELD_INTERLACED:
+		if (fd_capture >= 0 &&
+				ioctl(fd_capture, VIDIOC_G_STD, &std) == 0 &&
+				(std & V4L2_STD_525_60))
+			deint_first = 1;
+		break;
+	default:
+		break;
+	}
+
+	if (deint_init(&deint, opts.deint_mode, capture_fmt.width,
+						capture_fmt.height))
+		die("deint_init\n");
 
-	if (ioctl(fd_output, VIDIOC_DQBUF, &buf) == -1)
-		die_errno("VIDEO_OUPUT: VIDIOC_DQBUF");
+	if (scaling || fb_output || (drm_output && !drm.direct)) {
+		deint_staging = (unsigned char *)malloc(capture_fmt.bytesperline *
+							capture_fmt.height);
+		if (!deint_staging)
+			die("out of memory\n");
+	}
 
-	memcpy(buf_output[buf.index].start, p, size);
-	buf.bytesused = size;
+	printf("%s - %s, %s field first%s\n", __func__,
+			deint_mode_name(opts.deint_mode),
+			deint_first ? "bottom" : "top",
+			opts.field_rate ? ", at field rate" : "");
 
-	if (ioctl(fd_output, VIDIOC_QBUF, &buf) == -1)
-		die_errno("VIDEO_OUPUT: VIDIOC_QBUF");
+	deinterlacing = true;
 }
 
-int VideoWorker::readFrame()
+/*
+ * Burn the OSD into frames in the format and at the size they are output,
+ * clipped to the screen for the framebuffer.
+ */
+void VideoWorker::initOsd()
 {
-	struct v4l2_buffer buf;
-
-	memset(&buf, 0, sizeof(buf));
-	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	buf.memory = V4L2_MEMORY_MMAP;
+	uint32_t dot[OSD_DOT_SIZE * OSD_DOT_SIZE];
+	enum osd_format format = OSD_YUYV;
+	unsigned width = videoSize.width();
+	unsigned height = videoSize.height();
+	unsigned x, y, i, j, n;
+	int dx, dy;
+
+	if (fb_output) {
+		format = OSD_XRGB8888;
+		if (width > fb.var.xres)
+			width = fb.var.xres & ~1U;
+		if (height > fb.var.yres)
+			height = fb.var.yres;
+	} else if (drm_output && !drm.direct) {
+		format = OSD_XRGB8888;
+	}
 
-	if (ioctl(fd_capture, VIDIOC_DQBUF, &buf) == -1) {
-		switch (errno) {
-			case EAGAIN:
-				return 0;
-			case EIO:
-			default:
-				die_errno("VIDIOC_DQBUF");
+	if (osd_init(&osd, format, width, height))
+		die("osd_init\n");
+
+	/* recording indicator, a disc antialiased by 4x4 supersampling */
+	for (y = 0; y < OSD_DOT_SIZE; ++y) {
+		for (x = 0; x < OSD_DOT_SIZE; ++x) {
+			n = 0;
+			for (i = 0; i < 4; ++i) {
+				for (j = 0; j < 4; ++j) {
+					dx = 8 * x + 2 * j + 1 - 4 * OSD_DOT_SIZE;
+					dy = 8 * y + 2 * i + 1 - 4 * OSD_DOT_SIZE;
+					if (dx * dx + dy * dy <= 14 * OSD_DOT_SIZE *
+								OSD_DOT_SIZE)
+						++n;
+				}
 			}
+			dot[y * OSD_DOT_SIZE + x] = (n * 255 / 16) << 24 |
+								OSD_DOT_COLOR;
+		}
 	}
 
-	processFrame(buf_capture[buf.index].start, buf.bytesused);
+	if (osd_icon(&osd, OSD_ITEM_REC, -OSD_MARGIN, OSD_MARGIN, dot,
+				OSD_DOT_SIZE, OSD_DOT_SIZE, OSD_DOT_SIZE))
+		die("osd_icon\n");
+	osd_show(&osd, OSD_ITEM_REC, false);
 
-	if (ioctl(fd_capture, VIDIOC_QBUF, &buf) == -1)
-		die_errno("VIDIOC_QBUF");
+	if (opts.osd_label) {
+		if (osd_text(&osd, OSD_ITEM_LABEL, OSD_MARGIN, -OSD_MARGIN,
+							opts.osd_label))
+			die("osd_text\n");
+	}
 
-	return 1;
+	annotating = true;
 }
 
-void VideoWorker::processStream()
+/*
+ * Draw the OSD over an outgoing frame. The timestamp is only re-rendered
+ * when the second changes.
+ */
+void VideoWorker::annotateFrame(void *dst, unsigned stride)
 {
-	fd_set fds;
-	struct timeval tv;
-	int r;
+	time_t t = time(NULL);
+	char text[32];
+	struct tm tm;
+
+	if (t != osd_time) {
+		localtime_r(&t, &tm);
+		strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", &tm);
+		osd_text(&osd, OSD_ITEM_TIME, OSD_MARGIN, OSD_MARGIN, text);
+		osd_time = t;
+	}
 
-	v4l_streamon(fd_capture, V4L2_BUF_TYPE_VIDEO_CAPTURE, buf_capture_count);
+	osd_show(&osd, OSD_ITEM_REC, recording);
+	osd_blend(&osd, dst, stride);
+}
 
-	emit started();
+/*
+ * Get the frame to scale or convert, deinterlaced into a staging buffer
+ * when deinterlacing.
+ */
+const void *VideoWorker::sourceFrame(const struct video_frame *frame)
+{
+	unsigned height = capture_fmt.height;
 
-	while (!is_paused) {
-		FD_ZERO(&fds);
-		FD_SET(fd_capture, &fds);
+	if (!deinterlacing)
+		return frame->data;
 
-		tv.tv_sec = 1;
-		tv.tv_usec = 0;
+	if (frame->size < height * capture_fmt.bytesperline)
+		height = frame->size / capture_fmt.bytesperline;
 
-		r = select(fd_capture + 1, &fds, NULL, NULL, &tv);
-		if (r == -1) {
-			if (errno == EINTR)
-				continue;
-			die_errno("select");
-		}
+	deint_frame(&deint, deint_staging, capture_fmt.bytesperline,
+			frame->data, capture_fmt.bytesperline, height,
+			deint_field, frame->sequence);
+
+	return deint_staging;
+}
 
-		if (r == 0)
-			die("select timeout\n");
+/*
+ * Copy a frame into an output buffer, downscaling it on the way when the
+ * source is larger than the preview. The capture and output strides need
+ * not match. Returns the number of bytes used.
+ */
+size_t VideoWorker::copyFrame(void *dst, const struct video_frame *frame)
+{
+	size_t line = capture_fmt.width * 2;
+	unsigned height = capture_fmt.height;
 
-		readFrame();
+	if (scaling) {
+		scaler_run(&scaler, dst, sourceFrame(frame));
+		return output_stride * videoSize.height();
 	}
 
-	v4l_streamoff(fd_capture, V4L2_BUF_TYPE_VIDEO_CAPTURE);
+	/* do not read past a short frame */
+	if (frame->size < (height - 1) * capture_fmt.bytesperline + line)
+		height = frame->size / capture_fmt.bytesperline;
+
+	if (deinterlacing) {
+		deint_frame(&deint, dst, output_stride, frame->data,
+				capture_fmt.bytesperline, height, deint_field,
+				frame->sequence);
+	} else {
+		copy_frame(dst, output_stride, frame->data,
+				capture_fmt.bytesperline, line, height);
+	}
 
-	emit paused();
+	return output_stride * height;
 }
 
-void VideoWorker::run()
+/*
+ * Get the YUYV preview of a frame for conversion, which is produced in a
+ * staging buffer when downscaling.
+ */
+const void *VideoWorker::previewFrame(const struct video_frame *frame,
+					unsigned *stride, unsigned *width,
+					unsigned *height)
 {
-	fd_output = open(dev_output, O_RDWR);
-	if (fd_output < 0) {
-		qCritical("could not open %s", dev_output);
-		QCoreApplication::exit(EXIT_FAILURE);
+	if (scaling) {
+		scaler_run(&scaler, fb_staging, sourceFrame(frame));
+		*stride = output_stride;
+		*width = videoSize.width();
+		*height = videoSize.height();
+		return fb_staging;
 	}
 
-	fd_capture = open(dev_capture, O_RDWR | O_NONBLOCK);
-	if (fd_capture < 0) {
-		qCritical("could not open %s", dev_capture);
-		QCoreApplication::exit(EXIT_FAILURE);
+	*stride = capture_fmt.bytesperline;
+	*width = capture_fmt.width;
+	*height = capture_fmt.height;
+	if (frame->size < *height * *stride)
+		*height = frame->size / *stride;
+
+	return sourceFrame(frame);
+}
+
+/*
+ * Convert a frame into the framebuffer.
+ */
+void VideoWorker::showFrame(const struct video_frame *frame)
+{
+	unsigned stride, width, height;
+	const void *src;
+	unsigned char *dst;
+
+	src = previewFrame(frame, &stride, &width, &height);
+	dst = fbsink_draw(&fb, V4L2_PIX_FMT_YUYV, src, stride, &width,
+								&height);
+	if (annotating)
+		annotateFrame(dst, fb.stride);
+	fbsink_flip(&fb);
+
+	if (!first_frame) {
+		startup_mark("first frame");
+		first_frame = true;
 	}
+}
 
-	initOutput();
-	initCapture();
+void VideoWorker::releaseScanout(const struct video_frame *released,
+							unsigned count)
+{
+	unsigned i;
 
-	v4l_streamon(fd_output, V4L2_BUF_TYPE_VIDEO_OUTPUT, buf_output_count);
+	for (i = 0; i < count; ++i)
+		releaseFrame(&released[i]);
 
-	is_stopped = false;
-	is_paused = false;
-	while (true) {
-		mutex.lock();
-		while (is_paused && !is_stopped)
-			stateChanged.wait(&mutex);
-		mutex.unlock();
+	if (drm.error) {
+		output_error = drm.error;
+		drm.error = 0;
+	} else if (count) {
+		recover_done(&output_recovery);
+	}
+}
 
-		if (is_stopped)
-			break;
+/*
+ * Hand a frame to the DRM plane. Capture buffers are scanned out in place
+ * and held until replaced on screen; anything else is copied. Frames that
+ * are drawn on or deinterlaced are always copied, as the capture buffers
+ * are shared with the taps.
+ */
+void VideoWorker::scanoutFrame(const struct video_frame *frame)
+{
+	struct video_frame released[2];
+	struct drm_scanout out;
+	unsigned stride, width, height;
+	unsigned pitch;
+	const void *src;
+	void *dst;
+
+	out.frame = *frame;
+	out.fb = 0;
+	out.dumb = -1;
+
+	if (drm.direct && !scaling && !annotating && !deinterlacing &&
+						frame->capture >= 0) {
+		out.fb = drmsink_import(&drm, frame->capture,
+					exportCapture(frame->capture),
+					capture_fmt.bytesperline);
+	}
 
-		processStream();
+	if (out.fb) {
+		acquireFrame(frame);
+	} else {
+		dst = drmsink_buffer(&drm, &out.dumb, &pitch);
+		if (drm.direct) {
+			copyFrame(dst, frame);
+		} else {
+			src = previewFrame(frame, &stride, &width, &height);
+			if (width > drm.width)
+				width = drm.width;
+			if (height > drm.height)
+				height = drm.height;
+			convert_yuyv_xrgb(dst, pitch, src, stride, width,
+								height);
+		}
+		if (annotating)
+			annotateFrame(dst, pitch);
+		out.fb = drm.dumb[out.dumb].fb;
+		out.frame.capture = -1;
+		out.frame.decoded = -1;
 	}
 
-	v4l_streamoff(fd_output, V4L2_BUF_TYPE_VIDEO_OUTPUT);
+	releaseScanout(released, drmsink_show(&drm, &out, released));
 
-	v4l_buffers_free(fd_capture, V4L2_BUF_TYPE_VIDEO_CAPTURE, buf_capture,
-							buf_capture_count);
-	v4l_buffers_free(fd_output, V4L2_BUF_TYPE_VIDEO_OUTPUT, buf_output,
-							buf_output_count);
-	close(fd_capture);
-	close(fd_output);
+	if (!first_frame) {
+		startup_mark("first frame");
+		first_frame = true;
+	}
+}
 
-	QThread::currentThread()->exit(0);
+void VideoWorker::handleFlips()
+{
+	struct video_frame released[2];
+
+	releaseScanout(released, drmsink_dispatch(&drm, released));
 }
 
-void VideoWorker::pause()
+void VideoWorker::processFrame(const struct video_frame *frame)
 {
-	mutex.lock();
-	is_paused = !is_paused;
-	stateChanged.wakeAll();
-	mutex.unlock();
+	struct v4l2_buffer buf;
+
+	if (fb_output) {
+		showFrame(frame);
+		return;
+	}
+
+	if (drm_output) {
+		scanoutFrame(frame);
+		return;
+	}
+
+	memset(&buf, 0, sizeof(buf));
+	buf.type   = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	buf.memory = V4L2_MEMORY_MMAP;
+
+	if (ioctl(fd_output, VIDIOC_DQBUF, &buf) == -1) {
+		output_error = errno;
+		return;
+	}
+
+	buf.bytesused = copyFrame(buf_output[buf.index].start, frame);
+	if (annotating)
+		annotateFrame(buf_output[buf.index].start, output_stride);
+
+	if (ioctl(fd_output, VIDIOC_QBUF, &buf) == -1) {
+		output_error = errno;
+		return;
+	}
+
+	recover_done(&output_recovery);
+
+	if (!first_frame) {
+		startup_mark("first frame");
+		first_frame = true;
+	}
+}
+
+/*
+ * Grow the capture pool by one buffer, preferably by putting a parked buffer
+ * back into rotation.
+ */
+void VideoWorker::growBuffers()
+{
+	struct v4l2_buffer buf;
+	unsigned old_count = buf_capture_active;
+	unsigned index;
+
+	if (buf_capture_active >= opts.max_capture_buffers)
+		return;
+
+	/* a parked buffer may still be in use by a tap */
+	for (index = 0; index < buf_capture_count; ++index) {
+		if (buf_capture[index].parked && !buf_capture[index].refs)
+			break;
+	}
+
+	if (index == buf_capture_count) {
+		if (!v4l_buffers_create(fd_capture,
+					V4L2_BUF_TYPE_VIDEO_CAPTURE,
+					&buf_capture, &buf_capture_count, 1)) {
+			/* do not retry on every window */
+			opts.max_capture_buffers = buf_capture_active;
+			return;
+		}
+		index = buf_capture_count - 1;
+	}
+
+	memset(&buf, 0, sizeof(buf));
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buf.memory = V4L2_MEMORY_MMAP;
+	buf.index = index;
+
+	if (ioctl(fd_capture, VIDIOC_QBUF, &buf) == -1) {
+		capture_error = errno;
+		return;
+	}
+
+	buf_capture[index].parked = false;
+	++buf_capture_active;
+	++buf_capture_queued;
+
+	printf("%s - %u -> %u (%u/%u dropped)\n", __func__, old_count,
+				buf_capture_active, tuner.drops, tuner.frames);
+}
+
+/*
+ * Track sequence gaps and driver queue depth of the capture stream over a
+ * window of frames and resize the pool so that the drop rate stays below
+ * the target with as few buffers as possible.
+ *
+ * Drops are only blamed on the pool if the driver actually ran out of
+ * queued buffers during the window. Buffers cannot be freed individually
+ * while streaming, so shrinking parks the dequeued buffer instead of
+ * requeuing it. Returns true if buf should be parked.
+ */
+bool VideoWorker::tuneBuffers(const struct v4l2_buffer *buf)
+{
+	unsigned drops = 0;
+	bool park = false;
+
+	if (tuner.have_sequence && buf->sequence > tuner.last_sequence + 1)
+		drops = buf->sequence - tuner.last_sequence - 1;
+
+	tuner.have_sequence = true;
+	tuner.last_sequence = buf->sequence;
+	tuner.frames += drops + 1;
+	tuner.drops += drops;
+	if (buf_capture_queued < tuner.min_queued)
+		tuner.min_queued = buf_capture_queued;
+
+	if (tuner.frames < TUNE_WINDOW)
+		return false;
+
+	if (tuner.drops * 1000 > tuner.frames * opts.drop_target) {
+		if (tuner.min_queued == 0)
+			growBuffers();
+	} else if (!tuner.drops && tuner.min_queued > TUNE_HEADROOM &&
+			buf_capture_active > opts.min_capture_buffers) {
+		printf("%s - %u -> %u\n", __func__, buf_capture_active,
+							buf_capture_active - 1);
+		park = true;
+	}
+
+	tuner.frames = 0;
+	tuner.drops = 0;
+	tuner.min_queued = ~0U;
+
+	return park;
+}
+
+/*
+ * Export a capture buffer as a DMABUF, which is kept until the buffers are
+ * freed. Returns -1 if the driver does not support exporting.
+ */
+int VideoWorker::exportCapture(unsigned index)
+{
+	struct v4l2_exportbuffer expbuf;
+
+	if (buf_capture[index].dmabuf >= 0)
+		return buf_capture[index].dmabuf;
+
+	if (fd_capture < 0)
+		return -1;
+
+	memset(&expbuf, 0, sizeof(expbuf));
+	expbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	expbuf.index = index;
+	expbuf.flags = O_CLOEXEC | O_RDONLY;
+
+	if (ioctl(fd_capture, VIDIOC_EXPBUF, &expbuf) == -1)
+		return -1;
+
+	buf_capture[index].dmabuf = expbuf.fd;
+
+	return expbuf.fd;
+}
+
+/*
+ * Drop a reference to a capture buffer and requeue it once it is no longer
+ * used by any frame. A buffer that cannot be requeued is left to be
+ * recovered with the rest of the queue.
+ */
+void VideoWorker::releaseCapture(unsigned index)
+{
+	struct v4l2_buffer buf;
+
+	if (--buf_capture[index].refs)
+		return;
+
+	if (buf_capture[index].parked || fd_capture < 0)
+		return;
+
+	memset(&buf, 0, sizeof(buf));
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buf.memory = V4L2_MEMORY_MMAP;
+	buf.index = index;
+
+	if (ioctl(fd_capture, VIDIOC_QBUF, &buf) == -1) {
+		capture_error = errno;
+		return;
+	}
+
+	++buf_capture_queued;
+}
+
+/*
+ * Dequeue output buffers that have been replaced on screen. As the output
+ * device provides no vblank events, the time of the swap is used to track
+ * the refresh phase.
+ */
+void VideoWorker::reclaimOutput()
+{
+	struct v4l2_buffer buf;
+
+	while (buf_output_queued > 1) {
+		memset(&buf, 0, sizeof(buf));
+		buf.type   = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+		buf.memory = V4L2_MEMORY_MMAP;
+
+		if (ioctl(fd_output, VIDIOC_DQBUF, &buf) == -1) {
+			if (errno != EAGAIN)
+				output_error = errno;
+			break;
+		}
+
+		buf_output[buf.index].parked = true;
+		--buf_output_queued;
+
+		present_vblank(&present, now_ns());
+	}
+}
+
+bool VideoWorker::presentFrame(const struct video_frame *frame)
+{
+	struct v4l2_buffer buf;
+	unsigned index;
+
+	for (index = 0; index < buf_output_count; ++index) {
+		if (buf_output[index].parked)
+			break;
+	}
+
+	if (index == buf_output_count)
+		return false;
+
+	memset(&buf, 0, sizeof(buf));
+	buf.type   = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	buf.memory = V4L2_MEMORY_MMAP;
+	buf.index  = index;
+	buf.bytesused = copyFrame(buf_output[index].start, frame);
+	if (annotating)
+		annotateFrame(buf_output[index].start, output_stride);
+
+	/* the frame is dropped until the output has been restarted */
+	if (ioctl(fd_output, VIDIOC_QBUF, &buf) == -1) {
+		output_error = errno;
+		++present.dropped;
+		releaseFrame(frame);
+		return true;
+	}
+
+	buf_output[index].parked = false;
+	++buf_output_queued;
+	++present.presented;
+	recover_done(&output_recovery);
+
+	if (!first_frame) {
+		startup_mark("first frame");
+		first_frame = true;
+	}
+
+	releaseFrame(frame);
+
+	return true;
+}
+
+/*
+ * Queue pending frames whose vblank is due, dropping frames that have been
+ * superseded by a newer frame that is also due. At most present_depth
+ * frames are queued ahead of the one on screen.
+ *
+ * Returns the time at which the next pending frame should be queued, or
+ * zero if there is nothing to wait for but output or capture buffers.
+ */
+long long VideoWorker::presentFrames()
+{
+	struct present_frame *frame;
+	long long now;
+
+	reclaimOutput();
+
+	now = now_ns();
+
+	while (present.pending_count) {
+		frame = &present.pending[0];
+
+		if (present.pending_count > 1 &&
+				present.pending[1].target - present.slack <= now) {
+			releaseFrame(&frame->frame);
+			++present.dropped;
+		} else {
+			if (frame->target - present.slack > now)
+				return frame->target - present.slack;
+
+			if (buf_output_queued > opts.present_depth)
+				return 0;
+
+			deint_field = frame->field;
+			if (!presentFrame(&frame->frame))
+				return 0;
+		}
+
+		--present.pending_count;
+		memmove(&present.pending[0], &present.pending[1],
+			present.pending_count * sizeof(present.pending[0]));
+	}
+
+	return 0;
+}
+
+void VideoWorker::scheduleFrame(const struct video_frame *in,
+							unsigned field)
+{
+	struct present_frame *frame;
+	long long target;
+
+	target = present_target(&present, in->timestamp);
+
+	/* only the newest frame for a given vblank is displayed */
+	if (present.pending_count) {
+		frame = &present.pending[present.pending_count - 1];
+		if (target <= frame->target) {
+			releaseFrame(&frame->frame);
+			++present.dropped;
+			--present.pending_count;
+		}
+	}
+
+	if (present.pending_count == PRESENT_PENDING_MAX) {
+		releaseFrame(&present.pending[0].frame);
+		++present.dropped;
+		--present.pending_count;
+		memmove(&present.pending[0], &present.pending[1],
+			present.pending_count * sizeof(present.pending[0]));
+	}
+
+	if (target - present.slack > now_ns())
+		++present.held;
+
+	frame = &present.pending[present.pending_count++];
+	frame->frame = *in;
+	frame->target = target;
+	frame->field = field;
+}
+
+/*
+ * Display a frame, or both its fields in turn at field rate. The later
+ * field is kept otherwise, as it is the more recent.
+ */
+void VideoWorker::displayFrame(const struct video_frame *frame)
+{
+	struct video_frame second;
+	long long interval;
+
+	if (!deinterlacing || !opts.field_rate) {
+		deint_field = !deint_first;
+		if (opts.present) {
+			scheduleFrame(frame, deint_field);
+			return;
+		}
+		processFrame(frame);
+		releaseFrame(frame);
+		return;
+	}
+
+	interval = frame->timestamp - deint_last;
+	if (deint_last && interval > 0 && interval < 4 * FIELD_PERIOD)
+		field_period = interval / 2;
+	deint_last = frame->timestamp;
+
+	if (opts.present) {
+		second = *frame;
+		second.timestamp += field_period;
+		acquireFrame(frame);
+		scheduleFrame(frame, deint_first);
+		scheduleFrame(&second, !deint_first);
+		return;
+	}
+
+	deint_field = deint_first;
+	processFrame(frame);
+	deint_field = !deint_first;
+	processFrame(frame);
+	releaseFrame(frame);
+}
+
+/*
+ * Frames are shared by reference between the display and the taps, and
+ * the backing buffer is given back when the last user releases it.
+ */
+void VideoWorker::acquireFrame(const struct video_frame *frame)
+{
+	if (frame->decoded >= 0)
+		++decoded_refs[frame->decoded];
+	else if (frame->capture >= 0)
+		++buf_capture[frame->capture].refs;
+}
+
+void VideoWorker::releaseFrame(const struct video_frame *frame)
+{
+	if (frame->decoded >= 0) {
+		if (!--decoded_refs[frame->decoded])
+			decoder_release(&decoder, frame->decoded);
+	} else if (frame->capture >= 0) {
+		releaseCapture(frame->capture);
+	}
+}
+
+/*
+ * Hand a reference to the frame to a tap consumer, unless it is still busy
+ * with earlier frames.
+ */
+void VideoWorker::tapFrame(struct frame_tap *tap,
+					const struct video_frame *frame)
+{
+	acquireFrame(frame);
+	if (!tap_push(tap, frame))
+		releaseFrame(frame);
+}
+
+void VideoWorker::reapTap(struct frame_tap *tap)
+{
+	struct video_frame frame;
+
+	while (tap_reap(tap, &frame))
+		releaseFrame(&frame);
+}
+
+void VideoWorker::recordFrame(const struct video_frame *frame)
+{
+	struct video_frame copy = *frame;
+
+	if (opts.record.encoder && frame->capture >= 0)
+		copy.dmabuf = exportCapture(frame->capture);
+
+	tapFrame(&recorder.tap, &copy);
+}
+
+/*
+ * Hand the frame over for the snapshot requested, by reference, so that
+ * the display goes on as is. The snapshot thread and its full-resolution
+ * copy are only set up for the first snapshot, which is delayed by that.
+ */
+void VideoWorker::snapshotFrame(const struct video_frame *frame)
+{
+	QByteArray path;
+	long long requested;
+
+	mutex.lock();
+	path = snapshot_path;
+	requested = snapshot_requested;
+	snapshot_pending = 0;
+	mutex.unlock();
+
+	if (!snapshotting) {
+		if (snapshot_start(&snapshotter, capture_fmt.width,
+					capture_fmt.height,
+					capture_fmt.bytesperline,
+					SNAPSHOT_QUALITY,
+					&opts.rt[RT_THREAD_OUTPUT])) {
+			err("%s: snapshot failed\n", path.constData());
+			return;
+		}
+
+		mutex.lock();
+		snapshotting = true;
+		mutex.unlock();
+	}
+
+	acquireFrame(frame);
+	if (!snapshot_take(&snapshotter, frame, path.constData(), requested)) {
+		releaseFrame(frame);
+		err("%s: snapshot dropped\n", path.constData());
+	}
+}
+
+/*
+ * Pass a captured or decoded frame on to the display.
+ */
+void VideoWorker::handleFrame(const struct video_frame *frame)
+{
+	struct video_frame checked;
+
+	/* as delivered, and carried along to the recording */
+	if (checksumming) {
+		checked = *frame;
+		checksum_frame(&checker, &checked);
+		frame = &checked;
+	}
+
+	/* nothing else has seen the frame yet */
+	if (denoising) {
+		denoise_frame(&denoiser, (void *)frame->data, frame->size);
+		if (checksumming)
+			checksum_rewritten(&checker, frame);
+	}
+
+	if (snapshot_pending.fetchAndAddAcquire(0))
+		snapshotFrame(frame);
+
+	if (opts.motion) {
+		unsigned score;
+
+		score = motion_analyze(&motion, frame->data);
+		emit motionScore(score);
+
+		if (opts.skip_static && score < opts.skip_threshold) {
+			++motion_skipped;
+			releaseFrame(frame);
+			return;
+		}
+
+		motion_accept(&motion);
+	}
+
+	if (recording)
+		recordFrame(frame);
+
+	if (streaming)
+		tapFrame(&streamer.tap, frame);
+
+	if (prerecording)
+		tapFrame(&prerecorder.tap, frame);
+
+	if (publishing)
+		framebus_publish(&bus, frame);
+
+	displayFrame(frame);
+}
+
+void VideoWorker::decodeFrames()
+{
+	struct video_frame frame;
+	int capture;
+	int ret;
+
+	while ((ret = decoder_get(&decoder, &frame, &capture))) {
+		releaseCapture(capture);
+		if (ret > 0) {
+			decoded_refs[frame.decoded] = 1;
+			handleFrame(&frame);
+		}
+	}
+}
+
+/*
+ * Dequeue a ready capture buffer. Returns false if there is none.
+ */
+bool VideoWorker::dequeueCapture(struct v4l2_buffer *buf)
+{
+	bool park = false;
+
+	for (;;) {
+		memset(buf, 0, sizeof(*buf));
+		buf->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buf->memory = V4L2_MEMORY_MMAP;
+
+		if (ioctl(fd_capture, VIDIOC_DQBUF, buf) == -1) {
+			if (errno != EAGAIN)
+				capture_error = errno;
+			return false;
+		}
+
+		--buf_capture_queued;
+
+		if (opts.adaptive_buffers)
+			park = tuneBuffers(buf);
+
+		if (park) {
+			buf_capture[buf->index].parked = true;
+			--buf_capture_active;
+		}
+
+		buf_capture[buf->index].refs = 1;
+
+		/* a corrupted frame does not count as the stream making progress */
+		if (!(buf->flags & V4L2_BUF_FLAG_ERROR))
+			return true;
+
+		++capture_recovery.frame_errors;
+		releaseCapture(buf->index);
+	}
+}
+
+void VideoWorker::handleCapture(const struct v4l2_buffer *buf)
+{
+	struct video_frame frame;
+
+	frame.capture = buf->index;
+	frame.decoded = -1;
+	frame.data = buf_capture[buf->index].start;
+	frame.size = buf->bytesused;
+	frame.dmabuf = -1;
+	frame.sequence = buf->sequence;
+	frame.timestamp = present_capture_time(buf);
+
+	if (capture_fmt.pixelformat == V4L2_PIX_FMT_MJPEG) {
+		if (!decoder_submit(&decoder, &frame))
+			releaseCapture(buf->index);
+		return;
+	}
+
+	handleFrame(&frame);
+}
+
+/*
+ * Dequeue every capture buffer that is ready before handling any of them,
+ * so that buffers requeued meanwhile are left for the next wakeup. After a
+ * stall, a backlog of more than skip_backlog frames, if set, is requeued
+ * unseen except for the newest frame, which catches up with the camera at
+ * once. Skipped frames reach neither the display nor any consumer, so this
+ * is off by default.
+ *
+ * Returns the number of frames dequeued.
+ */
+unsigned VideoWorker::readFrames()
+{
+	struct v4l2_buffer ready[VIDEO_MAX_FRAME];
+	unsigned count = 0;
+	unsigned first = 0;
+	unsigned i;
+
+	while (count < VIDEO_MAX_FRAME && dequeueCapture(&ready[count]))
+		++count;
+
+	if (!count)
+		return 0;
+
+	capture_last = now_ns();
+	recover_done(&capture_recovery);
+
+	++batch.wakeups;
+	batch.frames += count;
+	if (count > batch.max)
+		batch.max = count;
+
+	if (opts.skip_backlog && count > opts.skip_backlog) {
+		first = count - 1;
+		batch.skipped += first;
+		for (i = 0; i < first; ++i)
+			releaseCapture(ready[i].index);
+	}
+
+	for (i = first; i < count; ++i)
+		handleCapture(&ready[i]);
+
+	return count;
+}
+
+/*
+ * Pass on the next replayed frame when due, and stop at the end of the
+ * file.
+ */
+void VideoWorker::readReplay()
+{
+	struct video_frame frame;
+	int ret;
+
+	ret = replay_next(&replay, &frame);
+	if (ret > 0) {
+		handleFrame(&frame);
+	} else if (ret < 0) {
+		mutex.lock();
+		is_paused = true;
+		mutex.unlock();
+		QCoreApplication::exit(0);
+	}
+}
+
+/*
+ * Draw the next pattern frame when due into a buffer no longer in use, or
+ * drop it if all are.
+ */
+void VideoWorker::readPattern()
+{
+	struct video_frame frame;
+	int slot = -1;
+	unsigned i;
+
+	for (i = 0; i < buf_capture_count; ++i) {
+		if (!buf_capture[i].refs) {
+			slot = i;
+			break;
+		}
+	}
+
+	if (pattern_next(&pattern, slot, &frame)) {
+		buf_capture[slot].refs = 1;
+		handleFrame(&frame);
+	}
+}
+
+/*
+ * Get back all frames from the decoder, the display and the taps, e.g.
+ * before capture is stopped or its buffers are freed.
+ */
+void VideoWorker::flushFrames()
+{
+	unsigned i;
+
+	if (decoding)
+		decoder_flush(&decoder);
+
+	if (opts.present) {
+		while (present.pending_count)
+			releaseFrame(&present.pending[--present.pending_count].frame);
+	}
+
+	/* frames on screen stay there, but no longer hold their buffers */
+	if (drm_output)
+		drmsink_disown(&drm);
+
+	if (recording) {
+		tap_drain(&recorder.tap);
+		reapTap(&recorder.tap);
+	}
+
+	if (streaming) {
+		tap_drain(&streamer.tap);
+		reapTap(&streamer.tap);
+	}
+
+	if (prerecording) {
+		tap_drain(&prerecorder.tap);
+		reapTap(&prerecorder.tap);
+	}
+
+	if (snapshotting) {
+		tap_drain(&snapshotter.tap);
+		reapTap(&snapshotter.tap);
+	}
+
+	/* frames discarded by the decoder are never released */
+	for (i = 0; i < buf_capture_count; ++i)
+		buf_capture[i].refs = 0;
+}
+
+/*
+ * Restart the capture queue only. Buffers still used by frames are
+ * requeued as they are released.
+ */
+void VideoWorker::restartCapture()
+{
+	v4l_streamoff(fd_capture, V4L2_BUF_TYPE_VIDEO_CAPTURE);
+
+	capture_error = v4l_streamon(fd_capture, V4L2_BUF_TYPE_VIDEO_CAPTURE,
+					buf_capture, buf_capture_count,
+					&buf_capture_queued);
+	tuner.have_sequence = false;
+}
+
+/*
+ * Give up on the capture device, e.g. after it has been unplugged. It is
+ * reopened from the stream loop once it is back.
+ */
+void VideoWorker::closeCapture()
+{
+	int fd = fd_capture;
+
+	/* frames are released but not requeued from here on */
+	fd_capture = -1;
+	flushFrames();
+
+	if (drm_output)
+		drmsink_forget(&drm);
+
+	v4l_streamoff(fd, V4L2_BUF_TYPE_VIDEO_CAPTURE);
+	v4l_buffers_free(fd, V4L2_BUF_TYPE_VIDEO_CAPTURE, buf_capture,
+							buf_capture_count);
+	buf_capture = NULL;
+	buf_capture_count = 0;
+	close(fd);
+
+	capture_retry = now_ns();
+}
+
+/*
+ * Try to get a lost capture device back. Returns false if it is still
+ * missing or not usable yet.
+ */
+bool VideoWorker::reopenCapture()
+{
+	/* keep quiet until the device node is back */
+	if (access(dev_capture, F_OK))
+		return false;
+
+	if (openCapture())
+		return false;
+
+	if (v4l_streamon(fd_capture, V4L2_BUF_TYPE_VIDEO_CAPTURE, buf_capture,
+				buf_capture_count, &buf_capture_queued)) {
+		v4l_buffers_free(fd_capture, V4L2_BUF_TYPE_VIDEO_CAPTURE,
+					buf_capture, buf_capture_count);
+		buf_capture = NULL;
+		buf_capture_count = 0;
+		close(fd_capture);
+		fd_capture = -1;
+		return false;
+	}
+
+	capture_last = now_ns();
+	printf("%s - %s is back\n", __func__, dev_capture);
+
+	return true;
+}
+
+/*
+ * Recover from capture errors noted while handling frames, or from the
+ * stream going silent. This is done from the stream loop, where no frames
+ * are in the middle of being handled.
+ */
+void VideoWorker::checkCapture()
+{
+	long long now = now_ns();
+	int error;
+
+	if (fd_capture < 0) {
+		if (now >= capture_retry) {
+			capture_retry = now + REOPEN_INTERVAL * 1000000LL;
+			reopenCapture();
+		}
+		return;
+	}
+
+	error = capture_error;
+	if (!error && now - capture_last > CAPTURE_TIMEOUT * 1000000LL)
+		error = ETIMEDOUT;
+
+	if (!error)
+		return;
+
+	/* give the recovered stream a full timeout to produce a frame */
+	capture_error = 0;
+	capture_last = now;
+
+	switch (recover_failed(&capture_recovery, error)) {
+	case RECOVER_RETRY:
+		break;
+	case RECOVER_RESTART:
+		restartCapture();
+		break;
+	case RECOVER_REOPEN:
+		closeCapture();
+		break;
+	}
+}
+
+/*
+ * When scheduling presentation, only one frame is queued up front and the
+ * remaining output buffers are handed out as frames are due.
+ */
+int VideoWorker::startOutput()
+{
+	unsigned i;
+
+	if (fd_output < 0)
+		return 0;
+
+	for (i = 0; i < buf_output_count; ++i)
+		buf_output[i].parked = opts.present && i;
+
+	return v4l_streamon(fd_output, V4L2_BUF_TYPE_VIDEO_OUTPUT, buf_output,
+				buf_output_count, &buf_output_queued);
+}
+
+/*
+ * The output is part of the SoC and is not expected to go away, so it is
+ * only ever restarted.
+ */
+void VideoWorker::recoverOutput()
+{
+	int error = output_error;
+
+	output_error = 0;
+
+	if (recover_failed(&output_recovery, error) == RECOVER_RETRY ||
+								fd_output < 0)
+		return;
+
+	v4l_streamoff(fd_output, V4L2_BUF_TYPE_VIDEO_OUTPUT);
+	output_error = startOutput();
+}
+
+void VideoWorker::processStream()
+{
+	fd_set rfds, wfds;
+	struct timeval tv;
+	long long wakeup = 0;
+	long long timeout;
+	int fd_source;
+	int nfds;
+	int r;
+
+	if (replaying) {
+		replay_start(&replay);
+	} else if (generating) {
+		pattern_start(&pattern);
+	} else if (fd_capture >= 0) {
+		capture_error = v4l_streamon(fd_capture,
+						V4L2_BUF_TYPE_VIDEO_CAPTURE,
+						buf_capture, buf_capture_count,
+						&buf_capture_queued);
+		tuner.have_sequence = false;
+	}
+	capture_last = now_ns();
+	memset(&batch, 0, sizeof(batch));
+
+	emit started();
+
+	while (!is_paused) {
+		/* the capture device may come and go */
+		if (replaying)
+			fd_source = replay.timer_fd;
+		else if (generating)
+			fd_source = pattern.timer_fd;
+		else
+			fd_source = fd_capture;
+
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+		nfds = -1;
+
+		if (fd_source >= 0) {
+			FD_SET(fd_source, &rfds);
+			nfds = fd_source;
+		}
+
+		if (decoding) {
+			FD_SET(decoder.event_fd, &rfds);
+			if (decoder.event_fd > nfds)
+				nfds = decoder.event_fd;
+		}
+
+		if (recording) {
+			FD_SET(recorder.tap.event_fd, &rfds);
+			if (recorder.tap.event_fd > nfds)
+				nfds = recorder.tap.event_fd;
+		}
+
+		if (streaming) {
+			FD_SET(streamer.tap.event_fd, &rfds);
+			if (streamer.tap.event_fd > nfds)
+				nfds = streamer.tap.event_fd;
+		}
+
+		if (prerecording) {
+			FD_SET(prerecorder.tap.event_fd, &rfds);
+			if (prerecorder.tap.event_fd > nfds)
+				nfds = prerecorder.tap.event_fd;
+		}
+
+		if (snapshotting) {
+			FD_SET(snapshotter.tap.event_fd, &rfds);
+			if (snapshotter.tap.event_fd > nfds)
+				nfds = snapshotter.tap.event_fd;
+		}
+
+		if (publishing) {
+			FD_SET(bus.fd_listen, &rfds);
+			if (bus.fd_listen > nfds)
+				nfds = bus.fd_listen;
+		}
+
+		if (drm_output) {
+			FD_SET(drm.fd, &rfds);
+			if (drm.fd > nfds)
+				nfds = drm.fd;
+		}
+
+		if (fd_source >= 0) {
+			tv.tv_sec = 1;
+			tv.tv_usec = 0;
+		} else {
+			tv.tv_sec = 0;
+			tv.tv_usec = REOPEN_INTERVAL * 1000;
+		}
+
+		if (opts.present) {
+			wakeup = presentFrames();
+			if (wakeup) {
+				timeout = wakeup - now_ns();
+				if (timeout < 0)
+					timeout = 0;
+				tv.tv_sec = timeout / 1000000000LL;
+				tv.tv_usec = timeout % 1000000000LL / 1000;
+			}
+
+			if (buf_output_queued > 1) {
+				FD_SET(fd_output, &wfds);
+				if (fd_output > nfds)
+					nfds = fd_output;
+			}
+		}
+
+		r = select(nfds + 1, &rfds, &wfds, NULL, &tv);
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			die_errno("select");
+		}
+
+		if (fd_source >= 0 && FD_ISSET(fd_source, &rfds)) {
+			if (replaying)
+				readReplay();
+			else if (generating)
+				readPattern();
+			else
+				readFrames();
+		}
+
+		if (decoding && FD_ISSET(decoder.event_fd, &rfds))
+			decodeFrames();
+
+		if (recording && FD_ISSET(recorder.tap.event_fd, &rfds))
+			reapTap(&recorder.tap);
+
+		if (streaming && FD_ISSET(streamer.tap.event_fd, &rfds))
+			reapTap(&streamer.tap);
+
+		if (prerecording && FD_ISSET(prerecorder.tap.event_fd, &rfds))
+			reapTap(&prerecorder.tap);
+
+		if (snapshotting && FD_ISSET(snapshotter.tap.event_fd, &rfds))
+			reapTap(&snapshotter.tap);
+
+		if (publishing && FD_ISSET(bus.fd_listen, &rfds))
+			framebus_serve(&bus);
+
+		if (drm_output && FD_ISSET(drm.fd, &rfds))
+			handleFlips();
+
+		if (!replaying && !generating)
+			checkCapture();
+
+		if (output_error)
+			recoverOutput();
+	}
+
+	/* all buffers must be back before streaming is stopped */
+	flushFrames();
+
+	if (decoding) {
+		printf("%s - decoded %lu, errors %lu, overruns %lu\n",
+				__func__, decoder.decoded, decoder.errors,
+				decoder.overruns);
+	}
+
+	if (opts.present) {
+		printf("%s - presented %lu, dropped %lu, held %lu, "
+				"period %lld us\n", __func__,
+				present.presented, present.dropped,
+				present.held, present.period / 1000);
+	}
+
+	if (opts.motion && motion.frames) {
+		printf("%s - motion: %lu frames, %lu skipped, cost avg %lld "
+				"max %u us, row step %u\n", __func__,
+				motion.frames, motion_skipped,
+				motion.cost / motion.frames / 1000,
+				motion.cost_max / 1000, motion.step);
+	}
+
+	if (batch.wakeups) {
+		printf("%s - capture: %lu frames in %lu wakeups, batch avg "
+				"%lu.%02lu max %u, %lu skipped\n", __func__,
+				batch.frames, batch.wakeups,
+				batch.frames / batch.wakeups,
+				batch.frames * 100 / batch.wakeups % 100,
+				batch.max, batch.skipped);
+	}
+
+	if (scaling && scaler.frames) {
+		printf("%s - preview: %lu frames %ux%u -> %ux%u, cost avg %lld "
+				"max %u us\n", __func__, scaler.frames,
+				scaler.src_width, scaler.src_height,
+				scaler.dst_width, scaler.dst_height,
+				scaler.cost / scaler.frames / 1000,
+				scaler.cost_max / 1000);
+	}
+
+	recover_print(&capture_recovery);
+	recover_print(&output_recovery);
+
+	if (!replaying && fd_capture >= 0)
+		v4l_streamoff(fd_capture, V4L2_BUF_TYPE_VIDEO_CAPTURE);
+
+	emit paused();
+}
+
+/*
+ * Open and set up the devices. This does not involve Qt and is done from a
+ * separate thread while the user interface is created, before run().
+ */
+void VideoWorker::init()
+{
+	if (opts.fb_path) {
+		initFramebuffer();
+	} else if (opts.drm_path) {
+		initDrm();
+	} else {
+		fd_output = open(dev_output, O_RDWR |
+					(opts.present ? O_NONBLOCK : 0));
+		if (fd_output < 0)
+			die_errno("could not open %s", dev_output);
+
+		initOutput();
+	}
+	startup_mark("output");
+
+	if (opts.replay_path)
+		initReplay();
+	else if (opts.pattern)
+		initPattern();
+	else
+		initCapture();
+	startup_mark("capture");
+
+	if (sourceSize != videoSize) {
+		if (scaler_init(&scaler, capture_fmt.width, capture_fmt.height,
+					capture_fmt.bytesperline,
+					videoSize.width(), videoSize.height(),
+					output_stride))
+			die("cannot scale %dx%d to %dx%d\n",
+					sourceSize.width(), sourceSize.height(),
+					videoSize.width(), videoSize.height());
+		scaling = true;
+
+		if (fb_output || (drm_output && !drm.direct)) {
+			fb_staging = (unsigned char *)malloc(output_stride *
+							videoSize.height());
+			if (!fb_staging)
+				die("out of memory\n");
+		}
+	} else if (fd_output >= 0 || (drm_output && drm.direct)) {
+		copy_init(capture_fmt.width * 2, capture_fmt.height,
+				capture_fmt.bytesperline, output_stride);
+	}
+
+	/*
+	 * Captured and decoded frames are filtered in place, before motion
+	 * detection, the taps and the display, but replayed ones are mapped
+	 * read-only.
+	 */
+	if (opts.denoise && replaying) {
+		printf("denoise - replayed frames are left alone\n");
+	} else if (opts.denoise) {
+		if (denoise_init(&denoiser, V4L2_PIX_FMT_YUYV,
+					capture_fmt.width, capture_fmt.height,
+					capture_fmt.bytesperline, opts.denoise))
+			die("denoise_init\n");
+		denoising = true;
+	}
+
+	if (opts.deinterlace)
+		initDeinterlace();
+
+	if (opts.osd)
+		initOsd();
+
+	if (opts.motion) {
+		if (motion_init(&motion, capture_fmt.width, capture_fmt.height,
+				capture_fmt.bytesperline, opts.motion_budget))
+			die("motion_init\n");
+	}
+
+	if (opts.checksum) {
+		if (checksum_init(&checker, capture_fmt.width,
+					capture_fmt.height,
+					capture_fmt.bytesperline))
+			die("checksum_init\n");
+		checksumming = true;
+		opts.record.checksums = true;
+	}
+
+	/* consumers of the live stream run with the output parameters */
+	opts.record.rt = opts.rt[RT_THREAD_OUTPUT];
+	opts.stream.rt = opts.rt[RT_THREAD_OUTPUT];
+	opts.prerecord.rt = opts.rt[RT_THREAD_OUTPUT];
+
+	if (opts.record.path) {
+		if (decoding && opts.record.encoder)
+			die("hardware encoding of MJPEG capture not supported\n");
+
+		if (recorder_start(&recorder, &opts.record, capture_fmt.width,
+					capture_fmt.height,
+					capture_fmt.bytesperline))
+			die("recorder_start\n");
+		recording = true;
+	}
+
+	if (opts.stream.address) {
+		if (streamer_start(&streamer, &opts.stream, capture_fmt.width,
+					capture_fmt.height,
+					capture_fmt.bytesperline))
+			die("streamer_start\n");
+		streaming = true;
+	}
+
+	if (opts.prerecord.path) {
+		if (prerecord_start(&prerecorder, &opts.prerecord,
+					capture_fmt.width, capture_fmt.height,
+					capture_fmt.bytesperline))
+			die("prerecord_start\n");
+		prerecording = true;
+	}
+
+	if (opts.bus_path) {
+		if (framebus_init(&bus, opts.bus_path, opts.bus_slots,
+					capture_fmt.width, capture_fmt.height,
+					capture_fmt.bytesperline))
+			die("framebus_init\n");
+		publishing = true;
+	}
+
+	if (opts.present)
+		present_init(&present, opts.refresh, opts.present_delay);
+
+	if (startOutput())
+		die("could not start %s\n", dev_output);
+	startup_mark("devices");
+}
+
+void VideoWorker::run()
+{
+	rt_thread_setup("capture", &opts.rt[RT_THREAD_CAPTURE]);
+
+	is_stopped = false;
+	is_paused = false;
+	while (true) {
+		mutex.lock();
+		while (is_paused && !is_stopped)
+			stateChanged.wait(&mutex);
+		mutex.unlock();
+
+		if (is_stopped)
+			break;
+
+		processStream();
+	}
+
+	if (fd_output >= 0)
+		v4l_streamoff(fd_output, V4L2_BUF_TYPE_VIDEO_OUTPUT);
+
+	/* before the capture buffers it may be showing are freed */
+	if (drm_output)
+		drmsink_close(&drm);
+
+	if (recording)
+		recorder_stop(&recorder);
+	if (streaming)
+		streamer_stop(&streamer);
+	if (prerecording) {
+		prerecording = false;
+		prerecord_stop(&prerecorder);
+	}
+	if (snapshotting) {
+		mutex.lock();
+		snapshotting = false;
+		mutex.unlock();
+		snapshot_stop(&snapshotter);
+	}
+	if (publishing)
+		framebus_free(&bus);
+
+	if (replaying) {
+		replay_close(&replay);
+	} else if (generating) {
+		pattern_close(&pattern);
+		free(buf_capture);
+	} else if (fd_capture >= 0) {
+		v4l_buffers_free(fd_capture, V4L2_BUF_TYPE_VIDEO_CAPTURE,
+					buf_capture, buf_capture_count);
+		close(fd_capture);
+	}
+	if (fb_output)
+		fbsink_close(&fb);
+	free(fb_staging);
+
+	if (fd_output >= 0) {
+		v4l_buffers_free(fd_output, V4L2_BUF_TYPE_VIDEO_OUTPUT,
+					buf_output, buf_output_count);
+		close(fd_output);
+	}
+
+	if (opts.motion)
+		motion_free(&motion);
+	if (checksumming)
+		checksum_free(&checker);
+	if (denoising)
+		denoise_free(&denoiser);
+	if (deinterlacing)
+		deint_free(&deint);
+	free(deint_staging);
+	if (annotating)
+		osd_free(&osd);
+	if (scaling)
+		scaler_free(&scaler);
+	if (decoding)
+		decoder_free(&decoder);
+
+	QThread::currentThread()->exit(0);
+}
+
+void VideoWorker::pause()
+{
+	mutex.lock();
+	is_paused = !is_paused;
+	stateChanged.wakeAll();
+	mutex.unlock();
+}
+
+/*
+ * Write the next frame at full resolution to path, as a PNG if it ends in
+ * .png and as a JPEG otherwise. Safe to call from any thread, but fails
+ * while the previous snapshot is still pending or being written.
+ */
+bool VideoWorker::snapshot(const QString &path)
+{
+	bool ret = false;
+
+	mutex.lock();
+	if (!snapshot_pending &&
+			(!snapshotting || !snapshot_busy(&snapshotter))) {
+		snapshot_path = path.toLocal8Bit();
+		snapshot_requested = now_ns();
+		snapshot_pending = 1;
+		ret = true;
+	}
+	mutex.unlock();
+
+	return ret;
+}
+
+/*
+ * Write out the pre-event history, if kept. Safe to call from signal
+ * handlers.
+ */
+void VideoWorker::triggerEvent()
+{
+	if (prerecording)
+		prerecord_trigger(&prerecorder);
 }
 
 void VideoWorker::start()
@@ -1,15 +1,121 @@
 #ifndef VIDEO_WORKER_H
 #define VIDEO_WORKER_H
 
+#include <QtCore/QAtomicInt>
+#include <QtCore/QByteArray>
 #include <QtCore/QMutex>
 #include <QtCore/QObject>
 #include <QtCore/QSize>
+#include <QtCore/QString>
 #include <QtCore/QWaitCondition>
 
+#include <linux/videodev2.h>
+
+#include "checksum.h"
+#include "copy.h"
+#include "decode.h"
+#include "deinterlace.h"
+#include "denoise.h"
+#include "drmsink.h"
+#include "fbsink.h"
+#include "frame.h"
+#include "framebus.h"
+#include "motion.h"
+#include "osd.h"
+#include "pattern.h"
+#include "prerecord.h"
+#include "present.h"
+#include "record.h"
+#include "recover.h"
+#include "replay.h"
+#include "rt.h"
+#include "scale.h"
+#include "snapshot.h"
+#include "stream.h"
+
 
 struct video_buffer {
 	void *start;
 	size_t length;
+	bool parked;
+	unsigned refs;		/* frames using the buffer */
+	int dmabuf;		/* exported on demand, or -1 */
+};
+
+struct video_options {
+	__u32 capture_fourcc;		/* YUYV or MJPEG */
+	unsigned decode_threads;
+
+	QSize window;			/* overlay window, if not video size */
+	QSize capture_size;		/* full resolution, if not video size */
+
+	unsigned capture_buffers;
+	unsigned output_buffers;
+
+	/* adaptive capture buffer pool */
+	bool adaptive_buffers;
+	unsigned min_capture_buffers;
+	unsigned max_capture_buffers;
+	unsigned drop_target;		/* dropped frames per mille */
+
+	/* frames ready at once before all but the newest are skipped */
+	unsigned skip_backlog;
+
+	struct rt_params rt[RT_THREAD_COUNT];
+	bool lock_memory;
+
+	/* vblank-aligned presentation */
+	bool present;
+	unsigned present_delay;		/* us */
+	unsigned present_depth;		/* frames queued ahead of display */
+	unsigned refresh;		/* Hz */
+
+	/* scene change detection */
+	bool motion;
+	unsigned motion_budget;		/* us */
+	bool skip_static;
+	unsigned skip_threshold;	/* hundredths of a luma level */
+
+	/* CRC32C of every frame, for torn and duplicated frames */
+	bool checksum;
+
+	struct record_options record;
+	struct stream_options stream;
+
+	/* pre-event history, written out on triggers */
+	struct prerecord_options prerecord;
+
+	/* file-driven source in place of the capture device */
+	const char *replay_path;
+	unsigned replay_speed;		/* percent, zero for max */
+	unsigned replay_rate;		/* Hz, raw files */
+	bool replay_loop;
+
+	/* generated test pattern in place of the capture device */
+	bool pattern;
+	unsigned pattern_rate;		/* Hz, zero for max */
+
+	/* shared-memory frame bus */
+	const char *bus_path;
+	unsigned bus_slots;
+
+	/* framebuffer or DRM device in place of the V4L2 overlay */
+	const char *fb_path;
+	const char *drm_path;
+
+	/* temporal noise reduction, level or zero */
+	unsigned denoise;
+
+	/* deinterlacing of the displayed video */
+	bool deinterlace;
+	enum deint_mode deint_mode;
+	bool field_rate;		/* show each field in turn */
+
+	/* timestamp, recording indicator and label burned into the video */
+	bool osd;
+	const char *osd_label;
+
+	video_options();
 };
 
 class VideoWorker : public QObject
@@ -18,45 +124,201 @@ class VideoWorker : public QObject
 
 public:
 	VideoWorker(const char *dev_capture, const char *dev_output,
-				QSize &videoSize, QObject *parent = 0);
+				QSize &videoSize, const video_options &options,
+				QObject *parent = 0);
 	~VideoWorker();
 
+	void init();
+
 	void start();
 	void pause();
 	void stop();
 
+	bool snapshot(const QString &path);
+	void triggerEvent();
+
 public slots:
 	void run();
 
 signals:
 	void started();
 	void paused();
+	void motionScore(unsigned score);
 
 private:
+	int openCapture();
 	void initCapture();
+	void initReplay();
+	void initPattern();
 	void initOutput();
+	void initFramebuffer();
+	void initDrm();
+	void initDeinterlace();
+	void initOsd();
 
-	void processFrame(const void *p, size_t size);
-	int readFrame();
+	const void *sourceFrame(const struct video_frame *frame);
+	size_t copyFrame(void *dst, const struct video_frame *frame);
+	const void *previewFrame(const struct video_frame *frame,
+				unsigned *stride, unsigned *width,
+				unsigned *height);
+	void annotateFrame(void *dst, unsigned stride);
+	void showFrame(const struct video_frame *frame);
+	void releaseScanout(const struct video_frame *released,
+							unsigned count);
+	void scanoutFrame(const struct video_frame *frame);
+	void handleFlips();
+	void processFrame(const struct video_frame *frame);
+	bool dequeueCapture(struct v4l2_buffer *buf);
+	void handleCapture(const struct v4l2_buffer *buf);
+	unsigned readFrames();
+	void readReplay();
+	void readPattern();
 	void processStream();
 
+	void flushFrames();
+	void restartCapture();
+	void closeCapture();
+	bool reopenCapture();
+	void checkCapture();
+	int startOutput();
+	void recoverOutput();
+
+	bool tuneBuffers(const struct v4l2_buffer *buf);
+	void growBuffers();
+
+	int exportCapture(unsigned index);
+	void releaseCapture(unsigned index);
+	void acquireFrame(const struct video_frame *frame);
+	void releaseFrame(const struct video_frame *frame);
+	void tapFrame(struct frame_tap *tap, const struct video_frame *frame);
+	void reapTap(struct frame_tap *tap);
+	void recordFrame(const struct video_frame *frame);
+	void snapshotFrame(const struct video_frame *frame);
+	void handleFrame(const struct video_frame *frame);
+	void decodeFrames();
+
+	void reclaimOutput();
+	bool presentFrame(const struct video_frame *frame);
+	long long presentFrames();
+	void scheduleFrame(const struct video_frame *frame, unsigned field);
+	void displayFrame(const struct video_frame *frame);
+
 	const char *dev_capture;
 	const char *dev_output;
 
 	int fd_capture;
 	int fd_output;
 
+	struct v4l2_pix_format capture_fmt;
+
 	unsigned buf_capture_count;
 	unsigned buf_output_count;
 	struct video_buffer *buf_capture;
 	struct video_buffer *buf_output;
+	unsigned buf_output_queued;
+	unsigned output_stride;
+
+	/* capture buffers currently queued to the driver */
+	unsigned buf_capture_queued;
+	/* capture buffers in rotation, i.e. not parked */
+	unsigned buf_capture_active;
+
+	struct {
+		bool have_sequence;
+		__u32 last_sequence;
+		unsigned frames;
+		unsigned drops;
+		unsigned min_queued;
+	} tuner;
+
+	/* errors noted while handling frames, recovered from the loop */
+	int capture_error;
+	int output_error;
+	long long capture_last;		/* last good frame, ns */
+	long long capture_retry;	/* next attempt to reopen, ns */
+	struct recovery capture_recovery;
+	struct recovery output_recovery;
+
+	/* capture buffers dequeued per wakeup */
+	struct {
+		unsigned long wakeups;
+		unsigned long frames;
+		unsigned long skipped;
+		unsigned max;
+	} batch;
+
+	struct present_sched present;
+
+	/* preview downscaled from the full-resolution source */
+	struct scaler scaler;
+	bool scaling;
+
+	struct fb_sink fb;
+	bool fb_output;
+	unsigned char *fb_staging;	/* preview for conversion */
+
+	struct drm_sink drm;
+	bool drm_output;
+
+	struct denoiser denoiser;
+	bool denoising;
+
+	struct deinterlacer deint;
+	bool deinterlacing;
+	unsigned char *deint_staging;	/* for scaling or conversion */
+	unsigned deint_first;		/* field captured first */
+	unsigned deint_field;		/* field kept for the frame at hand */
+	long long deint_last;		/* timestamp of the last frame, ns */
+	long long field_period;		/* ns */
+
+	struct osd osd;
+	bool annotating;
+	long osd_time;			/* second shown, s */
+
+	struct motion_detector motion;
+	unsigned long motion_skipped;
+
+	struct frame_checker checker;
+	bool checksumming;
+
+	struct decoder decoder;
+	unsigned decoded_refs[DECODE_SLOTS_MAX];
+	bool decoding;
+
+	struct recorder recorder;
+	bool recording;
+
+	struct streamer streamer;
+	bool streaming;
+
+	struct prerecorder prerecorder;
+	bool prerecording;
+
+	struct snapshotter snapshotter;
+	bool snapshotting;		/* started on demand, under mutex */
+	QAtomicInt snapshot_pending;	/* for the next frame handled */
+	QByteArray snapshot_path;	/* under mutex */
+	long long snapshot_requested;	/* ns */
+
+	struct framebus bus;
+	bool publishing;
+
+	struct replay_source replay;
+	bool replaying;
+
+	struct pattern_source pattern;
+	bool generating;
 
 	QMutex mutex;
 	QWaitCondition stateChanged;
 	bool is_paused;
 	bool is_stopped;
 
-	QSize videoSize;
+	bool first_frame;
+
+	QSize videoSize;		/* preview */
+	QSize sourceSize;		/* capture or replay */
+	video_options opts;
 };
 
 #endif	/* VIDEO_WORKER_H */
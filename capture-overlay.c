@@ -5,6 +5,7 @@
  */
 
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
@@ -12,20 +13,40 @@
 #include <getopt.h>  
 
 #include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
 #include <errno.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <sys/signalfd.h>
 
 #include <linux/videodev2.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
 #define CLEAR(x) memset(&(x), '\0', sizeof(x))
 #define VIDEO_BUF_NBR 4
 #define CAPTURE_BUF_NBR 2
 
+#define CAPTURE_TIMEOUT_MS	1000	/* without frames before restarting */
+#define REOPEN_INTERVAL_MS	500
+#define RECOVER_ESCALATE	3	/* failed attempts before escalating */
+
+#define DRAIN_TIMEOUT_MS	200	/* for frames queued to the output */
+#define TEARDOWN_TIMEOUT_S	2	/* before the alarm kills the process */
+
+#define FRAME_WIDTH	640
+#define FRAME_HEIGHT	480
+#define COPY_RUNS	8	/* timed frame copies per kernel at startup */
+
 struct buffer
 {
 	void   *start;
@@ -40,13 +61,171 @@ static unsigned int n_buffers;
 struct buffer *buffers;
 struct buffer *video_buffers;
 static int count = 1000;
+static unsigned int capture_buf_nbr = CAPTURE_BUF_NBR;
+static unsigned int capture_stride = FRAME_WIDTH * 2;
+static unsigned int video_stride = FRAME_WIDTH * 2;
+static int deinterlace;
+static double interval;		/* s between frames shown, or 0 */
+static int every;		/* show every nth frame, or 0 */
+
+/* time-lapse decimation */
+static long long native_period;	/* us per frame, or 0 if unknown */
+static long long sensor_period;	/* us per frame as set, or 0 */
+static long long keep_period;	/* us between frames shown, or 0 */
+static unsigned int keep_factor = 1;
+static unsigned int keep_phase;
+static long long next_due;	/* us */
+static unsigned long frames_decimated;
+
+/*
+ * Streaming errors are not fatal. The least disruptive action that is
+ * likely to get frames flowing again is taken from the main loop:
+ * retrying, restarting only the failing queue, or reopening a capture
+ * device that has gone away. Repeated failures without a good frame in
+ * between escalate to the next action.
+ */
+enum recover_action {
+	RECOVER_RETRY,
+	RECOVER_RESTART,
+	RECOVER_REOPEN
+};
 
-static void errno_exit(const char *s)
+struct recovery
+{
+	const char *name;
+	int can_reopen;
+	long long failed;	/* first failure since the last good frame, us */
+	unsigned int attempts;
+	unsigned long errors;
+	unsigned long frame_errors;
+	unsigned long restarts;
+	unsigned long reopens;
+	unsigned long recovered;
+	long long recover_total;	/* us */
+	long long recover_max;		/* us */
+};
+
+static struct recovery capture_recovery = { .name = "capture", .can_reopen = 1 };
+static struct recovery video_recovery = { .name = "video output" };
+static int capture_error;
+static int video_error;
+static long long capture_last;
+static long long capture_retry;
+
+static void errno_warn(const char *s)
 {
 	fprintf(stderr, "%s error %d, %s\n", s, errno, strerror(errno));
+}
+
+static void errno_exit(const char *s)
+{
+	errno_warn(s);
 	exit(EXIT_FAILURE);
 }
 
+static long long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* Without frames for this long, the capture stream is restarted. */
+static long long capture_timeout_us(void)
+{
+	return CAPTURE_TIMEOUT_MS * 1000LL + 2 * sensor_period;
+}
+
+static enum recover_action recover_classify(int err)
+{
+	switch (err) {
+		case EAGAIN:
+		case EINTR:
+		case EBUSY:
+		case ENOMEM:
+			return RECOVER_RETRY;
+		case ENODEV:
+		case ENXIO:
+		case ENOENT:
+		case ESHUTDOWN:
+		case EBADF:
+			return RECOVER_REOPEN;
+		case EIO:
+		case EPIPE:
+		case ETIMEDOUT:
+		case EINVAL:
+		default:
+			return RECOVER_RESTART;
+	}
+}
+
+static enum recover_action recover_failed(struct recovery *rc, int err)
+{
+	enum recover_action action = recover_classify(err);
+	unsigned int n;
+
+	if (!rc->failed)
+		rc->failed = now_us();
+	n = ++rc->attempts;
+	++rc->errors;
+
+	if (n > RECOVER_ESCALATE && action != RECOVER_REOPEN)
+		++action;
+	if (action == RECOVER_REOPEN && !rc->can_reopen)
+		action = RECOVER_RESTART;
+
+	if (action == RECOVER_RESTART)
+		++rc->restarts;
+	else if (action == RECOVER_REOPEN)
+		++rc->reopens;
+
+	/* do not flood the log while a failure persists */
+	if (!(n & (n - 1)))
+		fprintf(stderr, "%s error %d, %s, attempt %u, %s\n", rc->name,
+			err, strerror(err), n,
+			action == RECOVER_RETRY ? "retrying" :
+			action == RECOVER_RESTART ? "restarting" : "reopening");
+
+	return action;
+}
+
+static void recover_done(struct recovery *rc)
+{
+	long long t;
+
+	if (!rc->failed)
+		return;
+
+	t = now_us() - rc->failed;
+	++rc->recovered;
+	rc->recover_total += t;
+	if (t > rc->recover_max)
+		rc->recover_max = t;
+
+	printf("%s recovered in %lld ms after %u attempts\n", rc->name,
+		t / 1000, rc->attempts);
+
+	rc->failed = 0;
+	rc->attempts = 0;
+}
+
+static void recover_print(const struct recovery *rc)
+{
+	if (!rc->errors && !rc->frame_errors)
+		return;
+
+	printf("%s: %lu errors, %lu frame errors, %lu restarts, %lu reopens, "
+		"%lu recovered", rc->name, rc->errors, rc->frame_errors,
+		rc->restarts, rc->reopens, rc->recovered);
+	if (rc->recovered)
+		printf(", time to recover avg %lld max %lld ms",
+			rc->recover_total / rc->recovered / 1000,
+			rc->recover_max / 1000);
+	printf("\n");
+}
+
 static int xioctl(int fh, int request, void *arg)
 {
 	int r;
@@ -67,12 +246,17 @@ static void usage(FILE *fp, int argc, char **argv)
 		"-d | --device <name>   Video capture device name  [%s]\n"
 		"-v | --video  <name>   Video output devive name   [%s]\n" 
 		"-c | --count  <value>  Number of frame to capture [%d]\n"
+		"-b | --buffers <value> Number of capture buffers  [%u]\n"
+		"-i | --deinterlace     Interpolate the bottom field away\n"
+		"-t | --interval <s>    Time-lapse, one frame every s seconds\n"
+		"-e | --every <n>       Time-lapse, one frame in every n\n"
 		"-h | --help	        Print this message\n"
 		"",
-		argv[0], capture_dev_name, video_dev_name, count);
+		argv[0], capture_dev_name, video_dev_name, count,
+		capture_buf_nbr);
 }
 
-static const char short_options[] = "dvc:h:";
+static const char short_options[] = "dvc:b:it:e:h:";
 
 static const struct option
 long_options[] =
@@ -80,6 +264,10 @@ long_options[] =
 	{ "device", required_argument, NULL, 'd' },
 	{ "videoe", required_argument, NULL, 'v' },
 	{ "count", required_argument,  NULL, 'c' },
+	{ "buffers", required_argument, NULL, 'b' },
+	{ "deinterlace", no_argument,  NULL, 'i' },
+	{ "interval", required_argument, NULL, 't' },
+	{ "every",  required_argument, NULL, 'e' },
 	{ "help",   no_argument,       NULL, 'h' },
 	{ 0, 0, 0, 0 }
 };
@@ -99,7 +287,7 @@ static void close_video_device(void)
 {
 	
 	if (-1 == close(fd_video))
-		errno_exit("close");
+		errno_warn("close");
 
 	fd_video = -1;
 }
@@ -134,6 +322,9 @@ static void init_video_device(void)
 		}
 	}
 
+	if (fmt.fmt.pix.bytesperline >= FRAME_WIDTH * 2)
+		video_stride = fmt.fmt.pix.bytesperline;
+
 	fmt.type = V4L2_BUF_TYPE_VIDEO_OVERLAY;
 	xioctl(fd_video, VIDIOC_G_FMT, &fmt);
 
@@ -207,7 +398,7 @@ static void uninit_video_device(void)
 
 	for (i = 0; i < VIDEO_BUF_NBR; ++i) {
 		if (-1 == munmap(video_buffers[i].start, video_buffers[i].length)) {
-			errno_exit("munmap");
+			errno_warn("munmap");
 		}
 	}
 }
@@ -221,36 +412,178 @@ static void start_video_overlay(void)
 	}
 }
 
+/*
+ * Restart the output queue with all buffers queued, as after setup.
+ */
+static int restart_video_overlay(void)
+{
+	unsigned long type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	struct v4l2_buffer buf;
+	unsigned int i;
+
+	xioctl(fd_video, VIDIOC_STREAMOFF, &type);
+
+	for (i = 0 ; i < VIDEO_BUF_NBR ; i++) {
+		CLEAR(buf);
+		buf.type   = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+		buf.memory = V4L2_MEMORY_MMAP;
+		buf.index  = i;
+		if (-1 == xioctl(fd_video, VIDIOC_QBUF, &buf))
+			return -1;
+	}
+
+	if (-1 == xioctl(fd_video, VIDIOC_STREAMON, &type))
+		return -1;
+
+	return 0;
+}
+
 static void stop_video_overlay(void)
 {
 	unsigned long type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
 	
 	if (-1 == xioctl(fd_video, VIDIOC_STREAMOFF, &type)) {
-		errno_exit("VIDEO_OUPUT: VIDIOC_STREAMOFF");
+		errno_warn("VIDEO_OUPUT: VIDIOC_STREAMOFF");
 	}
 }
 
-static void open_capture_device(void)
+static int open_capture_device(void)
 {
 	fd_capture = open(capture_dev_name, O_RDWR /* required */ | O_NONBLOCK, 0);
 
 	if (-1 == fd_capture ) 	{
 		fprintf(stderr, "Cannot open '%s': %d, %s\n",
 			capture_dev_name, errno, strerror(errno));
-		exit(EXIT_FAILURE);
+		return -1;
 	}
+
+	return 0;
 }
 
 static void close_capture_device(void)
 {
 	
 	if (-1 == close(fd_capture))
-		errno_exit("close");
+		errno_warn("close");
 
 	fd_capture = -1;
 }
 
-static void init_capture_device(void)
+static long long fract_us(const struct v4l2_fract *f)
+{
+	if (!f->numerator || !f->denominator)
+		return 0;
+
+	return f->numerator * 1000000LL / f->denominator;
+}
+
+static unsigned int gcd(unsigned int a, unsigned int b)
+{
+	unsigned int t;
+
+	while (b) {
+		t = a % b;
+		a = b;
+		b = t;
+	}
+
+	return a;
+}
+
+/*
+ * Ask the sensor for fewer frames when time-lapsing, so that frames that
+ * would only be skipped are never captured. Whatever the sensor cannot do
+ * is made up for by skipping frames at DQBUF. Run on every open, as the
+ * rate may not survive the device going away.
+ */
+static void set_frame_interval(void)
+{
+	struct v4l2_streamparm parm;
+	struct v4l2_fract *tpf = &parm.parm.capture.timeperframe;
+	long long period;
+	unsigned int g;
+
+	if (interval <= 0 && every <= 1)
+		return;
+
+	CLEAR(parm);
+	parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+	if (-1 == xioctl(fd_capture, VIDIOC_G_PARM, &parm))
+		CLEAR(parm);
+	else if (!native_period)
+		native_period = fract_us(tpf);
+
+	if (interval > 0)
+		period = interval * 1000000 + 0.5;
+	else
+		period = native_period * every;
+
+	sensor_period = 0;
+	if (period > 0 && period <= 0xffffffffLL &&
+	    (parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME)) {
+		g = gcd(period, 1000000);
+		tpf->numerator = period / g;
+		tpf->denominator = 1000000 / g;
+
+		if (-1 == xioctl(fd_capture, VIDIOC_S_PARM, &parm))
+			errno_warn("VIDIOC_S_PARM");
+		else
+			sensor_period = fract_us(tpf);
+	}
+
+	if (!sensor_period)
+		sensor_period = native_period;
+
+	keep_factor = 1;
+	if (interval > 0)
+		keep_period = period;
+	else if (native_period && sensor_period)
+		keep_factor = (every * native_period + sensor_period / 2) /
+								sensor_period;
+	else
+		keep_factor = every;
+
+	if (!keep_factor)
+		keep_factor = 1;
+
+	printf("time-lapse: sensor at %lld.%03lld ms per frame, showing one "
+		"frame ", sensor_period / 1000, sensor_period % 1000);
+	if (keep_period)
+		printf("every %lld.%03lld s\n", keep_period / 1000000,
+						keep_period / 1000 % 1000);
+	else
+		printf("in %u\n", keep_factor);
+}
+
+/*
+ * Decide whether to show a frame captured at t us when time-lapsing.
+ * Skipped frames are requeued without their data ever being read.
+ */
+static int keep_frame(long long t)
+{
+	if (keep_period) {
+		/* up to half a sensor period early is on time */
+		if (next_due && t < next_due - sensor_period / 2)
+			return 0;
+
+		/* after a stall, start over rather than catch up */
+		if (!next_due || t - next_due >= keep_period)
+			next_due = t + keep_period;
+		else
+			next_due += keep_period;
+
+		return 1;
+	}
+
+	return keep_phase++ % keep_factor == 0;
+}
+
+/*
+ * Set up the format and buffers of the capture device. Errors are returned
+ * rather than fatal, as this is also used to reopen the device.
+ */
+static int init_capture_device(void)
 {
 	struct v4l2_capability cap;
 	struct v4l2_cropcap cropcap;
@@ -265,11 +598,12 @@ static void init_capture_device(void)
 		{
 			fprintf(stderr, "%s is no V4L2 device\n",
 				capture_dev_name);
-			exit(EXIT_FAILURE);
+			return -1;
 		}
 		else
 		{
-			errno_exit("VIDIOC_QUERYCAP");
+			errno_warn("VIDIOC_QUERYCAP");
+			return -1;
 		}
 	}
 
@@ -277,12 +611,12 @@ static void init_capture_device(void)
 	{
 		fprintf(stderr, "%s is no video capture device\n",
 			capture_dev_name);
-		exit(EXIT_FAILURE);
+		return -1;
 	}
 
 	if (!(cap.capabilities & V4L2_CAP_STREAMING)) {
 		fprintf(stderr, "%s does not support streaming i/o\n", capture_dev_name);
-		exit(EXIT_FAILURE);
+		return -1;
 	}
 
 	CLEAR(fmt);
@@ -292,11 +626,18 @@ static void init_capture_device(void)
 	fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
 	fmt.fmt.pix.field	= V4L2_FIELD_INTERLACED;
 	
-	if (-1 == xioctl(fd_capture, VIDIOC_S_FMT, &fmt))
-		errno_exit("VIDIOC_S_FMT");
+	if (-1 == xioctl(fd_capture, VIDIOC_S_FMT, &fmt)) {
+		errno_warn("VIDIOC_S_FMT");
+		return -1;
+	}
+
+	if (fmt.fmt.pix.bytesperline >= FRAME_WIDTH * 2)
+		capture_stride = fmt.fmt.pix.bytesperline;
+
+	set_frame_interval();
 
 	CLEAR(req);
-	req.count  = CAPTURE_BUF_NBR;
+	req.count  = capture_buf_nbr;
 	req.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 	req.memory = V4L2_MEMORY_MMAP;
 
@@ -304,19 +645,22 @@ static void init_capture_device(void)
 		if (EINVAL == errno) {
 			fprintf(stderr, "%s does not support " 
 					"memory mapping\n", capture_dev_name);
-			exit(EXIT_FAILURE);
+			return -1;
 		} else {
-			errno_exit("VIDIOC_REQBUFS");
+			errno_warn("VIDIOC_REQBUFS");
+			return -1;
 		}
 	}
 
 	if (req.count < 2) {
 		fprintf(stderr, "Insufficient buffer memory on %s\n",
 			capture_dev_name);
-		exit(EXIT_FAILURE);
+		return -1;
 	}
 
 	buffers = calloc(req.count, sizeof(*buffers));
+	if (!buffers)
+		return -1;
 
 	for (n_buffers = 0; n_buffers < req.count; ++n_buffers)
 	{
@@ -328,8 +672,10 @@ static void init_capture_device(void)
 		buf.memory	= V4L2_MEMORY_MMAP;
 		buf.index	= n_buffers;
 
-		if (-1 == xioctl(fd_capture, VIDIOC_QUERYBUF, &buf))
-			errno_exit("VIDIOC_QUERYBUF");
+		if (-1 == xioctl(fd_capture, VIDIOC_QUERYBUF, &buf)) {
+			errno_warn("VIDIOC_QUERYBUF");
+			return -1;
+		}
 
 		buffers[n_buffers].length = buf.length;
 		buffers[n_buffers].start =
@@ -339,9 +685,13 @@ static void init_capture_device(void)
 		     MAP_SHARED /* recommended */,
 		     fd_capture, buf.m.offset);
 
-		if (MAP_FAILED == buffers[n_buffers].start)
-			errno_exit("mmap");
-	}	
+		if (MAP_FAILED == buffers[n_buffers].start) {
+			errno_warn("mmap");
+			return -1;
+		}
+	}
+
+	return 0;
 }
 
 static void uninit_capture_device(void)
@@ -350,9 +700,13 @@ static void uninit_capture_device(void)
 
 	for (i = 0; i < n_buffers; ++i) {
 		if (-1 == munmap(buffers[i].start, buffers[i].length)) {
-			errno_exit("munmap");
+			errno_warn("munmap");
 		}
 	}
+
+	free(buffers);
+	buffers = NULL;
+	n_buffers = 0;
 }
 
 static void start_capturing(void)
@@ -385,7 +739,323 @@ static void stop_capturing(void)
 
 	type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 	if (-1 == xioctl(fd_capture, VIDIOC_STREAMOFF, &type))
-	errno_exit("VIDIOC_STREAMOFF");
+		errno_warn("VIDIOC_STREAMOFF");
+}
+
+/*
+ * Restart the capture queue only. Stopping the stream returns all buffers,
+ * also those that could not be requeued.
+ */
+static int restart_capturing(void)
+{
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	struct v4l2_buffer buf;
+	unsigned int i;
+
+	xioctl(fd_capture, VIDIOC_STREAMOFF, &type);
+
+	for (i = 0; i < n_buffers; ++i) {
+		CLEAR(buf);
+		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buf.memory = V4L2_MEMORY_MMAP;
+		buf.index = i;
+
+		if (-1 == xioctl(fd_capture, VIDIOC_QBUF, &buf))
+			return -1;
+	}
+
+	if (-1 == xioctl(fd_capture, VIDIOC_STREAMON, &type))
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Give up on a capture device that has gone away, e.g. an unplugged USB
+ * camera. It is reopened from the main loop once it is back.
+ */
+static void lose_capture_device(void)
+{
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+	xioctl(fd_capture, VIDIOC_STREAMOFF, &type);
+	uninit_capture_device();
+	close(fd_capture);
+	fd_capture = -1;
+
+	capture_retry = now_us();
+}
+
+static int reopen_capture_device(void)
+{
+	/* keep quiet until the device node is back */
+	if (-1 == access(capture_dev_name, F_OK))
+		return -1;
+
+	if (-1 == open_capture_device())
+		return -1;
+
+	if (-1 == init_capture_device() || -1 == restart_capturing()) {
+		uninit_capture_device();
+		close(fd_capture);
+		fd_capture = -1;
+		return -1;
+	}
+
+	printf("%s is back\n", capture_dev_name);
+	capture_last = now_us();
+
+	return 0;
+}
+
+/*
+ * Act on errors noted while handling frames, or on the capture stream
+ * going silent.
+ */
+static void recover(void)
+{
+	long long now = now_us();
+	int error;
+
+	if (-1 == fd_capture) {
+		if (now >= capture_retry) {
+			capture_retry = now + REOPEN_INTERVAL_MS * 1000LL;
+			reopen_capture_device();
+		}
+	} else {
+		error = capture_error;
+		if (!error && now - capture_last > capture_timeout_us())
+			error = ETIMEDOUT;
+
+		if (error) {
+			/* give the restarted stream a full timeout */
+			capture_error = 0;
+			capture_last = now;
+
+			switch (recover_failed(&capture_recovery, error)) {
+				case RECOVER_RETRY:
+					break;
+				case RECOVER_RESTART:
+					if (-1 == restart_capturing())
+						capture_error = errno;
+					break;
+				case RECOVER_REOPEN:
+					lose_capture_device();
+					break;
+			}
+		}
+	}
+
+	if (video_error) {
+		error = video_error;
+		video_error = 0;
+
+		if (RECOVER_RETRY != recover_failed(&video_recovery, error) &&
+				-1 == restart_video_overlay())
+			video_error = errno;
+	}
+}
+
+/*
+ * Frames are copied line by line as the capture and output strides may
+ * differ. Non-temporal stores keep the output buffer, which is only read
+ * by the display controller, from evicting the rest of the cache. Which
+ * line copy is fastest depends on the memory system, so it is timed at
+ * startup.
+ */
+typedef void (*copy_line_fn)(void *dst, const void *src, size_t n);
+
+static void copy_line_memcpy(void *dst, const void *src, size_t n)
+{
+	memcpy(dst, src, n);
+}
+
+#if defined(__SSE2__)
+static void copy_line_stream(void *dst, const void *src, size_t n)
+{
+	unsigned char *d = dst;
+	const unsigned char *s = src;
+	size_t head = -(uintptr_t)d & 15;
+
+	if (head > n)
+		head = n;
+	memcpy(d, s, head);
+	d += head;
+	s += head;
+	n -= head;
+
+	for (; n >= 64; n -= 64, d += 64, s += 64) {
+		__m128i a = _mm_loadu_si128((const __m128i *)s);
+		__m128i b = _mm_loadu_si128((const __m128i *)(s + 16));
+		__m128i c = _mm_loadu_si128((const __m128i *)(s + 32));
+		__m128i e = _mm_loadu_si128((const __m128i *)(s + 48));
+
+		_mm_stream_si128((__m128i *)d, a);
+		_mm_stream_si128((__m128i *)(d + 16), b);
+		_mm_stream_si128((__m128i *)(d + 32), c);
+		_mm_stream_si128((__m128i *)(d + 48), e);
+	}
+	_mm_sfence();
+
+	memcpy(d, s, n);
+}
+#define COPY_LINE_SIMD		copy_line_stream
+#define COPY_LINE_SIMD_NAME	"sse2 stream"
+#elif defined(__ARM_NEON__)
+static void copy_line_neon(void *dst, const void *src, size_t n)
+{
+	uint8_t *d = dst;
+	const uint8_t *s = src;
+
+	for (; n >= 64; n -= 64, d += 64, s += 64) {
+		uint8x16_t a, b, c, e;
+
+		__builtin_prefetch(s + 256);
+		a = vld1q_u8(s);
+		b = vld1q_u8(s + 16);
+		c = vld1q_u8(s + 32);
+		e = vld1q_u8(s + 48);
+		vst1q_u8(d, a);
+		vst1q_u8(d + 16, b);
+		vst1q_u8(d + 32, c);
+		vst1q_u8(d + 48, e);
+	}
+
+	memcpy(d, s, n);
+}
+#define COPY_LINE_SIMD		copy_line_neon
+#define COPY_LINE_SIMD_NAME	"neon"
+#endif
+
+static copy_line_fn copy_line = copy_line_memcpy;
+
+static void copy_lines(copy_line_fn fn, void *dst, const void *src,
+							unsigned int lines)
+{
+	const size_t line = FRAME_WIDTH * 2;
+	unsigned char *d = dst;
+	const unsigned char *s = src;
+	unsigned int i;
+
+	if (capture_stride == line && video_stride == line) {
+		fn(d, s, line * lines);
+		return;
+	}
+
+	for (i = 0; i < lines; ++i) {
+		fn(d, s, line);
+		d += video_stride;
+		s += capture_stride;
+	}
+}
+
+/*
+ * Line averages for bob deinterlacing, rounding like the SIMD averages.
+ */
+static void average_line(void *dst, const void *a, const void *b, size_t n)
+{
+	unsigned char *d = dst;
+	const unsigned char *s = a;
+	const unsigned char *t = b;
+
+#if defined(__SSE2__)
+	for (; n >= 16; n -= 16, d += 16, s += 16, t += 16)
+		_mm_storeu_si128((__m128i *)d, _mm_avg_epu8(
+				_mm_loadu_si128((const __m128i *)s),
+				_mm_loadu_si128((const __m128i *)t)));
+#elif defined(__ARM_NEON__)
+	for (; n >= 16; n -= 16, d += 16, s += 16, t += 16)
+		vst1q_u8(d, vrhaddq_u8(vld1q_u8(s), vld1q_u8(t)));
+#endif
+	while (n--)
+		*d++ = (*s++ + *t++ + 1) >> 1;
+}
+
+/*
+ * Keep the top field and interpolate the lines of the bottom one, which
+ * removes the combing of woven fields on motion at the cost of half the
+ * vertical resolution.
+ */
+static void bob_lines(void *dst, const void *src, unsigned int lines)
+{
+	const size_t line = FRAME_WIDTH * 2;
+	unsigned char *d = dst;
+	const unsigned char *s = src;
+	unsigned int i;
+
+	for (i = 0; i < lines; ++i, d += video_stride, s += capture_stride) {
+		if (!(i & 1))
+			copy_line(d, s, line);
+		else if (i + 1 < lines)
+			average_line(d, s - capture_stride, s + capture_stride,
+									line);
+		else
+			copy_line(d, s - capture_stride, line);
+	}
+}
+
+static void copy_image(void *dst, const void *src, int size)
+{
+	unsigned int lines = FRAME_HEIGHT;
+
+	/* do not read past a short frame */
+	if (size < (int)((lines - 1) * capture_stride + FRAME_WIDTH * 2))
+		lines = size / capture_stride;
+
+	if (deinterlace)
+		bob_lines(dst, src, lines);
+	else
+		copy_lines(copy_line, dst, src, lines);
+}
+
+static long long time_copy(copy_line_fn fn, void *dst, const void *src)
+{
+	long long start, best = -1;
+	int i;
+
+	for (i = 0; i < COPY_RUNS; ++i) {
+		start = now_us();
+		copy_lines(fn, dst, src, FRAME_HEIGHT);
+		start = now_us() - start;
+		if (best < 0 || start < best)
+			best = start;
+	}
+
+	return best;
+}
+
+/*
+ * Pick the faster line copy for the actual strides, using a spare output
+ * buffer before streaming starts.
+ */
+static void select_copy_line(void)
+{
+	const char *name = "memcpy";
+	long long t = 0;
+	void *src;
+
+	printf("copy strides: capture %u, video %u\n", capture_stride,
+								video_stride);
+
+	src = calloc(FRAME_HEIGHT, capture_stride);
+	if (!src)
+		return;
+
+	t = time_copy(copy_line_memcpy, video_buffers[0].start, src);
+#ifdef COPY_LINE_SIMD
+	{
+		long long t_simd = time_copy(COPY_LINE_SIMD,
+						video_buffers[0].start, src);
+		if (t_simd < t) {
+			copy_line = COPY_LINE_SIMD;
+			name = COPY_LINE_SIMD_NAME;
+			t = t_simd;
+		}
+	}
+#endif
+	free(src);
+
+	printf("copy kernel: %s, %lld us per frame\n", name, t);
 }
 
 static unsigned char color = 0;
@@ -398,71 +1068,187 @@ static void process_image(const void *p, int size)
 	buf.memory = V4L2_MEMORY_MMAP;
 		
 	if (-1 == xioctl(fd_video, VIDIOC_DQBUF, &buf)) {
-		errno_exit("VIDEO_OUPUT: VIDIOC_DQBUF");
+		video_error = errno;
+		return;
 	}
 	
-	memcpy((void*) video_buffers[buf.index].start, p, size);
+	copy_image(video_buffers[buf.index].start, p, size);
 	
 	if (-1 == xioctl(fd_video, VIDIOC_QBUF, &buf)) {
-		errno_exit("VIDEO_OUPUT: VIDIOC_QBUF");
+		video_error = errno;
+		return;
 	}
+
+	recover_done(&video_recovery);
 }
 
 static int read_frame(void)
 {
 	struct v4l2_buffer buf;
+	long long now;
+	int shown = 0;
+
 	CLEAR(buf);
 	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 	buf.memory = V4L2_MEMORY_MMAP;
 
+	if (-1 == fd_capture)
+		return 0;
+
 	if (-1 == xioctl(fd_capture, VIDIOC_DQBUF, &buf)) {
-		switch (errno) {
-			case EAGAIN:
-				return 0;
-				
-			case EIO:
-			default:
-				errno_exit("VIDIOC_DQBUF");
-			}
+		if (EAGAIN != errno)
+			capture_error = errno;
+		return 0;
 	}
 
 	assert(buf.index < n_buffers);
 
-	process_image(buffers[buf.index].start, buf.bytesused);
+	/*
+	 * A corrupted frame does not count as the stream making progress, a
+	 * frame skipped for the time-lapse does.
+	 */
+	if (buf.flags & V4L2_BUF_FLAG_ERROR) {
+		++capture_recovery.frame_errors;
+	} else {
+		now = now_us();
+		capture_last = now;
+		recover_done(&capture_recovery);
 
-	if (-1 == xioctl(fd_capture, VIDIOC_QBUF, &buf))
-		errno_exit("VIDIOC_QBUF");
+		if (buf.timestamp.tv_sec || buf.timestamp.tv_usec)
+			now = buf.timestamp.tv_sec * 1000000LL +
+							buf.timestamp.tv_usec;
 
-	return 1;
+		if (keep_frame(now)) {
+			process_image(buffers[buf.index].start, buf.bytesused);
+			shown = 1;
+		} else {
+			++frames_decimated;
+		}
+	}
+
+	/* the buffer is requeued when the stream is restarted */
+	if (-1 == xioctl(fd_capture, VIDIOC_QBUF, &buf)) {
+		capture_error = errno;
+		return 0;
+	}
+
+	return shown;
 }
 
-static void mainloop(void)
+/*
+ * Handle frames until count frames have been shown or a signal arrives.
+ * Signals are received through a signalfd, so that shutdown is never run
+ * from a signal handler in the middle of an ioctl.
+ */
+static void mainloop(int fd_signal)
 {
-	if(count) {
-		while (count) {
-			if(read_frame() == 1) count--;
-			usleep(30000);
-		}
-	} else {
-		while(1) {
-			read_frame();
-			usleep(30000);
+	struct signalfd_siginfo si;
+	struct pollfd fds[2];
+	int timeout;
+
+	capture_last = now_us();
+
+	for (;;) {
+		fds[0].fd = fd_signal;
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+		/* a lost capture device is skipped by poll */
+		fds[1].fd = fd_capture;
+		fds[1].events = POLLIN;
+		fds[1].revents = 0;
+
+		timeout = -1 == fd_capture ? REOPEN_INTERVAL_MS :
+						capture_timeout_us() / 1000;
+
+		if (-1 == poll(fds, 2, timeout) && EINTR != errno)
+			errno_exit("poll");
+
+		if (fds[0].revents & POLLIN) {
+			if (sizeof(si) == read(fd_signal, &si, sizeof(si)))
+				printf("%s, stopping\n", strsignal(si.ssi_signo));
+			return;
 		}
-	}	
+
+		if (fds[1].revents && read_frame() == 1 && count && !--count)
+			return;
+
+		recover();
+	}
 }
 
-void handle_exit(int signal)
+/*
+ * Dequeue the frames still queued to the output, oldest first, until only
+ * the one on screen is left or the deadline has passed. Returns the number
+ * of frames drained.
+ */
+static unsigned int drain_video_output(long long deadline)
 {
+	struct pollfd pfd;
+	struct v4l2_buffer buf;
+	long long left;
+	unsigned int n;
+
+	for (n = 0; n < VIDEO_BUF_NBR - 1; ++n) {
+		left = deadline - now_us();
+		if (left <= 0)
+			break;
+
+		pfd.fd = fd_video;
+		pfd.events = POLLOUT;
+		pfd.revents = 0;
+
+		/* nothing queued is reported as an error */
+		if (poll(&pfd, 1, (left + 999) / 1000) <= 0 ||
+				!(pfd.revents & POLLOUT))
+			break;
+
+		CLEAR(buf);
+		buf.type   = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+		buf.memory = V4L2_MEMORY_MMAP;
+
+		if (-1 == xioctl(fd_video, VIDIOC_DQBUF, &buf))
+			break;
+	}
+
+	return n;
+}
+
+/*
+ * Stop capture first so that no new frames arrive, let the output finish
+ * the frames already queued to it, and only then turn off the overlay and
+ * release the buffers. Should a driver hang, the alarm, whose default
+ * action terminates the process, bounds the whole sequence.
+ */
+static void teardown(void)
+{
+	long long start = now_us();
+	long long t;
+	unsigned int drained;
+
+	alarm(TEARDOWN_TIMEOUT_S);
+
+	if (-1 != fd_capture) {
+		stop_capturing();
+		uninit_capture_device();
+		close_capture_device();
+	}
+
+	drained = drain_video_output(start + DRAIN_TIMEOUT_MS * 1000LL);
+
 	stop_video_overlay();
-	stop_capturing();
-	uninit_capture_device();
 	uninit_video_device();
-	close_capture_device();
 	close_video_device();
-	
-	exit(0);
-}
 
+	alarm(0);
+	t = now_us() - start;
+
+	recover_print(&capture_recovery);
+	recover_print(&video_recovery);
+	if (interval > 0 || every > 1)
+		printf("%lu frames skipped for time-lapse\n", frames_decimated);
+	printf("teardown in %lld.%03lld ms, %u output frames drained\n",
+		t / 1000, t % 1000, drained);
+}
 
 int main(int argc, char **argv)
 {
@@ -495,6 +1281,22 @@ int main(int argc, char **argv)
 				count = atoi(optarg);
 				break;
 
+			case 'b':
+				capture_buf_nbr = atoi(optarg);
+				break;
+
+			case 'i':
+				deinterlace = 1;
+				break;
+
+			case 't':
+				interval = atof(optarg);
+				break;
+
+			case 'e':
+				every = atoi(optarg);
+				break;
+
 
 			default:
 				usage(stderr, argc, argv);
@@ -502,22 +1304,35 @@ int main(int argc, char **argv)
 			}
 	}
 
-	struct sigaction myhandle; 
-	myhandle.sa_handler = handle_exit;
-	sigemptyset(&myhandle.sa_mask);
-	myhandle.sa_flags = 0;
-	sigaction(SIGINT, &myhandle, NULL);
+	/* handled from the main loop, also if they arrive during setup */
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+
+	if (-1 == sigprocmask(SIG_BLOCK, &mask, NULL))
+		errno_exit("sigprocmask");
 
-	open_capture_device();
+	int fd_signal = signalfd(-1, &mask, SFD_CLOEXEC);
+	if (-1 == fd_signal)
+		errno_exit("signalfd");
+
+	if (-1 == open_capture_device())
+		exit(EXIT_FAILURE);
 	open_video_device();
-	init_capture_device();
+	if (-1 == init_capture_device())
+		exit(EXIT_FAILURE);
 	init_video_device();
+	select_copy_line();
 	start_video_overlay();
 	start_capturing();
 
-	mainloop();
+	mainloop(fd_signal);
+
+	teardown();
+	close(fd_signal);
 
-	handle_exit(0);
+	return 0;
 }
 
 
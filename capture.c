@@ -20,6 +20,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
 
@@ -47,7 +48,26 @@ struct buffer          *buffers;
 static unsigned int     n_buffers;
 static int              out_buf;
 static int              force_format;
+static __u32            force_fourcc = V4L2_PIX_FMT_YUYV;
 static int              frame_count = 70;
+static int              skip_backlog;
+static double           interval;       /* s between frames kept, or 0 */
+static int              every;          /* keep every nth frame, or 0 */
+
+/* time-lapse decimation */
+static long long        native_period;  /* us per frame, or 0 if unknown */
+static long long        sensor_period;  /* us per frame as set, or 0 */
+static long long        keep_period;    /* us between frames kept, or 0 */
+static unsigned int     keep_factor = 1;
+static unsigned int     keep_phase;
+static long long        next_due;       /* us */
+static unsigned long    frames_decimated;
+
+/* buffers dequeued per wakeup */
+static unsigned long    wakeups;
+static unsigned long    frames_ready;
+static unsigned long    frames_skipped;
+static unsigned int     batch_max;
 
 static void errno_exit(const char *s)
 {
@@ -68,6 +88,134 @@ static int xioctl(int fh, int request, void *arg)
         return r;
 }
 
+static long long now_us(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static long long fract_us(const struct v4l2_fract *f)
+{
+        if (!f->numerator || !f->denominator)
+                return 0;
+
+        return f->numerator * 1000000LL / f->denominator;
+}
+
+static unsigned int gcd(unsigned int a, unsigned int b)
+{
+        unsigned int t;
+
+        while (b)
+        {
+                t = a % b;
+                a = b;
+                b = t;
+        }
+
+        return a;
+}
+
+/*
+ * Ask the sensor for fewer frames when time-lapsing, so that frames that
+ * would only be skipped are never captured. Whatever the sensor cannot do
+ * is made up for by skipping frames at DQBUF.
+ */
+static void set_frame_interval(void)
+{
+        struct v4l2_streamparm parm;
+        struct v4l2_fract *tpf = &parm.parm.capture.timeperframe;
+        long long period;
+        unsigned int g;
+
+        if (interval <= 0 && every <= 1)
+                return;
+
+        CLEAR(parm);
+        parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+        if (0 == xioctl(fd, VIDIOC_G_PARM, &parm))
+                native_period = fract_us(tpf);
+
+        if (interval > 0)
+                period = interval * 1000000 + 0.5;
+        else
+                period = native_period * every;
+
+        if (period > 0 && period <= 0xffffffffLL &&
+            (parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME))
+        {
+                g = gcd(period, 1000000);
+                tpf->numerator = period / g;
+                tpf->denominator = 1000000 / g;
+
+                if (-1 == xioctl(fd, VIDIOC_S_PARM, &parm))
+                        fprintf(stderr, "VIDIOC_S_PARM error %d, %s\n",
+                                errno, strerror(errno));
+                else
+                        sensor_period = fract_us(tpf);
+        }
+
+        if (!sensor_period)
+                sensor_period = native_period;
+
+        if (interval > 0)
+                keep_period = period;
+        else if (native_period && sensor_period)
+                keep_factor = (every * native_period + sensor_period / 2) /
+                              sensor_period;
+        else
+                keep_factor = every;
+
+        if (!keep_factor)
+                keep_factor = 1;
+
+        fprintf(stderr, "time-lapse: sensor at %lld.%03lld ms per frame, "
+                "keeping one frame ", sensor_period / 1000,
+                sensor_period % 1000);
+        if (keep_period)
+                fprintf(stderr, "every %lld.%03lld s\n",
+                        keep_period / 1000000, keep_period / 1000 % 1000);
+        else
+                fprintf(stderr, "in %u\n", keep_factor);
+}
+
+/*
+ * Decide whether to keep a frame captured at t us when time-lapsing.
+ * Skipped frames are requeued without their data ever being read.
+ */
+static int keep_frame(long long t)
+{
+        if (keep_period)
+        {
+                /* up to half a sensor period early is on time */
+                if (next_due && t < next_due - sensor_period / 2)
+                        return 0;
+
+                /* after a stall, start over rather than catch up */
+                if (!next_due || t - next_due >= keep_period)
+                        next_due = t + keep_period;
+                else
+                        next_due += keep_period;
+
+                return 1;
+        }
+
+        return keep_phase++ % keep_factor == 0;
+}
+
+static long long buffer_time(const struct v4l2_buffer *buf)
+{
+        long long t;
+
+        t = buf->timestamp.tv_sec * 1000000LL + buf->timestamp.tv_usec;
+
+        return t ? t : now_us();
+}
+
 static void process_image(const void *p, int size)
 {
         if (out_buf)
@@ -78,103 +226,148 @@ static void process_image(const void *p, int size)
         fflush(stdout);
 }
 
-static int read_frame(void)
+/*
+ * Dequeue a ready buffer. Returns 0 if there is none.
+ */
+static int dequeue_buffer(struct v4l2_buffer *buf)
 {
-        struct v4l2_buffer buf;
         unsigned int i;
 
-        switch (io)
-        {
-                case IO_METHOD_READ:
-                        if (-1 == read(fd, buffers[0].start, buffers[0].length))
-                        {
-                                switch (errno)
-                                {
-                                        case EAGAIN:
-                                                return 0;
-
-                                                case EIO:
-                                                /* Could ignore EIO, see spec. */
+        CLEAR(*buf);
 
-                                                /* fall through */
+        buf->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf->memory = IO_METHOD_MMAP == io ? V4L2_MEMORY_MMAP
+                                           : V4L2_MEMORY_USERPTR;
 
-                                                default:
-                                                errno_exit("read");
-                                        }
-                        }
+        if (-1 == xioctl(fd, VIDIOC_DQBUF, buf))
+        {
+                switch (errno)
+                {
+                        case EAGAIN:
+                                return 0;
 
-                        process_image(buffers[0].start, buffers[0].length);
-                        break;
+                                case EIO:
+                                /* Could ignore EIO, see spec. */
 
-                case IO_METHOD_MMAP:
-                        CLEAR(buf);
+                                /* fall through */
 
-                        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-                        buf.memory = V4L2_MEMORY_MMAP;
+                                default:
+                                errno_exit("VIDIOC_DQBUF");
+                        }
+        }
 
-                        if (-1 == xioctl(fd, VIDIOC_DQBUF, &buf))
-                        {
-                                switch (errno)
-                                {
-                                        case EAGAIN:
-                                                return 0;
+        if (IO_METHOD_USERPTR == io)
+        {
+                for (i = 0; i < n_buffers; ++i)
+                        if (buf->m.userptr == (unsigned long)buffers[i].start
+                            && buf->length == buffers[i].length)
+                                break;
 
-                                                case EIO:
-                                                /* Could ignore EIO, see spec. */
+                assert(i < n_buffers);
+        }
+        else
+        {
+                assert(buf->index < n_buffers);
+        }
 
-                                                /* fall through */
+        return 1;
+}
 
-                                                default:
-                                                errno_exit("VIDIOC_DQBUF");
-                                        }
-                        }
+static void process_buffer(struct v4l2_buffer *buf)
+{
+        if (IO_METHOD_USERPTR == io)
+                process_image((void *)buf->m.userptr, buf->bytesused);
+        else
+                process_image(buffers[buf->index].start, buf->bytesused);
+}
 
-                        assert(buf.index < n_buffers);
+static void queue_buffer(struct v4l2_buffer *buf)
+{
+        if (-1 == xioctl(fd, VIDIOC_QBUF, buf))
+                errno_exit("VIDIOC_QBUF");
+}
 
-                        process_image(buffers[buf.index].start, buf.bytesused);
+/*
+ * Handle up to max frames. With streaming i/o, every buffer that is ready
+ * is dequeued before any is handled, rather than paying a select() round
+ * trip per buffer after a stall. With -s, a backlog of more than
+ * skip_backlog frames is requeued unseen except for the newest frame.
+ * When time-lapsing, frames between those kept are requeued unseen too.
+ *
+ * Returns the number of frames handled.
+ */
+static unsigned int read_frame(unsigned int max)
+{
+        struct v4l2_buffer ready[VIDEO_MAX_FRAME];
+        unsigned int count = 0;
+        unsigned int first = 0;
+        unsigned int kept = 0;
+        unsigned int i;
 
-                        if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
-                                errno_exit("VIDIOC_QBUF");
-                        break;
+        if (IO_METHOD_READ == io)
+        {
+                if (-1 == read(fd, buffers[0].start, buffers[0].length))
+                {
+                        switch (errno)
+                        {
+                                case EAGAIN:
+                                        return 0;
 
-                case IO_METHOD_USERPTR:
-                        CLEAR(buf);
+                                        case EIO:
+                                        /* Could ignore EIO, see spec. */
 
-                        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-                        buf.memory = V4L2_MEMORY_USERPTR;
+                                        /* fall through */
 
-                        if (-1 == xioctl(fd, VIDIOC_DQBUF, &buf))
-                        {
-                                switch (errno)
-                                {
-                                        case EAGAIN:
-                                                return 0;
+                                        default:
+                                        errno_exit("read");
+                                }
+                }
 
-                                                case EIO:
-                                                /* Could ignore EIO, see spec. */
+                if (!keep_frame(now_us()))
+                {
+                        ++frames_decimated;
+                        return 0;
+                }
 
-                                                /* fall through */
+                process_image(buffers[0].start, buffers[0].length);
+                return 1;
+        }
 
-                                                default:
-                                                errno_exit("VIDIOC_DQBUF");
-                                        }
-                        }
+        while (count < max && count < VIDEO_MAX_FRAME &&
+               dequeue_buffer(&ready[count]))
+                ++count;
 
-                        for (i = 0; i < n_buffers; ++i)
-                                if (buf.m.userptr == (unsigned long)buffers[i].start
-                                    && buf.length == buffers[i].length)
-                        break;
+        if (!count)
+                return 0;
 
-                assert(i < n_buffers);
+        ++wakeups;
+        frames_ready += count;
+        if (count > batch_max)
+                batch_max = count;
 
-                process_image((void *)buf.m.userptr, buf.bytesused);
+        if (skip_backlog && count > (unsigned int)skip_backlog)
+        {
+                first = count - 1;
+                frames_skipped += first;
+                for (i = 0; i < first; ++i)
+                        queue_buffer(&ready[i]);
+        }
 
-                if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
-                        errno_exit("VIDIOC_QBUF");
-                break;
+        for (i = first; i < count; ++i)
+        {
+                if (keep_frame(buffer_time(&ready[i])))
+                {
+                        process_buffer(&ready[i]);
+                        ++kept;
+                }
+                else
+                {
+                        ++frames_decimated;
+                }
+                queue_buffer(&ready[i]);
         }
 
-        return 1;
+        return kept;
 }
 
 static void mainloop(void)
@@ -183,19 +376,20 @@ static void mainloop(void)
 
         count = frame_count;
 
-        while (count-- > 0)
+        while (count > 0)
         {
                 for (;;)
                 {
                         fd_set fds;
                         struct timeval tv;
+                        unsigned int n;
                         int r;
 
                         FD_ZERO(&fds);
                         FD_SET(fd, &fds);
 
-                        /* Timeout. */
-                        tv.tv_sec = 2;
+                        /* Timeout, allowing for a slowed down sensor. */
+                        tv.tv_sec = 2 + 2 * sensor_period / 1000000;
                         tv.tv_usec = 0;
 
                         r = select(fd + 1, &fds, NULL, NULL, &tv);
@@ -213,8 +407,12 @@ static void mainloop(void)
                                 exit(EXIT_FAILURE);
                         }
 
-                        if (read_frame())
+                        n = read_frame(count);
+                        if (n)
+                        {
+                                count -= n;
                                 break;
+                        }
                         /* EAGAIN - continue select loop. */
                 }
         }
@@ -535,12 +733,19 @@ static void init_device(void)
         {
                 fmt.fmt.pix.width       = 640;
                 fmt.fmt.pix.height      = 480;
-                fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+                fmt.fmt.pix.pixelformat = force_fourcc;
                 fmt.fmt.pix.field       = V4L2_FIELD_INTERLACED;
 
                 if (-1 == xioctl(fd, VIDIOC_S_FMT, &fmt))
                         errno_exit("VIDIOC_S_FMT");
 
+                if (fmt.fmt.pix.pixelformat != force_fourcc)
+                {
+                        fprintf(stderr, "%s does not support %.4s\n",
+                                dev_name, (char *)&force_fourcc);
+                        exit(EXIT_FAILURE);
+                }
+
                 /* Note VIDIOC_S_FMT may change width and height. */
         }
         else
@@ -550,13 +755,18 @@ static void init_device(void)
                         errno_exit("VIDIOC_G_FMT");
         }
 
-        /* Buggy driver paranoia. */
-        min = fmt.fmt.pix.width * 2;
-        if (fmt.fmt.pix.bytesperline < min)
-                fmt.fmt.pix.bytesperline = min;
-        min = fmt.fmt.pix.bytesperline * fmt.fmt.pix.height;
-        if (fmt.fmt.pix.sizeimage < min)
-                fmt.fmt.pix.sizeimage = min;
+        /* Buggy driver paranoia (compressed frames vary in size). */
+        if (fmt.fmt.pix.pixelformat != V4L2_PIX_FMT_MJPEG &&
+            fmt.fmt.pix.pixelformat != V4L2_PIX_FMT_JPEG &&
+            fmt.fmt.pix.pixelformat != V4L2_PIX_FMT_H264)
+        {
+                min = fmt.fmt.pix.width * 2;
+                if (fmt.fmt.pix.bytesperline < min)
+                        fmt.fmt.pix.bytesperline = min;
+                min = fmt.fmt.pix.bytesperline * fmt.fmt.pix.height;
+                if (fmt.fmt.pix.sizeimage < min)
+                        fmt.fmt.pix.sizeimage = min;
+        }
 
         switch (io)
         {
@@ -622,12 +832,17 @@ static void usage(FILE *fp, int argc, char **argv)
                 "-u | --userp         Use application allocated buffers\n"
                 "-o | --output        Outputs stream to stdout\n"
                 "-f | --format        Force format to 640x480 YUYV\n"
+                "-F | --fourcc code   Force fourcc instead of YUYV, e.g. MJPG\n"
                 "-c | --count         Number of frames to grab [%i]\n"
+                "-s | --skip-backlog n  Skip to the newest frame when more\n"
+                "                     than n are ready at once [off]\n"
+                "-t | --interval s    Time-lapse, one frame every s seconds\n"
+                "-e | --every n       Time-lapse, one frame in every n\n"
                 "",
                 argv[0], dev_name, frame_count);
 }
 
-static const char short_options[] = "d:hmruofc:";
+static const char short_options[] = "d:hmruofF:c:s:t:e:";
 
 static const struct option
 long_options[] =
@@ -639,7 +854,11 @@ long_options[] =
         { "userp",  no_argument,       NULL, 'u' },
         { "output", no_argument,       NULL, 'o' },
         { "format", no_argument,       NULL, 'f' },
+        { "fourcc", required_argument, NULL, 'F' },
         { "count",  required_argument, NULL, 'c' },
+        { "skip-backlog", required_argument, NULL, 's' },
+        { "interval", required_argument, NULL, 't' },
+        { "every",  required_argument, NULL, 'e' },
         { 0, 0, 0, 0 }
 };
 
@@ -691,6 +910,17 @@ int main(int argc, char **argv)
                                 force_format++;
                                 break;
 
+                        case 'F':
+                                if (strlen(optarg) != 4)
+                                {
+                                        usage(stderr, argc, argv);
+                                        exit(EXIT_FAILURE);
+                                }
+                                force_fourcc = v4l2_fourcc(optarg[0], optarg[1],
+                                                           optarg[2], optarg[3]);
+                                force_format++;
+                                break;
+
                         case 'c':
                                 errno = 0;
                                 frame_count = strtol(optarg, NULL, 0);
@@ -698,6 +928,27 @@ int main(int argc, char **argv)
                                         errno_exit(optarg);
                                 break;
 
+                        case 's':
+                                errno = 0;
+                                skip_backlog = strtol(optarg, NULL, 0);
+                                if (errno)
+                                        errno_exit(optarg);
+                                break;
+
+                        case 't':
+                                errno = 0;
+                                interval = strtod(optarg, NULL);
+                                if (errno)
+                                        errno_exit(optarg);
+                                break;
+
+                        case 'e':
+                                errno = 0;
+                                every = strtol(optarg, NULL, 0);
+                                if (errno)
+                                        errno_exit(optarg);
+                                break;
+
                         default:
                                 usage(stderr, argc, argv);
                                 exit(EXIT_FAILURE);
@@ -706,12 +957,20 @@ int main(int argc, char **argv)
 
         open_device();
         init_device();
+        set_frame_interval();
         start_capturing();
         mainloop();
         stop_capturing();
         uninit_device();
         close_device();
         fprintf(stderr, "\n");
+        if (wakeups)
+                fprintf(stderr, "%lu frames in %lu wakeups, max %u at once, "
+                        "%lu skipped\n", frames_ready, wakeups, batch_max,
+                        frames_skipped);
+        if (interval > 0 || every > 1)
+                fprintf(stderr, "%lu frames skipped for time-lapse\n",
+                        frames_decimated);
         return 0;
 }
 